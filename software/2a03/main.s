@@ -3,6 +3,7 @@
 ;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;;
 
 .import __STACK_START__, __STACK_SIZE__
+.import __BSS_RUN__, __BSS_SIZE__
 .include "zeropage.inc"
 .include "nes.inc"
 
@@ -40,13 +41,35 @@ PCA_CON_CR      = $07 ; Clock Rate (MASK)
 RECV_STATE_REG  = 0
 RECV_STATE_VAL  = 1
 RECV_STATE_DATA = 2
+RECV_STATE_FIFO = 3
+
+; First 64-byte block the DATA registers may load. RAM at $C000-$DFFF
+; mirrors $0000-$1FFF, so the blocks below this hold our own variables
+; and FIFO. This must match NES_DATA_BLOCK_MIN on the ESP32.
+DATA_BLOCK_MIN  = 28
 
 ; I2C Registers
 REG_CONFIG      = $7F ; Device configuration register
+REG_FIFO        = $7E ; Command FIFO write / FIFO flags read register
+REG_FIFO_LEVEL  = $7D ; Command FIFO fill level register
+REG_VERSION     = $7C ; Firmware version register
 REG_OUTPUT      = $16 ; Output control register
-REG_DATA_START  = $88 ; Data write start block register ($C200)
+REG_DATA_START  = $80 | DATA_BLOCK_MIN ; Data write start block register ($C700)
 REG_DATA_END    = $FF ; Data write end block register ($DFC0)
 
+; CONFIG register flags
+CONFIG_INCREMENT = $01 ; Increment the register after each value
+
+; Firmware version, readable to detect optional features
+FIRMWARE_VERSION = $01 ; Command FIFO supported
+
+; FIFO flags
+FIFO_FLAG_OVERFLOW = $01 ; An entry was dropped because the FIFO was full
+
+; FIFO register value for entries that only wait, which lands on the
+; unused APU test register at $4018
+FIFO_REG_NONE   = $18
+
 .segment "ZEROPAGE"
 ; Variables go here
 cmd_register:   .res 1 ; I2C selected register
@@ -55,6 +78,33 @@ cmd_recv_state: .res 1 ; I2C receive state
 output_value:   .res 1 ; Value of the OUTPUT register
 config_value:   .res 1 ; Value of the CONFIG register
 data_offset:    .res 2 ; Location for DATA loading
+fifo_head:      .res 1 ; FIFO index of the next entry to receive
+fifo_tail:      .res 1 ; FIFO index of the next entry to play
+fifo_pending:   .res 1 ; Non-zero while an entry is waiting to be played
+fifo_wait:      .res 2 ; Ticks until the pending entry is played
+fifo_cur_reg:   .res 1 ; Register of the pending entry
+fifo_cur_val:   .res 1 ; Value of the pending entry
+fifo_flags:     .res 1 ; FIFO status flags
+fifo_in:        .res 4 ; Entry being received
+
+; The shadow lives here rather than in BSS, as the zero page is not
+; reachable through the DATA registers. Indexed accesses to it still
+; use absolute addressing, as there is no zero page,Y form of LDA/STA.
+apu_shadow:     .res $19 ; Last values written to the APU registers
+
+.segment "BSS"
+; The FIFO arrays come first, so each is page aligned and indexed
+; loads never cross a page.
+fifo_delay_lo:  .res 256 ; Entry delay in ticks, low byte
+fifo_delay_hi:  .res 256 ; Entry delay in ticks, high byte
+fifo_reg:       .res 256 ; Entry APU register
+fifo_val:       .res 256 ; Entry value
+
+.assert (fifo_delay_lo & $FF) = 0, lderror, "fifo_delay_lo is not page aligned"
+.assert (fifo_delay_hi & $FF) = 0, lderror, "fifo_delay_hi is not page aligned"
+.assert (fifo_reg & $FF) = 0, lderror, "fifo_reg is not page aligned"
+.assert (fifo_val & $FF) = 0, lderror, "fifo_val is not page aligned"
+.assert __BSS_RUN__ + __BSS_SIZE__ <= DATA_BLOCK_MIN * 64, lderror, "BSS overlaps the DATA blocks"
 
 .segment "STARTUP"
 
@@ -91,6 +141,8 @@ start:
     sta config_value
     sta data_offset
     sta data_offset+1
+    sta fifo_flags
+    jsr fifo_clear
 
     ; Initialize the I2C controller
     jsr i2c_init
@@ -103,6 +155,7 @@ start:
     cmp #$80            ; Check if the bit is set
     bne @cmd_loop       ; Restart the loop if the bit was not set
 
+    jsr fifo_clear      ; Drop anything still queued
     jsr init_apu        ; Initialize the APU
     lda output_value    ; Clear the bit in the OUTPUT register
     and #$7F
@@ -121,14 +174,17 @@ forever:
 @loop:
     lda @regs,y
     sta $4000,y
+    sta apu_shadow,y
     dey
     bpl @loop
 
     ; We have to skip over $4014 (OAMDMA)
     lda #$0f
     sta $4015
+    sta apu_shadow+$15
     lda #$40
     sta $4017
+    sta apu_shadow+$17
 
     rts
 @regs:
@@ -159,14 +215,129 @@ forever:
 ;
 ; Wait for the I2C interrupt flag to be set
 ;
+; Each pass of the loop is one FIFO tick of 72 cycles, so the FIFO keeps
+; playing while we wait. The pass on entry also stands in for the time
+; spent handling the previous I2C event.
+;
 .proc i2c_wait_busy
     ; TODO: store a timeout counter somewhere
 @loop:
-    lda PCA_CON         ; Load the current value of I2CCON
-    and #PCA_CON_SI     ; Mask the SI bit
-    cmp #PCA_CON_SI     ; Check if the SI bit is set
+    jsr fifo_step       ; 6+57 Play the FIFO for one tick
+    lda PCA_CON         ; 4    Load the current value of I2CCON
+    and #PCA_CON_SI     ; 2    Mask the SI bit
     ; TODO: decrement a timer counter. and fail if zero
-    bne @loop           ; If not set, then loop
+    beq @loop           ; 3    If not set, then loop
+    rts
+.endproc
+
+;
+; Charge one FIFO tick for time spent away from i2c_wait_busy, by
+; shortening the wait of the pending entry. This never makes the entry
+; due, so it is left for fifo_step to play. Takes 13 cycles.
+;
+.macro fifo_charge
+    lda #1              ; 2
+    cmp fifo_wait       ; 3 Carry set if the wait is 1 or less
+    lda fifo_wait       ; 3
+    sbc #0              ; 2 Subtract 1 unless the carry is set
+    sta fifo_wait       ; 3
+.endmacro
+
+;
+; Play the command FIFO for one tick.
+;
+; Loading an entry takes one tick, after which it is written once its
+; delay has counted down, with a delay of 0 treated as 1. Every path
+; through here takes exactly 57 cycles, including the RTS, so that
+; i2c_wait_busy keeps a steady tick. That needs the branches and the
+; indexed loads to never cross a page, which is checked at link time.
+;
+.proc fifo_step
+    lda fifo_pending    ; 3
+    bne @pending        ; 2/3
+
+    ldx fifo_tail       ; 3
+    cpx fifo_head       ; 3
+    beq @idle           ; 2/3
+
+    ; Load the next entry (13)
+    lda fifo_delay_lo,x ; 4
+    sta fifo_wait       ; 3
+    lda fifo_delay_hi,x ; 4
+    sta fifo_wait+1     ; 3
+    lda fifo_reg,x      ; 4
+    sta fifo_cur_reg    ; 3
+    lda fifo_val,x      ; 4
+    sta fifo_cur_val    ; 3
+    inx                 ; 2
+    stx fifo_tail       ; 3
+    inc fifo_pending    ; 5
+    rts                 ; 6 (57)
+
+@idle:
+    ; Nothing to play (14)
+    .repeat 17
+    nop                 ; 34
+    .endrep
+    bit fifo_wait       ; 3
+    rts                 ; 6 (57)
+
+@pending:
+    ; (6)
+    lda fifo_wait+1     ; 3
+    bne @count_hi       ; 2/3
+    lda fifo_wait       ; 3
+    cmp #2              ; 2
+    bcc @apply          ; 2/3
+    jmp @count          ; 3 (21)
+
+@count_hi:
+    ; (12)
+    nop                 ; 2
+    nop                 ; 2
+    nop                 ; 2
+    bit fifo_wait       ; 3 (21)
+
+@count:
+    lda fifo_wait       ; 3
+    sec                 ; 2
+    sbc #1              ; 2
+    sta fifo_wait       ; 3
+    lda fifo_wait+1     ; 3
+    sbc #0              ; 2
+    sta fifo_wait+1     ; 3 (39)
+    .repeat 6
+    nop                 ; 12
+    .endrep
+    rts                 ; 6 (57)
+
+@apply:
+    ; Write the pending entry (19)
+    ldy fifo_cur_reg    ; 3
+    lda fifo_cur_val    ; 3
+    sta $4000,y         ; 5
+    sta apu_shadow,y    ; 5
+    lda #$00            ; 2
+    sta fifo_pending    ; 3 (40)
+    .repeat 4
+    nop                 ; 8
+    .endrep
+    bit fifo_wait       ; 3
+    rts                 ; 6 (57)
+.endproc
+
+.assert >fifo_step = >(fifo_step + .sizeof(fifo_step) - 1), lderror, "fifo_step crosses a page"
+
+;
+; Empty the command FIFO
+;
+.proc fifo_clear
+    lda fifo_head
+    sta fifo_tail
+    lda #$00
+    sta fifo_pending
+    sta fifo_wait
+    sta fifo_wait+1
     rts
 .endproc
 
@@ -197,7 +368,13 @@ forever:
     bne @receiver_done
 
     lda cmd_recv_state  ; Load our current state
-    
+
+    cmp #RECV_STATE_FIFO ; Check if we are receiving FIFO entries
+    bne @receiver_not_fifo
+    jmp @receiver_fifo
+
+@receiver_not_fifo:
+
     cmp #RECV_STATE_DATA ; Check if we are in the data load state
     beq @receiver_data
 
@@ -209,6 +386,8 @@ forever:
     sta cmd_register    ; Store the register byte
     cmp #REG_DATA_START ; Check if we received a data load register
     bcs @receiver_register_data
+    cmp #REG_FIFO       ; Check if we received the FIFO register
+    beq @receiver_register_fifo
 
 @receiver_register_value:
     lda #RECV_STATE_VAL
@@ -241,10 +420,26 @@ forever:
 
     jmp @receiver
 
+@receiver_register_fifo:
+    lda #RECV_STATE_FIFO
+    sta cmd_recv_state  ; Register received, switch to FIFO state
+    lda #$00
+    sta cmd_value       ; Start at the first byte of an entry
+    jmp @receiver
+
 @receiver_value:
     lda PCA_DAT          ; Load the received byte
     sta cmd_value        ; Store the value byte
     jsr register_write   ; Handle the register write
+    lda cmd_register
+    cmp #REG_CONFIG      ; A CONFIG write always ends the run of values
+    beq @receiver_value_done
+    lda config_value
+    and #CONFIG_INCREMENT
+    bne @receiver        ; In increment mode, the next byte is another value
+@receiver_value_done:
+    lda #RECV_STATE_REG
+    sta cmd_recv_state   ; Value handled, next byte is another register
     jmp @receiver
 
 @receiver_data:
@@ -310,6 +505,55 @@ forever:
     lda #(PCA_CON_AA | PCA_CON_ENSIO | PCA_CON_330kHz)
     sta PCA_CON         ; Reset SI bit
     rts
+
+    ; FIFO entries are four bytes: delay low, delay high, register and
+    ; value. Handling a byte, from i2c_wait_busy returning until it is
+    ; called again, is padded to 61 cycles. With the polling pass that
+    ; saw the byte, that spans two ticks: one played by that pass and
+    ; one charged here. The last byte also commits the entry, and is
+    ; padded to 133 cycles for three ticks. This keeps playback steady
+    ; while entries are streaming in.
+@receiver_fifo:
+    lda PCA_DAT          ; 4  Load the received byte
+    ldy cmd_value        ; 3  Load the byte position
+    sta fifo_in,y        ; 5  Stage the byte
+    cpy #3               ; 2  Check for the last byte of the entry
+    beq @receiver_fifo_commit ; 2/3
+    iny                  ; 2
+    sty cmd_value        ; 3
+    fifo_charge          ; 13 (34)
+    jmp @receiver
+
+@receiver_fifo_commit:
+    ; (17)
+    ldx fifo_head        ; 3
+    lda fifo_in          ; 3
+    sta fifo_delay_lo,x  ; 5
+    lda fifo_in+1        ; 3
+    sta fifo_delay_hi,x  ; 5
+    ldy fifo_in+2        ; 3
+    lda fifo_reg_map,y   ; 4  Only let APU registers through
+    sta fifo_reg,x       ; 5
+    lda fifo_in+3        ; 3
+    sta fifo_val,x       ; 5
+    inx                  ; 2
+    cpx fifo_tail        ; 3
+    bne @receiver_fifo_store ; 2/3
+    lda #FIFO_FLAG_OVERFLOW ; 2 Full, so drop the entry
+    sta fifo_flags       ; 3
+    jmp @receiver_fifo_next ; 3 (71)
+@receiver_fifo_store:
+    stx fifo_head        ; 3  Entry received, make it visible
+    nop                  ; 2
+    nop                  ; 2 (71)
+@receiver_fifo_next:
+    ldy #$00             ; 2
+    sty cmd_value        ; 3
+    fifo_charge          ; 13
+    fifo_charge          ; 13
+    nop                  ; 2
+    nop                  ; 2 (106)
+    jmp @receiver
 .endproc
 
 ;
@@ -341,6 +585,7 @@ forever:
     tay                 ; Transfer APU register offset into Y
     lda cmd_value       ; Load the value into A
     sta $4000, Y        ; Store A in $4000 + Y
+    sta apu_shadow, Y   ; Keep a copy so it can be read back
     jmp @done
 
 @output_write:
@@ -352,13 +597,18 @@ forever:
     jmp @done
 
 @config_write:
-    ; Config register is currently N/A, handle as a simple
-    ; readable / writable byte of memory.
+    ; Only the increment flag is defined, otherwise handle as a
+    ; simple readable / writable byte of memory.
     lda cmd_value
     sta config_value
+    rts                 ; Never increment away from CONFIG
 
 @done:
-    ; TODO: Check if increment mode is enabled, and increment cmd_register
+    lda config_value
+    and #CONFIG_INCREMENT
+    beq @return         ; Done if increment mode is not enabled
+    inc cmd_register    ; Move on to the next register
+@return:
     rts
 .endproc
 
@@ -372,6 +622,12 @@ forever:
     cmp #$15            ; Check if equal to $15
     beq @apu_read
 
+    ; Check if the command register maps to a write-only NES APU register
+    cmp #$14            ; Check if in range $00-$13
+    bcc @apu_shadow_read
+    cmp #$17            ; Check if equal to $17
+    beq @apu_shadow_read
+
     ; Check if the command register maps to the OUTPUT register
     cmp #REG_OUTPUT
     beq @output_read
@@ -380,6 +636,16 @@ forever:
     cmp #REG_CONFIG
     beq @config_read
 
+    ; Check if the command register maps to a FIFO register
+    cmp #REG_FIFO
+    beq @fifo_flags_read
+    cmp #REG_FIFO_LEVEL
+    beq @fifo_level_read
+
+    ; Check if the command register maps to the VERSION register
+    cmp #REG_VERSION
+    beq @version_read
+
     ; Handle the default case of an unknown register
     jmp @unknown_read
 
@@ -388,6 +654,12 @@ forever:
     sta cmd_value       ; Store the value
     jmp @done
 
+@apu_shadow_read:
+    tay                 ; Transfer APU register offset into Y
+    lda apu_shadow, Y   ; Load the last value written
+    sta cmd_value       ; Store the value
+    jmp @done
+
 @output_read:
     lda output_value    ; Load the OUTPUT value into A
     and #$07            ; Mask the readable bits
@@ -399,12 +671,35 @@ forever:
     sta cmd_value       ; Store the value
     jmp @done
 
+@fifo_flags_read:
+    lda fifo_flags      ; Load the FIFO flags into A
+    sta cmd_value       ; Store the value
+    lda #$00
+    sta fifo_flags      ; Clear the flags once read
+    jmp @done
+
+@fifo_level_read:
+    lda fifo_head       ; Count the entries waiting to be played
+    sec
+    sbc fifo_tail
+    sta cmd_value       ; Store the value
+    jmp @done
+
+@version_read:
+    lda #FIRMWARE_VERSION
+    sta cmd_value       ; Store the value
+    jmp @done
+
 @unknown_read:
     lda #$00
     sta cmd_value
 
 @done:
-    ; TODO: Check if increment mode is enabled, and increment cmd_register
+    lda config_value
+    and #CONFIG_INCREMENT
+    beq @return         ; Done if increment mode is not enabled
+    inc cmd_register    ; Move on to the next register
+@return:
     rts
 .endproc
 
@@ -445,6 +740,22 @@ irq:
 .segment "RODATA"
 ; Static data goes here
 
+;
+; Register to play for each FIFO entry register byte. Anything that is
+; not a writable APU register becomes a wait, so an entry can never
+; reach $4014 (OAM DMA) or $4016. The table is page aligned, so the
+; lookup never crosses a page.
+;
+.align $100
+fifo_reg_map:
+.repeat $100, i
+    .if i <= $13 .or i = $15 .or i = $17
+    .byte i
+    .else
+    .byte FIFO_REG_NONE
+    .endif
+.endrep
+
 .segment "VECTORS"
 .word nmi   ;$FFFA NMI
 .word start ;$FFFC Reset
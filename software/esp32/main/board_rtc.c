@@ -224,7 +224,7 @@ esp_err_t board_rtc_get_time(time_t *time)
         return ESP_ERR_INVALID_ARG;
     }
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    i2c_mutex_lock_background(I2C_P0_NUM);
     ret = mcp7940_get_time(I2C_P0_NUM, &timeinfo);
     i2c_mutex_unlock(I2C_P0_NUM);
 
@@ -298,7 +298,8 @@ esp_err_t board_rtc_int_event_handler()
 
     bzero(&timeinfo, sizeof(struct tm));
 
-    i2c_mutex_lock(I2C_P0_NUM);
+    // This runs every minute, and can wait for a gap in the music
+    i2c_mutex_lock_background(I2C_P0_NUM);
     do {
         ret = mcp7940_has_alarm_occurred(I2C_P0_NUM, MCP7940_ALARM_0, &alarm0_occurred);
         if (ret != ESP_OK) {
@@ -1,6 +1,15 @@
-/* Fake6502 CPU emulator core v1.1 *******************
+/* Fake6502 CPU emulator core v1.2 *******************
  * (c)2011 Mike Chambers (miker00lz@gmail.com)       *
  *****************************************************
+ * v1.2 - Reworked for the ESP32. Instructions are   *
+ *        dispatched through a single switch with    *
+ *        the addressing modes inlined, registers    *
+ *        are kept in locals while running, and the  *
+ *        core runs from IRAM. Only the 2A03 is      *
+ *        emulated, so BCD is gone, and undocumented *
+ *        opcodes are always handled. Added          *
+ *        run6502() to run up to a given address.    *
+ *                                                   *
  * v1.1 - Small bugfix in BIT opcode, but it was the *
  *        difference between a few games in my NES   *
  *        emulator working and being broken!         *
@@ -19,23 +28,6 @@
  * engine in C. It was written as part of a Nintendo *
  * Entertainment System emulator I've been writing.  *
  *                                                   *
- * A couple important things to know about are two   *
- * defines in the code. One is "UNDOCUMENTED" which, *
- * when defined, allows Fake6502 to compile with     *
- * full support for the more predictable             *
- * undocumented instructions of the 6502. If it is   *
- * undefined, undocumented opcodes just act as NOPs. *
- *                                                   *
- * The other define is "NES_CPU", which causes the   *
- * code to compile without support for binary-coded  *
- * decimal (BCD) support for the ADC and SBC         *
- * opcodes. The Ricoh 2A03 CPU in the NES does not   *
- * support BCD, but is otherwise identical to the    *
- * standard MOS 6502. (Note that this define is      *
- * enabled in this file if you haven't changed it    *
- * yourself. If you're not emulating a NES, you      *
- * should comment it out.)                           *
- *                                                   *
  * If you do discover an error in timing accuracy,   *
  * or operation in general please e-mail me at the   *
  * address above so that I can fix it. Thank you!    *
@@ -77,6 +69,10 @@
  * void step6502()                                   *
  *   - Execute a single instrution.                  *
  *                                                   *
+ * bool run6502(uint16_t stoppc, uint32_t maxticks)  *
+ *   - Execute until the PC reaches the given        *
+ *     address, or the tick limit is used up.        *
+ *                                                   *
  * void irq6502()                                    *
  *   - Trigger a hardware IRQ in the 6502 core.      *
  *                                                   *
@@ -102,17 +98,13 @@
  *                                                   *
  *****************************************************/
 
-#include <stdio.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
 
-//6502 defines
-#define UNDOCUMENTED //when this is defined, undocumented opcodes are handled.
-                     //otherwise, they're simply treated as NOPs.
+#include <esp_attr.h>
 
-#define NES_CPU      //when this is defined, the binary-coded decimal (BCD)
-                     //status flag is not honored by ADC and SBC. the 2A03
-                     //CPU in the Nintendo Entertainment System does not
-                     //support BCD operation.
+#include "fake6502.h"
 
 #define FLAG_CARRY     0x01
 #define FLAG_ZERO      0x02
@@ -125,843 +117,541 @@
 
 #define BASE_STACK     0x100
 
-#define saveaccum(n) a = (uint8_t)((n) & 0x00FF)
-
-
-//flag modifier macros
-#define setcarry() status |= FLAG_CARRY
-#define clearcarry() status &= (~FLAG_CARRY)
-#define setzero() status |= FLAG_ZERO
-#define clearzero() status &= (~FLAG_ZERO)
-#define setinterrupt() status |= FLAG_INTERRUPT
-#define clearinterrupt() status &= (~FLAG_INTERRUPT)
-#define setdecimal() status |= FLAG_DECIMAL
-#define cleardecimal() status &= (~FLAG_DECIMAL)
-#define setoverflow() status |= FLAG_OVERFLOW
-#define clearoverflow() status &= (~FLAG_OVERFLOW)
-#define setsign() status |= FLAG_SIGN
-#define clearsign() status &= (~FLAG_SIGN)
-
-
-//flag calculation macros
-#define zerocalc(n) {\
-    if ((n) & 0x00FF) clearzero();\
-        else setzero();\
-}
-
-#define signcalc(n) {\
-    if ((n) & 0x0080) setsign();\
-        else clearsign();\
-}
-
-#define carrycalc(n) {\
-    if ((n) & 0xFF00) setcarry();\
-        else clearcarry();\
-}
-
-#define overflowcalc(n, m, o) { /* n = result, m = accumulator, o = memory */ \
-    if (((n) ^ (uint16_t)(m)) & ((n) ^ (o)) & 0x0080) setoverflow();\
-        else clearoverflow();\
-}
-
-
-//6502 CPU registers
-uint16_t pc;
-uint8_t sp, a, x, y, status;
-
+//6502 CPU registers, which the core copies into locals while it runs
+static struct {
+    uint16_t pc;
+    uint8_t sp, a, x, y, status;
+} cpu;
 
 //helper variables
 uint32_t instructions = 0; //keep track of total instructions executed
 uint32_t clockticks6502 = 0, clockgoal6502 = 0;
-uint16_t oldpc, ea, reladdr, value, result;
-uint8_t opcode, oldstatus;
 
 //externally supplied functions
 extern uint8_t read6502(uint16_t address);
 extern void write6502(uint16_t address, uint8_t value);
 
-//a few general functions used by various other functions
-void push16(uint16_t pushval) {
-    write6502(BASE_STACK + sp, (pushval >> 8) & 0xFF);
-    write6502(BASE_STACK + ((sp - 1) & 0xFF), pushval & 0xFF);
-    sp -= 2;
-}
-
-void push8(uint8_t pushval) {
-    write6502(BASE_STACK + sp--, pushval);
-}
+uint8_t callexternal = 0;
+void (*loopexternal)();
 
-uint16_t pull16() {
-    uint16_t temp16;
-    temp16 = read6502(BASE_STACK + ((sp + 1) & 0xFF)) | ((uint16_t)read6502(BASE_STACK + ((sp + 2) & 0xFF)) << 8);
-    sp += 2;
-    return(temp16);
+//a few general functions used by the interrupt entry points
+static void push16(uint16_t pushval) {
+    write6502(BASE_STACK + cpu.sp, (pushval >> 8) & 0xFF);
+    write6502(BASE_STACK + ((cpu.sp - 1) & 0xFF), pushval & 0xFF);
+    cpu.sp -= 2;
 }
 
-uint8_t pull8() {
-    return (read6502(BASE_STACK + ++sp));
+static void push8(uint8_t pushval) {
+    write6502(BASE_STACK + cpu.sp--, pushval);
 }
 
 void reset6502() {
-    pc = (uint16_t)read6502(0xFFFC) | ((uint16_t)read6502(0xFFFD) << 8);
-    a = 0;
-    x = 0;
-    y = 0;
-    sp = 0xFD;
-    status |= FLAG_CONSTANT;
-}
-
-static void (*addrtable[256])();
-static void (*optable[256])();
-uint8_t penaltyop, penaltyaddr;
-
-//addressing mode functions, calculates effective addresses
-static void imp() { //implied
-}
-
-static void acc() { //accumulator
+    cpu.pc = (uint16_t)read6502(0xFFFC) | ((uint16_t)read6502(0xFFFD) << 8);
+    cpu.a = 0;
+    cpu.x = 0;
+    cpu.y = 0;
+    cpu.sp = 0xFD;
+    cpu.status |= FLAG_CONSTANT;
 }
 
-static void imm() { //immediate
-    ea = pc++;
-}
-
-static void zp() { //zero-page
-    ea = (uint16_t)read6502((uint16_t)pc++);
-}
-
-static void zpx() { //zero-page,X
-    ea = ((uint16_t)read6502((uint16_t)pc++) + (uint16_t)x) & 0xFF; //zero-page wraparound
-}
-
-static void zpy() { //zero-page,Y
-    ea = ((uint16_t)read6502((uint16_t)pc++) + (uint16_t)y) & 0xFF; //zero-page wraparound
-}
-
-static void rel() { //relative for branch ops (8-bit immediate value, sign-extended)
-    reladdr = (uint16_t)read6502(pc++);
-    if (reladdr & 0x80) reladdr |= 0xFF00;
-}
-
-static void abso() { //absolute
-    ea = (uint16_t)read6502(pc) | ((uint16_t)read6502(pc+1) << 8);
-    pc += 2;
-}
-
-static void absx() { //absolute,X
-    uint16_t startpage;
-    ea = ((uint16_t)read6502(pc) | ((uint16_t)read6502(pc+1) << 8));
-    startpage = ea & 0xFF00;
-    ea += (uint16_t)x;
-
-    if (startpage != (ea & 0xFF00)) { //one cycle penlty for page-crossing on some opcodes
-        penaltyaddr = 1;
-    }
-
-    pc += 2;
-}
-
-static void absy() { //absolute,Y
-    uint16_t startpage;
-    ea = ((uint16_t)read6502(pc) | ((uint16_t)read6502(pc+1) << 8));
-    startpage = ea & 0xFF00;
-    ea += (uint16_t)y;
-
-    if (startpage != (ea & 0xFF00)) { //one cycle penlty for page-crossing on some opcodes
-        penaltyaddr = 1;
-    }
-
-    pc += 2;
-}
-
-static void ind() { //indirect
-    uint16_t eahelp, eahelp2;
-    eahelp = (uint16_t)read6502(pc) | (uint16_t)((uint16_t)read6502(pc+1) << 8);
-    eahelp2 = (eahelp & 0xFF00) | ((eahelp + 1) & 0x00FF); //replicate 6502 page-boundary wraparound bug
-    ea = (uint16_t)read6502(eahelp) | ((uint16_t)read6502(eahelp2) << 8);
-    pc += 2;
-}
-
-static void indx() { // (indirect,X)
-    uint16_t eahelp;
-    eahelp = (uint16_t)(((uint16_t)read6502(pc++) + (uint16_t)x) & 0xFF); //zero-page wraparound for table pointer
-    ea = (uint16_t)read6502(eahelp & 0x00FF) | ((uint16_t)read6502((eahelp+1) & 0x00FF) << 8);
-}
-
-static void indy() { // (indirect),Y
-    uint16_t eahelp, eahelp2, startpage;
-    eahelp = (uint16_t)read6502(pc++);
-    eahelp2 = (eahelp & 0xFF00) | ((eahelp + 1) & 0x00FF); //zero-page wraparound
-    ea = (uint16_t)read6502(eahelp) | ((uint16_t)read6502(eahelp2) << 8);
-    startpage = ea & 0xFF00;
-    ea += (uint16_t)y;
-
-    if (startpage != (ea & 0xFF00)) { //one cycle penlty for page-crossing on some opcodes
-        penaltyaddr = 1;
-    }
-}
-
-static uint16_t getvalue() {
-    if (addrtable[opcode] == acc) return((uint16_t)a);
-        else return((uint16_t)read6502(ea));
-}
-
-#if 0
-static uint16_t getvalue16() {
-    return((uint16_t)read6502(ea) | ((uint16_t)read6502(ea+1) << 8));
-}
-#endif
-
-static void putvalue(uint16_t saveval) {
-    if (addrtable[opcode] == acc) a = (uint8_t)(saveval & 0x00FF);
-        else write6502(ea, (saveval & 0x00FF));
+void nmi6502() {
+    push16(cpu.pc);
+    push8(cpu.status);
+    cpu.status |= FLAG_INTERRUPT;
+    cpu.pc = (uint16_t)read6502(0xFFFA) | ((uint16_t)read6502(0xFFFB) << 8);
 }
 
+void irq6502() {
+    push16(cpu.pc);
+    push8(cpu.status);
+    cpu.status |= FLAG_INTERRUPT;
+    cpu.pc = (uint16_t)read6502(0xFFFE) | ((uint16_t)read6502(0xFFFF) << 8);
+}
+
+/*
+ * Everything below works on the locals of run_core(): pc, sp, a, x, y,
+ * status, ticks, plus ea and penalty for the current instruction.
+ */
+
+//stack
+#define PUSH8(v) write6502(BASE_STACK + sp--, (v))
+#define PULL8() read6502(BASE_STACK + ++sp)
+#define PUSH16(v) { \
+    write6502(BASE_STACK + sp, ((v) >> 8) & 0xFF); \
+    write6502(BASE_STACK + ((sp - 1) & 0xFF), (v) & 0xFF); \
+    sp -= 2; \
+}
+#define PULL16() (tmp = (uint16_t)read6502(BASE_STACK + ((sp + 1) & 0xFF)) \
+        | ((uint16_t)read6502(BASE_STACK + ((sp + 2) & 0xFF)) << 8), sp += 2, tmp)
+
+//flags
+#define SETZN(n) status = (status & ~(FLAG_ZERO | FLAG_SIGN)) \
+        | (((n) & 0xFF) ? 0 : FLAG_ZERO) | ((n) & FLAG_SIGN)
+#define SETC(c) status = (status & ~FLAG_CARRY) | ((c) ? FLAG_CARRY : 0)
+
+//addressing modes, which leave the effective address in ea
+#define IMM() ea = pc++
+#define ZP() ea = read6502(pc++)
+#define ZPX() ea = (read6502(pc++) + x) & 0xFF
+#define ZPY() ea = (read6502(pc++) + y) & 0xFF
+#define ABS() { \
+    ea = (uint16_t)read6502(pc) | ((uint16_t)read6502(pc + 1) << 8); \
+    pc += 2; \
+}
+#define ABSI(r) { \
+    tmp = (uint16_t)read6502(pc) | ((uint16_t)read6502(pc + 1) << 8); \
+    ea = tmp + (r); \
+    penalty = ((tmp ^ ea) & 0xFF00) ? 1 : 0; \
+    pc += 2; \
+}
+#define ABSX() ABSI(x)
+#define ABSY() ABSI(y)
+#define IND() { \
+    tmp = (uint16_t)read6502(pc) | ((uint16_t)read6502(pc + 1) << 8); \
+    ea = (uint16_t)read6502(tmp) | ((uint16_t)read6502((tmp & 0xFF00) | ((tmp + 1) & 0x00FF)) << 8); \
+    pc += 2; \
+}
+#define INDX() { \
+    tmp = (read6502(pc++) + x) & 0xFF; \
+    ea = (uint16_t)read6502(tmp) | ((uint16_t)read6502((tmp + 1) & 0xFF) << 8); \
+}
+#define INDY() { \
+    tmp = read6502(pc++); \
+    tmp = (uint16_t)read6502(tmp) | ((uint16_t)read6502((tmp + 1) & 0xFF) << 8); \
+    ea = tmp + y; \
+    penalty = ((tmp ^ ea) & 0xFF00) ? 1 : 0; \
+}
+
+//loads, stores and transfers
+#define LDA() { a = read6502(ea); SETZN(a); }
+#define LDX() { x = read6502(ea); SETZN(x); }
+#define LDY() { y = read6502(ea); SETZN(y); }
+#define LAX() { a = x = read6502(ea); SETZN(a); }
+#define STA() write6502(ea, a)
+#define STX() write6502(ea, x)
+#define STY() write6502(ea, y)
+#define SAX() write6502(ea, a & x)
+#define TAX() { x = a; SETZN(x); }
+#define TAY() { y = a; SETZN(y); }
+#define TSX() { x = sp; SETZN(x); }
+#define TXA() { a = x; SETZN(a); }
+#define TXS() sp = x
+#define TYA() { a = y; SETZN(a); }
+
+//arithmetic and logic
+#define ADD(v) { \
+    value = (v); \
+    result = (uint16_t)a + value + (status & FLAG_CARRY); \
+    SETC(result & 0xFF00); \
+    status = (status & ~FLAG_OVERFLOW) | ((result ^ a) & (result ^ value) & 0x80 ? FLAG_OVERFLOW : 0); \
+    a = (uint8_t)result; \
+    SETZN(a); \
+}
+#define ADC() ADD(read6502(ea))
+#define SBC() ADD(read6502(ea) ^ 0xFF)
+#define AND() { a &= read6502(ea); SETZN(a); }
+#define ORA() { a |= read6502(ea); SETZN(a); }
+#define EOR() { a ^= read6502(ea); SETZN(a); }
+#define COMPARE(r, v) { \
+    value = (v); \
+    SETC((r) >= value); \
+    SETZN((uint8_t)((r) - value)); \
+}
+#define CMP() COMPARE(a, read6502(ea))
+#define CPX() COMPARE(x, read6502(ea))
+#define CPY() COMPARE(y, read6502(ea))
+#define BIT() { \
+    value = read6502(ea); \
+    status = (status & 0x3D) | ((a & value) ? 0 : FLAG_ZERO) | (value & 0xC0); \
+}
+
+//read-modify-write, in memory and on the accumulator
+#define MODIFY(op) { value = read6502(ea); op(value); write6502(ea, value); }
+#define DO_ASL(v) { SETC((v) & 0x80); v <<= 1; SETZN(v); }
+#define DO_LSR(v) { SETC((v) & 0x01); v >>= 1; SETZN(v); }
+#define DO_ROL(v) { tmp = (v << 1) | (status & FLAG_CARRY); SETC(tmp & 0x100); v = (uint8_t)tmp; SETZN(v); }
+#define DO_ROR(v) { tmp = (v >> 1) | ((status & FLAG_CARRY) << 7); SETC((v) & 0x01); v = (uint8_t)tmp; SETZN(v); }
+#define DO_INC(v) { v++; SETZN(v); }
+#define DO_DEC(v) { v--; SETZN(v); }
+#define ASL() MODIFY(DO_ASL)
+#define LSR() MODIFY(DO_LSR)
+#define ROL() MODIFY(DO_ROL)
+#define ROR() MODIFY(DO_ROR)
+#define INC() MODIFY(DO_INC)
+#define DEC() MODIFY(DO_DEC)
+#define ASL_A() DO_ASL(a)
+#define LSR_A() DO_LSR(a)
+#define ROL_A() DO_ROL(a)
+#define ROR_A() DO_ROR(a)
+#define INX() DO_INC(x)
+#define INY() DO_INC(y)
+#define DEX() DO_DEC(x)
+#define DEY() DO_DEC(y)
+
+//undocumented combinations of the above
+#define SLO() { MODIFY(DO_ASL); a |= value; SETZN(a); }
+#define RLA() { MODIFY(DO_ROL); a &= value; SETZN(a); }
+#define SRE() { MODIFY(DO_LSR); a ^= value; SETZN(a); }
+#define RRA() { MODIFY(DO_ROR); ADD(value); }
+#define DCP() { MODIFY(DO_DEC); COMPARE(a, value); }
+#define ISB() { MODIFY(DO_INC); ADD(value ^ 0xFF); }
+
+//flags
+#define CLC() status &= ~FLAG_CARRY
+#define CLD() status &= ~FLAG_DECIMAL
+#define CLI() status &= ~FLAG_INTERRUPT
+#define CLV() status &= ~FLAG_OVERFLOW
+#define SEC() status |= FLAG_CARRY
+#define SED() status |= FLAG_DECIMAL
+#define SEI() status |= FLAG_INTERRUPT
+
+//branches, with a tick for taking it and another for crossing a page
+#define BRANCH(cond) { \
+    tmp = read6502(pc++); \
+    if (cond) { \
+        ea = pc + (int8_t)tmp; \
+        ticks += ((pc ^ ea) & 0xFF00) ? 2 : 1; \
+        pc = ea; \
+    } \
+}
+#define BCC() BRANCH(!(status & FLAG_CARRY))
+#define BCS() BRANCH(status & FLAG_CARRY)
+#define BNE() BRANCH(!(status & FLAG_ZERO))
+#define BEQ() BRANCH(status & FLAG_ZERO)
+#define BPL() BRANCH(!(status & FLAG_SIGN))
+#define BMI() BRANCH(status & FLAG_SIGN)
+#define BVC() BRANCH(!(status & FLAG_OVERFLOW))
+#define BVS() BRANCH(status & FLAG_OVERFLOW)
+
+//jumps, calls and the stack
+#define JMP() pc = ea
+#define JSR() { PUSH16(pc - 1); pc = ea; }
+#define RTS() pc = PULL16() + 1
+#define RTI() { status = PULL8(); pc = PULL16(); }
+#define BRK() { \
+    pc++; \
+    PUSH16(pc); \
+    PUSH8(status | FLAG_BREAK); \
+    status |= FLAG_INTERRUPT; \
+    pc = (uint16_t)read6502(0xFFFE) | ((uint16_t)read6502(0xFFFF) << 8); \
+}
+#define PHA() PUSH8(a)
+#define PHP() PUSH8(status | FLAG_BREAK)
+#define PLA() { a = PULL8(); SETZN(a); }
+#define PLP() status = PULL8() | FLAG_CONSTANT
+
+/*
+ * Run up to count instructions, stopping early once maxticks have
+ * passed or the PC lands on stoppc, which is ignored if negative.
+ */
+static void IRAM_ATTR run_core(uint32_t count, uint32_t maxticks, int32_t stoppc) {
+    uint16_t pc = cpu.pc;
+    uint8_t sp = cpu.sp, a = cpu.a, x = cpu.x, y = cpu.y, status = cpu.status;
+    uint32_t ticks = clockticks6502;
+    uint32_t startticks = ticks;
+    uint32_t executed = 0;
+
+    while (executed < count && (ticks - startticks) < maxticks) {
+        uint16_t ea, tmp, result;
+        uint8_t value;
+        uint8_t penalty = 0;
+        uint8_t opcode = read6502(pc++);
+        status |= FLAG_CONSTANT;
 
-//instruction handler functions
-static void adc() {
-    penaltyop = 1;
-    value = getvalue();
-    result = (uint16_t)a + value + (uint16_t)(status & FLAG_CARRY);
-   
-    carrycalc(result);
-    zerocalc(result);
-    overflowcalc(result, a, value);
-    signcalc(result);
-    
-    #ifndef NES_CPU
-    if (status & FLAG_DECIMAL) {
-        clearcarry();
-        
-        if ((a & 0x0F) > 0x09) {
-            a += 0x06;
+        switch (opcode) {
+        case 0x00: BRK(); ticks += 7; break;
+        case 0x01: INDX(); ORA(); ticks += 6; break;
+        case 0x02: ticks += 2; break;
+        case 0x03: INDX(); SLO(); ticks += 8; break;
+        case 0x04: ZP(); ticks += 3; break;
+        case 0x05: ZP(); ORA(); ticks += 3; break;
+        case 0x06: ZP(); ASL(); ticks += 5; break;
+        case 0x07: ZP(); SLO(); ticks += 5; break;
+        case 0x08: PHP(); ticks += 3; break;
+        case 0x09: IMM(); ORA(); ticks += 2; break;
+        case 0x0A: ASL_A(); ticks += 2; break;
+        case 0x0B: IMM(); ticks += 2; break;
+        case 0x0C: ABS(); ticks += 4; break;
+        case 0x0D: ABS(); ORA(); ticks += 4; break;
+        case 0x0E: ABS(); ASL(); ticks += 6; break;
+        case 0x0F: ABS(); SLO(); ticks += 6; break;
+        case 0x10: BPL(); ticks += 2; break;
+        case 0x11: INDY(); ORA(); ticks += 5 + penalty; break;
+        case 0x12: ticks += 2; break;
+        case 0x13: INDY(); SLO(); ticks += 8; break;
+        case 0x14: ZPX(); ticks += 4; break;
+        case 0x15: ZPX(); ORA(); ticks += 4; break;
+        case 0x16: ZPX(); ASL(); ticks += 6; break;
+        case 0x17: ZPX(); SLO(); ticks += 6; break;
+        case 0x18: CLC(); ticks += 2; break;
+        case 0x19: ABSY(); ORA(); ticks += 4 + penalty; break;
+        case 0x1A: ticks += 2; break;
+        case 0x1B: ABSY(); SLO(); ticks += 7; break;
+        case 0x1C: ABSX(); ticks += 4 + penalty; break;
+        case 0x1D: ABSX(); ORA(); ticks += 4 + penalty; break;
+        case 0x1E: ABSX(); ASL(); ticks += 7; break;
+        case 0x1F: ABSX(); SLO(); ticks += 7; break;
+        case 0x20: ABS(); JSR(); ticks += 6; break;
+        case 0x21: INDX(); AND(); ticks += 6; break;
+        case 0x22: ticks += 2; break;
+        case 0x23: INDX(); RLA(); ticks += 8; break;
+        case 0x24: ZP(); BIT(); ticks += 3; break;
+        case 0x25: ZP(); AND(); ticks += 3; break;
+        case 0x26: ZP(); ROL(); ticks += 5; break;
+        case 0x27: ZP(); RLA(); ticks += 5; break;
+        case 0x28: PLP(); ticks += 4; break;
+        case 0x29: IMM(); AND(); ticks += 2; break;
+        case 0x2A: ROL_A(); ticks += 2; break;
+        case 0x2B: IMM(); ticks += 2; break;
+        case 0x2C: ABS(); BIT(); ticks += 4; break;
+        case 0x2D: ABS(); AND(); ticks += 4; break;
+        case 0x2E: ABS(); ROL(); ticks += 6; break;
+        case 0x2F: ABS(); RLA(); ticks += 6; break;
+        case 0x30: BMI(); ticks += 2; break;
+        case 0x31: INDY(); AND(); ticks += 5 + penalty; break;
+        case 0x32: ticks += 2; break;
+        case 0x33: INDY(); RLA(); ticks += 8; break;
+        case 0x34: ZPX(); ticks += 4; break;
+        case 0x35: ZPX(); AND(); ticks += 4; break;
+        case 0x36: ZPX(); ROL(); ticks += 6; break;
+        case 0x37: ZPX(); RLA(); ticks += 6; break;
+        case 0x38: SEC(); ticks += 2; break;
+        case 0x39: ABSY(); AND(); ticks += 4 + penalty; break;
+        case 0x3A: ticks += 2; break;
+        case 0x3B: ABSY(); RLA(); ticks += 7; break;
+        case 0x3C: ABSX(); ticks += 4 + penalty; break;
+        case 0x3D: ABSX(); AND(); ticks += 4 + penalty; break;
+        case 0x3E: ABSX(); ROL(); ticks += 7; break;
+        case 0x3F: ABSX(); RLA(); ticks += 7; break;
+        case 0x40: RTI(); ticks += 6; break;
+        case 0x41: INDX(); EOR(); ticks += 6; break;
+        case 0x42: ticks += 2; break;
+        case 0x43: INDX(); SRE(); ticks += 8; break;
+        case 0x44: ZP(); ticks += 3; break;
+        case 0x45: ZP(); EOR(); ticks += 3; break;
+        case 0x46: ZP(); LSR(); ticks += 5; break;
+        case 0x47: ZP(); SRE(); ticks += 5; break;
+        case 0x48: PHA(); ticks += 3; break;
+        case 0x49: IMM(); EOR(); ticks += 2; break;
+        case 0x4A: LSR_A(); ticks += 2; break;
+        case 0x4B: IMM(); ticks += 2; break;
+        case 0x4C: ABS(); JMP(); ticks += 3; break;
+        case 0x4D: ABS(); EOR(); ticks += 4; break;
+        case 0x4E: ABS(); LSR(); ticks += 6; break;
+        case 0x4F: ABS(); SRE(); ticks += 6; break;
+        case 0x50: BVC(); ticks += 2; break;
+        case 0x51: INDY(); EOR(); ticks += 5 + penalty; break;
+        case 0x52: ticks += 2; break;
+        case 0x53: INDY(); SRE(); ticks += 8; break;
+        case 0x54: ZPX(); ticks += 4; break;
+        case 0x55: ZPX(); EOR(); ticks += 4; break;
+        case 0x56: ZPX(); LSR(); ticks += 6; break;
+        case 0x57: ZPX(); SRE(); ticks += 6; break;
+        case 0x58: CLI(); ticks += 2; break;
+        case 0x59: ABSY(); EOR(); ticks += 4 + penalty; break;
+        case 0x5A: ticks += 2; break;
+        case 0x5B: ABSY(); SRE(); ticks += 7; break;
+        case 0x5C: ABSX(); ticks += 4 + penalty; break;
+        case 0x5D: ABSX(); EOR(); ticks += 4 + penalty; break;
+        case 0x5E: ABSX(); LSR(); ticks += 7; break;
+        case 0x5F: ABSX(); SRE(); ticks += 7; break;
+        case 0x60: RTS(); ticks += 6; break;
+        case 0x61: INDX(); ADC(); ticks += 6; break;
+        case 0x62: ticks += 2; break;
+        case 0x63: INDX(); RRA(); ticks += 8; break;
+        case 0x64: ZP(); ticks += 3; break;
+        case 0x65: ZP(); ADC(); ticks += 3; break;
+        case 0x66: ZP(); ROR(); ticks += 5; break;
+        case 0x67: ZP(); RRA(); ticks += 5; break;
+        case 0x68: PLA(); ticks += 4; break;
+        case 0x69: IMM(); ADC(); ticks += 2; break;
+        case 0x6A: ROR_A(); ticks += 2; break;
+        case 0x6B: IMM(); ticks += 2; break;
+        case 0x6C: IND(); JMP(); ticks += 5; break;
+        case 0x6D: ABS(); ADC(); ticks += 4; break;
+        case 0x6E: ABS(); ROR(); ticks += 6; break;
+        case 0x6F: ABS(); RRA(); ticks += 6; break;
+        case 0x70: BVS(); ticks += 2; break;
+        case 0x71: INDY(); ADC(); ticks += 5 + penalty; break;
+        case 0x72: ticks += 2; break;
+        case 0x73: INDY(); RRA(); ticks += 8; break;
+        case 0x74: ZPX(); ticks += 4; break;
+        case 0x75: ZPX(); ADC(); ticks += 4; break;
+        case 0x76: ZPX(); ROR(); ticks += 6; break;
+        case 0x77: ZPX(); RRA(); ticks += 6; break;
+        case 0x78: SEI(); ticks += 2; break;
+        case 0x79: ABSY(); ADC(); ticks += 4 + penalty; break;
+        case 0x7A: ticks += 2; break;
+        case 0x7B: ABSY(); RRA(); ticks += 7; break;
+        case 0x7C: ABSX(); ticks += 4 + penalty; break;
+        case 0x7D: ABSX(); ADC(); ticks += 4 + penalty; break;
+        case 0x7E: ABSX(); ROR(); ticks += 7; break;
+        case 0x7F: ABSX(); RRA(); ticks += 7; break;
+        case 0x80: IMM(); ticks += 2; break;
+        case 0x81: INDX(); STA(); ticks += 6; break;
+        case 0x82: IMM(); ticks += 2; break;
+        case 0x83: INDX(); SAX(); ticks += 6; break;
+        case 0x84: ZP(); STY(); ticks += 3; break;
+        case 0x85: ZP(); STA(); ticks += 3; break;
+        case 0x86: ZP(); STX(); ticks += 3; break;
+        case 0x87: ZP(); SAX(); ticks += 3; break;
+        case 0x88: DEY(); ticks += 2; break;
+        case 0x89: IMM(); ticks += 2; break;
+        case 0x8A: TXA(); ticks += 2; break;
+        case 0x8B: IMM(); ticks += 2; break;
+        case 0x8C: ABS(); STY(); ticks += 4; break;
+        case 0x8D: ABS(); STA(); ticks += 4; break;
+        case 0x8E: ABS(); STX(); ticks += 4; break;
+        case 0x8F: ABS(); SAX(); ticks += 4; break;
+        case 0x90: BCC(); ticks += 2; break;
+        case 0x91: INDY(); STA(); ticks += 6; break;
+        case 0x92: ticks += 2; break;
+        case 0x93: INDY(); ticks += 6; break;
+        case 0x94: ZPX(); STY(); ticks += 4; break;
+        case 0x95: ZPX(); STA(); ticks += 4; break;
+        case 0x96: ZPY(); STX(); ticks += 4; break;
+        case 0x97: ZPY(); SAX(); ticks += 4; break;
+        case 0x98: TYA(); ticks += 2; break;
+        case 0x99: ABSY(); STA(); ticks += 5; break;
+        case 0x9A: TXS(); ticks += 2; break;
+        case 0x9B: ABSY(); ticks += 5; break;
+        case 0x9C: ABSX(); ticks += 5; break;
+        case 0x9D: ABSX(); STA(); ticks += 5; break;
+        case 0x9E: ABSY(); ticks += 5; break;
+        case 0x9F: ABSY(); ticks += 5; break;
+        case 0xA0: IMM(); LDY(); ticks += 2; break;
+        case 0xA1: INDX(); LDA(); ticks += 6; break;
+        case 0xA2: IMM(); LDX(); ticks += 2; break;
+        case 0xA3: INDX(); LAX(); ticks += 6; break;
+        case 0xA4: ZP(); LDY(); ticks += 3; break;
+        case 0xA5: ZP(); LDA(); ticks += 3; break;
+        case 0xA6: ZP(); LDX(); ticks += 3; break;
+        case 0xA7: ZP(); LAX(); ticks += 3; break;
+        case 0xA8: TAY(); ticks += 2; break;
+        case 0xA9: IMM(); LDA(); ticks += 2; break;
+        case 0xAA: TAX(); ticks += 2; break;
+        case 0xAB: IMM(); ticks += 2; break;
+        case 0xAC: ABS(); LDY(); ticks += 4; break;
+        case 0xAD: ABS(); LDA(); ticks += 4; break;
+        case 0xAE: ABS(); LDX(); ticks += 4; break;
+        case 0xAF: ABS(); LAX(); ticks += 4; break;
+        case 0xB0: BCS(); ticks += 2; break;
+        case 0xB1: INDY(); LDA(); ticks += 5 + penalty; break;
+        case 0xB2: ticks += 2; break;
+        case 0xB3: INDY(); LAX(); ticks += 5 + penalty; break;
+        case 0xB4: ZPX(); LDY(); ticks += 4; break;
+        case 0xB5: ZPX(); LDA(); ticks += 4; break;
+        case 0xB6: ZPY(); LDX(); ticks += 4; break;
+        case 0xB7: ZPY(); LAX(); ticks += 4; break;
+        case 0xB8: CLV(); ticks += 2; break;
+        case 0xB9: ABSY(); LDA(); ticks += 4 + penalty; break;
+        case 0xBA: TSX(); ticks += 2; break;
+        case 0xBB: ABSY(); LAX(); ticks += 4 + penalty; break;
+        case 0xBC: ABSX(); LDY(); ticks += 4 + penalty; break;
+        case 0xBD: ABSX(); LDA(); ticks += 4 + penalty; break;
+        case 0xBE: ABSY(); LDX(); ticks += 4 + penalty; break;
+        case 0xBF: ABSY(); LAX(); ticks += 4 + penalty; break;
+        case 0xC0: IMM(); CPY(); ticks += 2; break;
+        case 0xC1: INDX(); CMP(); ticks += 6; break;
+        case 0xC2: IMM(); ticks += 2; break;
+        case 0xC3: INDX(); DCP(); ticks += 8; break;
+        case 0xC4: ZP(); CPY(); ticks += 3; break;
+        case 0xC5: ZP(); CMP(); ticks += 3; break;
+        case 0xC6: ZP(); DEC(); ticks += 5; break;
+        case 0xC7: ZP(); DCP(); ticks += 5; break;
+        case 0xC8: INY(); ticks += 2; break;
+        case 0xC9: IMM(); CMP(); ticks += 2; break;
+        case 0xCA: DEX(); ticks += 2; break;
+        case 0xCB: IMM(); ticks += 2; break;
+        case 0xCC: ABS(); CPY(); ticks += 4; break;
+        case 0xCD: ABS(); CMP(); ticks += 4; break;
+        case 0xCE: ABS(); DEC(); ticks += 6; break;
+        case 0xCF: ABS(); DCP(); ticks += 6; break;
+        case 0xD0: BNE(); ticks += 2; break;
+        case 0xD1: INDY(); CMP(); ticks += 5 + penalty; break;
+        case 0xD2: ticks += 2; break;
+        case 0xD3: INDY(); DCP(); ticks += 8; break;
+        case 0xD4: ZPX(); ticks += 4; break;
+        case 0xD5: ZPX(); CMP(); ticks += 4; break;
+        case 0xD6: ZPX(); DEC(); ticks += 6; break;
+        case 0xD7: ZPX(); DCP(); ticks += 6; break;
+        case 0xD8: CLD(); ticks += 2; break;
+        case 0xD9: ABSY(); CMP(); ticks += 4 + penalty; break;
+        case 0xDA: ticks += 2; break;
+        case 0xDB: ABSY(); DCP(); ticks += 7; break;
+        case 0xDC: ABSX(); ticks += 4 + penalty; break;
+        case 0xDD: ABSX(); CMP(); ticks += 4 + penalty; break;
+        case 0xDE: ABSX(); DEC(); ticks += 7; break;
+        case 0xDF: ABSX(); DCP(); ticks += 7; break;
+        case 0xE0: IMM(); CPX(); ticks += 2; break;
+        case 0xE1: INDX(); SBC(); ticks += 6; break;
+        case 0xE2: IMM(); ticks += 2; break;
+        case 0xE3: INDX(); ISB(); ticks += 8; break;
+        case 0xE4: ZP(); CPX(); ticks += 3; break;
+        case 0xE5: ZP(); SBC(); ticks += 3; break;
+        case 0xE6: ZP(); INC(); ticks += 5; break;
+        case 0xE7: ZP(); ISB(); ticks += 5; break;
+        case 0xE8: INX(); ticks += 2; break;
+        case 0xE9: IMM(); SBC(); ticks += 2; break;
+        case 0xEA: ticks += 2; break;
+        case 0xEB: IMM(); SBC(); ticks += 2; break;
+        case 0xEC: ABS(); CPX(); ticks += 4; break;
+        case 0xED: ABS(); SBC(); ticks += 4; break;
+        case 0xEE: ABS(); INC(); ticks += 6; break;
+        case 0xEF: ABS(); ISB(); ticks += 6; break;
+        case 0xF0: BEQ(); ticks += 2; break;
+        case 0xF1: INDY(); SBC(); ticks += 5 + penalty; break;
+        case 0xF2: ticks += 2; break;
+        case 0xF3: INDY(); ISB(); ticks += 8; break;
+        case 0xF4: ZPX(); ticks += 4; break;
+        case 0xF5: ZPX(); SBC(); ticks += 4; break;
+        case 0xF6: ZPX(); INC(); ticks += 6; break;
+        case 0xF7: ZPX(); ISB(); ticks += 6; break;
+        case 0xF8: SED(); ticks += 2; break;
+        case 0xF9: ABSY(); SBC(); ticks += 4 + penalty; break;
+        case 0xFA: ticks += 2; break;
+        case 0xFB: ABSY(); ISB(); ticks += 7; break;
+        case 0xFC: ABSX(); ticks += 4 + penalty; break;
+        case 0xFD: ABSX(); SBC(); ticks += 4 + penalty; break;
+        case 0xFE: ABSX(); INC(); ticks += 7; break;
+        case 0xFF: ABSX(); ISB(); ticks += 7; break;
         }
-        if ((a & 0xF0) > 0x90) {
-            a += 0x60;
-            setcarry();
-        }
-        
-        clockticks6502++;
-    }
-    #endif
-   
-    saveaccum(result);
-}
-
-static void and() {
-    penaltyop = 1;
-    value = getvalue();
-    result = (uint16_t)a & value;
-   
-    zerocalc(result);
-    signcalc(result);
-   
-    saveaccum(result);
-}
-
-static void asl() {
-    value = getvalue();
-    result = value << 1;
-
-    carrycalc(result);
-    zerocalc(result);
-    signcalc(result);
-   
-    putvalue(result);
-}
-
-static void bcc() {
-    if ((status & FLAG_CARRY) == 0) {
-        oldpc = pc;
-        pc += reladdr;
-        if ((oldpc & 0xFF00) != (pc & 0xFF00)) clockticks6502 += 2; //check if jump crossed a page boundary
-            else clockticks6502++;
-    }
-}
-
-static void bcs() {
-    if ((status & FLAG_CARRY) == FLAG_CARRY) {
-        oldpc = pc;
-        pc += reladdr;
-        if ((oldpc & 0xFF00) != (pc & 0xFF00)) clockticks6502 += 2; //check if jump crossed a page boundary
-            else clockticks6502++;
-    }
-}
-
-static void beq() {
-    if ((status & FLAG_ZERO) == FLAG_ZERO) {
-        oldpc = pc;
-        pc += reladdr;
-        if ((oldpc & 0xFF00) != (pc & 0xFF00)) clockticks6502 += 2; //check if jump crossed a page boundary
-            else clockticks6502++;
-    }
-}
-
-static void bit() {
-    value = getvalue();
-    result = (uint16_t)a & value;
-   
-    zerocalc(result);
-    status = (status & 0x3F) | (uint8_t)(value & 0xC0);
-}
-
-static void bmi() {
-    if ((status & FLAG_SIGN) == FLAG_SIGN) {
-        oldpc = pc;
-        pc += reladdr;
-        if ((oldpc & 0xFF00) != (pc & 0xFF00)) clockticks6502 += 2; //check if jump crossed a page boundary
-            else clockticks6502++;
-    }
-}
-
-static void bne() {
-    if ((status & FLAG_ZERO) == 0) {
-        oldpc = pc;
-        pc += reladdr;
-        if ((oldpc & 0xFF00) != (pc & 0xFF00)) clockticks6502 += 2; //check if jump crossed a page boundary
-            else clockticks6502++;
-    }
-}
-
-static void bpl() {
-    if ((status & FLAG_SIGN) == 0) {
-        oldpc = pc;
-        pc += reladdr;
-        if ((oldpc & 0xFF00) != (pc & 0xFF00)) clockticks6502 += 2; //check if jump crossed a page boundary
-            else clockticks6502++;
-    }
-}
-
-static void brk() {
-    pc++;
-    push16(pc); //push next instruction address onto stack
-    push8(status | FLAG_BREAK); //push CPU status to stack
-    setinterrupt(); //set interrupt flag
-    pc = (uint16_t)read6502(0xFFFE) | ((uint16_t)read6502(0xFFFF) << 8);
-}
-
-static void bvc() {
-    if ((status & FLAG_OVERFLOW) == 0) {
-        oldpc = pc;
-        pc += reladdr;
-        if ((oldpc & 0xFF00) != (pc & 0xFF00)) clockticks6502 += 2; //check if jump crossed a page boundary
-            else clockticks6502++;
-    }
-}
-
-static void bvs() {
-    if ((status & FLAG_OVERFLOW) == FLAG_OVERFLOW) {
-        oldpc = pc;
-        pc += reladdr;
-        if ((oldpc & 0xFF00) != (pc & 0xFF00)) clockticks6502 += 2; //check if jump crossed a page boundary
-            else clockticks6502++;
-    }
-}
-
-static void clc() {
-    clearcarry();
-}
-
-static void cld() {
-    cleardecimal();
-}
-
-static void cli() {
-    clearinterrupt();
-}
-
-static void clv() {
-    clearoverflow();
-}
-
-static void cmp() {
-    penaltyop = 1;
-    value = getvalue();
-    result = (uint16_t)a - value;
-   
-    if (a >= (uint8_t)(value & 0x00FF)) setcarry();
-        else clearcarry();
-    if (a == (uint8_t)(value & 0x00FF)) setzero();
-        else clearzero();
-    signcalc(result);
-}
 
-static void cpx() {
-    value = getvalue();
-    result = (uint16_t)x - value;
-   
-    if (x >= (uint8_t)(value & 0x00FF)) setcarry();
-        else clearcarry();
-    if (x == (uint8_t)(value & 0x00FF)) setzero();
-        else clearzero();
-    signcalc(result);
-}
-
-static void cpy() {
-    value = getvalue();
-    result = (uint16_t)y - value;
-   
-    if (y >= (uint8_t)(value & 0x00FF)) setcarry();
-        else clearcarry();
-    if (y == (uint8_t)(value & 0x00FF)) setzero();
-        else clearzero();
-    signcalc(result);
-}
-
-static void dec() {
-    value = getvalue();
-    result = value - 1;
-   
-    zerocalc(result);
-    signcalc(result);
-   
-    putvalue(result);
-}
-
-static void dex() {
-    x--;
-   
-    zerocalc(x);
-    signcalc(x);
-}
-
-static void dey() {
-    y--;
-   
-    zerocalc(y);
-    signcalc(y);
-}
-
-static void eor() {
-    penaltyop = 1;
-    value = getvalue();
-    result = (uint16_t)a ^ value;
-   
-    zerocalc(result);
-    signcalc(result);
-   
-    saveaccum(result);
-}
-
-static void inc() {
-    value = getvalue();
-    result = value + 1;
-   
-    zerocalc(result);
-    signcalc(result);
-   
-    putvalue(result);
-}
-
-static void inx() {
-    x++;
-   
-    zerocalc(x);
-    signcalc(x);
-}
-
-static void iny() {
-    y++;
-   
-    zerocalc(y);
-    signcalc(y);
-}
-
-static void jmp() {
-    pc = ea;
-}
-
-static void jsr() {
-    push16(pc - 1);
-    pc = ea;
-}
+        executed++;
 
-static void lda() {
-    penaltyop = 1;
-    value = getvalue();
-    a = (uint8_t)(value & 0x00FF);
-   
-    zerocalc(a);
-    signcalc(a);
-}
-
-static void ldx() {
-    penaltyop = 1;
-    value = getvalue();
-    x = (uint8_t)(value & 0x00FF);
-   
-    zerocalc(x);
-    signcalc(x);
-}
-
-static void ldy() {
-    penaltyop = 1;
-    value = getvalue();
-    y = (uint8_t)(value & 0x00FF);
-   
-    zerocalc(y);
-    signcalc(y);
-}
-
-static void lsr() {
-    value = getvalue();
-    result = value >> 1;
-   
-    if (value & 1) setcarry();
-        else clearcarry();
-    zerocalc(result);
-    signcalc(result);
-   
-    putvalue(result);
-}
+        if (callexternal) {
+            cpu.pc = pc; cpu.sp = sp; cpu.a = a; cpu.x = x; cpu.y = y; cpu.status = status;
+            clockticks6502 = ticks;
+            (*loopexternal)();
+            pc = cpu.pc; sp = cpu.sp; a = cpu.a; x = cpu.x; y = cpu.y; status = cpu.status;
+        }
 
-static void nop() {
-    switch (opcode) {
-        case 0x1C:
-        case 0x3C:
-        case 0x5C:
-        case 0x7C:
-        case 0xDC:
-        case 0xFC:
-            penaltyop = 1;
+        if (pc == stoppc) {
             break;
-    }
-}
-
-static void ora() {
-    penaltyop = 1;
-    value = getvalue();
-    result = (uint16_t)a | value;
-   
-    zerocalc(result);
-    signcalc(result);
-   
-    saveaccum(result);
-}
-
-static void pha() {
-    push8(a);
-}
-
-static void php() {
-    push8(status | FLAG_BREAK);
-}
-
-static void pla() {
-    a = pull8();
-   
-    zerocalc(a);
-    signcalc(a);
-}
-
-static void plp() {
-    status = pull8() | FLAG_CONSTANT;
-}
-
-static void rol() {
-    value = getvalue();
-    result = (value << 1) | (status & FLAG_CARRY);
-   
-    carrycalc(result);
-    zerocalc(result);
-    signcalc(result);
-   
-    putvalue(result);
-}
-
-static void ror() {
-    value = getvalue();
-    result = (value >> 1) | ((status & FLAG_CARRY) << 7);
-   
-    if (value & 1) setcarry();
-        else clearcarry();
-    zerocalc(result);
-    signcalc(result);
-   
-    putvalue(result);
-}
-
-static void rti() {
-    status = pull8();
-    value = pull16();
-    pc = value;
-}
-
-static void rts() {
-    value = pull16();
-    pc = value + 1;
-}
-
-static void sbc() {
-    penaltyop = 1;
-    value = getvalue() ^ 0x00FF;
-    result = (uint16_t)a + value + (uint16_t)(status & FLAG_CARRY);
-   
-    carrycalc(result);
-    zerocalc(result);
-    overflowcalc(result, a, value);
-    signcalc(result);
-
-    #ifndef NES_CPU
-    if (status & FLAG_DECIMAL) {
-        clearcarry();
-        
-        a -= 0x66;
-        if ((a & 0x0F) > 0x09) {
-            a += 0x06;
-        }
-        if ((a & 0xF0) > 0x90) {
-            a += 0x60;
-            setcarry();
         }
-        
-        clockticks6502++;
     }
-    #endif
-   
-    saveaccum(result);
-}
-
-static void sec() {
-    setcarry();
-}
-
-static void sed() {
-    setdecimal();
-}
 
-static void sei() {
-    setinterrupt();
+    cpu.pc = pc; cpu.sp = sp; cpu.a = a; cpu.x = x; cpu.y = y; cpu.status = status;
+    clockticks6502 = ticks;
+    instructions += executed;
 }
 
-static void sta() {
-    putvalue(a);
-}
-
-static void stx() {
-    putvalue(x);
-}
-
-static void sty() {
-    putvalue(y);
-}
-
-static void tax() {
-    x = a;
-   
-    zerocalc(x);
-    signcalc(x);
-}
-
-static void tay() {
-    y = a;
-   
-    zerocalc(y);
-    signcalc(y);
-}
-
-static void tsx() {
-    x = sp;
-   
-    zerocalc(x);
-    signcalc(x);
-}
-
-static void txa() {
-    a = x;
-   
-    zerocalc(a);
-    signcalc(a);
-}
-
-static void txs() {
-    sp = x;
-}
-
-static void tya() {
-    a = y;
-   
-    zerocalc(a);
-    signcalc(a);
-}
-
-//undocumented instructions
-#ifdef UNDOCUMENTED
-    static void lax() {
-        lda();
-        ldx();
-    }
-
-    static void sax() {
-        sta();
-        stx();
-        putvalue(a & x);
-        if (penaltyop && penaltyaddr) clockticks6502--;
-    }
-
-    static void dcp() {
-        dec();
-        cmp();
-        if (penaltyop && penaltyaddr) clockticks6502--;
-    }
-
-    static void isb() {
-        inc();
-        sbc();
-        if (penaltyop && penaltyaddr) clockticks6502--;
-    }
-
-    static void slo() {
-        asl();
-        ora();
-        if (penaltyop && penaltyaddr) clockticks6502--;
-    }
-
-    static void rla() {
-        rol();
-        and();
-        if (penaltyop && penaltyaddr) clockticks6502--;
-    }
-
-    static void sre() {
-        lsr();
-        eor();
-        if (penaltyop && penaltyaddr) clockticks6502--;
-    }
-
-    static void rra() {
-        ror();
-        adc();
-        if (penaltyop && penaltyaddr) clockticks6502--;
-    }
-#else
-    #define lax nop
-    #define sax nop
-    #define dcp nop
-    #define isb nop
-    #define slo nop
-    #define rla nop
-    #define sre nop
-    #define rra nop
-#endif
-
-
-static void (*addrtable[256])() = {
-/*        |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |  8  |  9  |  A  |  B  |  C  |  D  |  E  |  F  |     */
-/* 0 */     imp, indx,  imp, indx,   zp,   zp,   zp,   zp,  imp,  imm,  acc,  imm, abso, abso, abso, abso, /* 0 */
-/* 1 */     rel, indy,  imp, indy,  zpx,  zpx,  zpx,  zpx,  imp, absy,  imp, absy, absx, absx, absx, absx, /* 1 */
-/* 2 */    abso, indx,  imp, indx,   zp,   zp,   zp,   zp,  imp,  imm,  acc,  imm, abso, abso, abso, abso, /* 2 */
-/* 3 */     rel, indy,  imp, indy,  zpx,  zpx,  zpx,  zpx,  imp, absy,  imp, absy, absx, absx, absx, absx, /* 3 */
-/* 4 */     imp, indx,  imp, indx,   zp,   zp,   zp,   zp,  imp,  imm,  acc,  imm, abso, abso, abso, abso, /* 4 */
-/* 5 */     rel, indy,  imp, indy,  zpx,  zpx,  zpx,  zpx,  imp, absy,  imp, absy, absx, absx, absx, absx, /* 5 */
-/* 6 */     imp, indx,  imp, indx,   zp,   zp,   zp,   zp,  imp,  imm,  acc,  imm,  ind, abso, abso, abso, /* 6 */
-/* 7 */     rel, indy,  imp, indy,  zpx,  zpx,  zpx,  zpx,  imp, absy,  imp, absy, absx, absx, absx, absx, /* 7 */
-/* 8 */     imm, indx,  imm, indx,   zp,   zp,   zp,   zp,  imp,  imm,  imp,  imm, abso, abso, abso, abso, /* 8 */
-/* 9 */     rel, indy,  imp, indy,  zpx,  zpx,  zpy,  zpy,  imp, absy,  imp, absy, absx, absx, absy, absy, /* 9 */
-/* A */     imm, indx,  imm, indx,   zp,   zp,   zp,   zp,  imp,  imm,  imp,  imm, abso, abso, abso, abso, /* A */
-/* B */     rel, indy,  imp, indy,  zpx,  zpx,  zpy,  zpy,  imp, absy,  imp, absy, absx, absx, absy, absy, /* B */
-/* C */     imm, indx,  imm, indx,   zp,   zp,   zp,   zp,  imp,  imm,  imp,  imm, abso, abso, abso, abso, /* C */
-/* D */     rel, indy,  imp, indy,  zpx,  zpx,  zpx,  zpx,  imp, absy,  imp, absy, absx, absx, absx, absx, /* D */
-/* E */     imm, indx,  imm, indx,   zp,   zp,   zp,   zp,  imp,  imm,  imp,  imm, abso, abso, abso, abso, /* E */
-/* F */     rel, indy,  imp, indy,  zpx,  zpx,  zpx,  zpx,  imp, absy,  imp, absy, absx, absx, absx, absx  /* F */
-};
-
-static void (*optable[256])() = {
-/*        |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |  8  |  9  |  A  |  B  |  C  |  D  |  E  |  F  |      */
-/* 0 */      brk,  ora,  nop,  slo,  nop,  ora,  asl,  slo,  php,  ora,  asl,  nop,  nop,  ora,  asl,  slo, /* 0 */
-/* 1 */      bpl,  ora,  nop,  slo,  nop,  ora,  asl,  slo,  clc,  ora,  nop,  slo,  nop,  ora,  asl,  slo, /* 1 */
-/* 2 */      jsr,  and,  nop,  rla,  bit,  and,  rol,  rla,  plp,  and,  rol,  nop,  bit,  and,  rol,  rla, /* 2 */
-/* 3 */      bmi,  and,  nop,  rla,  nop,  and,  rol,  rla,  sec,  and,  nop,  rla,  nop,  and,  rol,  rla, /* 3 */
-/* 4 */      rti,  eor,  nop,  sre,  nop,  eor,  lsr,  sre,  pha,  eor,  lsr,  nop,  jmp,  eor,  lsr,  sre, /* 4 */
-/* 5 */      bvc,  eor,  nop,  sre,  nop,  eor,  lsr,  sre,  cli,  eor,  nop,  sre,  nop,  eor,  lsr,  sre, /* 5 */
-/* 6 */      rts,  adc,  nop,  rra,  nop,  adc,  ror,  rra,  pla,  adc,  ror,  nop,  jmp,  adc,  ror,  rra, /* 6 */
-/* 7 */      bvs,  adc,  nop,  rra,  nop,  adc,  ror,  rra,  sei,  adc,  nop,  rra,  nop,  adc,  ror,  rra, /* 7 */
-/* 8 */      nop,  sta,  nop,  sax,  sty,  sta,  stx,  sax,  dey,  nop,  txa,  nop,  sty,  sta,  stx,  sax, /* 8 */
-/* 9 */      bcc,  sta,  nop,  nop,  sty,  sta,  stx,  sax,  tya,  sta,  txs,  nop,  nop,  sta,  nop,  nop, /* 9 */
-/* A */      ldy,  lda,  ldx,  lax,  ldy,  lda,  ldx,  lax,  tay,  lda,  tax,  nop,  ldy,  lda,  ldx,  lax, /* A */
-/* B */      bcs,  lda,  nop,  lax,  ldy,  lda,  ldx,  lax,  clv,  lda,  tsx,  lax,  ldy,  lda,  ldx,  lax, /* B */
-/* C */      cpy,  cmp,  nop,  dcp,  cpy,  cmp,  dec,  dcp,  iny,  cmp,  dex,  nop,  cpy,  cmp,  dec,  dcp, /* C */
-/* D */      bne,  cmp,  nop,  dcp,  nop,  cmp,  dec,  dcp,  cld,  cmp,  nop,  dcp,  nop,  cmp,  dec,  dcp, /* D */
-/* E */      cpx,  sbc,  nop,  isb,  cpx,  sbc,  inc,  isb,  inx,  sbc,  nop,  sbc,  cpx,  sbc,  inc,  isb, /* E */
-/* F */      beq,  sbc,  nop,  isb,  nop,  sbc,  inc,  isb,  sed,  sbc,  nop,  isb,  nop,  sbc,  inc,  isb  /* F */
-};
-
-static const uint32_t ticktable[256] = {
-/*        |  0  |  1  |  2  |  3  |  4  |  5  |  6  |  7  |  8  |  9  |  A  |  B  |  C  |  D  |  E  |  F  |     */
-/* 0 */      7,    6,    2,    8,    3,    3,    5,    5,    3,    2,    2,    2,    4,    4,    6,    6,  /* 0 */
-/* 1 */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7,  /* 1 */
-/* 2 */      6,    6,    2,    8,    3,    3,    5,    5,    4,    2,    2,    2,    4,    4,    6,    6,  /* 2 */
-/* 3 */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7,  /* 3 */
-/* 4 */      6,    6,    2,    8,    3,    3,    5,    5,    3,    2,    2,    2,    3,    4,    6,    6,  /* 4 */
-/* 5 */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7,  /* 5 */
-/* 6 */      6,    6,    2,    8,    3,    3,    5,    5,    4,    2,    2,    2,    5,    4,    6,    6,  /* 6 */
-/* 7 */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7,  /* 7 */
-/* 8 */      2,    6,    2,    6,    3,    3,    3,    3,    2,    2,    2,    2,    4,    4,    4,    4,  /* 8 */
-/* 9 */      2,    6,    2,    6,    4,    4,    4,    4,    2,    5,    2,    5,    5,    5,    5,    5,  /* 9 */
-/* A */      2,    6,    2,    6,    3,    3,    3,    3,    2,    2,    2,    2,    4,    4,    4,    4,  /* A */
-/* B */      2,    5,    2,    5,    4,    4,    4,    4,    2,    4,    2,    4,    4,    4,    4,    4,  /* B */
-/* C */      2,    6,    2,    8,    3,    3,    5,    5,    2,    2,    2,    2,    4,    4,    6,    6,  /* C */
-/* D */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7,  /* D */
-/* E */      2,    6,    2,    8,    3,    3,    5,    5,    2,    2,    2,    2,    4,    4,    6,    6,  /* E */
-/* F */      2,    5,    2,    8,    4,    4,    6,    6,    2,    4,    2,    7,    4,    4,    7,    7   /* F */
-};
-
-
-void nmi6502() {
-    push16(pc);
-    push8(status);
-    status |= FLAG_INTERRUPT;
-    pc = (uint16_t)read6502(0xFFFA) | ((uint16_t)read6502(0xFFFB) << 8);
-}
-
-void irq6502() {
-    push16(pc);
-    push8(status);
-    status |= FLAG_INTERRUPT;
-    pc = (uint16_t)read6502(0xFFFE) | ((uint16_t)read6502(0xFFFF) << 8);
-}
-
-uint8_t callexternal = 0;
-void (*loopexternal)();
-
 void exec6502(uint32_t tickcount) {
     clockgoal6502 += tickcount;
-   
-    while (clockticks6502 < clockgoal6502) {
-        opcode = read6502(pc++);
-        status |= FLAG_CONSTANT;
-
-        penaltyop = 0;
-        penaltyaddr = 0;
-
-        (*addrtable[opcode])();
-        (*optable[opcode])();
-        clockticks6502 += ticktable[opcode];
-        if (penaltyop && penaltyaddr) clockticks6502++;
-
-        instructions++;
-
-        if (callexternal) (*loopexternal)();
+    if (clockticks6502 < clockgoal6502) {
+        run_core(UINT32_MAX, clockgoal6502 - clockticks6502, -1);
     }
-
 }
 
 void step6502() {
-    opcode = read6502(pc++);
-    status |= FLAG_CONSTANT;
-
-    penaltyop = 0;
-    penaltyaddr = 0;
-
-    (*addrtable[opcode])();
-    (*optable[opcode])();
-    clockticks6502 += ticktable[opcode];
-    if (penaltyop && penaltyaddr) clockticks6502++;
+    run_core(1, UINT32_MAX, -1);
     clockgoal6502 = clockticks6502;
+}
 
-    instructions++;
-
-    if (callexternal) (*loopexternal)();
+bool run6502(uint16_t stoppc, uint32_t maxticks) {
+    run_core(UINT32_MAX, maxticks, stoppc);
+    clockgoal6502 = clockticks6502;
+    return cpu.pc == stoppc;
 }
 
 void hookexternal(void *funcptr) {
@@ -976,5 +666,5 @@ uint32_t get6502_ticks() {
 }
 
 uint32_t get6502_pc() {
-    return pc;
+    return cpu.pc;
 }
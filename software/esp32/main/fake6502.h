@@ -2,6 +2,7 @@
 #define FAKE6502_H
 
 #include <stdint.h>
+#include <stdbool.h>
 
 void reset6502();
 
@@ -9,6 +10,17 @@ void exec6502(uint32_t tickcount);
 
 void step6502();
 
+/**
+ * Run until the PC reaches an address, such as the end of a call set up
+ * by the caller. At least one instruction is run, so this can be called
+ * with the PC already at the address.
+ *
+ * @param stoppc Address to stop at
+ * @param maxticks Clock ticks to give up after
+ * @return True if the PC reached the address
+ */
+bool run6502(uint16_t stoppc, uint32_t maxticks);
+
 void irq6502();
 
 void nmi6502();
@@ -0,0 +1,59 @@
+/*
+ * Heap Call Counters
+ */
+
+#include "heap_count.h"
+
+#include <freertos/FreeRTOS.h>
+#include <stddef.h>
+
+static portMUX_TYPE heap_count_mux = portMUX_INITIALIZER_UNLOCKED;
+static heap_count_t heap_count = {0};
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size)
+{
+    portENTER_CRITICAL(&heap_count_mux);
+    heap_count.allocs++;
+    portEXIT_CRITICAL(&heap_count_mux);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+    portENTER_CRITICAL(&heap_count_mux);
+    heap_count.allocs++;
+    portEXIT_CRITICAL(&heap_count_mux);
+    return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    portENTER_CRITICAL(&heap_count_mux);
+    heap_count.allocs++;
+    portEXIT_CRITICAL(&heap_count_mux);
+    return __real_realloc(ptr, size);
+}
+
+void __wrap_free(void *ptr)
+{
+    if (ptr) {
+        portENTER_CRITICAL(&heap_count_mux);
+        heap_count.frees++;
+        portEXIT_CRITICAL(&heap_count_mux);
+    }
+    __real_free(ptr);
+}
+
+void heap_count_get(heap_count_t *count)
+{
+    if (count) {
+        portENTER_CRITICAL(&heap_count_mux);
+        *count = heap_count;
+        portEXIT_CRITICAL(&heap_count_mux);
+    }
+}
@@ -0,0 +1,24 @@
+/*
+ * Heap Call Counters
+ *
+ * Counts calls to the C library allocator, so the heap traffic of a
+ * running task can be measured. The counting wrappers are linked in
+ * with --wrap, from component.mk.
+ */
+
+#ifndef HEAP_COUNT_H
+#define HEAP_COUNT_H
+
+#include <esp_types.h>
+
+typedef struct {
+    uint32_t allocs; /**< Calls to malloc, calloc and realloc */
+    uint32_t frees;  /**< Calls to free with a non-NULL pointer */
+} heap_count_t;
+
+/**
+ * Get the number of allocator calls made since startup, by all tasks.
+ */
+void heap_count_get(heap_count_t *count);
+
+#endif /* HEAP_COUNT_H */
@@ -0,0 +1,268 @@
+/*
+ * I2C Bus Scheduler
+ */
+
+#include "i2c_sched.h"
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/queue.h>
+#include <freertos/semphr.h>
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#include "board_config.h"
+
+static const char *TAG = "i2c_sched";
+
+/* Number of callers that can wait for the bus at the same time */
+#define I2C_SCHED_CLIENTS_MAX 8
+
+/*
+ * Idle time needed to run a low priority request, which is at most a
+ * handful of short transactions to the RTC or volume control.
+ */
+#define I2C_SCHED_LOW_BUDGET_US 2000
+
+/* Longest a low priority request is held back waiting for an idle gap */
+#define I2C_SCHED_LOW_MAX_DEFER_US 500000
+
+typedef struct {
+    SemaphoreHandle_t grant;
+    int64_t submit_time;
+} i2c_sched_request_t;
+
+typedef struct {
+    xQueueHandle high_queue;
+    xQueueHandle low_queue;
+    xQueueHandle grant_pool;
+    SemaphoreHandle_t signal;
+    SemaphoreHandle_t release;
+    bool realtime;
+    int64_t idle_until;
+} i2c_sched_t;
+
+static i2c_sched_t *i2c_sched_p0 = NULL;
+static portMUX_TYPE i2c_sched_mux = portMUX_INITIALIZER_UNLOCKED;
+
+static void i2c_sched_task(void *pvParameters);
+static int64_t i2c_sched_low_hold(i2c_sched_t *sched, const i2c_sched_request_t *request);
+static void i2c_sched_grant(i2c_sched_t *sched, const i2c_sched_request_t *request);
+
+static i2c_sched_t *i2c_sched_get(i2c_port_t i2c_num)
+{
+    return (i2c_num == I2C_P0_NUM) ? i2c_sched_p0 : NULL;
+}
+
+esp_err_t i2c_sched_init(i2c_port_t i2c_num)
+{
+    esp_err_t ret = ESP_OK;
+    i2c_sched_t *sched = NULL;
+
+    if (i2c_num != I2C_P0_NUM) {
+        return ESP_ERR_NOT_SUPPORTED;
+    }
+    if (i2c_sched_p0) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    do {
+        sched = malloc(sizeof(i2c_sched_t));
+        if (!sched) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        bzero(sched, sizeof(i2c_sched_t));
+
+        sched->high_queue = xQueueCreate(I2C_SCHED_CLIENTS_MAX, sizeof(i2c_sched_request_t));
+        sched->low_queue = xQueueCreate(I2C_SCHED_CLIENTS_MAX, sizeof(i2c_sched_request_t));
+        sched->grant_pool = xQueueCreate(I2C_SCHED_CLIENTS_MAX, sizeof(SemaphoreHandle_t));
+        sched->signal = xSemaphoreCreateCounting(I2C_SCHED_CLIENTS_MAX * 2, 0);
+        sched->release = xSemaphoreCreateBinary();
+        if (!sched->high_queue || !sched->low_queue || !sched->grant_pool
+                || !sched->signal || !sched->release) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        // Grant semaphores are created up front and lent to each caller
+        // while it waits, so requests do not allocate.
+        for (int i = 0; i < I2C_SCHED_CLIENTS_MAX; i++) {
+            SemaphoreHandle_t grant = xSemaphoreCreateBinary();
+            if (!grant) {
+                ret = ESP_ERR_NO_MEM;
+                break;
+            }
+            xQueueSend(sched->grant_pool, &grant, 0);
+        }
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        // Run alongside the player on the application core, at a higher
+        // priority so the bus is handed over without delay.
+        if (xTaskCreatePinnedToCore(i2c_sched_task, "i2c_sched_task", 2048,
+                sched, 6, NULL, APP_CPU_NUM) != pdPASS) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+    } while (0);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to start scheduler: %d", ret);
+        if (sched) {
+            SemaphoreHandle_t grant;
+            while (sched->grant_pool && xQueueReceive(sched->grant_pool, &grant, 0) == pdTRUE) {
+                vSemaphoreDelete(grant);
+            }
+            if (sched->high_queue) { vQueueDelete(sched->high_queue); }
+            if (sched->low_queue) { vQueueDelete(sched->low_queue); }
+            if (sched->grant_pool) { vQueueDelete(sched->grant_pool); }
+            if (sched->signal) { vSemaphoreDelete(sched->signal); }
+            if (sched->release) { vSemaphoreDelete(sched->release); }
+            free(sched);
+        }
+        return ret;
+    }
+
+    i2c_sched_p0 = sched;
+    ESP_LOGI(TAG, "Scheduler started for port %d", i2c_num);
+    return ESP_OK;
+}
+
+bool i2c_sched_is_running(i2c_port_t i2c_num)
+{
+    return i2c_sched_get(i2c_num) != NULL;
+}
+
+void i2c_sched_begin(i2c_port_t i2c_num, i2c_sched_priority_t priority)
+{
+    i2c_sched_t *sched = i2c_sched_get(i2c_num);
+    if (!sched) {
+        return;
+    }
+
+    i2c_sched_request_t request;
+    xQueueReceive(sched->grant_pool, &request.grant, portMAX_DELAY);
+    request.submit_time = esp_timer_get_time();
+
+    xQueueSend((priority == I2C_SCHED_PRIORITY_HIGH) ? sched->high_queue : sched->low_queue,
+            &request, portMAX_DELAY);
+    xSemaphoreGive(sched->signal);
+
+    xSemaphoreTake(request.grant, portMAX_DELAY);
+    xQueueSend(sched->grant_pool, &request.grant, portMAX_DELAY);
+}
+
+void i2c_sched_end(i2c_port_t i2c_num)
+{
+    i2c_sched_t *sched = i2c_sched_get(i2c_num);
+    if (!sched) {
+        return;
+    }
+
+    xSemaphoreGive(sched->release);
+}
+
+void i2c_sched_set_realtime(i2c_port_t i2c_num, bool realtime)
+{
+    i2c_sched_t *sched = i2c_sched_get(i2c_num);
+    if (!sched) {
+        return;
+    }
+
+    portENTER_CRITICAL(&i2c_sched_mux);
+    sched->realtime = realtime;
+    sched->idle_until = 0;
+    portEXIT_CRITICAL(&i2c_sched_mux);
+
+    xSemaphoreGive(sched->signal);
+}
+
+void i2c_sched_set_idle_until(i2c_port_t i2c_num, int64_t time)
+{
+    i2c_sched_t *sched = i2c_sched_get(i2c_num);
+    if (!sched) {
+        return;
+    }
+
+    portENTER_CRITICAL(&i2c_sched_mux);
+    sched->idle_until = time;
+    portEXIT_CRITICAL(&i2c_sched_mux);
+
+    xSemaphoreGive(sched->signal);
+}
+
+void i2c_sched_task(void *pvParameters)
+{
+    i2c_sched_t *sched = (i2c_sched_t *)pvParameters;
+    i2c_sched_request_t request;
+
+    while (true) {
+        // Music output always goes first
+        if (xQueueReceive(sched->high_queue, &request, 0) == pdTRUE) {
+            i2c_sched_grant(sched, &request);
+            continue;
+        }
+
+        if (xQueuePeek(sched->low_queue, &request, 0) == pdTRUE) {
+            int64_t hold = i2c_sched_low_hold(sched, &request);
+            if (hold <= 0) {
+                xQueueReceive(sched->low_queue, &request, 0);
+                i2c_sched_grant(sched, &request);
+            } else {
+                // Wait for a new request or idle gap, or for the
+                // request to run out of time.
+                TickType_t ticks = (hold / 1000) / portTICK_RATE_MS;
+                xSemaphoreTake(sched->signal, MAX(ticks, 1));
+            }
+            continue;
+        }
+
+        xSemaphoreTake(sched->signal, portMAX_DELAY);
+    }
+}
+
+/**
+ * Get how much longer a low priority request should be held back,
+ * or zero if it can run now.
+ */
+int64_t i2c_sched_low_hold(i2c_sched_t *sched, const i2c_sched_request_t *request)
+{
+    bool realtime;
+    int64_t idle_until;
+
+    portENTER_CRITICAL(&i2c_sched_mux);
+    realtime = sched->realtime;
+    idle_until = sched->idle_until;
+    portEXIT_CRITICAL(&i2c_sched_mux);
+
+    if (!realtime) {
+        return 0;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (now + I2C_SCHED_LOW_BUDGET_US <= idle_until) {
+        return 0;
+    }
+
+    int64_t hold = (request->submit_time + I2C_SCHED_LOW_MAX_DEFER_US) - now;
+    if (hold <= 0) {
+        ESP_LOGD(TAG, "Low priority request ran without an idle gap");
+        return 0;
+    }
+    return hold;
+}
+
+/**
+ * Hand the bus to a caller, and wait for it to be handed back.
+ */
+void i2c_sched_grant(i2c_sched_t *sched, const i2c_sched_request_t *request)
+{
+    xSemaphoreGive(request->grant);
+    xSemaphoreTake(sched->release, portMAX_DELAY);
+}
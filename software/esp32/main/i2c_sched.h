@@ -0,0 +1,57 @@
+/*
+ * I2C Bus Scheduler
+ *
+ * A task that owns access to an I2C port, and hands it to one caller
+ * at a time in priority order. Music output runs as soon as the bus is
+ * free, while housekeeping work is held back until the player reports
+ * an idle gap long enough to fit it.
+ */
+
+#ifndef I2C_SCHED_H
+#define I2C_SCHED_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+#include <driver/i2c.h>
+
+typedef enum {
+    I2C_SCHED_PRIORITY_HIGH = 0, /**< Music output, granted first */
+    I2C_SCHED_PRIORITY_LOW       /**< Housekeeping, deferred into idle gaps */
+} i2c_sched_priority_t;
+
+/**
+ * Start the scheduler task for a port.
+ */
+esp_err_t i2c_sched_init(i2c_port_t i2c_num);
+
+/**
+ * Check whether the scheduler is running for a port.
+ */
+bool i2c_sched_is_running(i2c_port_t i2c_num);
+
+/**
+ * Submit a request for the bus, and block until it is granted.
+ *
+ * The caller then runs its transactions directly, and must call
+ * i2c_sched_end() once it is done with the bus.
+ */
+void i2c_sched_begin(i2c_port_t i2c_num, i2c_sched_priority_t priority);
+
+/**
+ * Hand the bus back to the scheduler.
+ */
+void i2c_sched_end(i2c_port_t i2c_num);
+
+/**
+ * Mark the start of real-time playback, during which low priority
+ * requests only run inside reported idle gaps.
+ */
+void i2c_sched_set_realtime(i2c_port_t i2c_num, bool realtime);
+
+/**
+ * Report that the bus will not be needed for music output until the
+ * given time, as returned by esp_timer_get_time().
+ */
+void i2c_sched_set_idle_until(i2c_port_t i2c_num, int64_t time);
+
+#endif /* I2C_SCHED_H */
@@ -8,14 +8,39 @@
 #include <esp_err.h>
 #include <esp_log.h>
 #include <driver/i2c.h>
+#include <string.h>
 
 #include "board_config.h"
+#include "i2c_sched.h"
 
 static const char *TAG = "i2c_util";
 
+/*
+ * Writes up to this size, including the address byte, are packed into a
+ * single write command. The driver allocates each command separately, so
+ * this keeps a short write to four allocations: the link, start, write
+ * and stop.
+ */
+#define I2C_PACKED_WRITE_MAX 80
+
+/*
+ * Set to 0 to give the data of each write its own command again, so the
+ * heap counts in the VGM drift report can be compared with and without
+ * packing.
+ */
+#define I2C_PACK_WRITES 1
+
 SemaphoreHandle_t i2c_p0_mutex = NULL;
 SemaphoreHandle_t i2c_p1_mutex = NULL;
 
+static i2c_stats_t i2c_p0_stats = {0};
+static i2c_stats_t i2c_p1_stats = {0};
+
+static esp_err_t i2c_cmd_run(i2c_port_t i2c_num, uint8_t device_id, i2c_cmd_handle_t cmd);
+static esp_err_t i2c_write_packed(i2c_port_t i2c_num, uint8_t device_id,
+        const uint8_t *prefix, size_t prefix_len,
+        const uint8_t *data, size_t data_len);
+
 esp_err_t i2c_init_master_port0()
 {
     esp_err_t ret;
@@ -57,6 +82,14 @@ esp_err_t i2c_init_master_port0()
         return ret;
     }
 
+    // Port 0 is shared between the NES CPU and slower housekeeping
+    // devices, so access to it goes through the bus scheduler. If that
+    // fails to start, the mutex is still there to fall back on.
+    ret = i2c_sched_init(port);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "i2c_sched_init error: %d", ret);
+    }
+
     ESP_LOGI(TAG, "I2C Master port 0 initialized");
     return ESP_OK;
 }
@@ -99,14 +132,34 @@ esp_err_t i2c_init_master_port1()
 
 void i2c_mutex_lock(i2c_port_t port)
 {
+    if (i2c_sched_is_running(port)) {
+        i2c_sched_begin(port, I2C_SCHED_PRIORITY_HIGH);
+        return;
+    }
+
     SemaphoreHandle_t i2c_mutex = (port == I2C_P1_NUM) ? i2c_p1_mutex : i2c_p0_mutex;
     if (i2c_mutex) {
         xSemaphoreTake(i2c_mutex, portMAX_DELAY);
     }
 }
 
+void i2c_mutex_lock_background(i2c_port_t port)
+{
+    if (i2c_sched_is_running(port)) {
+        i2c_sched_begin(port, I2C_SCHED_PRIORITY_LOW);
+        return;
+    }
+
+    i2c_mutex_lock(port);
+}
+
 void i2c_mutex_unlock(i2c_port_t port)
 {
+    if (i2c_sched_is_running(port)) {
+        i2c_sched_end(port);
+        return;
+    }
+
     SemaphoreHandle_t i2c_mutex = (port == I2C_P1_NUM) ? i2c_p1_mutex : i2c_p0_mutex;
     if (i2c_mutex) {
         xSemaphoreGive(i2c_mutex);
@@ -159,39 +212,12 @@ esp_err_t i2c_read_byte(i2c_port_t i2c_num, uint8_t device_id, uint8_t *data)
     ESP_ERROR_CHECK(i2c_master_read_byte(cmd, data, true));
     ESP_ERROR_CHECK(i2c_master_stop(cmd));
 
-    esp_err_t ret = i2c_master_cmd_begin(i2c_num, cmd, 1000 / portTICK_RATE_MS);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "i2c_master_cmd_begin error: [%02X] %s (%d)",
-                device_id, esp_err_to_name(ret), ret);
-    }
-
-    i2c_cmd_link_delete(cmd);
-
-    return ret;
+    return i2c_cmd_run(i2c_num, device_id, cmd);
 }
 
 esp_err_t i2c_write_byte(i2c_port_t i2c_num, uint8_t device_id, uint8_t data)
 {
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    if (!cmd) {
-        ESP_LOGE(TAG, "i2c_cmd_link_create error");
-        return ESP_ERR_NO_MEM;
-    }
-
-    ESP_ERROR_CHECK(i2c_master_start(cmd));
-    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, device_id << 1 | I2C_MASTER_WRITE, true));
-    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, data, true));
-    ESP_ERROR_CHECK(i2c_master_stop(cmd));
-
-    esp_err_t ret = i2c_master_cmd_begin(i2c_num, cmd, 1000 / portTICK_RATE_MS);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "i2c_master_cmd_begin error: [%02X] %s (%d)",
-                device_id, esp_err_to_name(ret), ret);
-    }
-
-    i2c_cmd_link_delete(cmd);
-
-    return ret;
+    return i2c_write_packed(i2c_num, device_id, NULL, 0, &data, 1);
 }
 
 esp_err_t i2c_read_buffer(i2c_port_t i2c_num, uint8_t device_id, uint8_t *data, size_t data_len)
@@ -214,19 +240,44 @@ esp_err_t i2c_read_buffer(i2c_port_t i2c_num, uint8_t device_id, uint8_t *data,
 
     ESP_ERROR_CHECK(i2c_master_stop(cmd));
 
-    esp_err_t ret = i2c_master_cmd_begin(i2c_num, cmd, 1000 / portTICK_RATE_MS);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "i2c_master_cmd_begin error: [%02X] %s (%d)",
-                device_id, esp_err_to_name(ret), ret);
+    return i2c_cmd_run(i2c_num, device_id, cmd);
+}
+
+esp_err_t i2c_write_buffer(i2c_port_t i2c_num, uint8_t device_id, uint8_t *data, size_t data_len)
+{
+    return i2c_write_packed(i2c_num, device_id, NULL, 0, data, data_len);
+}
+
+esp_err_t i2c_read_register(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg, uint8_t *data)
+{
+    if (!data) {
+        return ESP_ERR_INVALID_ARG;
     }
 
-    i2c_cmd_link_delete(cmd);
+    return i2c_write_read_buffer(i2c_num, device_id, &reg, 1, data, 1);
+}
 
-    return ret;
+esp_err_t i2c_read_register_buffer(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg, uint8_t *data, size_t data_len)
+{
+    return i2c_write_read_buffer(i2c_num, device_id, &reg, 1, data, data_len);
 }
 
-esp_err_t i2c_write_buffer(i2c_port_t i2c_num, uint8_t device_id, uint8_t *data, size_t data_len)
+esp_err_t i2c_write_read_buffer(i2c_port_t i2c_num, uint8_t device_id,
+        const uint8_t *wdata, size_t wdata_len, uint8_t *rdata, size_t rdata_len)
 {
+    // The address byte and the data to write are packed into one write
+    // command, as in i2c_write_packed().
+    uint8_t packed[I2C_PACKED_WRITE_MAX];
+    if (!wdata || wdata_len == 0 || 1 + wdata_len > I2C_PACKED_WRITE_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (!rdata || rdata_len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    packed[0] = device_id << 1 | I2C_MASTER_WRITE;
+    memcpy(packed + 1, wdata, wdata_len);
+
     i2c_cmd_handle_t cmd = i2c_cmd_link_create();
     if (!cmd) {
         ESP_LOGE(TAG, "i2c_cmd_link_create error");
@@ -234,45 +285,55 @@ esp_err_t i2c_write_buffer(i2c_port_t i2c_num, uint8_t device_id, uint8_t *data,
     }
 
     ESP_ERROR_CHECK(i2c_master_start(cmd));
-    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, device_id << 1 | I2C_MASTER_WRITE, true));
-    ESP_ERROR_CHECK(i2c_master_write(cmd, data, data_len, true));
-    ESP_ERROR_CHECK(i2c_master_stop(cmd));
-
-    esp_err_t ret = i2c_master_cmd_begin(i2c_num, cmd, 1000 / portTICK_RATE_MS);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "i2c_master_cmd_begin error: [%02X] %s (%d)",
-                device_id, esp_err_to_name(ret), ret);
+    ESP_ERROR_CHECK(i2c_master_write(cmd, packed, 1 + wdata_len, true));
+    ESP_ERROR_CHECK(i2c_master_start(cmd));
+    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, device_id << 1 | I2C_MASTER_READ, true));
+    if (rdata_len > 1) {
+        ESP_ERROR_CHECK(i2c_master_read(cmd, rdata, rdata_len - 1, false));
     }
+    ESP_ERROR_CHECK(i2c_master_read_byte(cmd, rdata + (rdata_len - 1), true));
+    ESP_ERROR_CHECK(i2c_master_stop(cmd));
 
-    i2c_cmd_link_delete(cmd);
+    return i2c_cmd_run(i2c_num, device_id, cmd);
+}
 
-    return ret;
+esp_err_t i2c_write_register(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg, uint8_t data)
+{
+    return i2c_write_packed(i2c_num, device_id, &reg, 1, &data, 1);
 }
 
-esp_err_t i2c_read_register(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg, uint8_t *data)
+esp_err_t i2c_write_register_buffer(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg, const uint8_t *data, size_t data_len)
 {
-    esp_err_t ret = ESP_OK;
+    return i2c_write_packed(i2c_num, device_id, &reg, 1, data, data_len);
+}
 
-    if (!data) {
+/**
+ * Write the device address, a short prefix and the data as a single
+ * transaction. Short writes are copied into one buffer, so the command
+ * link only needs a single write command.
+ */
+esp_err_t i2c_write_packed(i2c_port_t i2c_num, uint8_t device_id,
+        const uint8_t *prefix, size_t prefix_len,
+        const uint8_t *data, size_t data_len)
+{
+    uint8_t packed[I2C_PACKED_WRITE_MAX];
+    size_t packed_len = 1 + prefix_len;
+    if (packed_len > I2C_PACKED_WRITE_MAX || (data_len > 0 && !data)) {
         return ESP_ERR_INVALID_ARG;
     }
 
-    ret = i2c_write_byte(i2c_num, device_id, reg);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "i2c_write_byte error: %d", ret);
-        return ret;
+    packed[0] = device_id << 1 | I2C_MASTER_WRITE;
+    if (prefix_len > 0) {
+        memcpy(packed + 1, prefix, prefix_len);
     }
 
-    ret = i2c_read_byte(i2c_num, device_id, data);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "i2c_read_byte error: %d", ret);
+    bool data_packed = false;
+    if (I2C_PACK_WRITES && data_len > 0 && packed_len + data_len <= I2C_PACKED_WRITE_MAX) {
+        memcpy(packed + packed_len, data, data_len);
+        packed_len += data_len;
+        data_packed = true;
     }
 
-    return ret;
-}
-
-esp_err_t i2c_write_register(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg, uint8_t data)
-{
     i2c_cmd_handle_t cmd = i2c_cmd_link_create();
     if (!cmd) {
         ESP_LOGE(TAG, "i2c_cmd_link_create error");
@@ -280,11 +341,20 @@ esp_err_t i2c_write_register(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg,
     }
 
     ESP_ERROR_CHECK(i2c_master_start(cmd));
-    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, device_id << 1 | I2C_MASTER_WRITE, true));
-    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, reg, true));
-    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, data, true));
+    ESP_ERROR_CHECK(i2c_master_write(cmd, packed, packed_len, true));
+    if (data_len > 0 && !data_packed) {
+        ESP_ERROR_CHECK(i2c_master_write(cmd, (uint8_t *)data, data_len, true));
+    }
     ESP_ERROR_CHECK(i2c_master_stop(cmd));
 
+    return i2c_cmd_run(i2c_num, device_id, cmd);
+}
+
+/**
+ * Run a command link, then free it and update the statistics.
+ */
+esp_err_t i2c_cmd_run(i2c_port_t i2c_num, uint8_t device_id, i2c_cmd_handle_t cmd)
+{
     esp_err_t ret = i2c_master_cmd_begin(i2c_num, cmd, 1000 / portTICK_RATE_MS);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "i2c_master_cmd_begin error: [%02X] %s (%d)",
@@ -293,5 +363,15 @@ esp_err_t i2c_write_register(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg,
 
     i2c_cmd_link_delete(cmd);
 
+    i2c_stats_t *stats = (i2c_num == I2C_P1_NUM) ? &i2c_p1_stats : &i2c_p0_stats;
+    stats->transactions++;
+
     return ret;
 }
+
+void i2c_get_stats(i2c_port_t port, i2c_stats_t *stats)
+{
+    if (stats) {
+        *stats = (port == I2C_P1_NUM) ? i2c_p1_stats : i2c_p0_stats;
+    }
+}
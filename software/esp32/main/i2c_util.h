@@ -10,6 +10,12 @@ esp_err_t i2c_init_master_port1();
 void i2c_mutex_lock(i2c_port_t port);
 void i2c_mutex_unlock(i2c_port_t port);
 
+/**
+ * Lock the port for housekeeping work, which can wait. On port 0 this
+ * is deferred by the bus scheduler until music output is idle.
+ */
+void i2c_mutex_lock_background(i2c_port_t port);
+
 void i2c_bus_scan(i2c_port_t port);
 
 esp_err_t i2c_read_byte(i2c_port_t i2c_num, uint8_t device_id, uint8_t *data);
@@ -21,4 +27,36 @@ esp_err_t i2c_write_buffer(i2c_port_t i2c_num, uint8_t device_id, uint8_t *data,
 esp_err_t i2c_read_register(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg, uint8_t *data);
 esp_err_t i2c_write_register(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg, uint8_t data);
 
+/**
+ * Write a buffer of data, then read back a buffer of data after a
+ * repeated start, in one transaction.
+ */
+esp_err_t i2c_write_read_buffer(i2c_port_t i2c_num, uint8_t device_id,
+        const uint8_t *wdata, size_t wdata_len, uint8_t *rdata, size_t rdata_len);
+
+/**
+ * Read a run of consecutive registers, starting at the given register,
+ * in one transaction. This relies on the device auto-incrementing its
+ * register address after each byte.
+ */
+esp_err_t i2c_read_register_buffer(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg, uint8_t *data, size_t data_len);
+
+/**
+ * Write a register byte followed by a buffer of data, in one transaction.
+ */
+esp_err_t i2c_write_register_buffer(i2c_port_t i2c_num, uint8_t device_id, uint8_t reg, const uint8_t *data, size_t data_len);
+
+/**
+ * Counters for the transactions run through the functions in this file.
+ *
+ * The I2C driver allocates the command link, and each command added to
+ * it, from the heap, so heap_count.h is the place to measure what each
+ * transaction costs.
+ */
+typedef struct {
+    uint32_t transactions;
+} i2c_stats_t;
+
+void i2c_get_stats(i2c_port_t port, i2c_stats_t *stats);
+
 #endif /* I2C_UTIL_H */
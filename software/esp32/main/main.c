@@ -75,7 +75,7 @@ static void gpio_poll_task(void *pvParameters)
             int val = adc1_get_raw(ADC1_VOL_PIN);
             int rheo_val = val >> 5;
             if (last_rheo_val < 0 || abs(rheo_val - last_rheo_val) > 1) {
-                i2c_mutex_lock(I2C_P0_NUM);
+                i2c_mutex_lock_background(I2C_P0_NUM);
                 mcp40d17_set_wiper(I2C_P0_NUM, 0x7F & rheo_val);
                 i2c_mutex_unlock(I2C_P0_NUM);
                 ESP_LOGI(TAG, "Set volume: %d", rheo_val);
@@ -169,7 +169,10 @@ static void adc_input_init(void)
 static void gpio_isr_init(void)
 {
     gpio_event_queue = xQueueCreate(10, sizeof(uint32_t));
-    xTaskCreate(gpio_queue_task, "gpio_queue_task", 2048, NULL, 10, NULL);
+
+    // Input handling stays on the protocol core, so it never competes
+    // with the player on the application core.
+    xTaskCreatePinnedToCore(gpio_queue_task, "gpio_queue_task", 2048, NULL, 10, NULL, PRO_CPU_NUM);
     ESP_ERROR_CHECK(gpio_install_isr_service(0 /*ESP_INTR_FLAG_DEFAULT*/));
 }
 
@@ -278,5 +281,5 @@ void app_main(void)
     main_menu_start();
 
     // Start the task that polls certain input pins
-    xTaskCreate(gpio_poll_task, "gpio_poll_task", 4096, NULL, 5, NULL);
+    xTaskCreatePinnedToCore(gpio_poll_task, "gpio_poll_task", 4096, NULL, 5, NULL, PRO_CPU_NUM);
 }
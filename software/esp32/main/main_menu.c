@@ -13,6 +13,7 @@
 #include <driver/adc.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <dirent.h>
@@ -29,6 +30,7 @@
 #include "sdcard_util.h"
 #include "nes_player.h"
 #include "vgm.h"
+#include "nbin.h"
 #include "nsf.h"
 #include "zoneinfo.h"
 #include "bsdlib.h"
@@ -125,7 +127,7 @@ static bool show_file_picker_impl(const char *title, const char *path, file_pick
         if (count < UINT8_MAX - 2) {
             if (namelist[i]->d_type == DT_REG) {
                 char *dot = strrchr(namelist[i]->d_name, '.');
-                if (dot && (!strcmp(dot, ".vgm") || !strcmp(dot, ".vgz") || !strcmp(dot, ".nsf"))) {
+                if (dot && (!strcmp(dot, ".vgm") || !strcmp(dot, ".vgz") || !strcmp(dot, ".nbin") || !strcmp(dot, ".nsf"))) {
                     vpool_insert(&vp, vpool_get_length(&vp), namelist[i]->d_name, strlen(namelist[i]->d_name));
                     vpool_insert(&vp, vpool_get_length(&vp), "\n", 1);
                 }
@@ -212,40 +214,68 @@ static void main_menu_demo_playback_cb(nes_playback_state_t state)
     }
 }
 
+#define VGM_NOTIFY_STARTED  0x01
+#define VGM_NOTIFY_FINISHED 0x02
+
+static void main_menu_vgm_playback_cb(nes_playback_state_t state)
+{
+    if (state == NES_PLAYER_STARTED) {
+        xTaskNotify(main_menu_task_handle, VGM_NOTIFY_STARTED, eSetBits);
+    } else if (state == NES_PLAYER_FINISHED) {
+        xTaskNotify(main_menu_task_handle, VGM_NOTIFY_FINISHED, eSetBits);
+    }
+}
+
+static void main_menu_show_vgm_tags(const vgm_gd3_tags_t *tags)
+{
+    struct vpool vp;
+    vpool_init(&vp, 1024, 0);
+    if (tags->game_name) {
+        vpool_insert(&vp, vpool_get_length(&vp), tags->game_name, strlen(tags->game_name));
+        vpool_insert(&vp, vpool_get_length(&vp), "\n", 1);
+    }
+    if (tags->track_name) {
+        vpool_insert(&vp, vpool_get_length(&vp), tags->track_name, strlen(tags->track_name));
+        vpool_insert(&vp, vpool_get_length(&vp), "\n", 1);
+    }
+    if (tags->track_author) {
+        vpool_insert(&vp, vpool_get_length(&vp), tags->track_author, strlen(tags->track_author));
+        vpool_insert(&vp, vpool_get_length(&vp), "\n", 1);
+    }
+    if (tags->game_release) {
+        vpool_insert(&vp, vpool_get_length(&vp), tags->game_release, strlen(tags->game_release));
+        vpool_insert(&vp, vpool_get_length(&vp), "\n", 1);
+    }
+    if (tags->vgm_author) {
+        vpool_insert(&vp, vpool_get_length(&vp), tags->vgm_author, strlen(tags->vgm_author));
+    }
+    vpool_insert(&vp, vpool_get_length(&vp), "\0", 1);
+
+    display_clear();
+    display_static_list("VGM Player", (char *)vpool_get_buf(&vp));
+    vpool_final(&vp);
+}
+
 static void main_menu_file_picker_play_vgm(const char *filename)
 {
-    // The player currently has code to parse the GD3 tags and
-    // show them on the display.
+    // The player fills in the GD3 tags while preparing the file,
+    // so they are shown once playback has actually started.
     const vgm_gd3_tags_t *tags = NULL;
-    if (nes_player_play_vgm_file(filename, NES_REPEAT_NONE, main_menu_demo_playback_cb, &tags) == ESP_OK) {
-        struct vpool vp;
-        vpool_init(&vp, 1024, 0);
-        if (tags->game_name) {
-            vpool_insert(&vp, vpool_get_length(&vp), tags->game_name, strlen(tags->game_name));
-            vpool_insert(&vp, vpool_get_length(&vp), "\n", 1);
-        }
-        if (tags->track_name) {
-            vpool_insert(&vp, vpool_get_length(&vp), tags->track_name, strlen(tags->track_name));
-            vpool_insert(&vp, vpool_get_length(&vp), "\n", 1);
-        }
-        if (tags->track_author) {
-            vpool_insert(&vp, vpool_get_length(&vp), tags->track_author, strlen(tags->track_author));
-            vpool_insert(&vp, vpool_get_length(&vp), "\n", 1);
-        }
-        if (tags->game_release) {
-            vpool_insert(&vp, vpool_get_length(&vp), tags->game_release, strlen(tags->game_release));
-            vpool_insert(&vp, vpool_get_length(&vp), "\n", 1);
-        }
-        if (tags->vgm_author) {
-            vpool_insert(&vp, vpool_get_length(&vp), tags->vgm_author, strlen(tags->vgm_author));
-        }
-        vpool_insert(&vp, vpool_get_length(&vp), "\0", 1);
-
+    xTaskNotifyWait(0, ULONG_MAX, NULL, 0);
+    if (nes_player_play_vgm_file(filename, NES_REPEAT_NONE, main_menu_vgm_playback_cb, &tags) == ESP_OK) {
         display_clear();
-        display_static_list("VGM Player", (char *)vpool_get_buf(&vp));
-        vpool_final(&vp);
+        display_static_list("VGM Player", "Loading...");
+
+        while (true) {
+            uint32_t notify_value = 0;
+            xTaskNotifyWait(0, ULONG_MAX, &notify_value, 100 / portTICK_RATE_MS);
+            if ((notify_value & VGM_NOTIFY_STARTED) == VGM_NOTIFY_STARTED) {
+                main_menu_show_vgm_tags(tags);
+            }
+            if ((notify_value & VGM_NOTIFY_FINISHED) == VGM_NOTIFY_FINISHED) {
+                break;
+            }
 
-        while (ulTaskNotifyTake(pdTRUE, 100 / portTICK_RATE_MS) == 0) {
             keypad_event_t keypad_event;
             if (keypad_wait_for_event(&keypad_event, 0) == ESP_OK) {
                 if (keypad_event.pressed && keypad_event.key == KEYPAD_BUTTON_B) {
@@ -327,7 +357,7 @@ static bool main_menu_file_picker_cb(const char *filename)
     // and implement some sort of playback UI.
 
     char *dot = strrchr(filename, '.');
-    if (dot && (!strcmp(dot, ".vgm") || !strcmp(dot, ".vgz"))) {
+    if (dot && (!strcmp(dot, ".vgm") || !strcmp(dot, ".vgz") || !strcmp(dot, ".nbin"))) {
         main_menu_file_picker_play_vgm(filename);
     } else if (dot && !strcmp(dot, ".nsf")) {
         main_menu_file_picker_play_nsf(filename, 0);
@@ -566,11 +596,31 @@ static void main_menu_set_alarm_time()
     }
 }
 
-static bool alarm_tune_file_picker_vgm(const char *filename)
+static bool alarm_tune_file_picker_read_nbin_tags(const char *filename, vgm_gd3_tags_t **tags)
+{
+    nbin_file_t *nbin_file;
+
+    if (nbin_open(&nbin_file, filename) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NBIN file");
+        display_message("Error", "File could not be opened", NULL, " OK ");
+        return false;
+    }
+
+    if (nbin_read_gd3_tags(tags, nbin_file) != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read tags");
+        nbin_free(nbin_file);
+        display_message("Error", "File could not be read", NULL, " OK ");
+        return false;
+    }
+
+    nbin_free(nbin_file);
+    return true;
+}
+
+static bool alarm_tune_file_picker_read_vgm_tags(const char *filename, vgm_gd3_tags_t **tags)
 {
     esp_err_t ret;
     vgm_file_t *vgm_file;
-    vgm_gd3_tags_t *tags_result = 0;
 
     ret = vgm_open(&vgm_file, filename);
     if (ret != ESP_OK) {
@@ -586,7 +636,7 @@ static bool alarm_tune_file_picker_vgm(const char *filename)
         return false;
     }
 
-    if (vgm_read_gd3_tags(&tags_result, vgm_file) != ESP_OK) {
+    if (vgm_read_gd3_tags(tags, vgm_file) != ESP_OK) {
         ESP_LOGE(TAG, "Failed to read GD3 tags");
         vgm_free(vgm_file);
         display_message("Error", "File could not be read", NULL, " OK ");
@@ -594,6 +644,23 @@ static bool alarm_tune_file_picker_vgm(const char *filename)
     }
 
     vgm_free(vgm_file);
+    return true;
+}
+
+static bool alarm_tune_file_picker_vgm(const char *filename)
+{
+    vgm_gd3_tags_t *tags_result = 0;
+
+    const char *dot = strrchr(filename, '.');
+    if (dot && !strcmp(dot, ".nbin")) {
+        if (!alarm_tune_file_picker_read_nbin_tags(filename, &tags_result)) {
+            return false;
+        }
+    } else {
+        if (!alarm_tune_file_picker_read_vgm_tags(filename, &tags_result)) {
+            return false;
+        }
+    }
 
     bool selected = false;
     do {
@@ -696,7 +763,7 @@ static bool alarm_tune_file_picker_cb(const char *filename)
     ESP_LOGI(TAG, "File: \"%s\"", filename);
 
     char *dot = strrchr(filename, '.');
-    if (dot && (!strcmp(dot, ".vgm") || !strcmp(dot, ".vgz"))) {
+    if (dot && (!strcmp(dot, ".vgm") || !strcmp(dot, ".vgz") || !strcmp(dot, ".nbin"))) {
         return alarm_tune_file_picker_vgm(filename);
     } else if (dot && !strcmp(dot, ".nsf")) {
         return alarm_tune_file_picker_nsf(filename);
@@ -1312,7 +1379,7 @@ static void start_alarm_sequence()
 
     if (ret == ESP_OK) {
         char *dot = strrchr(filename, '.');
-        if (dot && (!strcmp(dot, ".vgm") || !strcmp(dot, ".vgz"))) {
+        if (dot && (!strcmp(dot, ".vgm") || !strcmp(dot, ".vgz") || !strcmp(dot, ".nbin"))) {
             ret = nes_player_play_vgm_file(filename, NES_REPEAT_CONTINUOUS, NULL, NULL);
         } else if (dot && !strcmp(dot, ".nsf")) {
             if (song == 0) { song = 1; }
@@ -1512,7 +1579,8 @@ esp_err_t main_menu_start()
 
     board_rtc_set_alarm_cb(board_rtc_alarm_func);
 
-    xTaskCreate(main_menu_task, "main_menu_task", 4096, NULL, 5, &main_menu_task_handle);
+    // Keep display redraws on the protocol core, away from the player
+    xTaskCreatePinnedToCore(main_menu_task, "main_menu_task", 4096, NULL, 5, &main_menu_task_handle, PRO_CPU_NUM);
 
     return ESP_OK;
 }
@@ -200,15 +200,8 @@ esp_err_t mcp7940_set_time(i2c_port_t i2c_num, const struct tm *tm)
         return ESP_ERR_INVALID_ARG;
     }
 
-    /* Select the base of the timekeeping registers */
-    ret = i2c_write_byte(i2c_num, MCP7940_ADDRESS, MCP7940_RTCSEC);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "i2c_write_byte error: %d", ret);
-        return ret;
-    }
-
-    /* Read all 7 relevant registers in one operation */
-    ret = i2c_read_buffer(i2c_num, MCP7940_ADDRESS, &data[1], sizeof(data) - 1);
+    /* Read all 7 relevant timekeeping registers in one operation */
+    ret = i2c_read_register_buffer(i2c_num, MCP7940_ADDRESS, MCP7940_RTCSEC, &data[1], sizeof(data) - 1);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "mcp7940_read error: %d", ret);
         return ret;
@@ -289,15 +282,8 @@ esp_err_t mcp7940_get_time(i2c_port_t i2c_num, struct tm *tm)
         return ESP_ERR_INVALID_ARG;
     }
 
-    /* Select the base of the timekeeping registers */
-    ret = i2c_write_byte(i2c_num, MCP7940_ADDRESS, MCP7940_RTCSEC);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "mcp7940_write_byte error: %d", ret);
-        return ret;
-    }
-
-    /* Read all 7 relevant registers in one operation */
-    ret = i2c_read_buffer(i2c_num, MCP7940_ADDRESS, data, sizeof(data));
+    /* Read all 7 relevant timekeeping registers in one operation */
+    ret = i2c_read_register_buffer(i2c_num, MCP7940_ADDRESS, MCP7940_RTCSEC, data, sizeof(data));
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "mcp7940_read error: %d", ret);
         return ret;
@@ -397,15 +383,8 @@ esp_err_t mcp7940_set_alarm_time(i2c_port_t i2c_num, mcp7940_alarm_t alarm, cons
 
     const uint8_t reg = (alarm == MCP7940_ALARM_0) ? MCP7940_ALM0SEC : MCP7940_ALM1SEC;
 
-    /* Select the base of the alarm registers */
-    ret = i2c_write_byte(i2c_num, MCP7940_ADDRESS, reg);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "i2c_write_byte error: %d", ret);
-        return ret;
-    }
-
-    /* Read all 6 relevant registers in one operation */
-    ret = i2c_read_buffer(i2c_num, MCP7940_ADDRESS, &data[1], sizeof(data) - 1);
+    /* Read all 6 relevant alarm registers in one operation */
+    ret = i2c_read_register_buffer(i2c_num, MCP7940_ADDRESS, reg, &data[1], sizeof(data) - 1);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "mcp7940_read error: %d", ret);
         return ret;
@@ -460,15 +439,8 @@ esp_err_t mcp7940_get_alarm_time(i2c_port_t i2c_num, mcp7940_alarm_t alarm, stru
 
     const uint8_t reg = (alarm == MCP7940_ALARM_0) ? MCP7940_ALM0SEC : MCP7940_ALM1SEC;
 
-    /* Select the base of the alarm registers */
-    ret = i2c_write_byte(i2c_num, MCP7940_ADDRESS, reg);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "mcp7940_write_byte error: %d", ret);
-        return ret;
-    }
-
-    /* Read all 6 relevant registers in one operation */
-    ret = i2c_read_buffer(i2c_num, MCP7940_ADDRESS, data, sizeof(data));
+    /* Read all 6 relevant alarm registers in one operation */
+    ret = i2c_read_register_buffer(i2c_num, MCP7940_ADDRESS, reg, data, sizeof(data));
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "mcp7940_read error: %d", ret);
         return ret;
@@ -696,15 +668,8 @@ esp_err_t mcp7940_get_power_failure_time(i2c_port_t i2c_num, struct tm *tm_down,
         return ESP_ERR_INVALID_ARG;
     }
 
-    /* Select the base of the timestamp registers */
-    ret = i2c_write_byte(i2c_num, MCP7940_ADDRESS, MCP7940_PWRDNMIN);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "mcp7940_write_byte error: %d", ret);
-        return ret;
-    }
-
-    /* Read all 8 relevant registers in one operation */
-    ret = i2c_read_buffer(i2c_num, MCP7940_ADDRESS, data, sizeof(data));
+    /* Read all 8 relevant timestamp registers in one operation */
+    ret = i2c_read_register_buffer(i2c_num, MCP7940_ADDRESS, MCP7940_PWRDNMIN, data, sizeof(data));
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "mcp7940_read error: %d", ret);
         return ret;
@@ -813,13 +778,7 @@ esp_err_t mcp7940_data_read(i2c_port_t i2c_num, uint8_t offset, uint8_t *data, s
         return ESP_ERR_INVALID_ARG;
     }
 
-    ret = i2c_write_byte(i2c_num, MCP7940_ADDRESS, MCP7940_SRAM + offset);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "mcp7940_data_read error: %d", ret);
-        return ret;
-    }
-
-    ret = i2c_read_buffer(i2c_num, MCP7940_ADDRESS, data, data_len);
+    ret = i2c_read_register_buffer(i2c_num, MCP7940_ADDRESS, MCP7940_SRAM + offset, data, data_len);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "mcp7940_data_read error: %d", ret);
         return ret;
@@ -0,0 +1,412 @@
+#include "nbin.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/param.h>
+
+#include <esp_err.h>
+#include <esp_log.h>
+
+static const char *TAG = "nbin";
+
+/* Size of the read-ahead window for the event stream */
+#define NBIN_READ_BUFFER_SIZE 1024
+
+struct nbin_file_t {
+    FILE *file;
+    nbin_header_t header;
+    uint8_t buf[NBIN_READ_BUFFER_SIZE];
+    size_t buf_len;
+    size_t buf_pos;
+    uint32_t event_pos;  /* Event stream offset of the window start */
+    uint32_t sample_index;
+};
+
+static esp_err_t nbin_seek_events(nbin_file_t *nbin_file, uint32_t event_offset);
+static esp_err_t nbin_fill(nbin_file_t *nbin_file, size_t len);
+
+esp_err_t nbin_open(nbin_file_t **nbin_file, const char *filename)
+{
+    esp_err_t ret = ESP_OK;
+    nbin_file_t *nbin = NULL;
+
+    do {
+        nbin = malloc(sizeof(struct nbin_file_t));
+        if (!nbin) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        bzero(nbin, sizeof(struct nbin_file_t));
+
+        nbin->file = fopen(filename, "rb");
+        if (!nbin->file) {
+            ESP_LOGE(TAG, "Failed to open file for reading: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        if (fread(&nbin->header, 1, sizeof(nbin_header_t), nbin->file) != sizeof(nbin_header_t)) {
+            ESP_LOGE(TAG, "Unable to read header");
+            ret = ESP_FAIL;
+            break;
+        }
+
+        if (memcmp(nbin->header.magic, NBIN_MAGIC, sizeof(nbin->header.magic)) != 0) {
+            ESP_LOGE(TAG, "File is not NBIN");
+            ret = ESP_FAIL;
+            break;
+        }
+
+        if (nbin->header.version != NBIN_VERSION) {
+            ESP_LOGE(TAG, "Unsupported NBIN version: %d", nbin->header.version);
+            ret = ESP_FAIL;
+            break;
+        }
+
+        if ((nbin->header.flags & NBIN_FLAG_LOOP)
+                && nbin->header.loop_event_offset >= nbin->header.events_size) {
+            ESP_LOGE(TAG, "Invalid loop offset");
+            ret = ESP_FAIL;
+            break;
+        }
+
+        ESP_LOGI(TAG, "Samples: %d, loop samples: %d, groups: %d, refs: %d, events: %d bytes",
+                nbin->header.total_samples, nbin->header.loop_samples,
+                nbin->header.group_count, nbin->header.ref_count,
+                nbin->header.events_size);
+
+        ret = nbin_seek_start(nbin);
+    } while (0);
+
+    if (ret == ESP_OK) {
+        *nbin_file = nbin;
+    } else {
+        nbin_free(nbin);
+    }
+
+    return ret;
+}
+
+const nbin_header_t *nbin_get_header(const nbin_file_t *nbin_file)
+{
+    return &nbin_file->header;
+}
+
+bool nbin_has_loop(const nbin_file_t *nbin_file)
+{
+    return (nbin_file->header.flags & NBIN_FLAG_LOOP) != 0;
+}
+
+esp_err_t nbin_read_gd3_tags(vgm_gd3_tags_t **tags, nbin_file_t *nbin_file)
+{
+    esp_err_t ret = ESP_OK;
+    vgm_gd3_tags_t *parsed_tags = NULL;
+    char *buf = NULL;
+
+    do {
+        parsed_tags = malloc(sizeof(vgm_gd3_tags_t));
+        if (!parsed_tags) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        bzero(parsed_tags, sizeof(vgm_gd3_tags_t));
+
+        if (nbin_file->header.tags_size == 0) {
+            break;
+        }
+
+        buf = malloc(nbin_file->header.tags_size + 1);
+        if (!buf) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        if (fseek(nbin_file->file, nbin_file->header.tags_offset, SEEK_SET) != 0
+                || fread(buf, 1, nbin_file->header.tags_size, nbin_file->file) != nbin_file->header.tags_size) {
+            ESP_LOGE(TAG, "Unable to read tags");
+            ret = ESP_FAIL;
+            break;
+        }
+        buf[nbin_file->header.tags_size] = '\0';
+
+        char **fields[] = {
+            &parsed_tags->track_name,
+            &parsed_tags->game_name,
+            &parsed_tags->system_name,
+            &parsed_tags->track_author,
+            &parsed_tags->game_release,
+            &parsed_tags->vgm_author,
+            &parsed_tags->notes
+        };
+
+        const char *p = buf;
+        const char *end = buf + nbin_file->header.tags_size;
+        for (int i = 0; i < sizeof(fields) / sizeof(fields[0]) && p < end; i++) {
+            size_t len = strlen(p);
+            if (len > 0) {
+                *fields[i] = strdup(p);
+            }
+            p += len + 1;
+        }
+    } while (0);
+
+    free(buf);
+
+    // The event stream position is no longer valid
+    nbin_file->buf_len = 0;
+    nbin_file->buf_pos = 0;
+    nbin_file->event_pos = UINT32_MAX;
+
+    if (ret == ESP_OK) {
+        *tags = parsed_tags;
+    } else {
+        vgm_free_gd3_tags(parsed_tags);
+    }
+
+    return ret;
+}
+
+esp_err_t nbin_load_data_state(nbin_file_t *nbin_file, vgm_data_state_t *vgm_data_state)
+{
+    esp_err_t ret = ESP_OK;
+    nbin_group_t *groups = NULL;
+    vgm_data_block_group_t **block_groups = NULL;
+    uint8_t *data = NULL;
+    const nbin_header_t *header = &nbin_file->header;
+
+    if (header->group_count == 0) {
+        return ESP_OK;
+    }
+
+    do {
+        groups = malloc(sizeof(nbin_group_t) * header->group_count);
+        block_groups = malloc(sizeof(vgm_data_block_group_t *) * header->group_count);
+        if (!groups || !block_groups) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        if (fseek(nbin_file->file, header->groups_offset, SEEK_SET) != 0
+                || fread(groups, sizeof(nbin_group_t), header->group_count, nbin_file->file) != header->group_count) {
+            ESP_LOGE(TAG, "Unable to read group table");
+            ret = ESP_FAIL;
+            break;
+        }
+
+        // Load the group data, which follows the group table in order
+        for (uint32_t i = 0; i < header->group_count; i++) {
+            uint8_t *group_data = realloc(data, groups[i].byte_size);
+            if (!group_data) {
+                ret = ESP_ERR_NO_MEM;
+                break;
+            }
+            data = group_data;
+
+            if (fseek(nbin_file->file, groups[i].data_offset, SEEK_SET) != 0
+                    || fread(data, 1, groups[i].byte_size, nbin_file->file) != groups[i].byte_size) {
+                ESP_LOGE(TAG, "Unable to read group data");
+                ret = ESP_FAIL;
+                break;
+            }
+
+            ret = vgm_data_state_add_group(vgm_data_state,
+                    groups[i].key_sample_time, groups[i].key_block,
+                    data, groups[i].byte_size, &block_groups[i]);
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "Unable to add block group");
+                break;
+            }
+        }
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        // Load the reference schedule
+        if (fseek(nbin_file->file, header->refs_offset, SEEK_SET) != 0) {
+            ret = ESP_FAIL;
+            break;
+        }
+        for (uint32_t i = 0; i < header->ref_count; i++) {
+            nbin_ref_t ref;
+            if (fread(&ref, sizeof(nbin_ref_t), 1, nbin_file->file) != 1) {
+                ESP_LOGE(TAG, "Unable to read reference table");
+                ret = ESP_FAIL;
+                break;
+            }
+            if (ref.group >= header->group_count) {
+                ESP_LOGE(TAG, "Invalid group reference: %d", ref.group);
+                ret = ESP_FAIL;
+                break;
+            }
+
+            ret = vgm_data_state_add_group_ref(vgm_data_state,
+                    block_groups[ref.group], ref.sample_time, ref.byte_size);
+            if (ret != ESP_OK) {
+                ESP_LOGE(TAG, "Unable to add sample reference");
+                break;
+            }
+        }
+    } while (0);
+
+    free(data);
+    free(block_groups);
+    free(groups);
+
+    // The event stream position is no longer valid
+    nbin_file->buf_len = 0;
+    nbin_file->buf_pos = 0;
+    nbin_file->event_pos = UINT32_MAX;
+
+    return ret;
+}
+
+esp_err_t nbin_seek_start(nbin_file_t *nbin_file)
+{
+    nbin_file->sample_index = 0;
+    return nbin_seek_events(nbin_file, 0);
+}
+
+esp_err_t nbin_seek_loop(nbin_file_t *nbin_file)
+{
+    if (!nbin_has_loop(nbin_file)) {
+        ESP_LOGE(TAG, "file does not have a loop offset");
+        return ESP_FAIL;
+    }
+    return nbin_seek_events(nbin_file, nbin_file->header.loop_event_offset);
+}
+
+esp_err_t nbin_seek_events(nbin_file_t *nbin_file, uint32_t event_offset)
+{
+    // Short files fit entirely within the window, so a seek back to the
+    // start or the loop point is usually just a change of read position.
+    if (nbin_file->event_pos != UINT32_MAX
+            && event_offset >= nbin_file->event_pos
+            && event_offset < nbin_file->event_pos + nbin_file->buf_len) {
+        nbin_file->buf_pos = event_offset - nbin_file->event_pos;
+        return ESP_OK;
+    }
+
+    if (fseek(nbin_file->file, nbin_file->header.events_offset + event_offset, SEEK_SET) != 0) {
+        ESP_LOGE(TAG, "fseek: %s", strerror(errno));
+        return ESP_FAIL;
+    }
+    nbin_file->event_pos = event_offset;
+    nbin_file->buf_len = 0;
+    nbin_file->buf_pos = 0;
+
+    return ESP_OK;
+}
+
+esp_err_t nbin_fill(nbin_file_t *nbin_file, size_t len)
+{
+    size_t avail = nbin_file->buf_len - nbin_file->buf_pos;
+    if (avail >= len) {
+        return ESP_OK;
+    }
+
+    if (nbin_file->event_pos == UINT32_MAX) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    // Shift the unread bytes to the front of the window
+    if (avail > 0) {
+        memmove(nbin_file->buf, nbin_file->buf + nbin_file->buf_pos, avail);
+    }
+    nbin_file->event_pos += nbin_file->buf_pos;
+    nbin_file->buf_pos = 0;
+    nbin_file->buf_len = avail;
+
+    size_t remaining = nbin_file->header.events_size - (nbin_file->event_pos + avail);
+    size_t read_len = MIN(remaining, NBIN_READ_BUFFER_SIZE - avail);
+    if (read_len > 0) {
+        size_t n = fread(nbin_file->buf + avail, 1, read_len, nbin_file->file);
+        nbin_file->buf_len += n;
+    }
+
+    if (nbin_file->buf_len < len) {
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t nbin_next_command(nbin_file_t *nbin_file, vgm_command_t *command)
+{
+    memset(command, 0, sizeof(vgm_command_t));
+    command->sample_index = nbin_file->sample_index;
+
+    // Every opcode is at most 3 bytes long, but the stream may end sooner
+    if (nbin_fill(nbin_file, 3) != ESP_OK && nbin_fill(nbin_file, 1) != ESP_OK) {
+        command->type = VGM_CMD_DONE;
+        return ESP_OK;
+    }
+
+    size_t avail = nbin_file->buf_len - nbin_file->buf_pos;
+    const uint8_t *buf = nbin_file->buf + nbin_file->buf_pos;
+    uint8_t op = buf[0];
+
+    if (op < NBIN_OP_WRITE_EXT) {
+        if (avail < 2) {
+            return ESP_FAIL;
+        }
+        command->type = VGM_CMD_NES_APU;
+        command->info.nes_apu.reg = 0x4000 + op;
+        command->info.nes_apu.dat = buf[1];
+        nbin_file->buf_pos += 2;
+    }
+    else if (op == NBIN_OP_WRITE_EXT) {
+        if (avail < 3) {
+            return ESP_FAIL;
+        }
+        command->type = VGM_CMD_NES_APU;
+        command->info.nes_apu.reg = 0x4000 + buf[1];
+        command->info.nes_apu.dat = buf[2];
+        nbin_file->buf_pos += 3;
+    }
+    else if (op >= NBIN_OP_WAIT && op < NBIN_OP_WAIT_FRAMES) {
+        command->type = VGM_CMD_WAIT;
+        command->info.wait.samples = (op & 0x3F) + 1;
+        nbin_file->buf_pos += 1;
+    }
+    else if (op >= NBIN_OP_WAIT_FRAMES && op < NBIN_OP_WAIT_LONG) {
+        command->type = VGM_CMD_WAIT;
+        command->info.wait.samples = ((op & 0x3F) + 1) * NBIN_FRAME_SAMPLES;
+        nbin_file->buf_pos += 1;
+    }
+    else if (op == NBIN_OP_WAIT_LONG) {
+        if (avail < 3) {
+            return ESP_FAIL;
+        }
+        command->type = VGM_CMD_WAIT;
+        command->info.wait.samples = (uint16_t)(buf[2] << 8 | buf[1]);
+        nbin_file->buf_pos += 3;
+    }
+    else if (op == NBIN_OP_END) {
+        command->type = VGM_CMD_DONE;
+        nbin_file->buf_pos += 1;
+    }
+    else {
+        ESP_LOGE(TAG, "Unsupported opcode: %02X", op);
+        command->type = VGM_CMD_UNKNOWN;
+        return ESP_FAIL;
+    }
+
+    if (command->type == VGM_CMD_WAIT) {
+        nbin_file->sample_index += command->info.wait.samples;
+    }
+
+    return ESP_OK;
+}
+
+void nbin_free(nbin_file_t *nbin_file)
+{
+    if (nbin_file) {
+        if (nbin_file->file) {
+            fclose(nbin_file->file);
+        }
+        free(nbin_file);
+    }
+}
@@ -0,0 +1,45 @@
+/*
+ * Nestronic Binary Playback File Decoder
+ *
+ * Plays files produced by the nbinconv tool, which have already been
+ * through the equivalent of the VGM prepare scan.
+ */
+
+#ifndef NBIN_H
+#define NBIN_H
+
+#include <esp_err.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "nbin_format.h"
+#include "vgm.h"
+#include "vgm_data.h"
+
+typedef struct nbin_file_t nbin_file_t;
+
+esp_err_t nbin_open(nbin_file_t **nbin_file, const char *filename);
+
+const nbin_header_t *nbin_get_header(const nbin_file_t *nbin_file);
+bool nbin_has_loop(const nbin_file_t *nbin_file);
+
+esp_err_t nbin_read_gd3_tags(vgm_gd3_tags_t **tags, nbin_file_t *nbin_file);
+
+/**
+ * Populate the data state with the DMC sample groups and references
+ * stored in the file.
+ */
+esp_err_t nbin_load_data_state(nbin_file_t *nbin_file, vgm_data_state_t *vgm_data_state);
+
+esp_err_t nbin_seek_start(nbin_file_t *nbin_file);
+esp_err_t nbin_seek_loop(nbin_file_t *nbin_file);
+
+/**
+ * Read the next event, in the same form as vgm_next_command() would
+ * return it from the original VGM file.
+ */
+esp_err_t nbin_next_command(nbin_file_t *nbin_file, vgm_command_t *command);
+
+void nbin_free(nbin_file_t *nbin_file);
+
+#endif /* NBIN_H */
@@ -0,0 +1,77 @@
+/*
+ * Nestronic Binary Playback Format (.nbin)
+ *
+ * This header is shared between the firmware and the host-side
+ * converter, so it must only depend on standard C headers.
+ *
+ * All values are little-endian. A file is laid out as:
+ * - File header
+ * - GD3 tag strings
+ * - DMC sample group table, followed by the group data
+ * - DMC sample reference table, in playback order
+ * - Event stream
+ */
+
+#ifndef NBIN_FORMAT_H
+#define NBIN_FORMAT_H
+
+#include <stdint.h>
+
+#define NBIN_MAGIC "NBIN"
+#define NBIN_VERSION 1
+
+/* Header flags */
+#define NBIN_FLAG_LOOP 0x0001
+
+/* Samples per wait frame, equal to 1/60th of a second at 44100Hz */
+#define NBIN_FRAME_SAMPLES 735
+
+/*
+ * Event stream opcodes
+ */
+#define NBIN_OP_WRITE     0x00 /**< $00-$1F: write the next byte to $4000 + op */
+#define NBIN_OP_WRITE_EXT 0x20 /**< Write the second byte to $4000 + the first byte */
+#define NBIN_OP_WAIT      0x40 /**< $40-$7F: wait (op & $3F) + 1 samples */
+#define NBIN_OP_WAIT_FRAMES 0x80 /**< $80-$BF: wait (op & $3F) + 1 frames */
+#define NBIN_OP_WAIT_LONG 0xC0 /**< Wait for the following 16-bit sample count */
+#define NBIN_OP_END       0xFF /**< End of sound data */
+
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint16_t version;
+    uint16_t flags;
+    uint32_t total_samples;     /**< Playback duration, excluding loops */
+    uint32_t loop_samples;      /**< Duration of the looped section */
+    uint32_t tags_offset;       /**< NUL-terminated strings, in the order of vgm_gd3_tags_t */
+    uint32_t tags_size;
+    uint32_t groups_offset;     /**< Array of nbin_group_t */
+    uint32_t group_count;
+    uint32_t refs_offset;       /**< Array of nbin_ref_t */
+    uint32_t ref_count;
+    uint32_t events_offset;
+    uint32_t events_size;
+    uint32_t loop_event_offset; /**< Loop point, relative to events_offset */
+} nbin_header_t;
+
+/*
+ * A DMC sample group, equivalent to a vgm_data_block_group_t after
+ * the prepare scan of the original VGM file.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t key_sample_time;   /**< Sample time the data was last loaded at */
+    uint16_t key_block;         /**< APU block the data was loaded into */
+    uint16_t byte_size;
+    uint32_t data_offset;       /**< File offset of the group data */
+} nbin_group_t;
+
+/*
+ * A reference to a DMC sample group, at the sample time of the command
+ * group that ends with the matching DMC address write.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t sample_time;
+    uint16_t group;             /**< Index into the group table */
+    uint16_t byte_size;
+} nbin_ref_t;
+
+#endif /* NBIN_FORMAT_H */
@@ -2,9 +2,13 @@
 
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <sys/param.h>
+#include <string.h>
 #include <driver/i2c.h>
 
 #include "i2c_util.h"
+#include "nes_apu_regs.h"
 
 static const char *TAG = "nes";
 
@@ -14,6 +18,32 @@ static const char *TAG = "nes";
 /* I2C registers */
 #define NES_OUTPUT  0x16 /*< NES OUTPUT register */
 #define NES_CONFIG  0x7F /*< NES CONFIG register */
+#define NES_FIFO    0x7E /*< NES FIFO register */
+#define NES_FIFO_LEVEL 0x7D /*< NES FIFO level register */
+#define NES_VERSION 0x7C /*< NES VERSION register */
+
+/* Number of APU registers, $4000-$4017 */
+#define NES_APU_REG_COUNT 0x18
+
+/* Bursts stop at $15, as the next register is OUTPUT rather than APU */
+#define NES_APU_BURST_END 0x16
+
+/* Upload time for one data block, until a real upload has been measured */
+#define NES_DATA_BLOCK_COST_DEFAULT_US 3500
+
+/* Running average of the upload time for one data block, in 1/16 us */
+static uint32_t nes_data_block_cost = 0;
+
+/* Last value written to the CONFIG register */
+static uint8_t nes_config_value = 0;
+
+/* Last values written to the APU registers, and which of them are known */
+static uint8_t nes_apu_shadow[NES_APU_REG_COUNT];
+static uint32_t nes_apu_shadow_valid = 0;
+static nes_apu_shadow_stats_t nes_apu_shadow_stats = {0};
+
+/* Registers that are written even when their value has not changed */
+#define NES_APU_SHADOW_ALWAYS NES_APU_SIDE_EFFECT_MASK
 
 esp_err_t nes_init(i2c_port_t i2c_num)
 {
@@ -36,7 +66,11 @@ esp_err_t nes_init(i2c_port_t i2c_num)
 
 esp_err_t nes_set_config(i2c_port_t i2c_num, uint8_t value)
 {
-    return i2c_write_register(i2c_num, NES_ADDRESS, NES_CONFIG, value);
+    esp_err_t ret = i2c_write_register(i2c_num, NES_ADDRESS, NES_CONFIG, value);
+    if (ret == ESP_OK) {
+        nes_config_value = value;
+    }
+    return ret;
 }
 
 esp_err_t nes_get_config(i2c_port_t i2c_num, uint8_t *value)
@@ -52,6 +86,7 @@ esp_err_t nes_get_config(i2c_port_t i2c_num, uint8_t *value)
     }
 
     *value = data;
+    nes_config_value = data;
 
     return ESP_OK;
 }
@@ -80,6 +115,8 @@ esp_err_t nes_get_amplifier_enabled(i2c_port_t i2c_num, bool *enabled)
 
 esp_err_t nes_apu_init(i2c_port_t i2c_num)
 {
+    nes_apu_shadow_invalidate();
+
     uint8_t data;
     esp_err_t ret = i2c_read_register(i2c_num, NES_ADDRESS, NES_OUTPUT, &data);
     if (ret != ESP_OK) {
@@ -88,88 +125,237 @@ esp_err_t nes_apu_init(i2c_port_t i2c_num)
 
     data |= 0x80;
 
-    return i2c_write_register(i2c_num, NES_ADDRESS, NES_OUTPUT, data);
+    ret = i2c_write_register(i2c_num, NES_ADDRESS, NES_OUTPUT, data);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // The NES CPU initializes the APU before it handles another command,
+    // so the registers it just set can be read back to seed the shadow.
+    // Firmware without the version register has no shadow to read.
+    uint8_t version;
+    if (nes_get_version(i2c_num, &version) == ESP_OK && version >= NES_VERSION_FIFO) {
+        uint8_t regs[0x14];
+        if (nes_apu_read_burst(i2c_num, NES_APU_PULSE1CTRL, regs, sizeof(regs)) == ESP_OK) {
+            memcpy(nes_apu_shadow, regs, sizeof(regs));
+            nes_apu_shadow_valid = (1UL << sizeof(regs)) - 1;
+        } else {
+            ESP_LOGW(TAG, "Unable to read back the APU registers");
+        }
+    }
+
+    return ESP_OK;
+}
+
+bool nes_apu_is_writable(uint8_t reg)
+{
+    return reg <= 0x13 || reg == 0x15 || reg == 0x17;
+}
+
+bool nes_apu_shadow_update(uint8_t reg, uint8_t dat)
+{
+    nes_apu_shadow_stats.writes++;
+
+    if (reg >= NES_APU_REG_COUNT) {
+        return true;
+    }
+
+    uint32_t mask = 1UL << reg;
+    if ((mask & NES_APU_SHADOW_ALWAYS) == 0
+            && (nes_apu_shadow_valid & mask) != 0
+            && nes_apu_shadow[reg] == dat) {
+        nes_apu_shadow_stats.skipped++;
+        return false;
+    }
+
+    nes_apu_shadow[reg] = dat;
+    nes_apu_shadow_valid |= mask;
+    return true;
+}
+
+void nes_apu_shadow_invalidate()
+{
+    nes_apu_shadow_valid = 0;
+}
+
+void nes_apu_shadow_get_stats(nes_apu_shadow_stats_t *stats)
+{
+    if (stats) {
+        *stats = nes_apu_shadow_stats;
+    }
+}
+
+void nes_apu_shadow_reset_stats()
+{
+    bzero(&nes_apu_shadow_stats, sizeof(nes_apu_shadow_stats_t));
 }
 
 esp_err_t nes_apu_write(i2c_port_t i2c_num, nes_apu_register_t reg, uint8_t dat)
 {
+    if (!nes_apu_shadow_update((uint8_t)(reg & 0xFF), dat)) {
+        return ESP_OK;
+    }
     return i2c_write_register(i2c_num, NES_ADDRESS, (uint8_t)(reg & 0xFF), dat);
 }
 
+esp_err_t nes_apu_write_batch(i2c_port_t i2c_num, const nes_apu_reg_write_t *writes, size_t count)
+{
+    if (!writes || count > NES_APU_BATCH_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Drop the writes that would not change anything
+    nes_apu_reg_write_t changed[NES_APU_BATCH_MAX];
+    size_t changed_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (nes_apu_shadow_update(writes[i].reg, writes[i].dat)) {
+            changed[changed_count++] = writes[i];
+        }
+    }
+    if (changed_count == 0) {
+        return ESP_OK;
+    }
+
+    // The 2A03 returns to the register state after each value, so the
+    // register/value pairs can simply follow each other.
+    return i2c_write_buffer(i2c_num, NES_ADDRESS, (uint8_t *)changed, changed_count * sizeof(nes_apu_reg_write_t));
+}
+
+esp_err_t nes_apu_write_burst(i2c_port_t i2c_num, nes_apu_register_t reg, const uint8_t *data, size_t data_len)
+{
+    uint8_t start = (uint8_t)(reg & 0xFF);
+    if (!data || data_len == 0 || start + data_len > NES_APU_BURST_END) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Enable increment mode, then send the start register and the
+    // run of values. The NES CPU returns to the register state after
+    // a CONFIG write, so this all fits in one transaction.
+    uint8_t buf[2 + NES_APU_BURST_END];
+    buf[0] = nes_config_value | NES_CONFIG_INCREMENT;
+    buf[1] = start;
+    memcpy(buf + 2, data, data_len);
+
+    esp_err_t ret = i2c_write_register_buffer(i2c_num, NES_ADDRESS, NES_CONFIG, buf, 2 + data_len);
+
+    // Bursts are always sent in full, but still keep the shadow current
+    for (size_t i = 0; i < data_len; i++) {
+        nes_apu_shadow[start + i] = data[i];
+        nes_apu_shadow_valid |= 1UL << (start + i);
+    }
+
+    // Always try to leave increment mode, so plain register writes
+    // keep working.
+    esp_err_t ret2 = nes_set_config(i2c_num, nes_config_value & ~NES_CONFIG_INCREMENT);
+    return (ret != ESP_OK) ? ret : ret2;
+}
+
+esp_err_t nes_apu_read_burst(i2c_port_t i2c_num, nes_apu_register_t reg, uint8_t *data, size_t data_len)
+{
+    uint8_t start = (uint8_t)(reg & 0xFF);
+    if (!data || data_len == 0 || start + data_len > NES_APU_BURST_END) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Enable increment mode and select the start register, then read
+    // the run of values after a repeated start.
+    uint8_t config[] = { NES_CONFIG, nes_config_value | NES_CONFIG_INCREMENT, start };
+    esp_err_t ret = i2c_write_read_buffer(i2c_num, NES_ADDRESS, config, sizeof(config), data, data_len);
+
+    esp_err_t ret2 = nes_set_config(i2c_num, nes_config_value & ~NES_CONFIG_INCREMENT);
+    return (ret != ESP_OK) ? ret : ret2;
+}
+
+esp_err_t nes_get_version(i2c_port_t i2c_num, uint8_t *version)
+{
+    if (!version) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return i2c_read_register(i2c_num, NES_ADDRESS, NES_VERSION, version);
+}
+
+esp_err_t nes_fifo_write(i2c_port_t i2c_num, const nes_fifo_entry_t *entries, size_t count)
+{
+    if (!entries || count > NES_FIFO_SIZE) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (count == 0) {
+        return ESP_OK;
+    }
+
+    return i2c_write_register_buffer(i2c_num, NES_ADDRESS, NES_FIFO,
+            (const uint8_t *)entries, count * sizeof(nes_fifo_entry_t));
+}
+
+esp_err_t nes_fifo_get_level(i2c_port_t i2c_num, uint8_t *level)
+{
+    if (!level) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return i2c_read_register(i2c_num, NES_ADDRESS, NES_FIFO_LEVEL, level);
+}
+
+esp_err_t nes_fifo_get_flags(i2c_port_t i2c_num, uint8_t *flags)
+{
+    if (!flags) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    return i2c_read_register(i2c_num, NES_ADDRESS, NES_FIFO, flags);
+}
+
 esp_err_t nes_data_write(i2c_port_t i2c_num, uint8_t block, uint8_t *data, size_t data_len)
 {
-	if (block < 8 || block > 127) {
+	if (block < NES_DATA_BLOCK_MIN || block > NES_DATA_BLOCK_MAX) {
 		return ESP_ERR_INVALID_ARG;
 	}
 	if (!data || data_len == 0 || data_len > 256) {
 		return ESP_ERR_INVALID_ARG;
 	}
 
-    i2c_cmd_handle_t cmd = i2c_cmd_link_create();
-    if (!cmd) {
-        ESP_LOGE(TAG, "i2c_cmd_link_create error");
-        return ESP_ERR_NO_MEM;
+    int64_t time0 = esp_timer_get_time();
+    esp_err_t ret = i2c_write_register_buffer(i2c_num, NES_ADDRESS, block | 0x80, data, data_len);
+    if (ret == ESP_OK && data_len >= 64) {
+        // Fold the measured time into the running average, weighting
+        // each new upload by 1/8. The time is scaled by bytes, so a
+        // partial block is not counted as a whole one, and writes under
+        // a block are left out as the fixed cost of the transaction
+        // would dominate.
+        int64_t elapsed = esp_timer_get_time() - time0;
+        uint32_t cost = (uint32_t)((elapsed * 16 * 64) / data_len);
+        if (nes_data_block_cost == 0) {
+            nes_data_block_cost = cost;
+        } else {
+            nes_data_block_cost = (int32_t)nes_data_block_cost
+                    + (((int32_t)cost - (int32_t)nes_data_block_cost) / 8);
+        }
     }
+    return ret;
+}
 
-    ESP_ERROR_CHECK(i2c_master_start(cmd));
-    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, NES_ADDRESS << 1 | I2C_MASTER_WRITE, true));
-    ESP_ERROR_CHECK(i2c_master_write_byte(cmd, block | 0x80, true))
-    ESP_ERROR_CHECK(i2c_master_write(cmd, data, data_len, true));
-    ESP_ERROR_CHECK(i2c_master_stop(cmd));
-
-    esp_err_t ret = i2c_master_cmd_begin(i2c_num, cmd, 1000 / portTICK_RATE_MS);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "i2c_master_cmd_begin error: [%02X] %s (%d)",
-        		NES_ADDRESS, esp_err_to_name(ret), ret);
+uint32_t nes_data_get_block_cost()
+{
+    if (nes_data_block_cost == 0) {
+        return NES_DATA_BLOCK_COST_DEFAULT_US;
     }
-
-    i2c_cmd_link_delete(cmd);
-
-    return ret;
+    return MAX(nes_data_block_cost / 16, 1);
 }
 
 esp_err_t nes_data_read(i2c_port_t i2c_num, uint8_t block, uint8_t *data, size_t data_len)
 {
 	esp_err_t ret;
-	if (block < 8 || block > 127) {
+	if (block < NES_DATA_BLOCK_MIN || block > NES_DATA_BLOCK_MAX) {
 		return ESP_ERR_INVALID_ARG;
 	}
 	if (!data || data_len == 0 || data_len > 256) {
 		return ESP_ERR_INVALID_ARG;
 	}
 
-    ret = i2c_write_byte(i2c_num, NES_ADDRESS, block | 0x80);
+    ret = i2c_read_register_buffer(i2c_num, NES_ADDRESS, block | 0x80, data, data_len);
     if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "nes_data_write error: %d", ret);
-        return ret;
-    }
-
-    ret = i2c_read_buffer(i2c_num, NES_ADDRESS, data, data_len);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "nes_data_write error: %d", ret);
+        ESP_LOGE(TAG, "nes_data_read error: %d", ret);
         return ret;
     }
 
     return ret;
 }
 
-uint16_t nes_addr_to_apu_block(uint16_t addr)
-{
-    if (addr >= 0xC000) {
-        return (addr >> 6) & 0xFF;
-    } else if (addr >= 0x8000) {
-        return (((addr - 0xC000) >> 6) & 0xFF) + 256;
-    } else {
-        ESP_LOGE(TAG, "Invalid block address: $%04X", addr);
-        return 0; // consider a better magic value, or simply validate beforehand
-    }
-}
-
-uint16_t nes_len_to_apu_blocks(uint32_t len)
-{
-    if ((len & 0x3F) == 0) {
-        return len >> 6;
-    } else {
-        return ((len | 0x3F) + 1) >> 6;
-    }
-}
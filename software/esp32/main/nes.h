@@ -33,6 +33,48 @@ typedef enum {
     NES_APU_PAD2        = 0x4017  /**< Joypad #2/SOFTCLK (W) */
 } nes_apu_register_t;
 
+/* CONFIG register flags */
+#define NES_CONFIG_INCREMENT 0x01 /*< Auto-increment the register after each value */
+
+/* NES CPU clock rate, in Hz */
+#define NES_CPU_CLOCK_HZ 1789773
+
+/* Firmware version that added the command FIFO */
+#define NES_VERSION_FIFO 0x01
+
+/* Number of entries the command FIFO can hold */
+#define NES_FIFO_SIZE 255
+
+/* Length of a command FIFO tick, in NES CPU cycles */
+#define NES_FIFO_TICK_CYCLES 72
+
+/* Register value for FIFO entries that only wait */
+#define NES_FIFO_REG_NONE 0x18
+
+/* FIFO flags */
+#define NES_FIFO_FLAG_OVERFLOW 0x01 /*< An entry was dropped because the FIFO was full */
+
+/*
+ * Range of 64-byte blocks that DATA register loads may use. RAM at
+ * $C000-$DFFF mirrors $0000-$1FFF, and the lower blocks hold the zero
+ * page, the stack and the command FIFO of the NES CPU firmware, which
+ * rejects loads below the minimum. This must match DATA_BLOCK_MIN in
+ * the firmware.
+ */
+#define NES_DATA_BLOCK_MIN 28
+#define NES_DATA_BLOCK_MAX 127
+
+/* Maximum number of register writes sent in one batch */
+#define NES_APU_BATCH_MAX 32
+
+/**
+ * A single APU register write, laid out as it is sent over I2C
+ */
+typedef struct {
+    uint8_t reg; /**< Low byte of the APU register address */
+    uint8_t dat; /**< Value to write */
+} nes_apu_reg_write_t;
+
 esp_err_t nes_init(i2c_port_t i2c_num);
 
 esp_err_t nes_set_config(i2c_port_t i2c_num, uint8_t value);
@@ -41,12 +83,133 @@ esp_err_t nes_get_config(i2c_port_t i2c_num, uint8_t *value);
 esp_err_t nes_set_amplifier_enabled(i2c_port_t i2c_num, bool enabled);
 esp_err_t nes_get_amplifier_enabled(i2c_port_t i2c_num, bool *enabled);
 
+/**
+ * Counters for the APU shadow registers
+ */
+typedef struct {
+    uint32_t writes;  /**< APU register writes requested */
+    uint32_t skipped; /**< Writes dropped because they changed nothing */
+} nes_apu_shadow_stats_t;
+
 esp_err_t nes_apu_init(i2c_port_t i2c_num);
+
+/**
+ * Writes to the APU registers go through nes_apu_write() and
+ * nes_apu_write_batch(), which skip any write that would not change
+ * a register. The registers in NES_APU_SIDE_EFFECT_MASK, such as the
+ * length counter loads and $4015, are always written.
+ */
 esp_err_t nes_apu_write(i2c_port_t i2c_num, nes_apu_register_t reg, uint8_t dat);
 
+/**
+ * Write several APU registers in a single I2C transaction.
+ *
+ * The writes are applied in order, as if each had been sent with
+ * nes_apu_write().
+ *
+ * @param writes Array of register writes
+ * @param count Number of writes, up to NES_APU_BATCH_MAX
+ */
+esp_err_t nes_apu_write_batch(i2c_port_t i2c_num, const nes_apu_reg_write_t *writes, size_t count);
+
+/**
+ * Check whether a register is one of the APU registers the NES CPU
+ * writes, which are $00-$13, $15 and $17.
+ *
+ * @param reg Low byte of the APU register address
+ */
+bool nes_apu_is_writable(uint8_t reg);
+
+/**
+ * Record a register write in the APU shadow.
+ *
+ * This is for callers that send APU writes by other means, such as
+ * the command FIFO, to share the redundant write checks.
+ *
+ * @param reg Low byte of the APU register address
+ * @param dat Value to write
+ * @return True if the write needs to be sent
+ */
+bool nes_apu_shadow_update(uint8_t reg, uint8_t dat);
+
+/**
+ * Forget the contents of the APU shadow, so every register is written
+ * again. This is done by nes_apu_init(), which then reloads the shadow
+ * from the freshly initialized registers.
+ */
+void nes_apu_shadow_invalidate();
+
+void nes_apu_shadow_get_stats(nes_apu_shadow_stats_t *stats);
+void nes_apu_shadow_reset_stats();
+
+/**
+ * Write a run of consecutive APU registers in a single burst, using the
+ * auto-increment mode of the NES CPU.
+ *
+ * @param reg First register to write
+ * @param data Values for the registers, starting at reg
+ * @param data_len Number of registers to write, which must not run
+ *                 past $4015
+ */
+esp_err_t nes_apu_write_burst(i2c_port_t i2c_num, nes_apu_register_t reg, const uint8_t *data, size_t data_len);
+
+/**
+ * Read back a run of consecutive APU registers in a single burst,
+ * which must not run past $4015.
+ *
+ * Write-only registers return the last value written to them.
+ */
+esp_err_t nes_apu_read_burst(i2c_port_t i2c_num, nes_apu_register_t reg, uint8_t *data, size_t data_len);
+
+/**
+ * A command FIFO entry, laid out as it is sent over I2C.
+ *
+ * Once the previous entry has been written, the NES CPU takes one tick
+ * to load this entry, then waits for its delay (at least one tick)
+ * before writing the register.
+ */
+typedef struct __attribute__((__packed__)) {
+    uint16_t delay; /**< Ticks to wait before the write, little endian */
+    uint8_t reg;    /**< Low byte of the APU register address */
+    uint8_t dat;    /**< Value to write */
+} nes_fifo_entry_t;
+
+/**
+ * Read the firmware version of the NES CPU. Firmware that predates the
+ * version register reads back as 0.
+ */
+esp_err_t nes_get_version(i2c_port_t i2c_num, uint8_t *version);
+
+/**
+ * Append entries to the command FIFO.
+ *
+ * The caller is responsible for not overfilling the FIFO, as entries
+ * that do not fit are dropped.
+ */
+esp_err_t nes_fifo_write(i2c_port_t i2c_num, const nes_fifo_entry_t *entries, size_t count);
+
+/**
+ * Get the number of entries in the command FIFO that have not been
+ * loaded for playback yet.
+ */
+esp_err_t nes_fifo_get_level(i2c_port_t i2c_num, uint8_t *level);
+
+/**
+ * Get the FIFO flags, which are cleared by reading them.
+ */
+esp_err_t nes_fifo_get_flags(i2c_port_t i2c_num, uint8_t *flags);
+
 esp_err_t nes_data_write(i2c_port_t i2c_num, uint8_t block, uint8_t *data, size_t data_len);
 esp_err_t nes_data_read(i2c_port_t i2c_num, uint8_t block, uint8_t *data, size_t data_len);
 
+/**
+ * Get the time it takes to upload one 64-byte block, as a running
+ * average kept by nes_data_write() over writes of at least a block.
+ *
+ * @return Time per block in microseconds
+ */
+uint32_t nes_data_get_block_cost();
+
 /**
  * Convert a 16-bit NES memory address into an APU sample block
  *
@@ -0,0 +1,30 @@
+/*
+ * NES APU register properties
+ *
+ * This header is shared between the firmware and the host-side
+ * converter, so it must only depend on standard C headers.
+ */
+
+#ifndef NES_APU_REGS_H
+#define NES_APU_REGS_H
+
+/*
+ * Registers whose writes have side effects beyond latching a value, or
+ * which are relocated at playback time. Writes to these are never
+ * dropped as redundant, by the APU shadow or by the converter.
+ */
+#define NES_APU_SIDE_EFFECT_MASK ( \
+    (1UL << 0x01) | /* Pulse 1 sweep, reloads the sweep divider */ \
+    (1UL << 0x03) | /* Pulse 1 length counter and phase reset */ \
+    (1UL << 0x05) | /* Pulse 2 sweep */ \
+    (1UL << 0x07) | /* Pulse 2 length counter and phase reset */ \
+    (1UL << 0x0B) | /* Triangle length counter and linear reload */ \
+    (1UL << 0x0F) | /* Noise length counter and envelope restart */ \
+    (1UL << 0x10) | /* DMC registers, relocated by the player */ \
+    (1UL << 0x11) | /* DMC output level, which the DMC also changes */ \
+    (1UL << 0x12) | \
+    (1UL << 0x13) | \
+    (1UL << 0x15) | /* Channel enables and DMC restart */ \
+    (1UL << 0x17))  /* Frame counter reset */
+
+#endif /* NES_APU_REGS_H */
@@ -0,0 +1,33 @@
+/*
+ * APU sample block conversions
+ *
+ * These are kept apart from nes.c, which talks to the NES CPU over I2C,
+ * so the host tools can link the same code.
+ */
+
+#include "nes.h"
+
+#include <esp_log.h>
+
+static const char *TAG = "nes";
+
+uint16_t nes_addr_to_apu_block(uint16_t addr)
+{
+    if (addr >= 0xC000) {
+        return (addr >> 6) & 0xFF;
+    } else if (addr >= 0x8000) {
+        return (((addr - 0xC000) >> 6) & 0xFF) + 256;
+    } else {
+        ESP_LOGE(TAG, "Invalid block address: $%04X", addr);
+        return 0; // consider a better magic value, or simply validate beforehand
+    }
+}
+
+uint16_t nes_len_to_apu_blocks(uint32_t len)
+{
+    if ((len & 0x3F) == 0) {
+        return len >> 6;
+    } else {
+        return ((len | 0x3F) + 1) >> 6;
+    }
+}
@@ -24,6 +24,9 @@ static xQueueHandle nes_player_event_queue = NULL;
 static EventGroupHandle_t nes_player_event_group = NULL;
 static TimerHandle_t nes_player_idle_timer = 0;
 
+/* Values for clearing $4000-$4013 in one burst */
+static const uint8_t nes_player_apu_zero[0x14] = {0};
+
 typedef enum {
     NES_PLAYER_PLAY_EFFECT,
     NES_PLAYER_PLAY_VGM,
@@ -90,6 +93,10 @@ static void nes_player_task(void *pvParameters)
     nes_player_idle_timer = xTimerCreate("nes_player_idle_timer", 1000 / portTICK_RATE_MS,
             pdFALSE, NULL, nes_player_idle_timer_callback);
 
+    // Measure data uploads once at startup, so the first file with
+    // samples does not have to start from a guess.
+    nes_player_run_benchmark_data();
+
     nes_player_event_t event;
     for(;;) {
         if(xQueueReceive(nes_player_event_queue, &event, portMAX_DELAY)) {
@@ -177,7 +184,9 @@ esp_err_t nes_player_init()
         return ESP_ERR_NO_MEM;
     }
 
-    if (xTaskCreate(nes_player_task, "nes_player_task", 4096, NULL, 5, NULL) != pdPASS) {
+    // Pin the player to the application core, so its timing is not
+    // disturbed by Wi-Fi and the user interface on the protocol core.
+    if (xTaskCreatePinnedToCore(nes_player_task, "nes_player_task", 4096, NULL, 5, NULL, APP_CPU_NUM) != pdPASS) {
         vEventGroupDelete(nes_player_event_group);
         nes_player_event_group = NULL;
         vQueueDelete(nes_player_event_queue);
@@ -200,6 +209,7 @@ esp_err_t nes_player_play_vgm_file(const char *filename, nes_playback_repeat_t r
         return ret;
     }
 
+    // The tags are only populated once playback has started
     if (tags) {
         *tags = vgm_player_get_gd3_tags(player);
     }
@@ -326,26 +336,7 @@ void nes_player_play_effect_blip()
 {
     i2c_mutex_lock(I2C_P0_NUM);
     nes_apu_write(I2C_P0_NUM, 0x15, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x00, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x01, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x02, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x03, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x04, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x05, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x06, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x07, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x08, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x09, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0A, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0B, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0C, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0D, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0E, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0F, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x10, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x11, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x12, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x13, 0x00);
+    nes_apu_write_burst(I2C_P0_NUM, NES_APU_PULSE1CTRL, nes_player_apu_zero, sizeof(nes_player_apu_zero));
     nes_apu_write(I2C_P0_NUM, 0x15, 0x0F);
     nes_apu_write(I2C_P0_NUM, 0x17, 0xC0);
     nes_apu_write(I2C_P0_NUM, 0x17, 0xC0);
@@ -382,26 +373,7 @@ void nes_player_play_effect_credit()
 {
     i2c_mutex_lock(I2C_P0_NUM);
     nes_apu_write(I2C_P0_NUM, 0x15, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x00, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x01, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x02, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x03, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x04, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x05, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x06, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x07, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x08, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x09, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0A, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0B, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0C, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0D, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0E, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x0F, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x10, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x11, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x12, 0x00);
-    nes_apu_write(I2C_P0_NUM, 0x13, 0x00);
+    nes_apu_write_burst(I2C_P0_NUM, NES_APU_PULSE1CTRL, nes_player_apu_zero, sizeof(nes_player_apu_zero));
     nes_apu_write(I2C_P0_NUM, 0x15, 0x0F);
     nes_apu_write(I2C_P0_NUM, 0x17, 0xC0);
     nes_apu_write(I2C_P0_NUM, 0x17, 0xFF);
@@ -452,7 +424,7 @@ void nes_player_run_benchmark_data()
     for (int i = 0; i < iterations; i++) {
         i2c_mutex_lock(I2C_P0_NUM);
         time0 = esp_timer_get_time();
-        nes_data_write(I2C_P0_NUM, 8 + i, data, 32);
+        nes_data_write(I2C_P0_NUM, NES_DATA_BLOCK_MIN + i, data, 32);
         time1 = esp_timer_get_time();
         i2c_mutex_unlock(I2C_P0_NUM);
         time_total0 += (time1 - time0);
@@ -461,7 +433,7 @@ void nes_player_run_benchmark_data()
     for (int i = 0; i < iterations; i++) {
         i2c_mutex_lock(I2C_P0_NUM);
         time0 = esp_timer_get_time();
-        nes_data_write(I2C_P0_NUM, 8 + i, data, 64);
+        nes_data_write(I2C_P0_NUM, NES_DATA_BLOCK_MIN + i, data, 64);
         time1 = esp_timer_get_time();
         i2c_mutex_unlock(I2C_P0_NUM);
         time_total1 += (time1 - time0);
@@ -470,7 +442,7 @@ void nes_player_run_benchmark_data()
     for (int i = 0; i < iterations; i++) {
         i2c_mutex_lock(I2C_P0_NUM);
         time0 = esp_timer_get_time();
-        nes_data_write(I2C_P0_NUM, 8 + i, data, 128);
+        nes_data_write(I2C_P0_NUM, NES_DATA_BLOCK_MIN + i, data, 128);
         time1 = esp_timer_get_time();
         i2c_mutex_unlock(I2C_P0_NUM);
         time_total2 += (time1 - time0);
@@ -479,7 +451,7 @@ void nes_player_run_benchmark_data()
     for (int i = 0; i < iterations; i++) {
         i2c_mutex_lock(I2C_P0_NUM);
         time0 = esp_timer_get_time();
-        nes_data_write(I2C_P0_NUM, 8 + i, data, 256);
+        nes_data_write(I2C_P0_NUM, NES_DATA_BLOCK_MIN + i, data, 256);
         time1 = esp_timer_get_time();
         i2c_mutex_unlock(I2C_P0_NUM);
         time_total4 += (time1 - time0);
@@ -507,4 +479,5 @@ void nes_player_run_benchmark_data()
     ESP_LOGI(TAG, "Time per block: %dms, samples=%d",
             (int)((useconds / blocks) / 1000),
             (int)((useconds / blocks) / sample_multiplier));
+    ESP_LOGI(TAG, "Block upload estimate: %dus", nes_data_get_block_cost());
 }
@@ -15,6 +15,16 @@
 
 static const char *TAG = "nsf";
 
+/* Address the driver program loops back to after each call to play */
+#define NSF_PRG_IDLE_PC 0x1007
+
+/*
+ * Limits on how long the init and play routines may run, in CPU clock
+ * ticks, before the code is assumed to be stuck.
+ */
+#define NSF_INIT_MAX_TICKS 1789773
+#define NSF_PLAY_MAX_TICKS 447443
+
 typedef struct {
     /* $0000 - $7FFF */
     uint8_t ram[2048];
@@ -35,6 +45,7 @@ struct nsf_file_t {
     nsf_header_t header;
     nsf_nes_memory_t nes_memory;
     nsf_apu_write_cb_t apu_write_cb;
+    uint32_t bank_loads;
 };
 
 static nsf_file_t *active_nsf_file = NULL;
@@ -387,6 +398,7 @@ esp_err_t nsf_load_rom_bank(nsf_file_t *nsf, uint16_t reg, uint8_t bank)
     }
 
     ESP_LOGD(TAG, "Load bank: $%04X -> %d", reg, bank);
+    nsf->bank_loads++;
 
     nsf_nes_memory_t *nes_memory = &nsf->nes_memory;
     uint16_t padding = nsf->header.load_address & 0x0FFF;
@@ -437,28 +449,51 @@ esp_err_t nsf_playback_init(nsf_file_t *nsf, uint8_t song, nsf_apu_write_cb_t ap
 
     reset6502();
 
-    do {
-        step6502();
-        //TODO have a sanity check condition
-    } while (get6502_pc() != 0x1007);
+    if (!run6502(NSF_PRG_IDLE_PC, NSF_INIT_MAX_TICKS)) {
+        ESP_LOGE(TAG, "Init routine did not return");
+        return ESP_ERR_TIMEOUT;
+    }
 
     return ESP_OK;
 }
 
 esp_err_t nsf_playback_frame(nsf_file_t *nsf)
 {
-    if (get6502_pc() != 0x1007) {
+    if (get6502_pc() != NSF_PRG_IDLE_PC) {
         return ESP_ERR_INVALID_STATE;
     }
 
-    do {
-        step6502();
-        //TODO have a sanity check condition
-    } while (get6502_pc() != 0x1007);
+    if (!run6502(NSF_PRG_IDLE_PC, NSF_PLAY_MAX_TICKS)) {
+        ESP_LOGE(TAG, "Play routine did not return");
+        return ESP_ERR_TIMEOUT;
+    }
 
     return ESP_OK;
 }
 
+void nsf_read_memory(const nsf_file_t *nsf, uint16_t address, uint8_t *data, size_t len)
+{
+    const nsf_nes_memory_t *nes_memory = &nsf->nes_memory;
+
+    for (size_t i = 0; i < len; i++) {
+        if (address <= 0x07FF) {
+            data[i] = nes_memory->ram[address];
+        } else if (address >= 0x8000 && address < 0xFFFA) {
+            data[i] = nes_memory->rom[address - 0x8000];
+        } else if (address >= 0xFFFA) {
+            data[i] = nes_memory->int_vecs[address - 0xFFFA];
+        } else {
+            data[i] = 0;
+        }
+        address = (address == 0xFFFF) ? 0x8000 : address + 1;
+    }
+}
+
+uint32_t nsf_get_bank_loads(const nsf_file_t *nsf)
+{
+    return nsf->bank_loads;
+}
+
 void nsf_free(nsf_file_t *nsf)
 {
     if (nsf) {
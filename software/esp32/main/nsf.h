@@ -47,6 +47,18 @@ const nsf_header_t *nsf_get_header(const nsf_file_t *nsf);
 esp_err_t nsf_playback_init(nsf_file_t *nsf, uint8_t song, nsf_apu_write_cb_t apu_write_cb);
 esp_err_t nsf_playback_frame(nsf_file_t *nsf);
 
+/**
+ * Read the emulated NES memory, as the DMC would, so addresses past
+ * $FFFF wrap around to $8000.
+ */
+void nsf_read_memory(const nsf_file_t *nsf, uint16_t address, uint8_t *data, size_t len);
+
+/**
+ * Count of ROM bank loads so far. The ROM contents can only have changed
+ * if this has.
+ */
+uint32_t nsf_get_bank_loads(const nsf_file_t *nsf);
+
 void nsf_free(nsf_file_t *nsf);
 
 #endif /* NSF_H */
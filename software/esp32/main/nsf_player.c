@@ -2,15 +2,37 @@
 
 #include <esp_err.h>
 #include <esp_log.h>
+#include <esp_timer.h>
+#include <sys/param.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "board_config.h"
 #include "i2c_util.h"
+#include "i2c_sched.h"
 #include "nes.h"
+#include "fake6502.h"
 
 static const char *TAG = "nsf_player";
 
+/*
+ * Range of sample RAM blocks available for DMC samples, $C700-$DFFF.
+ * The blocks below this mirror the NES CPU's own variables and FIFO.
+ */
+#define SAMPLE_BLOCK_MIN NES_DATA_BLOCK_MIN
+#define SAMPLE_BLOCK_MAX NES_DATA_BLOCK_MAX
+
+/* Number of distinct DMC samples that can be tracked */
+#define SAMPLE_MAX 32
+
+/* Samples started within this many frames may still be playing, so
+ * they are never evicted */
+#define SAMPLE_KEEP_FRAMES 2
+
+/* Limits on how far ahead the song is run to find its samples */
+#define SAMPLE_SCAN_FRAMES 1800
+#define SAMPLE_SCAN_TIME_US 2000000
+
 typedef struct nsf_player_t {
     nsf_file_t *nsf_file;
     nes_playback_cb_t playback_cb;
@@ -71,16 +93,312 @@ const nsf_header_t *nsf_player_get_header(const nsf_player_t *player)
     }
 }
 
+/*
+ * APU writes made while running the NSF code, which are sent together
+ * once per frame. The write callback has no context, so this is shared.
+ */
+static nes_apu_reg_write_t nsf_apu_batch[NES_APU_BATCH_MAX];
+static size_t nsf_apu_batch_len = 0;
+
+static void nsf_player_flush_batch()
+{
+    if (nsf_apu_batch_len == 0) {
+        return;
+    }
+
+    i2c_mutex_lock(I2C_P0_NUM);
+    nes_apu_write_batch(I2C_P0_NUM, nsf_apu_batch, nsf_apu_batch_len);
+    i2c_mutex_unlock(I2C_P0_NUM);
+
+    nsf_apu_batch_len = 0;
+}
+
+static void nsf_player_batch_write(nes_apu_register_t reg, uint8_t dat)
+{
+    if (nsf_apu_batch_len == NES_APU_BATCH_MAX) {
+        nsf_player_flush_batch();
+    }
+    nsf_apu_batch[nsf_apu_batch_len].reg = (uint8_t)(reg & 0xFF);
+    nsf_apu_batch[nsf_apu_batch_len].dat = dat;
+    nsf_apu_batch_len++;
+}
+
+/*
+ * A range of emulated memory that the DMC has been pointed at, and where
+ * it has been copied to in sample RAM.
+ */
+typedef struct {
+    uint16_t address;
+    uint16_t byte_size;
+    uint32_t hash;
+    uint8_t loaded_block;
+    uint32_t last_used;
+    uint32_t bank_loads;
+} nsf_sample_t;
+
+/*
+ * DMC sample handling. The emulated code points the DMC at its own ROM,
+ * so those ranges are copied into sample RAM, and the address writes are
+ * moved to match at each sample start. Ranges seen while scanning ahead
+ * are loaded before playback, and anything else is loaded when it is
+ * first used, evicting whatever was used least recently.
+ * Like the APU batch, this is shared with the write callback.
+ */
+static struct {
+    nsf_file_t *nsf_file;
+    nsf_sample_t samples[SAMPLE_MAX];
+    size_t sample_count;
+    uint8_t addr;
+    uint8_t len;
+    uint32_t frame;
+    bool scanning;
+    uint32_t starts;
+    uint32_t late_loads;
+    uint32_t dropped;
+} nsf_dmc;
+
+/* Sample data is copied here on its way to the NES */
+static uint8_t nsf_dmc_staging[256];
+
+static uint32_t nsf_player_sample_hash(uint16_t address, uint16_t byte_size)
+{
+    uint32_t hash = 2166136261U;
+    while (byte_size > 0) {
+        size_t len = MIN(byte_size, sizeof(nsf_dmc_staging));
+        nsf_read_memory(nsf_dmc.nsf_file, address, nsf_dmc_staging, len);
+        for (size_t i = 0; i < len; i++) {
+            hash = (hash ^ nsf_dmc_staging[i]) * 16777619U;
+        }
+        address = (address + len > 0xFFFF) ? address + len - 0x8000 : address + len;
+        byte_size -= len;
+    }
+    return hash;
+}
+
+/**
+ * Find the sample for the current DMC address and length registers,
+ * adding it if it has not been seen before.
+ *
+ * The ROM contents only change with a bank switch, so a sample that has
+ * been matched since the last one is found without hashing it again.
+ */
+static nsf_sample_t *nsf_player_find_sample()
+{
+    uint16_t address = 0xC000 | ((uint16_t)nsf_dmc.addr << 6);
+    uint16_t byte_size = ((uint16_t)nsf_dmc.len << 4) + 1;
+    uint32_t bank_loads = nsf_get_bank_loads(nsf_dmc.nsf_file);
+
+    for (size_t i = 0; i < nsf_dmc.sample_count; i++) {
+        nsf_sample_t *sample = &nsf_dmc.samples[i];
+        if (sample->address == address && sample->byte_size == byte_size
+                && sample->bank_loads == bank_loads) {
+            return sample;
+        }
+    }
+
+    uint32_t hash = nsf_player_sample_hash(address, byte_size);
+
+    for (size_t i = 0; i < nsf_dmc.sample_count; i++) {
+        nsf_sample_t *sample = &nsf_dmc.samples[i];
+        if (sample->address == address && sample->byte_size == byte_size && sample->hash == hash) {
+            sample->bank_loads = bank_loads;
+            return sample;
+        }
+    }
+
+    if (nsf_dmc.sample_count == SAMPLE_MAX) {
+        return NULL;
+    }
+
+    nsf_sample_t *sample = &nsf_dmc.samples[nsf_dmc.sample_count++];
+    bzero(sample, sizeof(nsf_sample_t));
+    sample->address = address;
+    sample->byte_size = byte_size;
+    sample->hash = hash;
+    sample->bank_loads = bank_loads;
+    return sample;
+}
+
+/**
+ * Find free sample RAM for a sample, optionally evicting the samples
+ * used least recently until there is room. Samples started in the last
+ * SAMPLE_KEEP_FRAMES frames are left alone.
+ *
+ * @return First block of the space, or 0 if there is none
+ */
+static uint8_t nsf_player_place_sample(const nsf_sample_t *sample, bool evict)
+{
+    uint16_t block_size = nes_len_to_apu_blocks(sample->byte_size);
+
+    while (true) {
+        // Look for the first gap between loaded samples that is big enough
+        uint16_t start = SAMPLE_BLOCK_MIN;
+        while (start + block_size <= SAMPLE_BLOCK_MAX + 1) {
+            uint16_t next = start;
+            for (size_t i = 0; i < nsf_dmc.sample_count; i++) {
+                const nsf_sample_t *other = &nsf_dmc.samples[i];
+                if (other->loaded_block == 0) {
+                    continue;
+                }
+                uint16_t other_end = other->loaded_block + nes_len_to_apu_blocks(other->byte_size);
+                if (other->loaded_block < start + block_size && other_end > start) {
+                    next = MAX(next, other_end);
+                }
+            }
+            if (next == start) {
+                return (uint8_t)start;
+            }
+            start = next;
+        }
+
+        if (!evict) {
+            return 0;
+        }
+
+        nsf_sample_t *oldest = NULL;
+        for (size_t i = 0; i < nsf_dmc.sample_count; i++) {
+            nsf_sample_t *other = &nsf_dmc.samples[i];
+            if (other->loaded_block != 0 && other != sample
+                    && nsf_dmc.frame - other->last_used >= SAMPLE_KEEP_FRAMES
+                    && (!oldest || other->last_used < oldest->last_used)) {
+                oldest = other;
+            }
+        }
+        if (!oldest) {
+            return 0;
+        }
+        oldest->loaded_block = 0;
+    }
+}
+
+static esp_err_t nsf_player_load_sample(nsf_sample_t *sample, uint8_t starting_block)
+{
+    esp_err_t ret = ESP_OK;
+    uint16_t address = sample->address;
+    size_t load_len = sample->byte_size;
+    uint8_t block = starting_block;
+
+    i2c_mutex_lock(I2C_P0_NUM);
+    while (load_len > 0) {
+        size_t len = MIN(load_len, sizeof(nsf_dmc_staging));
+        nsf_read_memory(nsf_dmc.nsf_file, address, nsf_dmc_staging, len);
+        ret = nes_data_write(I2C_P0_NUM, block, nsf_dmc_staging, len);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Unable to load data block");
+            break;
+        }
+        address = (address + len > 0xFFFF) ? address + len - 0x8000 : address + len;
+        load_len -= len;
+        block += 4;
+    }
+    i2c_mutex_unlock(I2C_P0_NUM);
+
+    sample->loaded_block = (ret == ESP_OK) ? starting_block : 0;
+    return ret;
+}
+
+/**
+ * Make sure the sample for a DMC start is in sample RAM.
+ *
+ * @return The sample, or NULL if it cannot be played
+ */
+static nsf_sample_t *nsf_player_start_sample()
+{
+    nsf_dmc.starts++;
+
+    nsf_sample_t *sample = nsf_player_find_sample();
+    if (!sample) {
+        return NULL;
+    }
+    sample->last_used = nsf_dmc.frame;
+
+    if (nsf_dmc.scanning || sample->loaded_block != 0) {
+        return sample;
+    }
+
+    // Not seen while scanning, or evicted since, so this upload has to
+    // come out of the frame time.
+    uint8_t block = nsf_player_place_sample(sample, /*evict*/true);
+    if (block == 0 || nsf_player_load_sample(sample, block) != ESP_OK) {
+        return NULL;
+    }
+    nsf_dmc.late_loads++;
+    return sample;
+}
+
 static void vgm_player_nsf_apu_write(nes_apu_register_t reg, uint8_t dat)
 {
-    if (reg == NES_APU_MODCTRL || reg == NES_APU_MODADDR || reg == NES_APU_MODLEN) {
-        // Skip DMC commands until we can handle them
-        //ESP_LOGI(TAG, "Unsupported DMC command: $%04X, $%02X", reg, dat);
-    } else {
-        i2c_mutex_lock(I2C_P0_NUM);
-        nes_apu_write(I2C_P0_NUM, reg, dat);
-        i2c_mutex_unlock(I2C_P0_NUM);
+    if (reg == NES_APU_MODADDR) {
+        // Sent with the relocated address when the sample starts
+        nsf_dmc.addr = dat;
+        return;
+    } else if (reg == NES_APU_MODLEN) {
+        nsf_dmc.len = dat;
+        return;
+    } else if (reg == NES_APU_MODCTRL) {
+        // The DMC IRQ has nowhere to go
+        dat &= 0x4F;
+    } else if (reg == NES_APU_CHANCTRL && (dat & 0x10) == 0x10) {
+        nsf_sample_t *sample = nsf_player_start_sample();
+        if (sample && !nsf_dmc.scanning) {
+            nsf_player_batch_write(NES_APU_MODADDR, sample->loaded_block);
+            nsf_player_batch_write(NES_APU_MODLEN, nsf_dmc.len);
+        } else if (!sample) {
+            nsf_dmc.dropped++;
+            dat &= ~0x10;
+        }
+    }
+
+    if (!nsf_dmc.scanning) {
+        nsf_player_batch_write(reg, dat);
+    }
+}
+
+/**
+ * Run the song ahead to find the samples it uses, and load as many of
+ * them as fit into sample RAM, in the order they are first used.
+ */
+static esp_err_t nsf_player_preload_samples(nsf_player_t *player, uint8_t song)
+{
+    nsf_dmc.scanning = true;
+    esp_err_t ret = nsf_playback_init(player->nsf_file, song, vgm_player_nsf_apu_write);
+
+    int64_t time0 = esp_timer_get_time();
+    uint32_t frames = 0;
+    while (ret == ESP_OK && frames < SAMPLE_SCAN_FRAMES
+            && esp_timer_get_time() - time0 < SAMPLE_SCAN_TIME_US) {
+        nsf_dmc.frame = ++frames;
+        ret = nsf_playback_frame(player->nsf_file);
+    }
+    int64_t time1 = esp_timer_get_time();
+    nsf_dmc.scanning = false;
+
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    // Samples are read from the ROM as the scan left it, so any that
+    // came from a bank that has since been switched out are left until
+    // they are used.
+    size_t loaded = 0;
+    size_t loaded_bytes = 0;
+    for (size_t i = 0; i < nsf_dmc.sample_count; i++) {
+        nsf_sample_t *sample = &nsf_dmc.samples[i];
+        sample->last_used = 0;
+        if (nsf_player_sample_hash(sample->address, sample->byte_size) != sample->hash) {
+            continue;
+        }
+        uint8_t block = nsf_player_place_sample(sample, /*evict*/false);
+        if (block != 0 && nsf_player_load_sample(sample, block) == ESP_OK) {
+            loaded++;
+            loaded_bytes += sample->byte_size;
+        }
     }
+
+    ESP_LOGI(TAG, "Sample scan: %d frames in %dms, %d samples found, %d loaded (%d bytes)",
+            frames, (uint32_t)((time1 - time0) / 1000),
+            nsf_dmc.sample_count, loaded, loaded_bytes);
+    return ESP_OK;
 }
 
 esp_err_t nsf_player_prepare(nsf_player_t *player, uint8_t song)
@@ -93,10 +411,24 @@ esp_err_t nsf_player_prepare(nsf_player_t *player, uint8_t song)
         return ESP_ERR_INVALID_ARG;
     }
 
+    nsf_apu_batch_len = 0;
+    bzero(&nsf_dmc, sizeof(nsf_dmc));
+    nsf_dmc.nsf_file = player->nsf_file;
+
+    if (nsf_player_preload_samples(player, (header->starting_song + (song - 1)) - 1) != ESP_OK) {
+        ESP_LOGE(TAG, "NSF sample scan failed");
+        return ESP_FAIL;
+    }
+    nsf_dmc.starts = 0;
+    nsf_dmc.dropped = 0;
+    nsf_dmc.frame = 0;
+
+    nes_apu_shadow_reset_stats();
     if (nsf_playback_init(player->nsf_file, (header->starting_song + (song - 1)) - 1, vgm_player_nsf_apu_write) != ESP_OK) {
         ESP_LOGE(TAG, "NSF initialization failed");
         return ESP_FAIL;
     }
+    nsf_player_flush_batch();
 
     return ESP_OK;
 }
@@ -105,6 +437,11 @@ esp_err_t nsf_player_play_loop(nsf_player_t *player)
 {
     ESP_LOGI(TAG, "Starting playback");
     const nsf_header_t *header = nsf_get_header(player->nsf_file);
+    i2c_sched_set_realtime(I2C_P0_NUM, true);
+
+    // Emulation time, including the APU writes sent during frames
+    uint64_t cpu_ticks = 0;
+    int64_t cpu_time = 0;
 
     while(true) {
         if ((xEventGroupGetBits(player->event_group) & BIT0) == BIT0) {
@@ -112,18 +449,39 @@ esp_err_t nsf_player_play_loop(nsf_player_t *player)
         }
 
         int64_t time0 = esp_timer_get_time();
+        uint32_t ticks0 = get6502_ticks();
+        nsf_dmc.frame++;
         if (nsf_playback_frame(player->nsf_file) != ESP_OK) {
             ESP_LOGE(TAG, "NSF frame playback failed");
             break;
         }
+        cpu_ticks += get6502_ticks() - ticks0;
+        cpu_time += esp_timer_get_time() - time0;
+        nsf_player_flush_batch();
         int64_t time1 = esp_timer_get_time();
 
         int64_t time_remaining = header->play_speed_ntsc - (time1 - time0);
 
         if (time_remaining > 0 && time_remaining <= header->play_speed_ntsc) {
+            // Let housekeeping on the bus run until the next frame
+            i2c_sched_set_idle_until(I2C_P0_NUM, time1 + time_remaining);
             usleep(time_remaining);
         }
     }
+    i2c_sched_set_realtime(I2C_P0_NUM, false);
+
+    nes_apu_shadow_stats_t shadow_stats;
+    nes_apu_shadow_get_stats(&shadow_stats);
+    ESP_LOGI(TAG, "APU writes: %u requested, %u skipped (%u%%)",
+            shadow_stats.writes, shadow_stats.skipped,
+            shadow_stats.writes ? (shadow_stats.skipped * 100) / shadow_stats.writes : 0);
+    if (cpu_time > 0) {
+        uint32_t khz = (uint32_t)((cpu_ticks * 1000) / cpu_time);
+        ESP_LOGI(TAG, "6502 emulation: %llu cycles in %ums (%u.%02u MHz)",
+                cpu_ticks, (uint32_t)(cpu_time / 1000), khz / 1000, (khz % 1000) / 10);
+    }
+    ESP_LOGI(TAG, "DMC samples: %u started, %u loaded during playback, %u not playable",
+            nsf_dmc.starts, nsf_dmc.late_loads, nsf_dmc.dropped);
 
     // Reset the APU
     i2c_mutex_lock(I2C_P0_NUM);
@@ -172,12 +172,8 @@ esp_err_t tsl2591_get_full_channel_data(i2c_port_t i2c_num, uint16_t *ch0_val, u
     esp_err_t ret;
     uint8_t data[4];
 
-    ret = i2c_write_byte(i2c_num, TSL2591_ADDRESS, TSL2591_CMD_NORMAL | TSL2591_C0DATAL);
-    if (ret != ESP_OK) {
-        return ret;
-    }
-
-    ret = i2c_read_buffer(i2c_num, TSL2591_ADDRESS, data, sizeof(data));
+    ret = i2c_read_register_buffer(i2c_num, TSL2591_ADDRESS, TSL2591_CMD_NORMAL | TSL2591_C0DATAL,
+            data, sizeof(data));
     if (ret != ESP_OK) {
         return ret;
     }
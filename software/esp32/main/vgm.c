@@ -5,12 +5,13 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <sys/unistd.h>
+#include <sys/param.h>
 #include <errno.h>
 
 #include <esp_err.h>
 #include <esp_log.h>
 
-#include "zlib.h"
+#include "vgm_stream.h"
 
 static const char *TAG = "vgm";
 
@@ -19,15 +20,26 @@ static const char *TAG = "vgm";
 #define UINT16_FROM_BYTES(buf, n) \
     (uint16_t)(buf[n+1] << 8 | buf[n])
 
+/* Size of the read-ahead window that commands are decoded from */
+#define VGM_READ_BUFFER_SIZE 4096
+
 struct vgm_file_t {
-    gzFile file;
+    vgm_stream_t *stream;
     vgm_header_t header;
     bool at_vgm_data;
     uint32_t sample_index;
+    uint8_t *buf;        /* Read-ahead window */
+    size_t buf_len;      /* Number of valid bytes in the window */
+    size_t buf_pos;      /* Read position within the window */
+    uint32_t buf_offset; /* File offset of the first byte in the window */
 };
 
 static int bcd_to_decimal(unsigned char x);
 static esp_err_t vgm_read_header(vgm_file_t *vgm_file);
+static esp_err_t vgm_buffer_fill(vgm_file_t *vgm_file, size_t len);
+static esp_err_t vgm_buffer_read(vgm_file_t *vgm_file, uint8_t *data, size_t len);
+static esp_err_t vgm_buffer_skip(vgm_file_t *vgm_file, size_t len);
+static esp_err_t vgm_buffer_seek(vgm_file_t *vgm_file, uint32_t offset);
 
 int bcd_to_decimal(unsigned char x)
 {
@@ -48,10 +60,14 @@ esp_err_t vgm_open(vgm_file_t **vgm_file, const char *filename)
 
         bzero(vgm, sizeof(struct vgm_file_t));
 
-        vgm->file = gzopen(filename, "rb");
-        if (!vgm->file) {
-            ESP_LOGE(TAG, "Failed to open file for reading: %s", strerror(errno));
-            ret = ESP_FAIL;
+        vgm->buf = malloc(VGM_READ_BUFFER_SIZE);
+        if (!vgm->buf) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        ret = vgm_stream_open(&vgm->stream, filename);
+        if (ret != ESP_OK) {
             break;
         }
 
@@ -60,6 +76,10 @@ esp_err_t vgm_open(vgm_file_t **vgm_file, const char *filename)
             break;
         }
 
+        // Make sure the loop is checkpointed, since playback will keep
+        // seeking back to it.
+        vgm_stream_set_loop_offset(vgm->stream, vgm->header.loop_offset);
+
     } while (0);
 
     if (ret == ESP_OK) {
@@ -73,21 +93,22 @@ esp_err_t vgm_open(vgm_file_t **vgm_file, const char *filename)
 
 esp_err_t vgm_read_header(vgm_file_t *vgm_file)
 {
-    size_t n;
+    int n;
     uint8_t buf[256];
 
     // Assume we are at the start of the file, since this function should
     // only be called from vgm_open().
 
     // Read the header to a buffer
-    n = gzread(vgm_file->file, buf, sizeof(buf));
+    n = vgm_stream_read(vgm_file->stream, buf, sizeof(buf));
     if (n < 0x38) {
-        int errnum;
-        const char *msg = gzerror(vgm_file->file, &errnum);
-        ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+        ESP_LOGE(TAG, "Unable to read header");
         return ESP_FAIL;
     }
 
+    // The read-ahead window starts right after the header bytes
+    vgm_file->buf_offset = n;
+
     // Validate the magic at the start of the header
     if (memcmp(buf, "Vgm ", 4) != 0) {
         ESP_LOGE(TAG, "File is not VGM");
@@ -218,19 +239,13 @@ esp_err_t vgm_read_gd3_tags(vgm_gd3_tags_t **tags, vgm_file_t *vgm_file)
     vgm_file->at_vgm_data = false;
 
     // Seek to the start of the GD3 data
-    if (gzseek(vgm_file->file, vgm_file->header.gd3_offset, SEEK_SET) < 0) {
-        int errnum;
-        const char *msg = gzerror(vgm_file->file, &errnum);
-        ESP_LOGE(TAG, "gzseek: %s [%d]", msg, errnum);
+    if (vgm_buffer_seek(vgm_file, vgm_file->header.gd3_offset) != ESP_OK) {
         return ESP_FAIL;
     }
 
     // Read the GD3 header bytes
     uint8_t gd3_header[12];
-    if (gzread(vgm_file->file, gd3_header, sizeof(gd3_header)) != sizeof(gd3_header)) {
-        int errnum;
-        const char *msg = gzerror(vgm_file->file, &errnum);
-        ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+    if (vgm_buffer_read(vgm_file, gd3_header, sizeof(gd3_header)) != ESP_OK) {
         return ESP_FAIL;
     }
 
@@ -252,10 +267,8 @@ esp_err_t vgm_read_gd3_tags(vgm_gd3_tags_t **tags, vgm_file_t *vgm_file)
         return ESP_ERR_INVALID_SIZE;
     }
 
-    if (gzread(vgm_file->file, buf, gd3_size) != gd3_size) {
-        int errnum;
-        const char *msg = gzerror(vgm_file->file, &errnum);
-        ESP_LOGE(TAG, "gzseek: %s [%d]", msg, errnum);
+    if (vgm_buffer_read(vgm_file, buf, gd3_size) != ESP_OK) {
+        free(buf);
         return ESP_FAIL;
     }
 
@@ -339,10 +352,7 @@ void vgm_free_gd3_tags(vgm_gd3_tags_t *tags)
 esp_err_t vgm_seek_start(vgm_file_t *vgm_file)
 {
     if (!vgm_file->at_vgm_data) {
-        if (gzseek(vgm_file->file, vgm_file->header.data_offset, SEEK_SET) < 0) {
-            int errnum;
-            const char *msg = gzerror(vgm_file->file, &errnum);
-            ESP_LOGE(TAG, "gzseek: %s [%d]", msg, errnum);
+        if (vgm_buffer_seek(vgm_file, vgm_file->header.data_offset) != ESP_OK) {
             return ESP_FAIL;
         }
         vgm_file->at_vgm_data = true;
@@ -364,19 +374,27 @@ esp_err_t vgm_seek_loop(vgm_file_t *vgm_file)
         return ESP_FAIL;
     }
 
-    if (gzseek(vgm_file->file, vgm_file->header.loop_offset, SEEK_SET) < 0) {
-        int errnum;
-        const char *msg = gzerror(vgm_file->file, &errnum);
-        ESP_LOGE(TAG, "gzseek: %s [%d]", msg, errnum);
+    if (vgm_buffer_seek(vgm_file, vgm_file->header.loop_offset) != ESP_OK) {
         return ESP_FAIL;
     }
     vgm_file->at_vgm_data = true;
     return ESP_OK;
 }
 
+uint32_t vgm_tell(const vgm_file_t *vgm_file)
+{
+    return vgm_file->buf_offset + vgm_file->buf_pos;
+}
+
+void vgm_log_seek_index(const vgm_file_t *vgm_file)
+{
+    vgm_stream_log_index(vgm_file->stream);
+}
+
 esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool load_data)
 {
     uint8_t cmd;
+    const uint8_t *buf;
 
     if (vgm_seek_start(vgm_file) != ESP_OK) {
         return ESP_FAIL;
@@ -385,51 +403,56 @@ esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool lo
     memset(command, 0, sizeof(vgm_command_t));
     command->sample_index = vgm_file->sample_index;
 
-    if(gzread(vgm_file->file, &cmd, sizeof(cmd)) != sizeof(cmd)) {
-        int errnum;
-        const char *msg = gzerror(vgm_file->file, &errnum);
-        ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+    // Make sure the longest fixed-size command (a data block header and
+    // its start address) can be decoded straight out of the window.
+    // Near the end of the file, less than that may be available.
+    if (vgm_buffer_fill(vgm_file, 9) != ESP_OK
+            && vgm_buffer_fill(vgm_file, 1) != ESP_OK) {
         return ESP_FAIL;
     }
 
+    size_t avail = vgm_file->buf_len - vgm_file->buf_pos;
+    buf = vgm_file->buf + vgm_file->buf_pos;
+    cmd = buf[0];
+
     if (cmd == 0x61) {
         /* Wait n samples, n can range from 0 to 65535 */
-        uint8_t buf[2];
-        if(gzread(vgm_file->file, &buf, sizeof(buf)) != sizeof(buf)) {
-            int errnum;
-            const char *msg = gzerror(vgm_file->file, &errnum);
-            ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+        if (avail < 3) {
+            ESP_LOGE(TAG, "Truncated command: %02X", cmd);
             return ESP_FAIL;
         }
         command->type = VGM_CMD_WAIT;
-        command->info.wait.samples = UINT16_FROM_BYTES(buf, 0);
+        command->info.wait.samples = UINT16_FROM_BYTES(buf, 1);
         vgm_file->sample_index += command->info.wait.samples;
+        vgm_file->buf_pos += 3;
     }
     else if (cmd == 0x62) {
         /* Wait 735 samples */
         command->type = VGM_CMD_WAIT;
         command->info.wait.samples = 735;
         vgm_file->sample_index += command->info.wait.samples;
+        vgm_file->buf_pos += 1;
     }
     else if (cmd == 0x63) {
         /* Wait 882 samples */
         command->type = VGM_CMD_WAIT;
         command->info.wait.samples = 882;
         vgm_file->sample_index += command->info.wait.samples;
+        vgm_file->buf_pos += 1;
     }
     else if (cmd == 0x66) {
         /* End of sound data */
         command->type = VGM_CMD_DONE;
+        vgm_file->buf_pos += 1;
     }
     else if (cmd == 0x67) {
         /* Data block */
-        uint8_t header[6];
-        if(gzread(vgm_file->file, &header, sizeof(header)) != sizeof(header)) {
-            int errnum;
-            const char *msg = gzerror(vgm_file->file, &errnum);
-            ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+        if (avail < 7) {
+            ESP_LOGE(TAG, "Truncated command: %02X", cmd);
             return ESP_FAIL;
         }
+        const uint8_t *header = buf + 1;
+        vgm_file->buf_pos += 7;
 
         if (header[0] != 0x66) {
             ESP_LOGE(TAG, "Unknown value at start of data block: %02X", header[0]);
@@ -464,17 +487,14 @@ esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool lo
 
         if (header[1] >= 0xC0 && header[1] <= 0xDF) {
             /* RAM writes (for RAM with up to 64 KB) */
-            uint8_t addr_buf[2];
-
-            if(gzread(vgm_file->file, addr_buf, 2) != 2) {
-                int errnum;
-                const char *msg = gzerror(vgm_file->file, &errnum);
-                ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+            if (avail < 9) {
+                ESP_LOGE(TAG, "Truncated data block");
                 return ESP_FAIL;
             }
 
             data_size -= 2;
-            start_addr = UINT16_FROM_BYTES(addr_buf, 0);
+            start_addr = UINT16_FROM_BYTES(buf, 7);
+            vgm_file->buf_pos += 2;
 
             ESP_LOGI(TAG, "Data start address: $%04X", start_addr);
 
@@ -484,19 +504,13 @@ esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool lo
                     return ESP_ERR_NO_MEM;
                 }
 
-                if(gzread(vgm_file->file, data_buf, data_size) != data_size) {
+                if (vgm_buffer_read(vgm_file, data_buf, data_size) != ESP_OK) {
                     free(data_buf);
-                    int errnum;
-                    const char *msg = gzerror(vgm_file->file, &errnum);
-                    ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
                     return ESP_FAIL;
                 }
 
             } else {
-                if (gzseek(vgm_file->file, data_size, SEEK_CUR) < 0) {
-                    int errnum;
-                    const char *msg = gzerror(vgm_file->file, &errnum);
-                    ESP_LOGE(TAG, "gzseek: %s [%d]", msg, errnum);
+                if (vgm_buffer_skip(vgm_file, data_size) != ESP_OK) {
                     return ESP_FAIL;
                 }
             }
@@ -522,43 +536,45 @@ esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool lo
         /* Wait n+1 samples, n can range from 0 to 15 */
         command->type = VGM_CMD_WAIT;
         command->info.wait.samples = (cmd & 0x0F) + 1;
+        vgm_file->sample_index += command->info.wait.samples;
+        vgm_file->buf_pos += 1;
     }
     else if (cmd == 0xB4) {
         /* NES APU, write value dd to register aa */
-        uint8_t buf[2];
-        if(gzread(vgm_file->file, &buf, sizeof(buf)) != sizeof(buf)) {
-            int errnum;
-            const char *msg = gzerror(vgm_file->file, &errnum);
-            ESP_LOGE(TAG, "gzread: %s [%d]", msg, errnum);
+        if (avail < 3) {
+            ESP_LOGE(TAG, "Truncated command: %02X", cmd);
             return ESP_FAIL;
         }
+        uint8_t aa = buf[1];
+        uint8_t dd = buf[2];
+        vgm_file->buf_pos += 3;
 
         uint8_t reg_l = 0;
-        if (buf[0] <= 0x1F) {
+        if (aa <= 0x1F) {
             /* Registers $00-$1F equal NES address $4000-$401F */
-            reg_l = buf[0];
+            reg_l = aa;
         }
-        else if (buf[0] >= 0x20 && buf[0] <= 0x3E) {
+        else if (aa >= 0x20 && aa <= 0x3E) {
             /* Registers $20-$3E equal NES address $4080-$409E */
-            reg_l = 0x80 + (buf[0] - 0x20);
+            reg_l = 0x80 + (aa - 0x20);
         }
-        else if (buf[0] == 0x3F) {
+        else if (aa == 0x3F) {
             /* Register $3F equals NES address $4023 */
             reg_l = 0x23;
         }
-        else if (buf[0] >= 0x40 && buf[0] <= 0x7F) {
+        else if (aa >= 0x40 && aa <= 0x7F) {
            /* Registers $40-$7F equal NES address $4040-$407F */
-           reg_l = 0x40 + (buf[0] - 0x40);
+           reg_l = 0x40 + (aa - 0x40);
         }
         else {
-            ESP_LOGE(TAG, "Unknown NES APU register: %02X", buf[0]);
+            ESP_LOGE(TAG, "Unknown NES APU register: %02X", aa);
             command->type = VGM_CMD_UNKNOWN;
             return 0;
         }
 
         command->type = VGM_CMD_NES_APU;
         command->info.nes_apu.reg = 0x4000 + reg_l; /* Write to 0x4000 + reg_l */
-        command->info.nes_apu.dat = buf[1];
+        command->info.nes_apu.dat = dd;
     }
     else {
         ESP_LOGE(TAG, "Unsupported command: %02X", cmd);
@@ -570,12 +586,138 @@ esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool lo
     return ESP_OK;
 }
 
+/**
+ * Make sure at least len bytes are available in the read-ahead window,
+ * refilling it from the file in bulk if necessary.
+ */
+esp_err_t vgm_buffer_fill(vgm_file_t *vgm_file, size_t len)
+{
+    size_t avail = vgm_file->buf_len - vgm_file->buf_pos;
+    if (avail >= len) {
+        return ESP_OK;
+    }
+
+    if (len > VGM_READ_BUFFER_SIZE) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+
+    // Shift the unread bytes to the front of the window
+    if (vgm_file->buf_pos > 0) {
+        if (avail > 0) {
+            memmove(vgm_file->buf, vgm_file->buf + vgm_file->buf_pos, avail);
+        }
+        vgm_file->buf_offset += vgm_file->buf_pos;
+        vgm_file->buf_pos = 0;
+        vgm_file->buf_len = avail;
+    }
+
+    int n = vgm_stream_read(vgm_file->stream, vgm_file->buf + vgm_file->buf_len,
+            VGM_READ_BUFFER_SIZE - vgm_file->buf_len);
+    if (n < 0) {
+        return ESP_FAIL;
+    }
+    vgm_file->buf_len += n;
+
+    if (vgm_file->buf_len < len) {
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+/**
+ * Read bytes from the current position, bypassing the window for
+ * anything larger than what it already holds.
+ */
+esp_err_t vgm_buffer_read(vgm_file_t *vgm_file, uint8_t *data, size_t len)
+{
+    size_t avail = vgm_file->buf_len - vgm_file->buf_pos;
+    size_t copy_len = MIN(avail, len);
+
+    memcpy(data, vgm_file->buf + vgm_file->buf_pos, copy_len);
+    vgm_file->buf_pos += copy_len;
+    data += copy_len;
+    len -= copy_len;
+
+    if (len == 0) {
+        return ESP_OK;
+    }
+
+    // The window is now empty, so the file position is right past its end
+    vgm_file->buf_offset += vgm_file->buf_len;
+    vgm_file->buf_len = 0;
+    vgm_file->buf_pos = 0;
+
+    if (len >= VGM_READ_BUFFER_SIZE) {
+        if (vgm_stream_read(vgm_file->stream, data, len) != len) {
+            ESP_LOGE(TAG, "Unexpected end of file");
+            return ESP_FAIL;
+        }
+        vgm_file->buf_offset += len;
+        return ESP_OK;
+    }
+
+    if (vgm_buffer_fill(vgm_file, len) != ESP_OK) {
+        ESP_LOGE(TAG, "Unexpected end of file");
+        return ESP_FAIL;
+    }
+    memcpy(data, vgm_file->buf, len);
+    vgm_file->buf_pos += len;
+
+    return ESP_OK;
+}
+
+/**
+ * Skip over bytes from the current position.
+ */
+esp_err_t vgm_buffer_skip(vgm_file_t *vgm_file, size_t len)
+{
+    size_t avail = vgm_file->buf_len - vgm_file->buf_pos;
+    if (len <= avail) {
+        vgm_file->buf_pos += len;
+        return ESP_OK;
+    }
+
+    // Skip past the end of the window, and drop its contents
+    uint32_t offset = vgm_file->buf_offset + vgm_file->buf_pos + len;
+    if (vgm_stream_seek(vgm_file->stream, offset) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    vgm_file->buf_offset = offset;
+    vgm_file->buf_len = 0;
+    vgm_file->buf_pos = 0;
+
+    return ESP_OK;
+}
+
+/**
+ * Seek to an absolute file offset. If the offset falls inside the
+ * current window, this is just a change of read position. Otherwise
+ * the window is invalidated and refilled on the next read.
+ */
+esp_err_t vgm_buffer_seek(vgm_file_t *vgm_file, uint32_t offset)
+{
+    if (offset >= vgm_file->buf_offset
+            && offset < vgm_file->buf_offset + vgm_file->buf_len) {
+        vgm_file->buf_pos = offset - vgm_file->buf_offset;
+        return ESP_OK;
+    }
+
+    if (vgm_stream_seek(vgm_file->stream, offset) != ESP_OK) {
+        return ESP_FAIL;
+    }
+    vgm_file->buf_offset = offset;
+    vgm_file->buf_len = 0;
+    vgm_file->buf_pos = 0;
+
+    return ESP_OK;
+}
+
 void vgm_free(vgm_file_t *vgm_file)
 {
     if (vgm_file) {
-        if (vgm_file->file) {
-            gzclose(vgm_file->file);
-        }
+        vgm_stream_close(vgm_file->stream);
+        free(vgm_file->buf);
         free(vgm_file);
     }
 }
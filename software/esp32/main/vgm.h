@@ -85,6 +85,8 @@ void vgm_free_gd3_tags(vgm_gd3_tags_t *tags);
 esp_err_t vgm_seek_start(vgm_file_t *vgm_file);
 esp_err_t vgm_seek_restart(vgm_file_t *vgm_file);
 esp_err_t vgm_seek_loop(vgm_file_t *vgm_file);
+uint32_t vgm_tell(const vgm_file_t *vgm_file);
+void vgm_log_seek_index(const vgm_file_t *vgm_file);
 esp_err_t vgm_next_command(vgm_file_t *vgm_file, vgm_command_t *command, bool load_data);
 
 void vgm_free(vgm_file_t *vgm_file);
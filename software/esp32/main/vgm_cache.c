@@ -0,0 +1,410 @@
+#include "vgm_cache.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+
+#include <esp_err.h>
+#include <esp_log.h>
+
+#include "nbin_format.h"
+
+static const char *TAG = "vgm_cache";
+
+#define VGM_CACHE_MAGIC "VPRC"
+#define VGM_CACHE_VERSION 3
+
+/*
+ * A cache file is laid out as:
+ * - File header
+ * - Source path, NUL-terminated
+ * - GD3 tag strings, in the same form as in a .nbin file
+ * - Group table, with data offsets relative to the group data
+ * - Reference table, in playback order
+ * - Group data
+ * - Event tape, if there is one
+ */
+typedef struct __attribute__((packed)) {
+    char magic[4];
+    uint16_t version;
+    uint16_t reserved;
+    uint32_t source_size;
+    uint32_t source_mtime;
+    uint32_t total_samples;
+    uint32_t loop_samples;
+    uint32_t loop_offset;
+    uint32_t loop_sample_time;
+    uint32_t path_size;
+    uint32_t tags_size;
+    uint32_t group_count;
+    uint32_t ref_count;
+    uint32_t data_size;
+    uint32_t tape_size;
+} vgm_cache_header_t;
+
+static void vgm_cache_path(char *path, size_t len, const char *filename);
+static char **vgm_cache_tag_field(vgm_gd3_tags_t *tags, int index);
+static esp_err_t vgm_cache_parse(const uint8_t *buf, size_t len, const char *filename,
+        const struct stat *st, vgm_data_state_t **data_state,
+        vgm_gd3_tags_t *tags, vgm_cache_info_t *info);
+
+/* Number of GD3 tag strings, in the order of vgm_gd3_tags_t */
+#define VGM_CACHE_TAG_COUNT 7
+
+/**
+ * Get the cache file path for a source file, named after a hash of
+ * its path so it fits within 8.3 file names.
+ */
+void vgm_cache_path(char *path, size_t len, const char *filename)
+{
+    uint32_t hash = 2166136261U;
+    for (const char *p = filename; *p; p++) {
+        hash = (hash ^ (uint8_t)*p) * 16777619U;
+    }
+    snprintf(path, len, "%s/%08X.VPC", VGM_CACHE_DIR, hash);
+}
+
+char **vgm_cache_tag_field(vgm_gd3_tags_t *tags, int index)
+{
+    switch (index) {
+    case 0: return &tags->track_name;
+    case 1: return &tags->game_name;
+    case 2: return &tags->system_name;
+    case 3: return &tags->track_author;
+    case 4: return &tags->game_release;
+    case 5: return &tags->vgm_author;
+    case 6: return &tags->notes;
+    default: return NULL;
+    }
+}
+
+esp_err_t vgm_cache_load(const char *filename, vgm_data_state_t **data_state,
+        vgm_gd3_tags_t *tags, vgm_cache_info_t *info,
+        vgm_tape_t **tape, size_t tape_limit)
+{
+    esp_err_t ret = ESP_OK;
+    char path[64];
+    struct stat source_st;
+    struct stat cache_st;
+    FILE *file = NULL;
+    uint8_t *buf = NULL;
+    vgm_cache_header_t header;
+
+    if (!filename || !data_state || !tags || !info || !tape) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    *tape = NULL;
+
+    vgm_cache_path(path, sizeof(path), filename);
+    if (stat(filename, &source_st) != 0 || stat(path, &cache_st) != 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    if (cache_st.st_size < sizeof(vgm_cache_header_t)) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    do {
+        file = fopen(path, "rb");
+        if (!file) {
+            ret = ESP_ERR_NOT_FOUND;
+            break;
+        }
+        if (fread(&header, sizeof(vgm_cache_header_t), 1, file) != 1) {
+            ESP_LOGE(TAG, "Unable to read cache file: %d", errno);
+            ret = ESP_FAIL;
+            break;
+        }
+        if (header.tape_size > cache_st.st_size - sizeof(vgm_cache_header_t)) {
+            ret = ESP_ERR_NOT_FOUND;
+            break;
+        }
+
+        // Everything up to the tape is small, so read it in one go. The
+        // tape is read straight into its own buffer afterwards.
+        size_t len = cache_st.st_size - header.tape_size;
+        buf = malloc(len);
+        if (!buf) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        memcpy(buf, &header, sizeof(vgm_cache_header_t));
+        if (fread(buf + sizeof(vgm_cache_header_t), 1, len - sizeof(vgm_cache_header_t), file)
+                != len - sizeof(vgm_cache_header_t)) {
+            ESP_LOGE(TAG, "Unable to read cache file: %d", errno);
+            ret = ESP_FAIL;
+            break;
+        }
+
+        ret = vgm_cache_parse(buf, len, filename, &source_st, data_state, tags, info);
+        if (ret != ESP_OK || header.tape_size == 0) {
+            break;
+        }
+
+        // Without the tape, playback streams from the file, so a tape
+        // that cannot be loaded is not an error.
+        esp_err_t tape_ret = vgm_tape_read(tape, file, header.tape_size, tape_limit);
+        if (tape_ret == ESP_ERR_NO_MEM) {
+            ESP_LOGW(TAG, "Cached event tape is too large");
+        } else if (tape_ret != ESP_OK) {
+            ESP_LOGW(TAG, "Invalid cached event tape: %d", tape_ret);
+        }
+    } while (0);
+
+    if (file) {
+        fclose(file);
+    }
+    free(buf);
+
+    return ret;
+}
+
+esp_err_t vgm_cache_parse(const uint8_t *buf, size_t len, const char *filename,
+        const struct stat *st, vgm_data_state_t **data_state,
+        vgm_gd3_tags_t *tags, vgm_cache_info_t *info)
+{
+    esp_err_t ret = ESP_OK;
+    vgm_cache_header_t header;
+    vgm_data_state_t *state = NULL;
+    vgm_data_block_group_t **block_groups = NULL;
+
+    memcpy(&header, buf, sizeof(vgm_cache_header_t));
+    if (memcmp(header.magic, VGM_CACHE_MAGIC, 4) != 0 || header.version != VGM_CACHE_VERSION) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    // Check the entry is for this exact version of the file
+    if (header.source_size != (uint32_t)st->st_size
+            || header.source_mtime != (uint32_t)st->st_mtime) {
+        ESP_LOGI(TAG, "Cache entry is stale");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    uint64_t expected_len = sizeof(vgm_cache_header_t) + (uint64_t)header.path_size
+            + header.tags_size + ((uint64_t)header.group_count * sizeof(nbin_group_t))
+            + ((uint64_t)header.ref_count * sizeof(nbin_ref_t)) + header.data_size;
+    if (expected_len != len) {
+        ESP_LOGW(TAG, "Cache entry is truncated");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const char *path = (const char *)(buf + sizeof(vgm_cache_header_t));
+    if (header.path_size == 0 || path[header.path_size - 1] != '\0' || strcmp(path, filename) != 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    const char *tag_data = path + header.path_size;
+    const nbin_group_t *groups = (const nbin_group_t *)(tag_data + header.tags_size);
+    const nbin_ref_t *refs = (const nbin_ref_t *)(groups + header.group_count);
+    const uint8_t *data = (const uint8_t *)(refs + header.ref_count);
+
+    do {
+        if (header.ref_count > 0) {
+            state = vgm_data_state_create();
+            block_groups = malloc(sizeof(vgm_data_block_group_t *) * MAX(header.group_count, 1));
+            if (!state || !block_groups) {
+                ret = ESP_ERR_NO_MEM;
+                break;
+            }
+
+            for (uint32_t i = 0; i < header.group_count; i++) {
+                nbin_group_t group;
+                memcpy(&group, &groups[i], sizeof(nbin_group_t));
+                if ((uint64_t)group.data_offset + group.byte_size > header.data_size) {
+                    ret = ESP_ERR_INVALID_SIZE;
+                    break;
+                }
+                ret = vgm_data_state_add_group(state, group.key_sample_time, group.key_block,
+                        data + group.data_offset, group.byte_size, &block_groups[i]);
+                if (ret != ESP_OK) {
+                    break;
+                }
+            }
+            if (ret != ESP_OK) {
+                break;
+            }
+
+            for (uint32_t i = 0; i < header.ref_count; i++) {
+                nbin_ref_t ref;
+                memcpy(&ref, &refs[i], sizeof(nbin_ref_t));
+                if (ref.group >= header.group_count) {
+                    ret = ESP_ERR_INVALID_SIZE;
+                    break;
+                }
+                ret = vgm_data_state_add_group_ref(state, block_groups[ref.group],
+                        ref.sample_time, ref.byte_size);
+                if (ret != ESP_OK) {
+                    break;
+                }
+            }
+            if (ret != ESP_OK) {
+                break;
+            }
+        }
+
+        const char *p = tag_data;
+        const char *end = tag_data + header.tags_size;
+        for (int i = 0; i < VGM_CACHE_TAG_COUNT && p < end; i++) {
+            size_t tag_len = strnlen(p, end - p);
+            if (tag_len > 0 && tag_len < end - p) {
+                *vgm_cache_tag_field(tags, i) = strndup(p, tag_len);
+            }
+            p += tag_len + 1;
+        }
+    } while (0);
+
+    free(block_groups);
+
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Invalid cache entry: %d", ret);
+        vgm_data_state_free(state);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    info->total_samples = header.total_samples;
+    info->loop_samples = header.loop_samples;
+    info->loop_offset = header.loop_offset;
+    info->loop_sample_time = header.loop_sample_time;
+    *data_state = state;
+    return ESP_OK;
+}
+
+esp_err_t vgm_cache_save(const char *filename, const vgm_data_state_t *data_state,
+        const vgm_gd3_tags_t *tags, const vgm_cache_info_t *info,
+        const vgm_tape_t *tape)
+{
+    esp_err_t ret = ESP_OK;
+    char path[64];
+    struct stat st;
+    FILE *file = NULL;
+    vgm_cache_header_t header;
+
+    if (!filename || !tags || !info) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (stat(filename, &st) != 0) {
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    if (mkdir(VGM_CACHE_DIR, 0777) != 0 && errno != EEXIST) {
+        ESP_LOGW(TAG, "Unable to create cache directory: %d", errno);
+        return ESP_FAIL;
+    }
+
+    size_t group_count = data_state ? vgm_data_state_group_count(data_state) : 0;
+    size_t ref_count = data_state ? vgm_data_state_ref_count(data_state) : 0;
+
+    bzero(&header, sizeof(vgm_cache_header_t));
+    memcpy(header.magic, VGM_CACHE_MAGIC, 4);
+    header.version = VGM_CACHE_VERSION;
+    header.source_size = st.st_size;
+    header.source_mtime = st.st_mtime;
+    header.total_samples = info->total_samples;
+    header.loop_samples = info->loop_samples;
+    header.loop_offset = info->loop_offset;
+    header.loop_sample_time = info->loop_sample_time;
+    header.path_size = strlen(filename) + 1;
+    header.group_count = group_count;
+    header.ref_count = ref_count;
+    header.tape_size = tape ? vgm_tape_file_size(tape) : 0;
+    for (int i = 0; i < VGM_CACHE_TAG_COUNT; i++) {
+        const char *tag = *vgm_cache_tag_field((vgm_gd3_tags_t *)tags, i);
+        header.tags_size += (tag ? strlen(tag) : 0) + 1;
+    }
+    for (size_t i = 0; i < group_count; i++) {
+        header.data_size += vgm_data_block_group_byte_size(vgm_data_state_group(data_state, i));
+    }
+
+    vgm_cache_path(path, sizeof(path), filename);
+    unlink(path);
+
+    do {
+        file = fopen(path, "wb");
+        if (!file) {
+            ESP_LOGW(TAG, "Unable to create cache file: %d", errno);
+            ret = ESP_FAIL;
+            break;
+        }
+
+        if (fwrite(&header, sizeof(vgm_cache_header_t), 1, file) != 1
+                || fwrite(filename, 1, header.path_size, file) != header.path_size) {
+            ret = ESP_FAIL;
+            break;
+        }
+
+        for (int i = 0; i < VGM_CACHE_TAG_COUNT; i++) {
+            const char *tag = *vgm_cache_tag_field((vgm_gd3_tags_t *)tags, i);
+            if (fwrite(tag ? tag : "", 1, (tag ? strlen(tag) : 0) + 1, file) == 0) {
+                ret = ESP_FAIL;
+                break;
+            }
+        }
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        uint32_t data_offset = 0;
+        for (size_t i = 0; i < group_count && ret == ESP_OK; i++) {
+            const vgm_data_block_group_t *block_group = vgm_data_state_group(data_state, i);
+            nbin_group_t group = {
+                .key_sample_time = vgm_data_block_group_key_sample_time(block_group),
+                .key_block = vgm_data_block_group_key_block(block_group),
+                .byte_size = vgm_data_block_group_byte_size(block_group),
+                .data_offset = data_offset
+            };
+            if (fwrite(&group, sizeof(nbin_group_t), 1, file) != 1) {
+                ret = ESP_FAIL;
+            }
+            data_offset += group.byte_size;
+        }
+
+        for (size_t i = 0; i < ref_count && ret == ESP_OK; i++) {
+            nbin_ref_t ref = {
+                .sample_time = vgm_data_state_ref_sample_time(data_state, i),
+                .group = vgm_data_block_group_index(vgm_data_state_ref_block_group(data_state, i)),
+                .byte_size = vgm_data_state_ref_byte_size(data_state, i)
+            };
+            if (fwrite(&ref, sizeof(nbin_ref_t), 1, file) != 1) {
+                ret = ESP_FAIL;
+            }
+        }
+
+        // Sample data is written decoded, in the same form it is read
+        for (size_t i = 0; i < group_count && ret == ESP_OK; i++) {
+            vgm_data_block_group_reader_t reader;
+            vgm_data_block_group_reader_init(&reader, vgm_data_state_group(data_state, i));
+            uint8_t buf[256];
+            size_t len;
+            while ((len = vgm_data_block_group_read(&reader, buf, sizeof(buf))) > 0) {
+                if (fwrite(buf, 1, len, file) != len) {
+                    ret = ESP_FAIL;
+                    break;
+                }
+            }
+        }
+
+        if (tape && ret == ESP_OK) {
+            ret = vgm_tape_write(tape, file);
+        }
+    } while (0);
+
+    if (file) {
+        if (fclose(file) != 0) {
+            ret = ESP_FAIL;
+        }
+    }
+
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to write cache file: %s", path);
+        unlink(path);
+        return ret;
+    }
+
+    ESP_LOGI(TAG, "Saved prepared state: %s (%d groups, %d refs, %d byte tape)",
+            path, group_count, ref_count, header.tape_size);
+    return ESP_OK;
+}
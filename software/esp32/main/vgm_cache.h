@@ -0,0 +1,60 @@
+/*
+ * Prepared Track Cache
+ *
+ * Keeps the results of the VGM prepare scan on the SD card, keyed by
+ * the path, size and modification time of the source file, so later
+ * plays of the same file can skip the scan.
+ */
+
+#ifndef VGM_CACHE_H
+#define VGM_CACHE_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+#include "vgm.h"
+#include "vgm_data.h"
+#include "vgm_tape.h"
+
+/* Directory the cache files are kept in */
+#define VGM_CACHE_DIR "/sdcard/.nestronic"
+
+/* Loop sample time for files whose loop point was not found */
+#define VGM_CACHE_LOOP_TIME_NONE UINT32_MAX
+
+typedef struct {
+    uint32_t total_samples;
+    uint32_t loop_samples;
+    uint32_t loop_offset;
+    uint32_t loop_sample_time; /**< Song time at the loop offset, as scanned */
+} vgm_cache_info_t;
+
+/**
+ * Load the prepared state for a file.
+ *
+ * @param filename Path of the source VGM file
+ * @param data_state Set to the sample groups and references, or NULL
+ *                   if the file has none
+ * @param tags Filled in with the cached GD3 tags
+ * @param info Filled in with the cached duration and loop information
+ * @param tape Set to the cached event tape, or NULL if there is none or
+ *             it is larger than tape_limit
+ * @param tape_limit Maximum size of the tape data, in bytes
+ * @return ESP_ERR_NOT_FOUND if there is no cache entry, or it is stale
+ */
+esp_err_t vgm_cache_load(const char *filename, vgm_data_state_t **data_state,
+        vgm_gd3_tags_t *tags, vgm_cache_info_t *info,
+        vgm_tape_t **tape, size_t tape_limit);
+
+/**
+ * Save the prepared state for a file, replacing any existing entry.
+ *
+ * @param data_state Sample groups and references, or NULL if none
+ * @param tape Finished event tape, with DMC addresses as in the source
+ *             file, or NULL if none
+ */
+esp_err_t vgm_cache_save(const char *filename, const vgm_data_state_t *data_state,
+        const vgm_gd3_tags_t *tags, const vgm_cache_info_t *info,
+        const vgm_tape_t *tape);
+
+#endif /* VGM_CACHE_H */
@@ -6,53 +6,103 @@
 #include <sys/param.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "nes.h"
-#include "uthash.h"
-#include "utlist.h"
 
 static const char *TAG = "vgm_data";
 
-struct vgm_data_t {
-    uint8_t raw_data[32768];
-    uint32_t block_sample_time[512];
-};
+/* Number of bytes in one APU block, which is also the staging page size */
+#define VGM_DATA_PAGE_SIZE 64
 
+/* Number of APU blocks covering $8000-$FFFF */
+#define VGM_DATA_PAGE_COUNT 512
+
+/*
+ * One APU block of staged data. Pages are only allocated once data is
+ * written to them, and read back as zeros until then.
+ */
 typedef struct {
     uint32_t sample_time;
-    uint16_t block;
-} vgm_data_block_group_key_t;
+    uint8_t data[VGM_DATA_PAGE_SIZE];
+} vgm_data_page_t;
+
+struct vgm_data_t {
+    vgm_data_page_t *pages[VGM_DATA_PAGE_COUNT]; /* Indexed by APU block */
+    size_t page_count;
+};
+
+/* Size of each arena chunk that block groups and their data come from */
+#define VGM_DATA_ARENA_CHUNK_SIZE 4096
+
+/* Initial number of references the reference arrays are sized for */
+#define VGM_DATA_REFS_INITIAL 256
+
+typedef struct vgm_data_arena_chunk_t {
+    struct vgm_data_arena_chunk_t *next;
+    size_t size;
+    size_t used;
+    uint8_t data[] __attribute__((aligned(8)));
+} vgm_data_arena_chunk_t;
+
+/*
+ * Run length coding of the stored sample data. A control byte below
+ * VGM_DATA_RLE_RUN is followed by that many plus one literal bytes, and
+ * one at or above it by a single byte repeated the low bits plus
+ * VGM_DATA_RLE_MIN_RUN times.
+ */
+#define VGM_DATA_RLE_RUN 0x80
+#define VGM_DATA_RLE_MIN_RUN 3
+#define VGM_DATA_RLE_MAX_RUN (0x7F + VGM_DATA_RLE_MIN_RUN)
+#define VGM_DATA_RLE_MAX_LITERAL 0x80
 
 struct vgm_data_block_group_t {
-    vgm_data_block_group_key_t key;
-    vgm_data_block_ref_node_t *block_refs_head;
+    uint32_t key_sample_time;
+    uint16_t key_block;
     uint16_t block_size;
     uint16_t byte_size;
-    uint8_t *raw_data;
+    uint16_t stored_size;
     uint8_t loaded_block;
-    UT_hash_handle hh;
+    bool compressed;
+    uint32_t index;
+    uint32_t ref_count;
+    uint8_t *raw_data;
 };
 
-typedef struct vgm_data_block_ref_t {
-    uint32_t sample_time;
-    vgm_data_block_group_t *block_group;
-    uint16_t byte_size;
-    bool detached;
-} vgm_data_block_ref_t;
+/*
+ * Block groups and their sample data are allocated from an arena, so
+ * they are never freed one at a time. References are kept in playback
+ * order as parallel arrays, indexed the same way as the placement plan.
+ */
+struct vgm_data_state_t {
+    vgm_data_arena_chunk_t *arena;
 
-typedef struct vgm_data_block_ref_node_t {
-    vgm_data_block_ref_t *block_ref;
-    struct vgm_data_block_ref_node_t *next, *prev;
-} vgm_data_block_ref_node_t;
+    vgm_data_block_group_t **groups;
+    size_t group_count;
+    size_t group_capacity;
 
-struct vgm_data_state_t {
-    struct vgm_data_block_group_t *block_groups;
-    vgm_data_block_ref_node_t *block_refs_head;
+    /* Open addressing table of group indexes plus one, by group key */
+    uint32_t *group_table;
+    size_t group_table_size;
+
+    uint32_t *ref_sample_time;
+    uint32_t *ref_group;
+    uint16_t *ref_byte_size;
+    size_t ref_count;
+    size_t ref_capacity;
 };
 
+static vgm_data_page_t *vgm_data_get_page(const vgm_data_t *vgm_data, uint32_t addr);
 static esp_err_t vgm_data_load_impl(vgm_data_t *vgm_data, uint32_t sample_time,
         uint16_t addr, const uint8_t *data, size_t len);
+static void *vgm_data_arena_alloc(vgm_data_state_t *vgm_data_state, size_t size);
+static uint32_t vgm_data_group_key_hash(uint32_t sample_time, uint16_t block);
+static vgm_data_block_group_t *vgm_data_state_find_group(const vgm_data_state_t *vgm_data_state,
+        uint32_t sample_time, uint16_t block);
+static esp_err_t vgm_data_state_add_group_impl(vgm_data_state_t *vgm_data_state,
+        uint32_t sample_time, uint16_t block, vgm_data_block_group_t **block_group);
+static size_t vgm_data_rle_encode(const uint8_t *data, size_t len, uint8_t *out);
 
 vgm_data_t* vgm_data_create()
 {
@@ -119,13 +169,37 @@ esp_err_t vgm_data_load_impl(vgm_data_t *vgm_data, uint32_t sample_time,
         return ESP_ERR_INVALID_ARG;
     }
 
-    // Copy the data into our internal buffer
-    memcpy(vgm_data->raw_data + (addr - 0x8000), data, len);
-
     // Convert memory addresses into APU blocks
     uint16_t apu_block = nes_addr_to_apu_block(addr);
     uint16_t block_count = nes_len_to_apu_blocks(len);
 
+    // Copy the data into its pages, allocating them as needed
+    uint32_t page_addr = addr;
+    const uint8_t *page_data = data;
+    size_t remaining = len;
+    while (remaining > 0) {
+        uint16_t page_block = nes_addr_to_apu_block(page_addr & ~(VGM_DATA_PAGE_SIZE - 1));
+        vgm_data_page_t *page = vgm_data->pages[page_block];
+        if (!page) {
+            page = malloc(sizeof(vgm_data_page_t));
+            if (!page) {
+                return ESP_ERR_NO_MEM;
+            }
+            bzero(page, sizeof(vgm_data_page_t));
+            vgm_data->pages[page_block] = page;
+            vgm_data->page_count++;
+        }
+
+        size_t offset = page_addr & (VGM_DATA_PAGE_SIZE - 1);
+        size_t copy_len = MIN(remaining, VGM_DATA_PAGE_SIZE - offset);
+        memcpy(page->data + offset, page_data, copy_len);
+        page->sample_time = sample_time;
+
+        page_addr += copy_len;
+        page_data += copy_len;
+        remaining -= copy_len;
+    }
+
     // Figure out the APU block ranges that correspond to the loaded data.
     // Note: This can be two disjoint block ranges, if there is data
     // both before and after address 0xC000.
@@ -142,23 +216,13 @@ esp_err_t vgm_data_load_impl(vgm_data_t *vgm_data, uint32_t sample_time,
          has_block2 = true;
     }
 
-    // Populate the sample time array for the loaded blocks
-    for (uint16_t i = start_block1; i <= end_block1; i++) {
-        vgm_data->block_sample_time[i] = sample_time;
-    }
-    if (has_block2) {
-        for (uint16_t i = start_block2; i <= end_block2; i++) {
-            vgm_data->block_sample_time[i] = sample_time;
-        }
-    }
-
     // Log the results of what we just did
     if (has_block2) {
         ESP_LOGI(TAG, "[%d] Data block: $%04X + $%04X (%d-%d)(%d-%d) %d", sample_time,
-            addr, len, start_block2, end_block2, start_block1, end_block1, block_count);
+            addr, (unsigned)len, start_block2, end_block2, start_block1, end_block1, block_count);
     } else {
         ESP_LOGI(TAG, "[%d] Data block: $%04X + $%04X (%d-%d) %d", sample_time,
-            addr, len, start_block1, end_block1, block_count);
+            addr, (unsigned)len, start_block1, end_block1, block_count);
     }
 
     return ESP_OK;
@@ -177,7 +241,9 @@ esp_err_t vgm_data_get_sample_time(const vgm_data_t *vgm_data, uint16_t block, s
 
     uint32_t val = 0;
     for (uint16_t i = block; i < block + block_count; i++) {
-        val = MAX(val, vgm_data->block_sample_time[i]);
+        if (vgm_data->pages[i]) {
+            val = MAX(val, vgm_data->pages[i]->sample_time);
+        }
     }
 
     *sample_time = val;
@@ -191,22 +257,51 @@ esp_err_t vgm_data_get_data(const vgm_data_t *vgm_data, uint16_t block, size_t l
         return ESP_ERR_INVALID_ARG;
     }
 
-    // Copy the initial segment
-    uint16_t addr = 0xC000 + (block * 64);
-    size_t copy_len = MIN(len, (0xFFFF - addr) + 1);
-    memcpy(data, vgm_data->raw_data + (addr - 0x8000), copy_len);
+    // Copy page by page, wrapping around from $FFFF to $8000
+    uint32_t addr = 0xC000 + (block * 64);
+    while (len > 0) {
+        if (addr > 0xFFFF) {
+            addr = 0x8000;
+        }
+
+        size_t offset = addr & (VGM_DATA_PAGE_SIZE - 1);
+        size_t copy_len = MIN(len, VGM_DATA_PAGE_SIZE - offset);
+        const vgm_data_page_t *page = vgm_data_get_page(vgm_data, addr);
+        if (page) {
+            memcpy(data, page->data + offset, copy_len);
+        } else {
+            bzero(data, copy_len);
+        }
 
-    // Handle wrap-around
-    if (copy_len < len) {
-        memcpy(data + copy_len, vgm_data->raw_data, len - copy_len);
+        addr += copy_len;
+        data += copy_len;
+        len -= copy_len;
     }
 
     return ESP_OK;
 }
 
+size_t vgm_data_get_allocated_size(const vgm_data_t *vgm_data)
+{
+    if (!vgm_data) {
+        return 0;
+    }
+    return sizeof(vgm_data_t) + (vgm_data->page_count * sizeof(vgm_data_page_t));
+}
+
+vgm_data_page_t *vgm_data_get_page(const vgm_data_t *vgm_data, uint32_t addr)
+{
+    return vgm_data->pages[nes_addr_to_apu_block(addr & ~(VGM_DATA_PAGE_SIZE - 1))];
+}
+
 void vgm_data_free(vgm_data_t *vgm_data)
 {
-    free(vgm_data);
+    if (vgm_data) {
+        for (int i = 0; i < VGM_DATA_PAGE_COUNT; i++) {
+            free(vgm_data->pages[i]);
+        }
+        free(vgm_data);
+    }
 }
 
 vgm_data_state_t* vgm_data_state_create()
@@ -221,6 +316,53 @@ vgm_data_state_t* vgm_data_state_create()
     return vgm_data_state;
 }
 
+void *vgm_data_arena_alloc(vgm_data_state_t *vgm_data_state, size_t size)
+{
+    // Keep allocations aligned for any member type
+    size = (size + 7) & ~7;
+
+    vgm_data_arena_chunk_t *chunk = vgm_data_state->arena;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = MAX(size, VGM_DATA_ARENA_CHUNK_SIZE - sizeof(vgm_data_arena_chunk_t));
+        chunk = malloc(sizeof(vgm_data_arena_chunk_t) + chunk_size);
+        if (!chunk) {
+            return NULL;
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->next = vgm_data_state->arena;
+        vgm_data_state->arena = chunk;
+    }
+
+    void *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+uint32_t vgm_data_group_key_hash(uint32_t sample_time, uint16_t block)
+{
+    return (sample_time * 2654435761U) ^ (block * 2246822519U);
+}
+
+vgm_data_block_group_t *vgm_data_state_find_group(const vgm_data_state_t *vgm_data_state,
+        uint32_t sample_time, uint16_t block)
+{
+    if (vgm_data_state->group_table_size == 0) {
+        return NULL;
+    }
+
+    size_t mask = vgm_data_state->group_table_size - 1;
+    size_t i = vgm_data_group_key_hash(sample_time, block) & mask;
+    while (vgm_data_state->group_table[i] != 0) {
+        vgm_data_block_group_t *group = vgm_data_state->groups[vgm_data_state->group_table[i] - 1];
+        if (group->key_sample_time == sample_time && group->key_block == block) {
+            return group;
+        }
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
 esp_err_t vgm_data_state_add_ref(vgm_data_state_t *vgm_data_state, const vgm_data_t *vgm_data,
         uint32_t sample_time, uint16_t block, size_t len)
 {
@@ -234,201 +376,496 @@ esp_err_t vgm_data_state_add_ref(vgm_data_state_t *vgm_data_state, const vgm_dat
 
     // Get the saved block group, keyed on a combination of the block
     // identifier and the most recent sample time
-    struct vgm_data_block_group_t *group;
-    vgm_data_block_group_key_t group_key = {
-            .sample_time = data_sample_time,
-            .block = block
-    };
-    HASH_FIND(hh, vgm_data_state->block_groups, &group_key, sizeof(vgm_data_block_group_key_t), group);
+    vgm_data_block_group_t *group = vgm_data_state_find_group(vgm_data_state, data_sample_time, block);
 
     // Create and insert a new block group if a saved one did not exist
     if (!group) {
-        group = malloc(sizeof(struct vgm_data_block_group_t));
-        if (!group) {
-            return ESP_ERR_NO_MEM;
+        ret = vgm_data_state_add_group_impl(vgm_data_state, data_sample_time, block, &group);
+        if (ret != ESP_OK) {
+            return ret;
         }
-        bzero(group, sizeof(struct vgm_data_block_group_t));
-        group->key.sample_time = data_sample_time;
-        group->key.block = block;
-        HASH_ADD(hh, vgm_data_state->block_groups, key, sizeof(vgm_data_block_group_key_t), group);
     }
 
     // Update the group data, if its unpopulated or shorter than the
-    // referenced data
+    // referenced data. The shorter copy stays in the arena until the
+    // state is freed.
     if (group->byte_size < len) {
-        uint8_t *raw_data = realloc(group->raw_data, len);
+        uint8_t *raw_data = vgm_data_arena_alloc(vgm_data_state, len);
         if (!raw_data) {
             return ESP_ERR_NO_MEM;
         }
         ret = vgm_data_get_data(vgm_data, block, len, raw_data);
         if (ret != ESP_OK) {
-            free(raw_data);
             return ret;
         }
         group->raw_data = raw_data;
         group->byte_size = len;
+        group->stored_size = len;
         group->block_size = nes_len_to_apu_blocks(len);
     }
 
-    // Create a block reference
-    vgm_data_block_ref_t *block_ref = malloc(sizeof(vgm_data_block_ref_t));
-    if (!block_ref) {
-        return ESP_ERR_NO_MEM;
+    return vgm_data_state_add_group_ref(vgm_data_state, group, sample_time, len);
+}
+
+esp_err_t vgm_data_state_add_group(vgm_data_state_t *vgm_data_state,
+        uint32_t sample_time, uint16_t block, const uint8_t *data, size_t len,
+        vgm_data_block_group_t **block_group)
+{
+    esp_err_t ret;
+    vgm_data_block_group_t *group;
+
+    if (!vgm_data_state || !data || len == 0 || !block_group) {
+        return ESP_ERR_INVALID_ARG;
     }
-    bzero(block_ref, sizeof(vgm_data_block_ref_t));
-    block_ref->sample_time = sample_time;
-    block_ref->block_group = group;
-    block_ref->byte_size = len;
 
-    // Insert the block reference into the main reference list
-    vgm_data_block_ref_node_t *ref_node = malloc(sizeof(vgm_data_block_ref_node_t));
-    if (!ref_node) {
-        free (block_ref);
-        return ESP_ERR_NO_MEM;
+    if (vgm_data_state_find_group(vgm_data_state, sample_time, block)) {
+        return ESP_ERR_INVALID_STATE;
     }
-    bzero(ref_node, sizeof(vgm_data_block_ref_node_t));
-    ref_node->block_ref = block_ref;
-    DL_APPEND(vgm_data_state->block_refs_head, ref_node);
 
-    // Insert the block reference into the group's reference list
-    vgm_data_block_ref_node_t *group_ref_node = malloc(sizeof(vgm_data_block_ref_node_t));
-    if (!group_ref_node) {
+    uint8_t *raw_data = vgm_data_arena_alloc(vgm_data_state, len);
+    if (!raw_data) {
         return ESP_ERR_NO_MEM;
     }
-    bzero(group_ref_node, sizeof(vgm_data_block_ref_node_t));
-    group_ref_node->block_ref = block_ref;
-    DL_APPEND(group->block_refs_head, group_ref_node);
+    memcpy(raw_data, data, len);
+
+    ret = vgm_data_state_add_group_impl(vgm_data_state, sample_time, block, &group);
+    if (ret != ESP_OK) {
+        return ret;
+    }
+
+    group->raw_data = raw_data;
+    group->byte_size = len;
+    group->stored_size = len;
+    group->block_size = nes_len_to_apu_blocks(len);
 
+    *block_group = group;
     return ESP_OK;
 }
 
-bool vgm_data_state_has_refs(const vgm_data_state_t *vgm_data_state)
+esp_err_t vgm_data_state_add_group_impl(vgm_data_state_t *vgm_data_state,
+        uint32_t sample_time, uint16_t block, vgm_data_block_group_t **block_group)
 {
-    return vgm_data_state->block_refs_head ? true : false;
-}
+    // Grow the group list
+    if (vgm_data_state->group_count == vgm_data_state->group_capacity) {
+        size_t capacity = MAX(vgm_data_state->group_capacity * 2, 64);
+        vgm_data_block_group_t **groups = realloc(vgm_data_state->groups,
+                sizeof(vgm_data_block_group_t *) * capacity);
+        if (!groups) {
+            return ESP_ERR_NO_MEM;
+        }
+        vgm_data_state->groups = groups;
+        vgm_data_state->group_capacity = capacity;
+    }
 
-vgm_data_block_ref_node_t* vgm_data_state_ref_list(const vgm_data_state_t *vgm_data_state)
-{
-    return vgm_data_state->block_refs_head;
+    // Grow the lookup table, keeping it at most half full
+    if ((vgm_data_state->group_count + 1) * 2 > vgm_data_state->group_table_size) {
+        size_t table_size = MAX(vgm_data_state->group_table_size * 2, 128);
+        uint32_t *table = malloc(sizeof(uint32_t) * table_size);
+        if (!table) {
+            return ESP_ERR_NO_MEM;
+        }
+        bzero(table, sizeof(uint32_t) * table_size);
+        for (size_t i = 0; i < vgm_data_state->group_table_size; i++) {
+            uint32_t entry = vgm_data_state->group_table[i];
+            if (entry != 0) {
+                const vgm_data_block_group_t *group = vgm_data_state->groups[entry - 1];
+                size_t j = vgm_data_group_key_hash(group->key_sample_time, group->key_block) & (table_size - 1);
+                while (table[j] != 0) {
+                    j = (j + 1) & (table_size - 1);
+                }
+                table[j] = entry;
+            }
+        }
+        free(vgm_data_state->group_table);
+        vgm_data_state->group_table = table;
+        vgm_data_state->group_table_size = table_size;
+    }
+
+    vgm_data_block_group_t *group = vgm_data_arena_alloc(vgm_data_state, sizeof(vgm_data_block_group_t));
+    if (!group) {
+        return ESP_ERR_NO_MEM;
+    }
+    bzero(group, sizeof(vgm_data_block_group_t));
+    group->key_sample_time = sample_time;
+    group->key_block = block;
+    group->index = vgm_data_state->group_count;
+
+    size_t mask = vgm_data_state->group_table_size - 1;
+    size_t i = vgm_data_group_key_hash(sample_time, block) & mask;
+    while (vgm_data_state->group_table[i] != 0) {
+        i = (i + 1) & mask;
+    }
+    vgm_data_state->group_table[i] = group->index + 1;
+    vgm_data_state->groups[vgm_data_state->group_count++] = group;
+
+    *block_group = group;
+    return ESP_OK;
 }
 
-vgm_data_block_ref_t* vgm_data_state_next_ref(const vgm_data_state_t *vgm_data_state)
+esp_err_t vgm_data_state_add_group_ref(vgm_data_state_t *vgm_data_state,
+        vgm_data_block_group_t *block_group, uint32_t sample_time, size_t len)
 {
-    return vgm_data_state->block_refs_head->block_ref;
+    if (!vgm_data_state || !block_group || len == 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // References have to arrive in playback order
+    if (vgm_data_state->ref_count > 0
+            && sample_time < vgm_data_state->ref_sample_time[vgm_data_state->ref_count - 1]) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Grow the reference arrays, only recording the new capacity once
+    // all of them have been resized.
+    if (vgm_data_state->ref_count == vgm_data_state->ref_capacity) {
+        size_t capacity = MAX(vgm_data_state->ref_capacity * 2, VGM_DATA_REFS_INITIAL);
+        uint32_t *ref_sample_time = realloc(vgm_data_state->ref_sample_time, sizeof(uint32_t) * capacity);
+        if (!ref_sample_time) {
+            return ESP_ERR_NO_MEM;
+        }
+        vgm_data_state->ref_sample_time = ref_sample_time;
+
+        uint32_t *ref_group = realloc(vgm_data_state->ref_group, sizeof(uint32_t) * capacity);
+        if (!ref_group) {
+            return ESP_ERR_NO_MEM;
+        }
+        vgm_data_state->ref_group = ref_group;
+
+        uint16_t *ref_byte_size = realloc(vgm_data_state->ref_byte_size, sizeof(uint16_t) * capacity);
+        if (!ref_byte_size) {
+            return ESP_ERR_NO_MEM;
+        }
+        vgm_data_state->ref_byte_size = ref_byte_size;
+
+        vgm_data_state->ref_capacity = capacity;
+    }
+
+    size_t i = vgm_data_state->ref_count++;
+    vgm_data_state->ref_sample_time[i] = sample_time;
+    vgm_data_state->ref_group[i] = block_group->index;
+    vgm_data_state->ref_byte_size[i] = len;
+    block_group->ref_count++;
+
+    return ESP_OK;
 }
 
-vgm_data_block_ref_t* vgm_data_state_take_next_ref(vgm_data_state_t *vgm_data_state)
+esp_err_t vgm_data_state_merge_duplicates(vgm_data_state_t *vgm_data_state,
+        size_t *merged, size_t *bytes_saved)
 {
-    vgm_data_block_ref_node_t *node = vgm_data_state->block_refs_head;
-    if (!node) {
-        return NULL;
+    size_t merged_count = 0;
+    size_t merged_bytes = 0;
+
+    if (!vgm_data_state) {
+        return ESP_ERR_INVALID_ARG;
     }
 
-    vgm_data_block_ref_t *block_ref = node->block_ref;
+    size_t group_count = vgm_data_state->group_count;
+    size_t table_size = 128;
+    while (table_size < group_count * 2) {
+        table_size *= 2;
+    }
 
-    // Remove the ref node from the main ref list
-    DL_DELETE(vgm_data_state->block_refs_head, node);
-    free(node);
+    uint32_t *content_table = malloc(sizeof(uint32_t) * table_size);
+    uint32_t *remap = malloc(sizeof(uint32_t) * MAX(group_count, 1));
+    if (!content_table || !remap) {
+        free(content_table);
+        free(remap);
+        return ESP_ERR_NO_MEM;
+    }
+    bzero(content_table, sizeof(uint32_t) * table_size);
+
+    // Key every group on its sample data. The first group seen with
+    // some data is kept, and later ones are merged into it. Kept groups
+    // are compacted to the front of the list as we go.
+    size_t kept = 0;
+    for (size_t i = 0; i < group_count; i++) {
+        vgm_data_block_group_t *group = vgm_data_state->groups[i];
+
+        uint32_t hash = 2166136261U;
+        for (uint16_t n = 0; n < group->byte_size; n++) {
+            hash = (hash ^ group->raw_data[n]) * 16777619U;
+        }
+
+        size_t j = hash & (table_size - 1);
+        vgm_data_block_group_t *target = NULL;
+        while (content_table[j] != 0) {
+            vgm_data_block_group_t *entry = vgm_data_state->groups[content_table[j] - 1];
+            if (entry->byte_size == group->byte_size
+                    && memcmp(entry->raw_data, group->raw_data, group->byte_size) == 0) {
+                target = entry;
+                break;
+            }
+            j = (j + 1) & (table_size - 1);
+        }
+
+        if (target && group->byte_size > 0) {
+            remap[i] = target->index;
+            target->ref_count += group->ref_count;
+            merged_count++;
+            merged_bytes += group->byte_size;
+            continue;
+        }
 
-    // Remove the ref node from the block group's ref list,
-    // assuming its the first element
-    vgm_data_block_group_t *block_group = block_ref->block_group;
-    node = block_group->block_refs_head;
-    if (!node || block_group->block_refs_head->block_ref != block_ref) {
-        ESP_LOGE(TAG, "Block group constraint failed!");
-        return block_ref;
+        group->index = kept;
+        vgm_data_state->groups[kept++] = group;
+        remap[i] = group->index;
+        if (!target) {
+            content_table[j] = group->index + 1;
+        }
+    }
+    vgm_data_state->group_count = kept;
+
+    if (merged_count > 0) {
+        for (size_t i = 0; i < vgm_data_state->ref_count; i++) {
+            vgm_data_state->ref_group[i] = remap[vgm_data_state->ref_group[i]];
+        }
+
+        // Keys of merged groups now find the group they were merged into
+        for (size_t i = 0; i < vgm_data_state->group_table_size; i++) {
+            if (vgm_data_state->group_table[i] != 0) {
+                vgm_data_state->group_table[i] = remap[vgm_data_state->group_table[i] - 1] + 1;
+            }
+        }
     }
-    node = block_group->block_refs_head;
-    DL_DELETE(block_group->block_refs_head, node);
-    free(node);
 
-    block_ref->detached = true;
+    free(content_table);
+    free(remap);
 
-    return block_ref;
+    if (merged) {
+        *merged = merged_count;
+    }
+    if (bytes_saved) {
+        *bytes_saved = merged_bytes;
+    }
+
+    return ESP_OK;
 }
 
-void vgm_data_state_log_block_groups(const vgm_data_state_t *vgm_data_state)
+size_t vgm_data_rle_encode(const uint8_t *data, size_t len, uint8_t *out)
 {
-    struct vgm_data_block_group_t *group;
+    size_t i = 0;
+    size_t out_len = 0;
 
-    for(group = vgm_data_state->block_groups; group != NULL; group = group->hh.next) {
-        uint16_t block_address = (((uint16_t)group->key.block) << 6) | 0xC000;
+    while (i < len) {
+        size_t run = 1;
+        while (i + run < len && run < VGM_DATA_RLE_MAX_RUN && data[i + run] == data[i]) {
+            run++;
+        }
 
-        int ref_count = 0;
-        vgm_data_block_ref_node_t *current_ref;
-        DL_COUNT(group->block_refs_head, current_ref, ref_count);
+        if (run >= VGM_DATA_RLE_MIN_RUN) {
+            out[out_len++] = VGM_DATA_RLE_RUN | (run - VGM_DATA_RLE_MIN_RUN);
+            out[out_len++] = data[i];
+            i += run;
+            continue;
+        }
 
-        ESP_LOGI(TAG, "Block Group: [t=%u, $%04X~%03d] refs=%d, blocks=%d, bytes=%d",
-                group->key.sample_time, block_address, group->key.block,
-                ref_count, group->block_size, group->byte_size);
+        // Take literals up to the start of the next run worth coding
+        size_t start = i;
+        while (i < len && i - start < VGM_DATA_RLE_MAX_LITERAL) {
+            if (i + 2 < len && data[i] == data[i + 1] && data[i] == data[i + 2]) {
+                break;
+            }
+            i++;
+        }
+        out[out_len++] = (i - start) - 1;
+        memcpy(out + out_len, data + start, i - start);
+        out_len += i - start;
     }
+
+    return out_len;
 }
 
-void vgm_data_state_free(vgm_data_state_t *vgm_data_state)
+esp_err_t vgm_data_state_compress(vgm_data_state_t *vgm_data_state,
+        size_t *raw_bytes, size_t *stored_bytes)
 {
-    struct vgm_data_block_group_t *current_group, *tmp_group;
-    vgm_data_block_ref_node_t *current_ref, *tmp_ref;
+    esp_err_t ret = ESP_OK;
+    size_t raw_total = 0;
+    size_t stored_total = 0;
 
     if (!vgm_data_state) {
-        return;
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t group_count = vgm_data_state->group_count;
+    size_t max_size = 0;
+    for (size_t i = 0; i < group_count; i++) {
+        max_size = MAX(max_size, vgm_data_state->groups[i]->byte_size);
     }
 
-    // Delete the hash table of block groups
-    HASH_ITER(hh, vgm_data_state->block_groups, current_group, tmp_group) {
-        HASH_DEL(vgm_data_state->block_groups, current_group);
+    // Everything still in use is copied into a new arena, which also
+    // leaves behind merged groups and superseded copies of their data.
+    vgm_data_arena_chunk_t *old_arena = vgm_data_state->arena;
+    vgm_data_state->arena = NULL;
+
+    vgm_data_block_group_t **moved = malloc(sizeof(vgm_data_block_group_t *) * MAX(group_count, 1));
+    uint8_t *encoded = malloc(max_size + (max_size / VGM_DATA_RLE_MAX_LITERAL) + 1);
+
+    do {
+        if (!moved || !encoded) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
 
-        // Free the block refs list, only deleting the nodes.
-        // The actual ref data will be deleted as part of the
-        // main ref list.
-        DL_FOREACH_SAFE(current_group->block_refs_head, current_ref, tmp_ref) {
-            DL_DELETE(current_group->block_refs_head, current_ref);
-            free(current_ref);
+        for (size_t i = 0; i < group_count && ret == ESP_OK; i++) {
+            const vgm_data_block_group_t *group = vgm_data_state->groups[i];
+            const uint8_t *stored = group->raw_data;
+            size_t stored_size = group->stored_size;
+            bool compressed = group->compressed;
+
+            // Only keep the coded data if it is actually smaller
+            if (!compressed) {
+                size_t encoded_size = vgm_data_rle_encode(group->raw_data, group->byte_size, encoded);
+                if (encoded_size < group->byte_size) {
+                    stored = encoded;
+                    stored_size = encoded_size;
+                    compressed = true;
+                }
+            }
+
+            vgm_data_block_group_t *copy = vgm_data_arena_alloc(vgm_data_state, sizeof(vgm_data_block_group_t));
+            uint8_t *raw_data = vgm_data_arena_alloc(vgm_data_state, stored_size);
+            if (!copy || !raw_data) {
+                ret = ESP_ERR_NO_MEM;
+                break;
+            }
+            memcpy(raw_data, stored, stored_size);
+            *copy = *group;
+            copy->raw_data = raw_data;
+            copy->stored_size = stored_size;
+            copy->compressed = compressed;
+            moved[i] = copy;
+
+            raw_total += group->byte_size;
+            stored_total += stored_size;
         }
+    } while (0);
 
-        free(current_group->raw_data);
-        free(current_group);
+    free(encoded);
+
+    // Free whichever arena is no longer needed
+    vgm_data_arena_chunk_t *chunk;
+    if (ret == ESP_OK) {
+        memcpy(vgm_data_state->groups, moved, sizeof(vgm_data_block_group_t *) * group_count);
+        chunk = old_arena;
+    } else {
+        chunk = vgm_data_state->arena;
+        vgm_data_state->arena = old_arena;
+    }
+    while (chunk) {
+        vgm_data_arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
+    free(moved);
 
-    // Free the main block refs list, along with ref data
-    DL_FOREACH_SAFE(vgm_data_state->block_refs_head, current_ref, tmp_ref) {
-        DL_DELETE(vgm_data_state->block_refs_head, current_ref);
-        free(current_ref->block_ref);
-        free(current_ref);
+    if (ret == ESP_OK) {
+        if (raw_bytes) {
+            *raw_bytes = raw_total;
+        }
+        if (stored_bytes) {
+            *stored_bytes = stored_total;
+        }
     }
+    return ret;
+}
 
-    free(vgm_data_state);
+bool vgm_data_state_has_refs(const vgm_data_state_t *vgm_data_state)
+{
+    return vgm_data_state->ref_count > 0;
 }
 
-vgm_data_block_ref_t* vgm_data_block_ref_list_element(const vgm_data_block_ref_node_t *list)
+size_t vgm_data_state_ref_count(const vgm_data_state_t *vgm_data_state)
 {
-    return list->block_ref;
+    return vgm_data_state->ref_count;
 }
 
-vgm_data_block_ref_node_t* vgm_data_block_ref_list_next(const vgm_data_block_ref_node_t *list)
+uint32_t vgm_data_state_ref_sample_time(const vgm_data_state_t *vgm_data_state, size_t index)
 {
-    return list->next;
+    return vgm_data_state->ref_sample_time[index];
 }
 
-uint32_t vgm_data_block_ref_sample_time(const vgm_data_block_ref_t *block_ref)
+size_t vgm_data_state_find_ref(const vgm_data_state_t *vgm_data_state, uint32_t sample_time)
 {
-    return block_ref->sample_time;
+    size_t lo = 0;
+    size_t hi = vgm_data_state->ref_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (vgm_data_state->ref_sample_time[mid] < sample_time) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
 }
 
-vgm_data_block_group_t* vgm_data_block_ref_block_group(const vgm_data_block_ref_t *block_ref)
+vgm_data_block_group_t* vgm_data_state_ref_block_group(const vgm_data_state_t *vgm_data_state, size_t index)
 {
-    return block_ref->block_group;
+    return vgm_data_state->groups[vgm_data_state->ref_group[index]];
 }
 
-uint16_t vgm_data_block_ref_byte_size(const vgm_data_block_ref_t *block_ref)
+uint16_t vgm_data_state_ref_byte_size(const vgm_data_state_t *vgm_data_state, size_t index)
 {
-    return block_ref->byte_size;
+    return vgm_data_state->ref_byte_size[index];
 }
 
-void vgm_data_block_ref_free(vgm_data_block_ref_t *block_ref)
+size_t vgm_data_state_group_count(const vgm_data_state_t *vgm_data_state)
+{
+    return vgm_data_state->group_count;
+}
+
+vgm_data_block_group_t* vgm_data_state_group(const vgm_data_state_t *vgm_data_state, size_t index)
+{
+    return vgm_data_state->groups[index];
+}
+
+void vgm_data_state_log_block_groups(const vgm_data_state_t *vgm_data_state)
 {
-    if (block_ref && block_ref->detached) {
-        free(block_ref);
+    for (size_t i = 0; i < vgm_data_state->group_count; i++) {
+        const vgm_data_block_group_t *group = vgm_data_state->groups[i];
+        uint16_t block_address = (((uint16_t)group->key_block) << 6) | 0xC000;
+
+        ESP_LOGI(TAG, "Block Group: [t=%u, $%04X~%03d] refs=%d, blocks=%d, bytes=%d",
+                group->key_sample_time, block_address, group->key_block,
+                group->ref_count, group->block_size, group->byte_size);
+    }
+}
+
+void vgm_data_state_free(vgm_data_state_t *vgm_data_state)
+{
+    if (!vgm_data_state) {
+        return;
     }
+
+    // Release the arena, which holds every group and its data
+    vgm_data_arena_chunk_t *chunk = vgm_data_state->arena;
+    while (chunk) {
+        vgm_data_arena_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+
+    free(vgm_data_state->groups);
+    free(vgm_data_state->group_table);
+    free(vgm_data_state->ref_sample_time);
+    free(vgm_data_state->ref_group);
+    free(vgm_data_state->ref_byte_size);
+    free(vgm_data_state);
+}
+
+uint32_t vgm_data_block_group_index(const vgm_data_block_group_t *block_group)
+{
+    return block_group->index;
+}
+
+uint32_t vgm_data_block_group_key_sample_time(const vgm_data_block_group_t *block_group)
+{
+    return block_group->key_sample_time;
+}
+
+uint16_t vgm_data_block_group_key_block(const vgm_data_block_group_t *block_group)
+{
+    return block_group->key_block;
 }
 
 uint16_t vgm_data_block_group_block_size(const vgm_data_block_group_t *block_group)
@@ -441,9 +878,57 @@ uint16_t vgm_data_block_group_byte_size(const vgm_data_block_group_t *block_grou
     return block_group->byte_size;
 }
 
-uint8_t *vgm_data_block_group_raw_data(const vgm_data_block_group_t *block_group)
+void vgm_data_block_group_reader_init(vgm_data_block_group_reader_t *reader,
+        const vgm_data_block_group_t *block_group)
 {
-    return block_group->raw_data;
+    bzero(reader, sizeof(vgm_data_block_group_reader_t));
+    reader->block_group = block_group;
+}
+
+size_t vgm_data_block_group_read(vgm_data_block_group_reader_t *reader, uint8_t *data, size_t len)
+{
+    const vgm_data_block_group_t *group = reader->block_group;
+    size_t count = 0;
+
+    if (!group->compressed) {
+        count = MIN(len, group->byte_size - reader->offset);
+        memcpy(data, group->raw_data + reader->offset, count);
+        reader->offset += count;
+        return count;
+    }
+
+    while (count < len) {
+        if (reader->run_left == 0) {
+            if (reader->stored_offset >= group->stored_size) {
+                break;
+            }
+            uint8_t control = group->raw_data[reader->stored_offset++];
+            if (control >= VGM_DATA_RLE_RUN) {
+                reader->run_left = (control & ~VGM_DATA_RLE_RUN) + VGM_DATA_RLE_MIN_RUN;
+                reader->run_repeat = true;
+            } else {
+                reader->run_left = control + 1;
+                reader->run_repeat = false;
+            }
+        }
+
+        size_t n = MIN(len - count, reader->run_left);
+        if (reader->run_repeat) {
+            memset(data + count, group->raw_data[reader->stored_offset], n);
+        } else {
+            memcpy(data + count, group->raw_data + reader->stored_offset, n);
+            reader->stored_offset += n;
+        }
+        reader->run_left -= n;
+        count += n;
+
+        if (reader->run_repeat && reader->run_left == 0) {
+            reader->stored_offset++;
+        }
+    }
+
+    reader->offset += count;
+    return count;
 }
 
 uint8_t vgm_data_block_group_get_loaded_block(const vgm_data_block_group_t *block_group)
@@ -455,8 +940,3 @@ void vgm_data_block_group_set_loaded_block(vgm_data_block_group_t *block_group,
 {
     block_group->loaded_block = loaded_block;
 }
-
-vgm_data_block_ref_node_t* vgm_data_block_group_ref_list(const vgm_data_block_group_t *block_group)
-{
-    return block_group->block_refs_head;
-}
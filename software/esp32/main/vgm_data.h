@@ -11,8 +11,18 @@
 typedef struct vgm_data_t vgm_data_t;
 typedef struct vgm_data_state_t vgm_data_state_t;
 typedef struct vgm_data_block_group_t vgm_data_block_group_t;
-typedef struct vgm_data_block_ref_t vgm_data_block_ref_t;
-typedef struct vgm_data_block_ref_node_t vgm_data_block_ref_node_t;
+
+/*
+ * Position in the sample data of a block group, which is read from the
+ * start in order. The fields are private.
+ */
+typedef struct {
+    const vgm_data_block_group_t *block_group;
+    size_t offset;
+    size_t stored_offset;
+    uint8_t run_left;
+    bool run_repeat;
+} vgm_data_block_group_reader_t;
 
 vgm_data_t* vgm_data_create();
 
@@ -21,6 +31,12 @@ esp_err_t vgm_data_load(vgm_data_t *vgm_data, uint32_t sample_time,
 esp_err_t vgm_data_get_sample_time(const vgm_data_t *vgm_data, uint16_t block, size_t len, uint32_t *sample_time);
 esp_err_t vgm_data_get_data(const vgm_data_t *vgm_data, uint16_t block, size_t len, uint8_t *data);
 
+/**
+ * Get the heap used by the staged data, which only grows with the
+ * blocks that have been loaded.
+ */
+size_t vgm_data_get_allocated_size(const vgm_data_t *vgm_data);
+
 void vgm_data_free(vgm_data_t *vgm_data);
 
 
@@ -28,28 +44,96 @@ vgm_data_state_t* vgm_data_state_create();
 
 esp_err_t vgm_data_state_add_ref(vgm_data_state_t *vgm_data_state, const vgm_data_t *vgm_data,
         uint32_t sample_time, uint16_t block, size_t len);
+
+/**
+ * Add a block group with already resolved data, such as one loaded from
+ * a precompiled file, instead of building it up with vgm_data_state_add_ref().
+ */
+esp_err_t vgm_data_state_add_group(vgm_data_state_t *vgm_data_state,
+        uint32_t sample_time, uint16_t block, const uint8_t *data, size_t len,
+        vgm_data_block_group_t **block_group);
+
+/**
+ * Add a reference to a block group, at the end of the reference list.
+ * References must be added in playback order.
+ */
+esp_err_t vgm_data_state_add_group_ref(vgm_data_state_t *vgm_data_state,
+        vgm_data_block_group_t *block_group, uint32_t sample_time, size_t len);
+
+/**
+ * Merge block groups that hold identical sample data, so each distinct
+ * sample is kept and uploaded only once. References to the merged
+ * groups are moved onto the group that remains.
+ *
+ * @param merged Number of groups that were merged away
+ * @param bytes_saved Size of the sample data that was merged away
+ */
+esp_err_t vgm_data_state_merge_duplicates(vgm_data_state_t *vgm_data_state,
+        size_t *merged, size_t *bytes_saved);
+
+/**
+ * Run length code the sample data of every group where that makes it
+ * smaller, and compact the groups into fresh memory. Groups must then
+ * be read with vgm_data_block_group_read(). Groups are moved, so this
+ * must come after merging duplicates and before anything holds on to
+ * them.
+ *
+ * @param raw_bytes Size of the sample data before coding
+ * @param stored_bytes Size of the sample data as now stored
+ */
+esp_err_t vgm_data_state_compress(vgm_data_state_t *vgm_data_state,
+        size_t *raw_bytes, size_t *stored_bytes);
+
 bool vgm_data_state_has_refs(const vgm_data_state_t *vgm_data_state);
-vgm_data_block_ref_node_t* vgm_data_state_ref_list(const vgm_data_state_t *vgm_data_state);
-vgm_data_block_ref_t* vgm_data_state_next_ref(const vgm_data_state_t *vgm_data_state);
-vgm_data_block_ref_t* vgm_data_state_take_next_ref(vgm_data_state_t *vgm_data_state);
 
-void vgm_data_state_log_block_groups(const vgm_data_state_t *vgm_data_state);
+/*
+ * The reference list is an array in playback order, which does not
+ * change once it has been built.
+ */
+size_t vgm_data_state_ref_count(const vgm_data_state_t *vgm_data_state);
+uint32_t vgm_data_state_ref_sample_time(const vgm_data_state_t *vgm_data_state, size_t index);
+vgm_data_block_group_t* vgm_data_state_ref_block_group(const vgm_data_state_t *vgm_data_state, size_t index);
+uint16_t vgm_data_state_ref_byte_size(const vgm_data_state_t *vgm_data_state, size_t index);
 
-void vgm_data_state_free(vgm_data_state_t *vgm_data_state);
+/**
+ * Find the first reference at or after a point in the song, which is
+ * where playback picks up the list again after a loop.
+ *
+ * @return Index of the reference, or the reference count if there is none
+ */
+size_t vgm_data_state_find_ref(const vgm_data_state_t *vgm_data_state, uint32_t sample_time);
+
+size_t vgm_data_state_group_count(const vgm_data_state_t *vgm_data_state);
+vgm_data_block_group_t* vgm_data_state_group(const vgm_data_state_t *vgm_data_state, size_t index);
 
-vgm_data_block_ref_t* vgm_data_block_ref_list_element(const vgm_data_block_ref_node_t *list);
-vgm_data_block_ref_node_t* vgm_data_block_ref_list_next(const vgm_data_block_ref_node_t *list);
+void vgm_data_state_log_block_groups(const vgm_data_state_t *vgm_data_state);
 
-uint32_t vgm_data_block_ref_sample_time(const vgm_data_block_ref_t *block_ref);
-vgm_data_block_group_t* vgm_data_block_ref_block_group(const vgm_data_block_ref_t *block_ref);
-uint16_t vgm_data_block_ref_byte_size(const vgm_data_block_ref_t *block_ref);
-void vgm_data_block_ref_free(vgm_data_block_ref_t *block_ref);
+void vgm_data_state_free(vgm_data_state_t *vgm_data_state);
 
+/**
+ * Get the position of a group in its state, from zero up to the group
+ * count, for use as an array index.
+ */
+uint32_t vgm_data_block_group_index(const vgm_data_block_group_t *block_group);
+uint32_t vgm_data_block_group_key_sample_time(const vgm_data_block_group_t *block_group);
+uint16_t vgm_data_block_group_key_block(const vgm_data_block_group_t *block_group);
 uint16_t vgm_data_block_group_block_size(const vgm_data_block_group_t *block_group);
 uint16_t vgm_data_block_group_byte_size(const vgm_data_block_group_t *block_group);
-uint8_t *vgm_data_block_group_raw_data(const vgm_data_block_group_t *block_group);
+
+/**
+ * Start reading the sample data of a block group from the beginning.
+ */
+void vgm_data_block_group_reader_init(vgm_data_block_group_reader_t *reader,
+        const vgm_data_block_group_t *block_group);
+
+/**
+ * Read the next part of the sample data, decoding it if necessary.
+ *
+ * @return Number of bytes read, which is short at the end of the data
+ */
+size_t vgm_data_block_group_read(vgm_data_block_group_reader_t *reader, uint8_t *data, size_t len);
+
 uint8_t vgm_data_block_group_get_loaded_block(const vgm_data_block_group_t *block_group);
 void vgm_data_block_group_set_loaded_block(vgm_data_block_group_t *block_group, uint8_t loaded_block);
-vgm_data_block_ref_node_t* vgm_data_block_group_ref_list(const vgm_data_block_group_t *block_group);
 
 #endif /* VGM_DATA_H */
@@ -0,0 +1,311 @@
+#include "vgm_plan.h"
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_types.h>
+#include <sys/param.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char *TAG = "vgm_plan";
+
+/* Next use of a group that is never referenced again */
+#define VGM_PLAN_NEVER SIZE_MAX
+
+struct vgm_plan_t {
+    vgm_plan_action_t *actions;
+    size_t action_count;
+    uint32_t preloads;
+    uint32_t loads;
+    uint32_t hits;
+    uint32_t evictions;
+    uint32_t unplaced;
+    uint32_t late_loads;
+};
+
+/* A group that is resident in NES CPU memory during the simulation */
+typedef struct {
+    const vgm_data_block_group_t *group;
+    uint8_t slot;
+    uint8_t block_size;
+    size_t next_use;
+} vgm_plan_resident_t;
+
+static esp_err_t vgm_plan_find_next_uses(const vgm_data_state_t *vgm_data_state,
+        size_t count, size_t *next_use);
+static int vgm_plan_find_window(const vgm_plan_resident_t *residents, size_t resident_count,
+        const int16_t *slot_owner, uint8_t first_block, uint8_t last_block,
+        uint8_t block_size, const vgm_data_block_group_t *active_group);
+
+esp_err_t vgm_plan_create(vgm_plan_t **plan, const vgm_data_state_t *vgm_data_state,
+        uint8_t first_block, uint8_t last_block, uint32_t block_load_us)
+{
+    esp_err_t ret = ESP_OK;
+    vgm_plan_t *result = NULL;
+    size_t *next_use = NULL;
+    vgm_plan_resident_t *residents = NULL;
+
+    if (!plan || !vgm_data_state || first_block > last_block || last_block >= 128) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    size_t count = vgm_data_state_ref_count(vgm_data_state);
+
+    do {
+        result = malloc(sizeof(vgm_plan_t));
+        if (!result) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        bzero(result, sizeof(vgm_plan_t));
+
+        if (count == 0) {
+            break;
+        }
+
+        result->actions = malloc(sizeof(vgm_plan_action_t) * count);
+        next_use = malloc(sizeof(size_t) * count);
+        residents = malloc(sizeof(vgm_plan_resident_t) * ((last_block - first_block) + 1));
+        if (!result->actions || !next_use || !residents) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+        bzero(result->actions, sizeof(vgm_plan_action_t) * count);
+        result->action_count = count;
+
+        ret = vgm_plan_find_next_uses(vgm_data_state, count, next_use);
+        if (ret != ESP_OK) {
+            break;
+        }
+
+        // Simulate playback, tracking which group owns each block
+        int16_t slot_owner[128];
+        for (int b = 0; b < 128; b++) {
+            slot_owner[b] = -1;
+        }
+        size_t resident_count = 0;
+        bool preloading = true;
+        uint8_t preload_offset = first_block;
+
+        for (size_t i = 0; i < count; i++) {
+            const vgm_data_block_group_t *group = vgm_data_state_ref_block_group(vgm_data_state, i);
+            uint8_t block_size = vgm_data_block_group_block_size(group);
+            vgm_plan_action_t *action = &result->actions[i];
+
+            // Already resident, so just note when it is next needed
+            size_t r;
+            for (r = 0; r < resident_count; r++) {
+                if (residents[r].group == group) {
+                    break;
+                }
+            }
+            if (r < resident_count) {
+                residents[r].next_use = next_use[i];
+                action->slot = residents[r].slot;
+                result->hits++;
+                continue;
+            }
+
+            // Fill memory in reference order before playback starts
+            if (preloading) {
+                if (block_size > 0 && preload_offset + block_size - 1 <= last_block) {
+                    action->slot = preload_offset;
+                    action->load = true;
+                    action->preload = true;
+                    residents[resident_count].group = group;
+                    residents[resident_count].slot = preload_offset;
+                    residents[resident_count].block_size = block_size;
+                    residents[resident_count].next_use = next_use[i];
+                    for (uint8_t b = preload_offset; b < preload_offset + block_size; b++) {
+                        slot_owner[b] = resident_count;
+                    }
+                    resident_count++;
+                    preload_offset += block_size;
+                    result->preloads++;
+                    continue;
+                }
+                preloading = false;
+            }
+
+            // The group for the previous reference may still be playing
+            const vgm_data_block_group_t *active_group = (i > 0)
+                    ? vgm_data_state_ref_block_group(vgm_data_state, i - 1) : NULL;
+            int window = vgm_plan_find_window(residents, resident_count, slot_owner,
+                    first_block, last_block, block_size, active_group);
+            if (window < 0) {
+                result->unplaced++;
+                continue;
+            }
+
+            // Evict everything overlapping the window, compacting the
+            // resident list as we go.
+            for (uint8_t b = window; b < window + block_size; b++) {
+                int16_t owner = slot_owner[b];
+                if (owner < 0) {
+                    continue;
+                }
+                vgm_plan_resident_t *evicted = &residents[owner];
+                for (uint8_t e = evicted->slot; e < evicted->slot + evicted->block_size; e++) {
+                    slot_owner[e] = -1;
+                }
+                resident_count--;
+                if (owner != resident_count) {
+                    residents[owner] = residents[resident_count];
+                    for (uint8_t e = residents[owner].slot;
+                            e < residents[owner].slot + residents[owner].block_size; e++) {
+                        slot_owner[e] = owner;
+                    }
+                }
+                result->evictions++;
+            }
+
+            residents[resident_count].group = group;
+            residents[resident_count].slot = window;
+            residents[resident_count].block_size = block_size;
+            residents[resident_count].next_use = next_use[i];
+            for (uint8_t b = window; b < window + block_size; b++) {
+                slot_owner[b] = resident_count;
+            }
+            resident_count++;
+
+            action->slot = window;
+            action->load = true;
+            result->loads++;
+
+            // The upload runs from the previous reference until this one
+            if (i > 0) {
+                uint32_t window = vgm_data_state_ref_sample_time(vgm_data_state, i)
+                        - vgm_data_state_ref_sample_time(vgm_data_state, i - 1);
+                uint64_t window_us = ((uint64_t)window * 1000000ULL) / 44100ULL;
+                if ((uint64_t)block_size * block_load_us > window_us) {
+                    result->late_loads++;
+                }
+            }
+        }
+    } while (0);
+
+    free(next_use);
+    free(residents);
+
+    if (ret != ESP_OK) {
+        vgm_plan_free(result);
+        return ret;
+    }
+
+    *plan = result;
+    return ESP_OK;
+}
+
+/**
+ * For each reference, find the index of the next reference to the
+ * same group.
+ */
+esp_err_t vgm_plan_find_next_uses(const vgm_data_state_t *vgm_data_state,
+        size_t count, size_t *next_use)
+{
+    // Walking backwards, this holds the last index seen for each group
+    size_t group_count = vgm_data_state_group_count(vgm_data_state);
+    size_t *group_next = malloc(sizeof(size_t) * MAX(group_count, 1));
+    if (!group_next) {
+        return ESP_ERR_NO_MEM;
+    }
+    for (size_t g = 0; g < group_count; g++) {
+        group_next[g] = VGM_PLAN_NEVER;
+    }
+
+    for (size_t i = count; i > 0; i--) {
+        uint32_t g = vgm_data_block_group_index(vgm_data_state_ref_block_group(vgm_data_state, i - 1));
+        next_use[i - 1] = group_next[g];
+        group_next[g] = i - 1;
+    }
+
+    free(group_next);
+    return ESP_OK;
+}
+
+/**
+ * Find the start of the best run of blocks for a group.
+ *
+ * A run is scored by the soonest next use among the groups it would
+ * evict, with free blocks never being used, and the latest wins. Ties
+ * go to the run that evicts the fewest blocks, so small samples do not
+ * break up large ones for no gain.
+ *
+ * @return The first block of the run, or -1 if nothing fits
+ */
+int vgm_plan_find_window(const vgm_plan_resident_t *residents, size_t resident_count,
+        const int16_t *slot_owner, uint8_t first_block, uint8_t last_block,
+        uint8_t block_size, const vgm_data_block_group_t *active_group)
+{
+    int best_start = -1;
+    size_t best_use = 0;
+    uint32_t best_evicted = UINT32_MAX;
+
+    if (block_size == 0 || block_size > (last_block - first_block) + 1) {
+        return -1;
+    }
+
+    for (int start = first_block; start + block_size - 1 <= last_block; start++) {
+        size_t soonest_use = VGM_PLAN_NEVER;
+        uint32_t evicted = 0;
+        int16_t last_owner = -1;
+        bool valid = true;
+
+        for (int b = start; b < start + block_size; b++) {
+            int16_t owner = slot_owner[b];
+            if (owner < 0 || owner == last_owner) {
+                continue;
+            }
+            last_owner = owner;
+            if (residents[owner].group == active_group) {
+                valid = false;
+                break;
+            }
+            soonest_use = MIN(soonest_use, residents[owner].next_use);
+            evicted += residents[owner].block_size;
+        }
+        if (!valid) {
+            continue;
+        }
+
+        if (best_start < 0 || soonest_use > best_use
+                || (soonest_use == best_use && evicted < best_evicted)) {
+            best_start = start;
+            best_use = soonest_use;
+            best_evicted = evicted;
+        }
+    }
+
+    return best_start;
+}
+
+size_t vgm_plan_action_count(const vgm_plan_t *plan)
+{
+    return plan ? plan->action_count : 0;
+}
+
+const vgm_plan_action_t *vgm_plan_get_action(const vgm_plan_t *plan, size_t index)
+{
+    if (!plan || index >= plan->action_count) {
+        return NULL;
+    }
+    return &plan->actions[index];
+}
+
+void vgm_plan_log_summary(const vgm_plan_t *plan)
+{
+    if (!plan) {
+        return;
+    }
+    ESP_LOGI(TAG, "Placement plan: refs=%d, preloads=%d, loads=%d, hits=%d, evictions=%d, unplaced=%d, late=%d",
+            (int)plan->action_count, plan->preloads, plan->loads, plan->hits,
+            plan->evictions, plan->unplaced, plan->late_loads);
+}
+
+void vgm_plan_free(vgm_plan_t *plan)
+{
+    if (plan) {
+        free(plan->actions);
+        free(plan);
+    }
+}
@@ -0,0 +1,59 @@
+/*
+ * VGM Sample Placement Plan
+ *
+ * Works out ahead of playback where in NES CPU memory each referenced
+ * block group will live, and when it has to be uploaded, so playback
+ * only needs to replay the resulting actions.
+ */
+
+#ifndef VGM_PLAN_H
+#define VGM_PLAN_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+#include "vgm_data.h"
+
+typedef struct vgm_plan_t vgm_plan_t;
+
+/*
+ * Placement of the block group for one entry in the reference list.
+ * A slot of 0 means there was no room for the group, and the
+ * reference will play whatever happens to be in memory.
+ */
+typedef struct {
+    uint8_t slot;  /**< First APU block the group occupies */
+    bool load;     /**< Group is uploaded ahead of this reference */
+    bool preload;  /**< Upload happens before playback starts */
+} vgm_plan_action_t;
+
+/**
+ * Build a placement plan for the reference list of a data state.
+ *
+ * Groups are preloaded in reference order until memory is full. After
+ * that, the group for each reference is placed when the previous
+ * reference starts playing. The evicted groups are the ones used
+ * furthest in the future, and among equal choices, the placement that
+ * evicts the fewest blocks wins.
+ *
+ * @param first_block First APU block available for samples
+ * @param last_block Last APU block available for samples
+ * @param block_load_us Time to upload one block, used to count the
+ *                      loads that cannot finish before they are needed
+ */
+esp_err_t vgm_plan_create(vgm_plan_t **plan, const vgm_data_state_t *vgm_data_state,
+        uint8_t first_block, uint8_t last_block, uint32_t block_load_us);
+
+size_t vgm_plan_action_count(const vgm_plan_t *plan);
+
+/**
+ * Get the action for an entry in the reference list, or NULL if the
+ * index is past the end of the plan.
+ */
+const vgm_plan_action_t *vgm_plan_get_action(const vgm_plan_t *plan, size_t index);
+
+void vgm_plan_log_summary(const vgm_plan_t *plan);
+
+void vgm_plan_free(vgm_plan_t *plan);
+
+#endif /* VGM_PLAN_H */
@@ -1,48 +1,203 @@
 #include "vgm_player.h"
 
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <freertos/semphr.h>
 #include <esp_err.h>
 #include <esp_log.h>
 #include <esp_types.h>
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
 #include <sys/param.h>
 #include <sys/unistd.h>
+#include <string.h>
 
 #include "vgm.h"
 #include "nes_player.h"
 #include "vgm_data.h"
-#include "utarray.h"
+#include "vgm_tape.h"
+#include "vgm_ring.h"
+#include "vgm_plan.h"
+#include "vgm_cache.h"
+#include "nbin.h"
 #include "board_config.h"
 #include "i2c_util.h"
+#include "i2c_sched.h"
+#include "heap_count.h"
 #include "nes.h"
 
 static const char *TAG = "vgm_player";
 
-#define BLOCK_LOAD_MIN 8
-#define BLOCK_LOAD_MAX 127
+#define BLOCK_LOAD_MIN NES_DATA_BLOCK_MIN
+#define BLOCK_LOAD_MAX NES_DATA_BLOCK_MAX
+
+/* Fraction of the largest free heap block the event tape may use */
+#define TAPE_HEAP_FRACTION 4
+
+/* Waits shorter than this are not worth arming the timer for */
+#define SCHEDULE_MIN_WAIT_US 50
+
+/* Falling further behind than this skips the schedule ahead, rather
+ * than rushing through the backlog of commands */
+#define SCHEDULE_MAX_LATE_US 250000
+
+/* Interval between drift reports, in song time */
+#define SCHEDULE_REPORT_INTERVAL_US (60 * 1000000LL)
+
+/* Number of decoded commands buffered between the decoder and output */
+#define DECODER_RING_SIZE 1024
+
+/* How far ahead of the music commands are sent to the NES CPU FIFO */
+#define FIFO_LEAD_US 100000
+
+/* Waits longer than this are padded with an entry at their end, so the
+ * FIFO does not run dry while the music is idle */
+#define FIFO_IDLE_TICKS 1024
+
+/* How many sample references ahead of playback an upload may start */
+#define PREFETCH_LOOKAHEAD_REFS 64
+
+/* How far the NES CPU may be behind the output when using the FIFO, in
+ * samples, with some margin for the latency of the first entry */
+#define PREFETCH_FIFO_LAG_SAMPLES ((uint32_t)((FIFO_LEAD_US + 20000) * 44100LL / 1000000))
+
+/* Number of sent sample references tracked until the NES CPU plays them */
+#define PREFETCH_QUEUED_MAX 16
+
+/*
+ * Sample data is decoded here on its way to the NES, one write at a
+ * time. Uploads only ever come from the playback task.
+ */
+static uint8_t load_staging[256];
 
 typedef struct vgm_player_t {
+    char *filename;
     vgm_file_t *vgm_file;
+    nbin_file_t *nbin_file;
     vgm_gd3_tags_t *tags;
     nes_playback_cb_t playback_cb;
     nes_playback_repeat_t repeat;
     EventGroupHandle_t event_group;
     bool has_data_block;
     vgm_data_state_t *data_state;
+    vgm_plan_t *plan;
+    vgm_tape_t *tape;
+    bool tape_resolved;
+    uint32_t loop_sample_time;
 } vgm_player_t;
 
+/*
+ * Playback clock, which converts sample counts into absolute deadlines
+ * relative to a start timestamp, so that errors do not build up over
+ * a long track.
+ */
 typedef struct {
-    uint8_t loaded_block;
-    uint16_t block_size;
-    uint32_t cost;
-} vgm_data_block_segment_t;
-
-UT_icd vgm_data_block_segment_icd = {sizeof(vgm_data_block_segment_t), NULL, NULL, NULL};
-UT_icd uint8_icd = {sizeof(uint8_t), NULL, NULL, NULL};
-
-static UT_array* vgm_player_build_segment_list(
-        vgm_data_block_ref_t *last_block_ref,
-        uint32_t sample_time, vgm_data_block_group_t *load_map[]);
-static UT_array* vgm_player_find_eviction_candiates(
-        UT_array *segments, uint32_t block_size);
+    esp_timer_handle_t timer;
+    TaskHandle_t task;
+    int64_t start_time;
+    uint64_t samples;
+    int64_t next_report;
+    uint32_t waits;
+    uint32_t overruns;
+    uint32_t resyncs;
+    int64_t late_total;
+    int64_t late_max;
+    int64_t report_time;
+    i2c_stats_t i2c_stats;
+    heap_count_t heap_count;
+} vgm_player_clock_t;
+
+/*
+ * Output stage, which either writes register batches directly, or
+ * streams timestamped entries into the command FIFO on the NES CPU.
+ */
+typedef struct {
+    EventGroupHandle_t event_group;
+    nes_apu_reg_write_t batch[NES_APU_BATCH_MAX];
+    size_t batch_len;
+    uint32_t batch_time;
+    bool use_fifo;
+    bool fifo_started;
+    uint64_t fifo_tick;
+    size_t fifo_free;
+} vgm_player_output_t;
+
+/*
+ * State shared with the decoder task, which runs on the other core and
+ * feeds the output loop through the ring.
+ */
+typedef struct {
+    vgm_player_t *player;
+    vgm_ring_t *ring;
+    SemaphoreHandle_t done_sem;
+    volatile bool stop;
+    volatile bool finished;
+} vgm_player_decoder_t;
+
+/*
+ * Sample uploads during playback. The loads in the placement plan are
+ * taken in reference order, which is also deadline order, and each one
+ * starts as soon as nothing still to be played needs the blocks it
+ * overwrites. Uploads then use the slack in every wait until done.
+ *
+ * A reference needs a load whenever its group is not already where the
+ * plan puts it, so after a loop the plan is followed again from the loop
+ * point, and whatever is still resident from the last pass is kept.
+ *
+ * References that have been sent, but may not have been played yet by
+ * the NES CPU, are queued along with their song time. The last one that
+ * has been played stays queued, as its sample may still be playing.
+ */
+typedef struct {
+    vgm_data_state_t *data_state;
+    const vgm_plan_t *plan;
+    size_t ref_count;
+    size_t next;
+    bool loading;
+    size_t active;
+    vgm_data_block_group_reader_t reader;
+    uint16_t blocks_loaded;
+    uint32_t early;
+    uint32_t abandoned;
+    vgm_data_block_group_t *queued[PREFETCH_QUEUED_MAX];
+    uint32_t queued_time[PREFETCH_QUEUED_MAX];
+    size_t queued_head;
+    size_t queued_count;
+} vgm_player_prefetch_t;
+
+static esp_err_t vgm_player_prepare_data_state(vgm_player_t *player);
+static void vgm_player_place_block_group(vgm_data_block_group_t *block_group, uint8_t slot,
+        vgm_data_block_group_t *load_map[]);
+static void vgm_player_unplace_block_group(vgm_data_block_group_t *block_group,
+        vgm_data_block_group_t *load_map[]);
+static esp_err_t vgm_player_next_command(vgm_player_t *player, vgm_command_t *command);
+static esp_err_t vgm_player_seek_restart(vgm_player_t *player);
+static esp_err_t vgm_player_seek_loop(vgm_player_t *player);
+static void vgm_player_load_gd3_tags(vgm_player_t *player);
+static bool vgm_player_has_loop(const vgm_player_t *player);
+static uint32_t vgm_player_loop_sample_time(const vgm_player_t *player);
+static esp_err_t vgm_player_init_nbin(vgm_player_t *player, const char *filename);
+static esp_err_t vgm_player_prepare_nbin(vgm_player_t *player);
+static esp_err_t vgm_player_load_cache(vgm_player_t *player);
+static void vgm_player_save_cache(vgm_player_t *player);
+static void vgm_player_resolve_tape(vgm_player_t *player);
+static void vgm_player_output_init(vgm_player_output_t *output, EventGroupHandle_t event_group);
+static void vgm_player_output_write(vgm_player_output_t *output, uint32_t sample_time, uint8_t reg, uint8_t dat);
+static void vgm_player_output_flush(vgm_player_output_t *output);
+static void vgm_player_output_wait(vgm_player_output_t *output, uint32_t sample_time, uint16_t samples);
+static void vgm_player_output_drain(vgm_player_output_t *output);
+static void vgm_player_output_reset(vgm_player_output_t *output);
+static void vgm_player_output_fifo_send(vgm_player_output_t *output, const nes_fifo_entry_t *entries, size_t count);
+static void vgm_player_decoder_task(void *pvParameters);
+static esp_err_t vgm_player_decoder_start(vgm_player_decoder_t *decoder, vgm_player_t *player);
+static bool vgm_player_decoder_next(vgm_player_decoder_t *decoder, vgm_ring_entry_t *entry);
+static void vgm_player_decoder_stop(vgm_player_decoder_t *decoder);
+static esp_err_t vgm_player_clock_init(vgm_player_clock_t *clock);
+static void vgm_player_clock_start(vgm_player_clock_t *clock);
+static int64_t vgm_player_clock_advance(vgm_player_clock_t *clock, uint16_t samples);
+static void vgm_player_clock_wait(vgm_player_clock_t *clock, int64_t deadline);
+static void vgm_player_clock_report(vgm_player_clock_t *clock);
+static void vgm_player_clock_free(vgm_player_clock_t *clock);
 
 esp_err_t vgm_player_init(vgm_player_t **player,
         const char *filename,
@@ -61,11 +216,25 @@ esp_err_t vgm_player_init(vgm_player_t **player,
         }
 
         bzero(player_result, sizeof(vgm_player_t));
+        player_result->loop_sample_time = VGM_CACHE_LOOP_TIME_NONE;
         player_result->playback_cb = playback_cb;
         player_result->repeat = repeat;
         player_result->event_group = event_group;
 
         ESP_LOGI(TAG, "Opening file: %s", filename);
+
+        player_result->filename = strdup(filename);
+        if (!player_result->filename) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        const char *dot = strrchr(filename, '.');
+        if (dot && !strcmp(dot, ".nbin")) {
+            ret = vgm_player_init_nbin(player_result, filename);
+            break;
+        }
+
         ret = vgm_open(&player_result->vgm_file, filename);
         if (ret != ESP_OK) {
             ESP_LOGE(TAG, "Failed to open VGM file");
@@ -74,11 +243,14 @@ esp_err_t vgm_player_init(vgm_player_t **player,
 
         vgm_log_header_fields(player_result->vgm_file);
 
-        ret = vgm_read_gd3_tags(&player_result->tags, player_result->vgm_file);
-        if (ret != ESP_OK) {
-            ESP_LOGE(TAG, "Failed to read GD3 tags");
+        // The GD3 tags are at the end of the file, so they are filled in
+        // later by the prepare scan. Until then, all the fields are empty.
+        player_result->tags = malloc(sizeof(vgm_gd3_tags_t));
+        if (!player_result->tags) {
+            ret = ESP_ERR_NO_MEM;
             break;
         }
+        bzero(player_result->tags, sizeof(vgm_gd3_tags_t));
 
         ret = vgm_seek_start(player_result->vgm_file);
         if (ret != ESP_OK) {
@@ -101,18 +273,62 @@ const vgm_gd3_tags_t *vgm_player_get_gd3_tags(const vgm_player_t *player)
     return player->tags;
 }
 
+size_t vgm_player_get_tape_size(const vgm_player_t *player)
+{
+    return player->tape ? vgm_tape_byte_size(player->tape) : 0;
+}
+
+esp_err_t vgm_player_init_nbin(vgm_player_t *player, const char *filename)
+{
+    esp_err_t ret;
+
+    ret = nbin_open(&player->nbin_file, filename);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to open NBIN file");
+        return ret;
+    }
+
+    // Tags are at the start of the file, so there is no reason to defer them
+    ret = nbin_read_gd3_tags(&player->tags, player->nbin_file);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to read tags");
+        return ret;
+    }
+
+    return nbin_seek_start(player->nbin_file);
+}
+
 esp_err_t vgm_player_prepare(vgm_player_t *player)
 {
+    if (player->nbin_file) {
+        return vgm_player_prepare_nbin(player);
+    }
+
+    // A file that has been scanned before can skip straight to playback
+    esp_err_t ret = vgm_player_load_cache(player);
+    if (ret != ESP_ERR_NOT_FOUND) {
+        if (ret == ESP_OK) {
+            vgm_player_resolve_tape(player);
+        }
+        return ret;
+    }
+
     ESP_LOGI(TAG, "Scanning file");
 
     vgm_command_t command;
 
     player->has_data_block = false;
     uint32_t sample_time = 0;
+    uint32_t command_count = 0;
     uint16_t current_block = 0;
     uint16_t current_len = 0;
     bool mod_dirty = false;
 
+    // Track the lowest free heap seen while scanning, to report the peak
+    // memory used by preparation.
+    const size_t heap_start = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    size_t heap_low = heap_start;
+
     // Allocate the state structure for playback VGM data blocks
     player->data_state = vgm_data_state_create();
     if (!player->data_state) {
@@ -127,14 +343,45 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
         return ESP_ERR_NO_MEM;
     }
 
+    // Allocate the event tape, which playback will use instead of the
+    // file if it can be completely recorded within the size limit.
+    size_t tape_limit = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / TAPE_HEAP_FRACTION;
+    player->tape = vgm_tape_create(tape_limit);
+    if (!player->tape) {
+        ESP_LOGW(TAG, "Unable to allocate event tape");
+    }
+
+    const uint32_t loop_offset = vgm_get_header(player->vgm_file)->loop_offset;
+    bool at_end = false;
+
+    int64_t time0 = esp_timer_get_time();
+
     while(true) {
         if ((xEventGroupGetBits(player->event_group) & BIT0) == BIT0) {
             break;
         }
 
+        if (loop_offset > 0 && vgm_tell(player->vgm_file) == loop_offset) {
+            // Header durations can disagree with the commands, so keep
+            // the time the decoder actually reaches the loop point at.
+            player->loop_sample_time = sample_time;
+            if (player->tape && vgm_tape_mark_loop(player->tape) != ESP_OK) {
+                ESP_LOGW(TAG, "Event tape too large, using file streaming");
+                vgm_tape_free(player->tape);
+                player->tape = NULL;
+            }
+        }
+
         if (vgm_next_command(player->vgm_file, &command, /*load_data*/true) != ESP_OK) {
             break;
         }
+        command_count++;
+
+        if (player->tape && vgm_tape_append(player->tape, &command) != ESP_OK) {
+            ESP_LOGW(TAG, "Event tape too large, using file streaming");
+            vgm_tape_free(player->tape);
+            player->tape = NULL;
+        }
 
         // Collect info from VGM commands relevant to the APU data loading
         if (command.type == VGM_CMD_DATA_BLOCK) {
@@ -162,6 +409,7 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
                     break;
                 }
                 player->has_data_block = true;
+                heap_low = MIN(heap_low, heap_caps_get_free_size(MALLOC_CAP_8BIT));
             } while (0);
 
             free(command.info.data_block.data);
@@ -193,6 +441,7 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
                 ESP_LOGI(TAG, "Unable to add sample reference");
                 break;
             }
+            heap_low = MIN(heap_low, heap_caps_get_free_size(MALLOC_CAP_8BIT));
         }
 
         // Handle commands that should be processed after a command group
@@ -201,12 +450,43 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
         }
         else if (command.type == VGM_CMD_DONE) {
             ESP_LOGI(TAG, "At end of data tag");
+            at_end = true;
             break;
         }
     }
 
+    int64_t time1 = esp_timer_get_time();
+    uint32_t scan_ms = (uint32_t)((time1 - time0) / 1000);
+    ESP_LOGI(TAG, "Scanned %d commands in %dms (%d cmd/s)",
+            command_count, scan_ms,
+            (uint32_t)((command_count * 1000000LL) / MAX(time1 - time0, 1)));
+    heap_low = MIN(heap_low, heap_caps_get_free_size(MALLOC_CAP_8BIT));
+    ESP_LOGI(TAG, "Prepare heap: peak=%d bytes, data staging=%d bytes",
+            heap_start - heap_low, vgm_data_get_allocated_size(vgm_data));
+    vgm_log_seek_index(player->vgm_file);
+
     vgm_data_free(vgm_data);
 
+    if (player->tape) {
+        if (!at_end) {
+            ESP_LOGW(TAG, "Incomplete scan, using file streaming");
+            vgm_tape_free(player->tape);
+            player->tape = NULL;
+        } else if (vgm_has_loop(player->vgm_file) && !vgm_tape_has_loop(player->tape)) {
+            ESP_LOGW(TAG, "Loop offset not on a command boundary, using file streaming");
+            vgm_tape_free(player->tape);
+            player->tape = NULL;
+        } else if (vgm_tape_finish(player->tape) != ESP_OK) {
+            ESP_LOGW(TAG, "Event tape too large, using file streaming");
+            vgm_tape_free(player->tape);
+            player->tape = NULL;
+        } else {
+            ESP_LOGI(TAG, "Event tape: %d events, %d bytes",
+                    vgm_tape_event_count(player->tape),
+                    vgm_tape_byte_size(player->tape));
+        }
+    }
+
     if (!vgm_data_state_has_refs(player->data_state)) {
         if (player->has_data_block) {
             ESP_LOGI(TAG, "VGM has unreferenced sample data");
@@ -218,26 +498,206 @@ esp_err_t vgm_player_prepare(vgm_player_t *player)
     else {
         // Log collected data for debugging
         vgm_data_state_log_block_groups(player->data_state);
+
+        ret = vgm_player_prepare_data_state(player);
+        if (ret != ESP_OK) {
+            return ret;
+        }
     }
 
+    // The scan has stopped just short of the GD3 tags, so they can be
+    // read without inflating the file again.
+    if (at_end) {
+        vgm_player_load_gd3_tags(player);
+        vgm_player_save_cache(player);
+    }
+
+    vgm_player_resolve_tape(player);
+
     vgm_seek_restart(player->vgm_file);
 
     return ESP_OK;
 }
 
+/**
+ * Load the results of an earlier prepare scan from the cache.
+ *
+ * @return ESP_ERR_NOT_FOUND if there is no usable entry, in which case
+ *         the player is left untouched
+ */
+esp_err_t vgm_player_load_cache(vgm_player_t *player)
+{
+    vgm_cache_info_t info;
+    vgm_data_state_t *data_state = NULL;
+
+    int64_t time0 = esp_timer_get_time();
+    size_t tape_limit = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / TAPE_HEAP_FRACTION;
+    esp_err_t ret = vgm_cache_load(player->filename, &data_state, player->tags, &info,
+            &player->tape, tape_limit);
+    if (ret != ESP_OK) {
+        return ESP_ERR_NOT_FOUND;
+    }
+    int64_t time1 = esp_timer_get_time();
+
+    ESP_LOGI(TAG, "Loaded prepared state in %dms: refs=%d, samples=%d, loop=%d, tape=%d bytes",
+            (uint32_t)((time1 - time0) / 1000),
+            data_state ? vgm_data_state_ref_count(data_state) : 0,
+            info.total_samples, info.loop_samples,
+            player->tape ? vgm_tape_byte_size(player->tape) : 0);
+
+    player->loop_sample_time = info.loop_sample_time;
+    player->data_state = data_state;
+    player->has_data_block = data_state != NULL;
+    if (player->has_data_block) {
+        vgm_data_state_log_block_groups(player->data_state);
+        ret = vgm_player_prepare_data_state(player);
+        if (ret != ESP_OK) {
+            return ret;
+        }
+    }
+
+    return ESP_OK;
+}
+
+void vgm_player_save_cache(vgm_player_t *player)
+{
+    const vgm_header_t *header = vgm_get_header(player->vgm_file);
+    vgm_cache_info_t info = {
+        .total_samples = header->total_samples,
+        .loop_samples = header->loop_samples,
+        .loop_offset = header->loop_offset,
+        .loop_sample_time = player->loop_sample_time
+    };
+
+    if (vgm_cache_save(player->filename, player->data_state, player->tags, &info, player->tape) != ESP_OK) {
+        ESP_LOGW(TAG, "Unable to cache prepared state");
+    }
+}
+
+/*
+ * Walks the tape alongside the sample references, which are in the
+ * same time order, to find the reference each DMC address write
+ * belongs to.
+ */
+typedef struct {
+    const vgm_data_state_t *data_state;
+    const vgm_plan_t *plan;
+    size_t ref_count;
+    size_t ref_index;
+    uint32_t resolved;
+} vgm_player_tape_resolver_t;
+
+static uint8_t vgm_player_resolve_modaddr(uint32_t sample_time, uint8_t dat, void *ctx)
+{
+    vgm_player_tape_resolver_t *resolver = ctx;
+
+    while (resolver->ref_index < resolver->ref_count
+            && vgm_data_state_ref_sample_time(resolver->data_state, resolver->ref_index) < sample_time) {
+        resolver->ref_index++;
+    }
+    if (resolver->ref_index >= resolver->ref_count
+            || vgm_data_state_ref_sample_time(resolver->data_state, resolver->ref_index) != sample_time) {
+        return dat;
+    }
+
+    const vgm_plan_action_t *action = vgm_plan_get_action(resolver->plan, resolver->ref_index);
+    if (!action || action->slot == 0) {
+        return dat;
+    }
+    resolver->resolved++;
+    return action->slot;
+}
+
+/**
+ * Replace the DMC addresses on the tape with the blocks the placement
+ * plan loads each sample into, so playback can send them as they are.
+ * The plan keeps every reference in the same place on every pass, so
+ * this holds across loops too.
+ */
+void vgm_player_resolve_tape(vgm_player_t *player)
+{
+    if (!player->tape || !player->has_data_block) {
+        return;
+    }
+
+    vgm_player_tape_resolver_t resolver = {
+        .data_state = player->data_state,
+        .plan = player->plan,
+        .ref_count = vgm_data_state_ref_count(player->data_state)
+    };
+    vgm_tape_rewrite(player->tape, NES_APU_MODADDR, vgm_player_resolve_modaddr, &resolver);
+    player->tape_resolved = true;
+
+    ESP_LOGI(TAG, "Event tape: resolved %d sample addresses", resolver.resolved);
+}
+
+esp_err_t vgm_player_prepare_nbin(vgm_player_t *player)
+{
+    esp_err_t ret;
+
+    // The sample groups and references were resolved by the converter,
+    // so there is nothing to scan.
+    player->has_data_block = false;
+    if (nbin_get_header(player->nbin_file)->ref_count > 0) {
+        player->data_state = vgm_data_state_create();
+        if (!player->data_state) {
+            ESP_LOGE(TAG, "Unable to allocate VGM data state");
+            return ESP_ERR_NO_MEM;
+        }
+
+        ret = nbin_load_data_state(player->nbin_file, player->data_state);
+        if (ret != ESP_OK) {
+            ESP_LOGE(TAG, "Unable to load sample data");
+            return ret;
+        }
+
+        player->has_data_block = vgm_data_state_has_refs(player->data_state);
+        vgm_data_state_log_block_groups(player->data_state);
+
+        if (player->has_data_block) {
+            ret = vgm_player_prepare_data_state(player);
+            if (ret != ESP_OK) {
+                return ret;
+            }
+        }
+    }
+
+    return nbin_seek_start(player->nbin_file);
+}
+
+void vgm_player_load_gd3_tags(vgm_player_t *player)
+{
+    vgm_gd3_tags_t *tags = NULL;
+
+    if (vgm_get_header(player->vgm_file)->gd3_offset == 0) {
+        return;
+    }
+
+    if (vgm_read_gd3_tags(&tags, player->vgm_file) != ESP_OK) {
+        ESP_LOGW(TAG, "Failed to read GD3 tags");
+        return;
+    }
+
+    // Move the parsed fields into the structure handed out by
+    // vgm_player_get_gd3_tags(), so existing pointers to it stay valid.
+    *player->tags = *tags;
+    free(tags);
+}
+
 static bool vgm_player_load_block_group(const vgm_data_block_group_t *block_group, uint8_t starting_block)
 {
+    vgm_data_block_group_reader_t reader;
+    vgm_data_block_group_reader_init(&reader, block_group);
+
     uint8_t block = starting_block;
     size_t load_len = vgm_data_block_group_byte_size(block_group);
-    uint8_t *load_data = vgm_data_block_group_raw_data(block_group);
     i2c_mutex_lock(I2C_P0_NUM);
     while(load_len > 0) {
-        size_t len = MIN(load_len, 256);
-        if (nes_data_write(I2C_P0_NUM, block, load_data, len) != ESP_OK) {
+        size_t len = vgm_data_block_group_read(&reader, load_staging, MIN(load_len, sizeof(load_staging)));
+        if (len == 0 || nes_data_write(I2C_P0_NUM, block, load_staging, len) != ESP_OK) {
             ESP_LOGE(TAG, "Unable to load data block");
             break;
         }
-        load_data += len;
         load_len -= len;
         block += 4;
     }
@@ -253,9 +713,14 @@ static bool vgm_player_load_block_group(const vgm_data_block_group_t *block_grou
     return load_len == 0;
 }
 
-static bool vgm_player_load_block_group_increment(const vgm_data_block_group_t *block_group,
+/**
+ * Load the next part of a block group, continuing from where the reader
+ * left off.
+ */
+static bool vgm_player_load_block_group_increment(vgm_data_block_group_reader_t *reader,
         uint8_t starting_block, uint16_t blocks_loaded, uint8_t block_load_limit)
 {
+    const vgm_data_block_group_t *block_group = reader->block_group;
     uint8_t block = starting_block + blocks_loaded;
     size_t byte_size = vgm_data_block_group_byte_size(block_group);
     size_t load_offset = blocks_loaded * 64;
@@ -266,16 +731,14 @@ static bool vgm_player_load_block_group_increment(const vgm_data_block_group_t *
     }
 
     size_t load_len = MIN(byte_size - load_offset, block_load_limit * 64);
-    uint8_t *load_data = vgm_data_block_group_raw_data(block_group) + load_offset;
 
     i2c_mutex_lock(I2C_P0_NUM);
     while(load_len > 0) {
-        size_t len = MIN(load_len, 256);
-        if (nes_data_write(I2C_P0_NUM, block, load_data, len) != ESP_OK) {
+        size_t len = vgm_data_block_group_read(reader, load_staging, MIN(load_len, sizeof(load_staging)));
+        if (len == 0 || nes_data_write(I2C_P0_NUM, block, load_staging, len) != ESP_OK) {
             ESP_LOGE(TAG, "Unable to load data block");
             break;
         }
-        load_data += len;
         load_len -= len;
         block += 4;
     }
@@ -291,65 +754,301 @@ static bool vgm_player_load_block_group_increment(const vgm_data_block_group_t *
     return load_len == 0;
 }
 
+static void vgm_player_prefetch_init(vgm_player_prefetch_t *prefetch, vgm_player_t *player)
+{
+    bzero(prefetch, sizeof(vgm_player_prefetch_t));
+    if (player->has_data_block) {
+        prefetch->data_state = player->data_state;
+        prefetch->plan = player->plan;
+        prefetch->ref_count = vgm_data_state_ref_count(player->data_state);
+    }
+}
+
+/**
+ * Find the next reference whose group is not loaded where the plan
+ * needs it.
+ */
+static size_t vgm_player_prefetch_find_load(const vgm_player_prefetch_t *prefetch, size_t index)
+{
+    while (index < prefetch->ref_count) {
+        const vgm_plan_action_t *action = vgm_plan_get_action(prefetch->plan, index);
+        if (action && action->slot != 0) {
+            vgm_data_block_group_t *block_group = vgm_data_state_ref_block_group(prefetch->data_state, index);
+            if (vgm_data_block_group_get_loaded_block(block_group) != action->slot) {
+                break;
+            }
+        }
+        index++;
+    }
+    return index;
+}
+
+/**
+ * Move back to the references after the loop point, giving up on any
+ * upload still running for the end of the last pass.
+ */
+static void vgm_player_prefetch_rewind(vgm_player_prefetch_t *prefetch,
+        vgm_data_block_group_t *load_map[], size_t index)
+{
+    if (prefetch->loading) {
+        vgm_player_unplace_block_group(
+                vgm_data_state_ref_block_group(prefetch->data_state, prefetch->active), load_map);
+        prefetch->loading = false;
+        prefetch->abandoned++;
+    }
+    prefetch->next = index;
+}
+
+/**
+ * Record a reference that has been sent for playback.
+ *
+ * @param sample_time Song time of the reference, counting every pass
+ */
+static void vgm_player_prefetch_queue(vgm_player_prefetch_t *prefetch,
+        vgm_data_block_group_t *block_group, uint32_t sample_time)
+{
+    if (prefetch->queued_count == PREFETCH_QUEUED_MAX) {
+        // The oldest is the most likely to be done with
+        prefetch->queued_head = (prefetch->queued_head + 1) % PREFETCH_QUEUED_MAX;
+        prefetch->queued_count--;
+    }
+    size_t i = (prefetch->queued_head + prefetch->queued_count) % PREFETCH_QUEUED_MAX;
+    prefetch->queued[i] = block_group;
+    prefetch->queued_time[i] = sample_time;
+    prefetch->queued_count++;
+}
+
+/**
+ * Drop the queued references that are behind the one the NES CPU is
+ * playing at the given song time.
+ */
+static void vgm_player_prefetch_retire(vgm_player_prefetch_t *prefetch, uint32_t play_time)
+{
+    while (prefetch->queued_count > 1
+            && prefetch->queued_time[(prefetch->queued_head + 1) % PREFETCH_QUEUED_MAX] <= play_time) {
+        prefetch->queued_head = (prefetch->queued_head + 1) % PREFETCH_QUEUED_MAX;
+        prefetch->queued_count--;
+    }
+}
+
+static bool vgm_player_prefetch_is_queued(const vgm_player_prefetch_t *prefetch,
+        const vgm_data_block_group_t *block_group)
+{
+    for (size_t i = 0; i < prefetch->queued_count; i++) {
+        if (prefetch->queued[(prefetch->queued_head + i) % PREFETCH_QUEUED_MAX] == block_group) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Check whether the load for a reference can start, because nothing it
+ * would overwrite is used from the samples that may still be playing or
+ * queued, up to the reference itself.
+ */
+static bool vgm_player_prefetch_can_start(const vgm_player_prefetch_t *prefetch,
+        vgm_data_block_group_t *load_map[], size_t ref_index, size_t index)
+{
+    const vgm_plan_action_t *action = vgm_plan_get_action(prefetch->plan, index);
+    vgm_data_block_group_t *block_group = vgm_data_state_ref_block_group(prefetch->data_state, index);
+    uint16_t block_size = vgm_data_block_group_block_size(block_group);
+    vgm_data_block_group_t *last_owner = NULL;
+
+    for (uint16_t i = action->slot; i < action->slot + block_size && i <= BLOCK_LOAD_MAX; i++) {
+        vgm_data_block_group_t *owner = load_map[i];
+        if (!owner || owner == block_group || owner == last_owner) {
+            continue;
+        }
+        if (vgm_player_prefetch_is_queued(prefetch, owner)) {
+            return false;
+        }
+        last_owner = owner;
+        for (size_t r = ref_index; r < index; r++) {
+            if (vgm_data_state_ref_block_group(prefetch->data_state, r) == owner) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Upload sample data until the deadline, starting queued loads as their
+ * blocks become free.
+ *
+ * @param ref_index Index of the next reference to be sent
+ * @param play_time Song time the NES CPU has at least reached
+ */
+static void vgm_player_prefetch_run(vgm_player_prefetch_t *prefetch,
+        vgm_data_block_group_t *load_map[], size_t ref_index,
+        uint32_t play_time, int64_t deadline)
+{
+    vgm_player_prefetch_retire(prefetch, play_time);
+
+    while (true) {
+        if (prefetch->loading && prefetch->active < ref_index) {
+            // The sample has already been played, so give up on the rest
+            // of it once a later load is due.
+            size_t due = vgm_player_prefetch_find_load(prefetch, prefetch->next);
+            if (due < prefetch->ref_count && due <= ref_index) {
+                vgm_player_unplace_block_group(
+                        vgm_data_state_ref_block_group(prefetch->data_state, prefetch->active), load_map);
+                prefetch->loading = false;
+                prefetch->abandoned++;
+            }
+        }
+
+        if (!prefetch->loading) {
+            prefetch->next = vgm_player_prefetch_find_load(prefetch, prefetch->next);
+            if (prefetch->next >= prefetch->ref_count
+                    || prefetch->next > ref_index + PREFETCH_LOOKAHEAD_REFS
+                    || !vgm_player_prefetch_can_start(prefetch, load_map, ref_index, prefetch->next)) {
+                return;
+            }
+
+            const vgm_plan_action_t *action = vgm_plan_get_action(prefetch->plan, prefetch->next);
+            vgm_data_block_group_t *block_group = vgm_data_state_ref_block_group(prefetch->data_state, prefetch->next);
+            vgm_player_place_block_group(block_group, action->slot, load_map);
+            if (prefetch->next > ref_index) {
+                prefetch->early++;
+            }
+            prefetch->active = prefetch->next++;
+            vgm_data_block_group_reader_init(&prefetch->reader, block_group);
+            prefetch->blocks_loaded = 0;
+            prefetch->loading = true;
+        }
+
+        // Size the chunk from the measured upload time, with some
+        // margin so a slow upload does not run into the deadline.
+        int64_t wait = deadline - esp_timer_get_time();
+        uint32_t block_cost = nes_data_get_block_cost();
+        if (wait <= 0) {
+            return;
+        }
+        uint8_t block_load_limit = MIN(wait / (block_cost + (block_cost / 8)), 120);
+        if (block_load_limit == 0) {
+            return;
+        }
+
+        vgm_data_block_group_t *block_group = vgm_data_state_ref_block_group(prefetch->data_state, prefetch->active);
+        uint8_t slot = vgm_data_block_group_get_loaded_block(block_group);
+        if (!vgm_player_load_block_group_increment(&prefetch->reader, slot, prefetch->blocks_loaded, block_load_limit)) {
+            ESP_LOGE(TAG, "Incremental block load error");
+            // The blocks hold a partial upload, so the group is not there
+            vgm_player_unplace_block_group(block_group, load_map);
+            prefetch->loading = false;
+            continue;
+        }
+
+        prefetch->blocks_loaded += block_load_limit;
+        if (prefetch->blocks_loaded >= vgm_data_block_group_block_size(block_group)) {
+            prefetch->loading = false;
+        }
+    }
+}
+
 esp_err_t vgm_player_play_loop(vgm_player_t *player)
 {
     vgm_data_block_group_t *load_map[128] = { 0 };
-    vgm_data_block_ref_t *block_ref = NULL;
 
-    uint8_t inc_load_start = 0;
-    uint16_t inc_blocks_loaded = 0;
-
-    // Pre-load block groups up to available memory
+    vgm_player_prefetch_t prefetch;
+    vgm_player_prefetch_init(&prefetch, player);
+
+    // Position in the reference list, which indexes the placement plan.
+    // The list covers one pass through the file, so on every loop the
+    // position goes back to the loop point, and song time is offset to
+    // match the reference times again.
+    vgm_data_state_t *data_state = player->has_data_block ? player->data_state : NULL;
+    size_t ref_count = data_state ? vgm_data_state_ref_count(data_state) : 0;
+    size_t ref_index = 0;
+    uint32_t ref_time_offset = 0;
+    uint32_t ref_passes = 1;
+    uint32_t ref_misses = 0;
+    uint32_t ref_partial = 0;
+
+    // Pre-load the block groups the plan puts in memory up front
     if (player->has_data_block) {
         ESP_LOGI(TAG, "Preloading data blocks");
-        const uint8_t max_blocks = (BLOCK_LOAD_MAX - BLOCK_LOAD_MIN) + 1;
-        uint8_t block_offset = BLOCK_LOAD_MIN;
-        uint8_t remaining_blocks = max_blocks;
-        vgm_data_block_ref_node_t *node = vgm_data_state_ref_list(player->data_state);
-        while (node) {
-            block_ref = vgm_data_block_ref_list_element(node);
-
-            vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(block_ref);
-            if (vgm_data_block_group_get_loaded_block(block_group) == 0) {
-                uint16_t group_block_size = vgm_data_block_group_block_size(block_group);
-                if (group_block_size <= remaining_blocks) {
-                    if (!vgm_player_load_block_group(block_group, block_offset)) {
-                        ESP_LOGI(TAG, "Block loading error");
-                        break;
-                    }
-                    vgm_data_block_group_set_loaded_block(block_group, block_offset);
-                    for (uint8_t i = block_offset; i < block_offset + group_block_size; i++) {
-                        load_map[i] = block_group;
-                    }
-                    block_offset += group_block_size;
-                    remaining_blocks -= group_block_size;
-                } else {
-                    ESP_LOGI(TAG, "No more space for preloading");
+        for (size_t i = 0; i < ref_count; i++) {
+            const vgm_plan_action_t *action = vgm_plan_get_action(player->plan, i);
+            if (action && action->preload) {
+                vgm_data_block_group_t *block_group = vgm_data_state_ref_block_group(data_state, i);
+                if (!vgm_player_load_block_group(block_group, action->slot)) {
+                    ESP_LOGI(TAG, "Block loading error");
                     break;
                 }
+                vgm_player_place_block_group(block_group, action->slot, load_map);
             }
-
-            node = vgm_data_block_ref_list_next(node);
         }
-        block_ref = vgm_data_state_take_next_ref(player->data_state);
     }
 
     ESP_LOGI(TAG, "Starting playback");
 
     vgm_command_t command;
-    const double wait_multiplier = 1000000.0/44100.0;
-    int64_t last_write_time = 0;
+    vgm_ring_entry_t entry;
     uint32_t sample_time = 0;
 
+    vgm_player_output_t output;
+    vgm_player_output_init(&output, player->event_group);
+    nes_apu_shadow_reset_stats();
+
+    vgm_player_decoder_t decoder;
+    if (vgm_player_decoder_start(&decoder, player) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to start decoder");
+        return ESP_FAIL;
+    }
+
+    vgm_player_clock_t clock;
+    if (vgm_player_clock_init(&clock) != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to create playback timer");
+        vgm_player_decoder_stop(&decoder);
+        return ESP_FAIL;
+    }
+
+    // Defer housekeeping on the bus only once playback is sure to start
+    i2c_sched_set_realtime(I2C_P0_NUM, true);
+
+    // Give the decoder a head start before the clock starts
+    while (!decoder.finished
+            && vgm_ring_count(decoder.ring) < vgm_ring_capacity(decoder.ring) / 2) {
+        vTaskDelay(1);
+    }
+
+    vgm_player_clock_start(&clock);
+
     while(true) {
         if ((xEventGroupGetBits(player->event_group) & BIT0) == BIT0) {
             break;
         }
 
-        if (vgm_next_command(player->vgm_file, &command, /*load_data*/false) != ESP_OK) {
+        if (!vgm_player_decoder_next(&decoder, &entry)) {
             break;
         }
 
+        if (entry.type == VGM_RING_LOOP) {
+            // The decoder has gone back to the loop point, so pick up the
+            // references from there. Samples still resident from the last
+            // pass are left where they are.
+            if (data_state) {
+                uint32_t loop_time = vgm_player_loop_sample_time(player);
+                ref_time_offset = entry.sample_time - loop_time;
+                ref_index = vgm_data_state_find_ref(data_state, loop_time);
+                vgm_player_prefetch_rewind(&prefetch, load_map, ref_index);
+                ref_passes++;
+            }
+            continue;
+        }
+
+        command.type = entry.type;
+        if (command.type == VGM_CMD_NES_APU) {
+            command.info.nes_apu.reg = entry.reg;
+            command.info.nes_apu.dat = entry.value;
+        } else if (command.type == VGM_CMD_WAIT) {
+            command.info.wait.samples = entry.value;
+        }
+        sample_time = entry.sample_time;
+
         if (command.type == VGM_CMD_NES_APU) {
             if ((command.info.nes_apu.reg == NES_APU_MODCTRL ||
                     command.info.nes_apu.reg == NES_APU_MODADDR ||
@@ -360,174 +1059,138 @@ esp_err_t vgm_player_play_loop(vgm_player_t *player)
                 continue;
             }
 
-            if (command.info.nes_apu.reg == NES_APU_MODADDR &&
-                    block_ref && vgm_data_block_ref_sample_time(block_ref) == sample_time) {
-                vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(block_ref);
+            if (command.info.nes_apu.reg == NES_APU_MODADDR && ref_index < ref_count
+                    && vgm_data_state_ref_sample_time(data_state, ref_index) == sample_time - ref_time_offset) {
+                vgm_data_block_group_t *block_group = vgm_data_state_ref_block_group(data_state, ref_index);
                 uint8_t loaded_block = vgm_data_block_group_get_loaded_block(block_group);
                 if (loaded_block == 0) {
+                    ref_misses++;
 #if 1
                     ESP_LOGI(TAG, "Referenced block not loaded: [%d] $%04X",
                             command.info.nes_apu.dat,
                             (((uint16_t)command.info.nes_apu.dat) << 6) | 0xC000);
 #endif
-                } else if (inc_load_start > 0) {
+                } else if (prefetch.loading && vgm_data_state_ref_block_group(data_state, prefetch.active) == block_group) {
+                    ref_partial++;
 #if 1
                     ESP_LOGI(TAG, "Referenced block partially loaded: [%d] $%04X (%d)",
                             command.info.nes_apu.dat,
                             (((uint16_t)command.info.nes_apu.dat) << 6) | 0xC000,
-                            inc_blocks_loaded * 64);
+                            prefetch.blocks_loaded * 64);
 #endif
-                } else {
+                } else if (!player->tape_resolved) {
 #if 0
                     ESP_LOGI(TAG, "NES_APU_MODADDR: [%d->%d] $%04X->$%04X t=%u",
                             command.info.nes_apu.dat, loaded_block,
                             (((uint16_t)command.info.nes_apu.dat) << 6) | 0xC000,
                             (((uint16_t)loaded_block) << 6) | 0xC000, sample_time);
 #endif
+                    // Streaming from the file, so relocate here instead
                     command.info.nes_apu.dat = loaded_block;
                 }
 
             }
 
-            int64_t time0 = esp_timer_get_time();
-            i2c_mutex_lock(I2C_P0_NUM);
-            nes_apu_write(I2C_P0_NUM, command.info.nes_apu.reg, command.info.nes_apu.dat);
-            i2c_mutex_unlock(I2C_P0_NUM);
-            int64_t time1 = esp_timer_get_time();
-            last_write_time += (time1 - time0);
+            // Collect writes until the next wait, to send them together
+            vgm_player_output_write(&output, sample_time,
+                    (uint8_t)(command.info.nes_apu.reg & 0xFF),
+                    command.info.nes_apu.dat);
         }
         else if (command.type == VGM_CMD_WAIT) {
-            if (block_ref && vgm_data_block_ref_sample_time(block_ref) == sample_time) {
-                int64_t time0 = esp_timer_get_time();
-                vgm_data_block_ref_t *last_block_ref = block_ref;
-                block_ref = vgm_data_state_take_next_ref(player->data_state);
-                if (block_ref) {
-                    vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(block_ref);
-                    uint8_t loaded_block = vgm_data_block_group_get_loaded_block(block_group);
-                    if (loaded_block == 0) {
-#if 0
-                        ESP_LOGI(TAG, "Need to load block, size=%d, wait=%d",
-                                vgm_data_block_group_byte_size(block_group),
-                                command.info.wait.samples);
-#endif
-
-                        // Build the list of loaded data segments and eviction costs
-                        UT_array *segments = vgm_player_build_segment_list(last_block_ref, sample_time, load_map);
-
-                        // Find the loaded segments to evict
-                        UT_array *evict = vgm_player_find_eviction_candiates(segments, vgm_data_block_group_block_size(block_group));
-                        utarray_free(segments);
-
-                        uint8_t load_segment = 0;
-                        if (utarray_len(evict) > 0) {
-                            // Evict the chosen segments
-                            load_segment = *(uint8_t*)utarray_front(evict); // make safer
-                            uint8_t *evict_segment;
-                            for(evict_segment = (uint8_t*)utarray_front(evict);
-                                    evict_segment != NULL;
-                                    evict_segment = (uint8_t*)utarray_next(evict, evict_segment)) {
-                                vgm_data_block_group_t *evict_group = load_map[*evict_segment];
-                                if (evict_group) {
-                                    vgm_data_block_group_set_loaded_block(evict_group, 0);
-                                    for (uint8_t i = *evict_segment;
-                                            i < *evict_segment + vgm_data_block_group_block_size(evict_group);
-                                            i++) {
-                                        load_map[i] = NULL;
-                                    }
-                                }
-                            }
-                        } else {
-                            ESP_LOGI(TAG, "Nothing to evict!");
-                        }
-                        utarray_free(evict);
-
-                        if (load_segment > 0) {
-                            // Set block as if it was loaded
-                            vgm_data_block_group_set_loaded_block(block_group, load_segment);
-
-                            // Set state variables for incremental loading
-                            inc_load_start = load_segment;
-                            inc_blocks_loaded = 0;
-                        }
+            vgm_player_output_wait(&output, sample_time, command.info.wait.samples);
+
+            if (ref_index < ref_count
+                    && vgm_data_state_ref_sample_time(data_state, ref_index) == sample_time - ref_time_offset) {
+                vgm_player_prefetch_queue(&prefetch,
+                        vgm_data_state_ref_block_group(data_state, ref_index), sample_time);
+                ref_index++;
+                if (ref_index < ref_count) {
+                    const vgm_plan_action_t *action = vgm_plan_get_action(player->plan, ref_index);
+                    if (action && action->slot == 0) {
+                        ESP_LOGI(TAG, "Nothing to evict!");
                     }
-
-                    vgm_data_block_ref_free(last_block_ref);
                 }
                 else {
                     ESP_LOGI(TAG, "End of block references");
                 }
-                int64_t time1 = esp_timer_get_time();
-                last_write_time += (time1 - time0);
             }
 
-            // Figure out how long we need to wait
-            int64_t wait = (command.info.wait.samples * wait_multiplier) - last_write_time;
-
-            // If a block group needs to be loaded, then incrementally load
-            // until complete.
-            if (block_ref && inc_load_start > 0 && wait > 0) {
-                // 3000-3500 uS per block
-                uint8_t block_load_limit = MIN(wait / 3500, 120);
-
-                if (block_load_limit > 0) {
-                    int64_t time0 = esp_timer_get_time();
-
-                    vgm_data_block_group_t *block_group = vgm_data_block_ref_block_group(block_ref);
-                    if (!vgm_player_load_block_group_increment(block_group, inc_load_start, inc_blocks_loaded, block_load_limit)) {
-                        ESP_LOGE(TAG, "Incremental block load error");
-                        inc_load_start = 0;
-                        inc_blocks_loaded = 0;
-                    }
-                    else {
-                        inc_blocks_loaded += block_load_limit;
-                        // Check if the load is complete
-                        if (inc_blocks_loaded >= vgm_data_block_group_block_size(block_group)) {
-                            inc_load_start = 0;
-                            inc_blocks_loaded = 0;
-                        }
-                    }
-
-                    // Update the wait time based on block loading
-                    int64_t time1 = esp_timer_get_time();
-                    wait -= (time1 - time0);
-                    last_write_time = 0;
-                }
+            // Figure out when the next command is due, and how long
+            // that leaves us.
+            int64_t deadline = vgm_player_clock_advance(&clock, command.info.wait.samples);
+            uint32_t play_time = sample_time;
+            if (output.use_fifo) {
+                // The NES CPU plays the commands itself, so we only need
+                // to stay far enough ahead of it. Samples sent within
+                // the lead may not have started yet.
+                deadline -= FIFO_LEAD_US;
+                play_time = (sample_time > PREFETCH_FIFO_LAG_SAMPLES) ? sample_time - PREFETCH_FIFO_LAG_SAMPLES : 0;
             }
 
-            if (wait > 0) {
-                last_write_time = 0;
-                // Need to use this because vTaskDelay() only has 1ms resolution
-                usleep(wait);
-            }
+            // Use the slack before the deadline for sample uploads
+            vgm_player_prefetch_run(&prefetch, load_map, ref_index, play_time, deadline);
 
-            // Update the sample time
-            sample_time += command.info.wait.samples;
+            // Let housekeeping on the bus run until the next deadline
+            i2c_sched_set_idle_until(I2C_P0_NUM, deadline);
+            vgm_player_clock_wait(&clock, deadline);
         }
         else if (command.type == VGM_CMD_DONE) {
-            ESP_LOGI(TAG, "At end of data tag");
-            if (player->repeat == NES_REPEAT_LOOP && vgm_has_loop(player->vgm_file)) {
-                ESP_LOGI(TAG, "Seeking to start of loop");
-                vgm_seek_loop(player->vgm_file);
-            } else if (player->repeat == NES_REPEAT_CONTINUOUS) {
-                ESP_LOGI(TAG, "Seeking to start of file");
+            vgm_player_output_flush(&output);
+            vgm_player_output_drain(&output);
 
+            // The decoder has already handled looping, and has moved
+            // on to the start of the file if we are repeating.
+            if (player->repeat == NES_REPEAT_CONTINUOUS) {
                 // Reset APU for a clean state
                 i2c_mutex_lock(I2C_P0_NUM);
                 nes_apu_init(I2C_P0_NUM);
                 i2c_mutex_unlock(I2C_P0_NUM);
+                vgm_player_output_reset(&output);
 
                 // Small delay
                 vTaskDelay(500 / portTICK_RATE_MS);
 
-                // Seek to start of file
-                vgm_seek_restart(player->vgm_file);
+                // Start the clock over, so the delay is not made up for
+                vgm_player_clock_report(&clock);
+                vgm_player_clock_start(&clock);
+
+                // The references start over with the file, and the APU
+                // reset leaves sample memory alone, so anything resident
+                // can still be used.
+                if (data_state) {
+                    ref_time_offset = sample_time;
+                    ref_index = 0;
+                    vgm_player_prefetch_rewind(&prefetch, load_map, ref_index);
+                    prefetch.queued_count = 0; // The APU reset emptied the FIFO
+                    ref_passes++;
+                }
             } else {
                 break;
             }
         }
     }
 
-    vgm_data_block_ref_free(block_ref);
+    vgm_player_output_flush(&output);
+    i2c_sched_set_realtime(I2C_P0_NUM, false);
+
+    vgm_player_decoder_stop(&decoder);
+
+    vgm_player_clock_report(&clock);
+    vgm_player_clock_free(&clock);
+
+    nes_apu_shadow_stats_t shadow_stats;
+    nes_apu_shadow_get_stats(&shadow_stats);
+    ESP_LOGI(TAG, "APU writes: %u requested, %u skipped (%u%%)",
+            shadow_stats.writes, shadow_stats.skipped,
+            shadow_stats.writes ? (shadow_stats.skipped * 100) / shadow_stats.writes : 0);
+
+    if (player->has_data_block) {
+        ESP_LOGI(TAG, "Sample references: %u not loaded, %u partially loaded, through ref %d of pass %u",
+                ref_misses, ref_partial, ref_index, ref_passes);
+        ESP_LOGI(TAG, "Sample uploads: %u started early, %u abandoned",
+                prefetch.early, prefetch.abandoned);
+        ESP_LOGI(TAG, "Block upload estimate: %dus", nes_data_get_block_cost());
+    }
 
     // Reset the APU in case we bailed early
     i2c_mutex_lock(I2C_P0_NUM);
@@ -539,136 +1202,616 @@ esp_err_t vgm_player_play_loop(vgm_player_t *player)
     return ESP_OK;
 }
 
-UT_array* vgm_player_build_segment_list(
-        vgm_data_block_ref_t *last_block_ref,
-        uint32_t sample_time, vgm_data_block_group_t *load_map[])
-{
-    UT_array *segments;
-    utarray_new(segments, &vgm_data_block_segment_icd);
-    vgm_data_block_group_t *active_group = vgm_data_block_ref_block_group(last_block_ref);
-    vgm_data_block_group_t *current_group = load_map[BLOCK_LOAD_MIN];
-    int q = BLOCK_LOAD_MIN;
-    for (int i = BLOCK_LOAD_MIN + 1; i <= BLOCK_LOAD_MAX; i++) {
-        if (load_map[i] != current_group || i == BLOCK_LOAD_MAX) {
-            if (!current_group) {
-                #if 0
-                ESP_LOGI(TAG, "Block: <empty>, location = %d, len=%d",
-                    q, i - q);
-                #endif
-                vgm_data_block_segment_t segment = {
-                    .loaded_block = q,
-                    .block_size = i - q,
-                    .cost = 0
-                };
-                utarray_push_back(segments, &segment);
-            } else {
-                uint32_t cost;
+esp_err_t vgm_player_next_command(vgm_player_t *player, vgm_command_t *command)
+{
+    if (player->nbin_file) {
+        return nbin_next_command(player->nbin_file, command);
+    } else if (player->tape) {
+        return vgm_tape_next_command(player->tape, command);
+    } else {
+        return vgm_next_command(player->vgm_file, command, /*load_data*/false);
+    }
+}
 
-                if (active_group == current_group) {
-                    cost = UINT32_MAX;
-                } else {
-                    vgm_data_block_ref_node_t *ref_node = vgm_data_block_group_ref_list(current_group);
-                    if (ref_node) {
-                        vgm_data_block_ref_t *next_ref = vgm_data_block_ref_list_element(ref_node);
-                        uint32_t next_ref_time = vgm_data_block_ref_sample_time(next_ref);
-                        cost = INT32_MAX - (next_ref_time - sample_time);
-                    } else {
-                        cost = 0;
-                    }
-                }
+esp_err_t vgm_player_seek_restart(vgm_player_t *player)
+{
+    if (player->nbin_file) {
+        return nbin_seek_start(player->nbin_file);
+    } else if (player->tape) {
+        vgm_tape_seek_start(player->tape);
+        return ESP_OK;
+    } else {
+        return vgm_seek_restart(player->vgm_file);
+    }
+}
 
-                #if 0
-                ESP_LOGI(TAG, "Block: location = %d, len=%d, cost=%u",
-                    q, i - q, cost);
-                #endif
+esp_err_t vgm_player_seek_loop(vgm_player_t *player)
+{
+    if (player->nbin_file) {
+        return nbin_seek_loop(player->nbin_file);
+    } else if (player->tape) {
+        vgm_tape_seek_loop(player->tape);
+        return ESP_OK;
+    } else {
+        return vgm_seek_loop(player->vgm_file);
+    }
+}
 
-                vgm_data_block_segment_t segment = {
-                    .loaded_block = q,
-                    .block_size = i - q,
-                    .cost = cost
-                };
-                utarray_push_back(segments, &segment);
+static uint64_t vgm_player_sample_to_tick(uint32_t sample_time)
+{
+    return ((uint64_t)sample_time * NES_CPU_CLOCK_HZ) / (44100ULL * NES_FIFO_TICK_CYCLES);
+}
 
-                current_group = load_map[i];
-                q = i;
-            }
+void vgm_player_output_init(vgm_player_output_t *output, EventGroupHandle_t event_group)
+{
+    bzero(output, sizeof(vgm_player_output_t));
+    output->event_group = event_group;
+
+    uint8_t version = 0;
+    i2c_mutex_lock(I2C_P0_NUM);
+    esp_err_t ret = nes_get_version(I2C_P0_NUM, &version);
+    i2c_mutex_unlock(I2C_P0_NUM);
+
+    output->use_fifo = (ret == ESP_OK && version >= NES_VERSION_FIFO);
+    ESP_LOGI(TAG, "NES CPU version %d, %s output", version,
+            output->use_fifo ? "FIFO" : "direct");
+}
+
+void vgm_player_output_write(vgm_player_output_t *output, uint32_t sample_time, uint8_t reg, uint8_t dat)
+{
+    // Drop anything that is not an APU register, which could otherwise
+    // reach $4014, $4016 or beyond through the FIFO.
+    if (!nes_apu_is_writable(reg)) {
+        return;
+    }
+
+    // Direct batches are checked against the APU shadow when they are
+    // sent, while FIFO entries need to be checked here.
+    if (output->use_fifo && !nes_apu_shadow_update(reg, dat)) {
+        return;
+    }
+
+    if (output->batch_len == NES_APU_BATCH_MAX) {
+        vgm_player_output_flush(output);
+    }
+
+    output->batch[output->batch_len].reg = reg;
+    output->batch[output->batch_len].dat = dat;
+    output->batch_len++;
+    output->batch_time = sample_time;
+}
+
+/**
+ * Convert a write at the target tick into FIFO entries, tracking the
+ * tick the NES CPU will play it at. Returns the number of entries used,
+ * which may include extra waits ahead of a long gap.
+ */
+static size_t vgm_player_output_fifo_entry(vgm_player_output_t *output,
+        uint64_t target, uint8_t reg, uint8_t dat, nes_fifo_entry_t *entries)
+{
+    size_t count = 0;
+
+    if (!output->fifo_started) {
+        // Line the FIFO timeline up with the first entry
+        output->fifo_started = true;
+        output->fifo_tick = target;
+        entries[count].delay = 1;
+    } else {
+        // Each entry takes a tick to load, plus its delay
+        while (target > output->fifo_tick + 1 + UINT16_MAX) {
+            entries[count].delay = UINT16_MAX;
+            entries[count].reg = NES_FIFO_REG_NONE;
+            entries[count].dat = 0;
+            output->fifo_tick += 1 + UINT16_MAX;
+            count++;
+        }
+        uint64_t gap = (target > output->fifo_tick) ? (target - output->fifo_tick) : 0;
+        entries[count].delay = (gap > 1) ? (gap - 1) : 1;
+        output->fifo_tick += 1 + entries[count].delay;
+    }
+    entries[count].reg = reg;
+    entries[count].dat = dat;
+    count++;
+
+    return count;
+}
+
+void vgm_player_output_flush(vgm_player_output_t *output)
+{
+    if (output->batch_len == 0) {
+        return;
+    }
+
+    if (!output->use_fifo) {
+        i2c_mutex_lock(I2C_P0_NUM);
+        nes_apu_write_batch(I2C_P0_NUM, output->batch, output->batch_len);
+        i2c_mutex_unlock(I2C_P0_NUM);
+        output->batch_len = 0;
+        return;
+    }
+
+    // Leave room for the waits that may go ahead of the first write
+    nes_fifo_entry_t entries[NES_APU_BATCH_MAX + 2];
+    size_t count = 0;
+    uint64_t target = vgm_player_sample_to_tick(output->batch_time);
+
+    for (size_t i = 0; i < output->batch_len; i++) {
+        if (count > NES_APU_BATCH_MAX) {
+            vgm_player_output_fifo_send(output, entries, count);
+            count = 0;
+        }
+        count += vgm_player_output_fifo_entry(output, target,
+                output->batch[i].reg, output->batch[i].dat, entries + count);
+    }
+    vgm_player_output_fifo_send(output, entries, count);
+    output->batch_len = 0;
+}
+
+void vgm_player_output_wait(vgm_player_output_t *output, uint32_t sample_time, uint16_t samples)
+{
+    vgm_player_output_flush(output);
+
+    if (output->use_fifo && output->fifo_started) {
+        // Keep the FIFO busy through a long wait, by playing an entry
+        // that does nothing just before the end of it.
+        uint64_t target = vgm_player_sample_to_tick(sample_time + samples);
+        if (target > output->fifo_tick + FIFO_IDLE_TICKS) {
+            nes_fifo_entry_t entries[2];
+            size_t count = vgm_player_output_fifo_entry(output, target - 2,
+                    NES_FIFO_REG_NONE, 0, entries);
+            vgm_player_output_fifo_send(output, entries, count);
+        }
+    }
+}
+
+void vgm_player_output_fifo_send(vgm_player_output_t *output, const nes_fifo_entry_t *entries, size_t count)
+{
+    if (count == 0) {
+        return;
+    }
+
+    // Wait for room in the FIFO, only asking the NES CPU for its level
+    // once our own count of free entries runs out.
+    while (output->fifo_free < count) {
+        if ((xEventGroupGetBits(output->event_group) & BIT0) == BIT0) {
+            return;
+        }
+
+        uint8_t level;
+        i2c_mutex_lock(I2C_P0_NUM);
+        esp_err_t ret = nes_fifo_get_level(I2C_P0_NUM, &level);
+        i2c_mutex_unlock(I2C_P0_NUM);
+        if (ret != ESP_OK) {
+            return;
+        }
+
+        output->fifo_free = NES_FIFO_SIZE - level;
+        if (output->fifo_free < count) {
+            vTaskDelay(1);
         }
     }
-    return segments;
+
+    i2c_mutex_lock(I2C_P0_NUM);
+    nes_fifo_write(I2C_P0_NUM, entries, count);
+    i2c_mutex_unlock(I2C_P0_NUM);
+    output->fifo_free -= count;
 }
 
-UT_array* vgm_player_find_eviction_candiates(
-        UT_array *segments, uint32_t block_size)
+void vgm_player_output_drain(vgm_player_output_t *output)
 {
-    vgm_data_block_segment_t *candidate_p = NULL;
-    vgm_data_block_segment_t *candidate_q = NULL;
-    uint32_t candidate_size = 0;
-    uint32_t candidate_cost = 0;
+    if (!output->use_fifo) {
+        return;
+    }
 
-    vgm_data_block_segment_t *p, *q;
-    for(p = (vgm_data_block_segment_t*)utarray_front(segments);
-        p != NULL;
-        p = (vgm_data_block_segment_t*)utarray_next(segments, p)) {
+    // Wait for the NES CPU to play out everything it has queued
+    uint8_t level;
+    do {
+        if ((xEventGroupGetBits(output->event_group) & BIT0) == BIT0) {
+            break;
+        }
+        vTaskDelay(1);
+
+        i2c_mutex_lock(I2C_P0_NUM);
+        esp_err_t ret = nes_fifo_get_level(I2C_P0_NUM, &level);
+        i2c_mutex_unlock(I2C_P0_NUM);
+        if (ret != ESP_OK) {
+            break;
+        }
+    } while (level > 0);
+
+    uint8_t flags = 0;
+    i2c_mutex_lock(I2C_P0_NUM);
+    nes_fifo_get_flags(I2C_P0_NUM, &flags);
+    i2c_mutex_unlock(I2C_P0_NUM);
+    if ((flags & NES_FIFO_FLAG_OVERFLOW) != 0) {
+        ESP_LOGW(TAG, "NES CPU FIFO overflowed");
+    }
+}
 
-        int elements = 0;
-        uint32_t range_size = 0;
-        uint32_t range_cost = 0;
-        for(q = p;
-            q != NULL;
-            q = (vgm_data_block_segment_t*)utarray_next(segments, q)) {
-            range_size += p->block_size;
-            if (range_cost + p->cost < range_cost) {
-                range_cost = UINT32_MAX;
+void vgm_player_output_reset(vgm_player_output_t *output)
+{
+    // The APU reset also empties the FIFO
+    output->batch_len = 0;
+    output->fifo_started = false;
+    output->fifo_free = 0;
+}
+
+void vgm_player_decoder_task(void *pvParameters)
+{
+    vgm_player_decoder_t *decoder = pvParameters;
+    vgm_player_t *player = decoder->player;
+    vgm_command_t command;
+    vgm_ring_entry_t entry;
+    uint32_t sample_time = 0;
+    bool pending = false;
+    bool done = false;
+
+    ESP_LOGI(TAG, "Decoder started on core %d", xPortGetCoreID());
+
+    while (!decoder->stop) {
+        if (!pending) {
+            if (vgm_player_next_command(player, &command) != ESP_OK) {
+                command.type = VGM_CMD_DONE;
+                done = true;
+            }
+
+            entry.sample_time = sample_time;
+            entry.type = command.type;
+            entry.reg = 0;
+            entry.value = 0;
+
+            if (command.type == VGM_CMD_NES_APU) {
+                entry.reg = command.info.nes_apu.reg;
+                entry.value = command.info.nes_apu.dat;
+            } else if (command.type == VGM_CMD_WAIT) {
+                entry.value = command.info.wait.samples;
+                sample_time += command.info.wait.samples;
+            } else if (command.type == VGM_CMD_DONE) {
+                ESP_LOGI(TAG, "At end of data tag");
+                if (done) {
+                    // Read error, so stop here
+                } else if (player->repeat == NES_REPEAT_LOOP && vgm_player_has_loop(player)) {
+                    ESP_LOGI(TAG, "Seeking to start of loop");
+                    vgm_player_seek_loop(player);
+                    entry.type = VGM_RING_LOOP;
+                } else if (player->repeat == NES_REPEAT_CONTINUOUS) {
+                    ESP_LOGI(TAG, "Seeking to start of file");
+                    vgm_player_seek_restart(player);
+                } else {
+                    done = true;
+                }
             } else {
-                range_cost += p->cost;
+                continue;
             }
-            elements++;
-            if (range_size >= block_size) {
+            pending = true;
+        }
+
+        if (vgm_ring_push(decoder->ring, &entry)) {
+            pending = false;
+            if (done) {
                 break;
             }
+        } else {
+            // Ring is full, so give the output side time to catch up
+            vTaskDelay(1);
         }
+    }
+
+    decoder->finished = true;
+    xSemaphoreGive(decoder->done_sem);
+    vTaskDelete(NULL);
+}
+
+esp_err_t vgm_player_decoder_start(vgm_player_decoder_t *decoder, vgm_player_t *player)
+{
+    bzero(decoder, sizeof(vgm_player_decoder_t));
+    decoder->player = player;
+
+    if (vgm_ring_create(&decoder->ring, DECODER_RING_SIZE) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    decoder->done_sem = xSemaphoreCreateBinary();
+    if (!decoder->done_sem) {
+        vgm_ring_free(decoder->ring);
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Decoding runs on the protocol core, leaving the application core
+    // free for the time critical APU output.
+    if (xTaskCreatePinnedToCore(vgm_player_decoder_task, "vgm_decoder_task", 4096,
+            decoder, 5, NULL, PRO_CPU_NUM) != pdPASS) {
+        vSemaphoreDelete(decoder->done_sem);
+        vgm_ring_free(decoder->ring);
+        return ESP_ERR_NO_MEM;
+    }
 
-        if (p && q && (!candidate_p || range_cost < candidate_cost
-            || (range_cost == candidate_cost && range_size < candidate_size))) {
-            candidate_p = p;
-            candidate_q = q;
-            candidate_size = range_size;
-            candidate_cost = range_cost;
+    return ESP_OK;
+}
+
+bool vgm_player_decoder_next(vgm_player_decoder_t *decoder, vgm_ring_entry_t *entry)
+{
+    uint32_t underrun_ticks = 0;
+    while (!vgm_ring_pop(decoder->ring, entry)) {
+        if (decoder->finished) {
+            // Check again, in case the final entry arrived just now
+            return vgm_ring_pop(decoder->ring, entry);
+        }
+        if ((xEventGroupGetBits(decoder->player->event_group) & BIT0) == BIT0) {
+            return false;
         }
+        vTaskDelay(1);
+        underrun_ticks++;
+    }
 
-#if 0
-        printf("Elements=%d, size=%u, cost=%u\n", elements, range_size, range_cost);
+    if (underrun_ticks > 0) {
+        ESP_LOGW(TAG, "Decoder underrun: %ums", underrun_ticks * portTICK_PERIOD_MS);
+    }
+    return true;
+}
 
-        printf("Block: location = %d, len=%d, cost=%u\n",
-            p->loaded_block, p->block_size, p->cost);
-#endif
+void vgm_player_decoder_stop(vgm_player_decoder_t *decoder)
+{
+    decoder->stop = true;
+    xSemaphoreTake(decoder->done_sem, portMAX_DELAY);
+    vSemaphoreDelete(decoder->done_sem);
+    vgm_ring_free(decoder->ring);
+}
+
+static void vgm_player_clock_timer_callback(void *arg)
+{
+    vgm_player_clock_t *clock = arg;
+    xTaskNotifyGive(clock->task);
+}
+
+esp_err_t vgm_player_clock_init(vgm_player_clock_t *clock)
+{
+    bzero(clock, sizeof(vgm_player_clock_t));
+    clock->task = xTaskGetCurrentTaskHandle();
+
+    esp_timer_create_args_t timer_args = {
+        .callback = vgm_player_clock_timer_callback,
+        .arg = clock,
+        .dispatch_method = ESP_TIMER_TASK,
+        .name = "vgm_player_clock"
+    };
+    return esp_timer_create(&timer_args, &clock->timer);
+}
+
+void vgm_player_clock_start(vgm_player_clock_t *clock)
+{
+    clock->start_time = esp_timer_get_time();
+    clock->samples = 0;
+    clock->next_report = SCHEDULE_REPORT_INTERVAL_US;
+    clock->report_time = clock->start_time;
+    i2c_get_stats(I2C_P0_NUM, &clock->i2c_stats);
+    heap_count_get(&clock->heap_count);
+}
+
+int64_t vgm_player_clock_advance(vgm_player_clock_t *clock, uint16_t samples)
+{
+    clock->samples += samples;
+    return clock->start_time + (int64_t)((clock->samples * 1000000ULL) / 44100ULL);
+}
 
+void vgm_player_clock_wait(vgm_player_clock_t *clock, int64_t deadline)
+{
+    int64_t now = esp_timer_get_time();
+    int64_t late = now - deadline;
+
+    clock->waits++;
+    if (late > 0) {
+        // Already behind, so there is nothing to wait for
+        clock->overruns++;
+        clock->late_total += late;
+        clock->late_max = MAX(clock->late_max, late);
+
+        if (late > SCHEDULE_MAX_LATE_US) {
+            // Skip the schedule forward, instead of trying to catch up
+            clock->start_time += late;
+            clock->resyncs++;
+        }
     }
+    else if (-late >= SCHEDULE_MIN_WAIT_US) {
+        // Clear any stale notification, then sleep until the deadline
+        ulTaskNotifyTake(pdTRUE, 0);
+        if (esp_timer_start_once(clock->timer, -late) == ESP_OK) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        } else {
+            usleep(-late);
+        }
 
-#if 0
-    printf("Block range: location = %d, len=%d, cost=%u\n",
-            candidate_p->loaded_block, candidate_size, candidate_cost);
-#endif
+        // Measure how late the wakeup was
+        late = esp_timer_get_time() - deadline;
+        if (late > 0) {
+            clock->late_total += late;
+            clock->late_max = MAX(clock->late_max, late);
+        }
+    }
+
+    if (deadline - clock->start_time >= clock->next_report) {
+        vgm_player_clock_report(clock);
+        clock->next_report += SCHEDULE_REPORT_INTERVAL_US;
+    }
+}
+
+void vgm_player_clock_report(vgm_player_clock_t *clock)
+{
+    if (clock->waits == 0) {
+        return;
+    }
+
+    int64_t song_time = (int64_t)((clock->samples * 1000000ULL) / 44100ULL);
+    int64_t drift = (esp_timer_get_time() - clock->start_time) - song_time;
+
+    ESP_LOGI(TAG, "Drift: song=%llds, drift=%lldus, waits=%u, late avg=%lldus max=%lldus, overruns=%u, resyncs=%u",
+            song_time / 1000000, drift, clock->waits,
+            clock->late_total / clock->waits, clock->late_max,
+            clock->overruns, clock->resyncs);
+
+    // Heap calls are counted for all tasks, so other work running
+    // alongside playback shows up here as well
+    i2c_stats_t i2c_stats;
+    heap_count_t heap_count;
+    int64_t now = esp_timer_get_time();
+    i2c_get_stats(I2C_P0_NUM, &i2c_stats);
+    heap_count_get(&heap_count);
+    uint32_t transactions = i2c_stats.transactions - clock->i2c_stats.transactions;
+    uint32_t allocs = heap_count.allocs - clock->heap_count.allocs;
+    uint32_t frees = heap_count.frees - clock->heap_count.frees;
+    int64_t elapsed_ms = MAX((now - clock->report_time) / 1000, 1);
+    ESP_LOGI(TAG, "I2C: transactions=%u (%lld/s), heap: allocs=%u (%lld/s) frees=%u (%lld/s)",
+            transactions, (transactions * 1000LL) / elapsed_ms,
+            allocs, (allocs * 1000LL) / elapsed_ms,
+            frees, (frees * 1000LL) / elapsed_ms);
+    clock->i2c_stats = i2c_stats;
+    clock->heap_count = heap_count;
+    clock->report_time = now;
+
+    clock->waits = 0;
+    clock->overruns = 0;
+    clock->resyncs = 0;
+    clock->late_total = 0;
+    clock->late_max = 0;
+}
+
+void vgm_player_clock_free(vgm_player_clock_t *clock)
+{
+    if (clock->timer) {
+        esp_timer_stop(clock->timer);
+        esp_timer_delete(clock->timer);
+        clock->timer = NULL;
+    }
+}
+
+bool vgm_player_has_loop(const vgm_player_t *player)
+{
+    if (player->nbin_file) {
+        return nbin_has_loop(player->nbin_file);
+    } else {
+        return vgm_has_loop(player->vgm_file);
+    }
+}
 
-    UT_array *evict;
-    utarray_new(evict, &uint8_icd);
+/**
+ * Song time of the loop point, counted from the start of the file.
+ * This is where the prepare scan reached the loop offset, or comes from
+ * the header durations if the scan did not see it.
+ */
+uint32_t vgm_player_loop_sample_time(const vgm_player_t *player)
+{
+    if (player->loop_sample_time != VGM_CACHE_LOOP_TIME_NONE) {
+        return player->loop_sample_time;
+    }
 
-    candidate_q = (vgm_data_block_segment_t*)utarray_next(segments, candidate_q);
-    for(p = candidate_p; p != candidate_q;
-        p = (vgm_data_block_segment_t*)utarray_next(segments, p)) {
-        uint8_t val = p->loaded_block;
-        utarray_push_back(evict, &val);
+    uint32_t total_samples;
+    uint32_t loop_samples;
+    if (player->nbin_file) {
+        total_samples = nbin_get_header(player->nbin_file)->total_samples;
+        loop_samples = nbin_get_header(player->nbin_file)->loop_samples;
+    } else {
+        total_samples = vgm_get_header(player->vgm_file)->total_samples;
+        loop_samples = vgm_get_header(player->vgm_file)->loop_samples;
     }
+    return (loop_samples < total_samples) ? total_samples - loop_samples : 0;
+}
 
-    return evict;
+/**
+ * Finish preparing the sample data, once all the references are known.
+ */
+esp_err_t vgm_player_prepare_data_state(vgm_player_t *player)
+{
+    // Identical samples only need to be kept and uploaded once
+    size_t merged = 0;
+    size_t bytes_saved = 0;
+    esp_err_t ret = vgm_data_state_merge_duplicates(player->data_state, &merged, &bytes_saved);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to merge duplicate block groups");
+        return ret;
+    }
+    if (merged > 0) {
+        ESP_LOGI(TAG, "Merged %d duplicate block groups, saving %d bytes", merged, bytes_saved);
+    }
+
+    // Keep the sample data coded until it is uploaded
+    size_t raw_bytes = 0;
+    size_t stored_bytes = 0;
+    ret = vgm_data_state_compress(player->data_state, &raw_bytes, &stored_bytes);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to compress sample data");
+        return ret;
+    }
+    ESP_LOGI(TAG, "Sample data stored in %d of %d bytes (%d%%), saving %d bytes",
+            stored_bytes, raw_bytes, raw_bytes ? (stored_bytes * 100) / raw_bytes : 0,
+            raw_bytes - stored_bytes);
+
+    int64_t time0 = esp_timer_get_time();
+    ret = vgm_plan_create(&player->plan, player->data_state, BLOCK_LOAD_MIN, BLOCK_LOAD_MAX,
+            nes_data_get_block_cost());
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "Unable to build placement plan");
+        return ret;
+    }
+    int64_t time1 = esp_timer_get_time();
+
+    vgm_plan_log_summary(player->plan);
+    ESP_LOGI(TAG, "Placement plan built in %dms", (uint32_t)((time1 - time0) / 1000));
+    return ESP_OK;
+}
+
+/**
+ * Mark a block group as no longer loaded.
+ */
+void vgm_player_unplace_block_group(vgm_data_block_group_t *block_group,
+        vgm_data_block_group_t *load_map[])
+{
+    for (uint16_t i = BLOCK_LOAD_MIN; i <= BLOCK_LOAD_MAX; i++) {
+        if (load_map[i] == block_group) {
+            load_map[i] = NULL;
+        }
+    }
+    vgm_data_block_group_set_loaded_block(block_group, 0);
+}
+
+/**
+ * Mark a block group as loaded at a slot, evicting any groups that
+ * overlap it. A group still loaded elsewhere from an earlier pass is
+ * moved.
+ */
+void vgm_player_place_block_group(vgm_data_block_group_t *block_group, uint8_t slot,
+        vgm_data_block_group_t *load_map[])
+{
+    uint8_t loaded_block = vgm_data_block_group_get_loaded_block(block_group);
+    if (loaded_block != 0 && loaded_block != slot) {
+        vgm_player_unplace_block_group(block_group, load_map);
+    }
+
+    uint16_t block_size = vgm_data_block_group_block_size(block_group);
+    for (uint16_t i = slot; i < slot + block_size && i <= BLOCK_LOAD_MAX; i++) {
+        vgm_data_block_group_t *evict_group = load_map[i];
+        if (evict_group && evict_group != block_group) {
+            uint8_t evict_slot = vgm_data_block_group_get_loaded_block(evict_group);
+            uint16_t evict_size = vgm_data_block_group_block_size(evict_group);
+            for (uint16_t e = evict_slot; e < evict_slot + evict_size && e <= BLOCK_LOAD_MAX; e++) {
+                load_map[e] = NULL;
+            }
+            vgm_data_block_group_set_loaded_block(evict_group, 0);
+        }
+        load_map[i] = block_group;
+    }
+    vgm_data_block_group_set_loaded_block(block_group, slot);
 }
 
 void vgm_player_free(vgm_player_t *player)
 {
     if (player) {
+        vgm_plan_free(player->plan);
         vgm_data_state_free(player->data_state);
+        vgm_tape_free(player->tape);
         vgm_free_gd3_tags(player->tags);
         vgm_free(player->vgm_file);
+        nbin_free(player->nbin_file);
+        free(player->filename);
         free(player);
     }
 }
@@ -19,8 +19,21 @@ esp_err_t vgm_player_init(vgm_player_t **player,
         nes_playback_repeat_t repeat,
         EventGroupHandle_t event_group);
 
+/**
+ * Get the GD3 tags for the file being played.
+ *
+ * The tags are read at the end of vgm_player_prepare(), so all their
+ * fields are empty until playback has started.
+ */
 const vgm_gd3_tags_t *vgm_player_get_gd3_tags(const vgm_player_t *player);
 
+/**
+ * Get the size of the playback event tape built by vgm_player_prepare().
+ *
+ * @return Tape size in bytes, or 0 if playback is streaming from the file
+ */
+size_t vgm_player_get_tape_size(const vgm_player_t *player);
+
 esp_err_t vgm_player_prepare(vgm_player_t *player);
 esp_err_t vgm_player_play_loop(vgm_player_t *player);
 
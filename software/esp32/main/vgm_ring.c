@@ -0,0 +1,89 @@
+#include "vgm_ring.h"
+
+#include <esp_err.h>
+#include <esp_types.h>
+#include <string.h>
+#include <stdlib.h>
+
+/*
+ * The head is only written by the producer and the tail only by the
+ * consumer. Both count up freely, and are masked to find the slot.
+ * Release stores on the index a side owns, paired with acquire loads
+ * of the other side's index, make the slot contents visible across
+ * cores without a lock.
+ */
+struct vgm_ring_t {
+    vgm_ring_entry_t *entries;
+    uint32_t mask;
+    uint32_t head;
+    uint32_t tail;
+};
+
+esp_err_t vgm_ring_create(vgm_ring_t **ring, size_t capacity)
+{
+    if (!ring || capacity == 0 || (capacity & (capacity - 1)) != 0) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    vgm_ring_t *ring_result = malloc(sizeof(vgm_ring_t));
+    if (!ring_result) {
+        return ESP_ERR_NO_MEM;
+    }
+    bzero(ring_result, sizeof(vgm_ring_t));
+
+    ring_result->entries = malloc(sizeof(vgm_ring_entry_t) * capacity);
+    if (!ring_result->entries) {
+        free(ring_result);
+        return ESP_ERR_NO_MEM;
+    }
+    ring_result->mask = capacity - 1;
+
+    *ring = ring_result;
+    return ESP_OK;
+}
+
+bool vgm_ring_push(vgm_ring_t *ring, const vgm_ring_entry_t *entry)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head - tail > ring->mask) {
+        return false;
+    }
+
+    ring->entries[head & ring->mask] = *entry;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+bool vgm_ring_pop(vgm_ring_t *ring, vgm_ring_entry_t *entry)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (head == tail) {
+        return false;
+    }
+
+    *entry = ring->entries[tail & ring->mask];
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+size_t vgm_ring_count(const vgm_ring_t *ring)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return head - tail;
+}
+
+size_t vgm_ring_capacity(const vgm_ring_t *ring)
+{
+    return ring->mask + 1;
+}
+
+void vgm_ring_free(vgm_ring_t *ring)
+{
+    if (ring) {
+        free(ring->entries);
+        free(ring);
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * VGM Playback Ring
+ *
+ * Lock-free single-producer/single-consumer ring of timestamped APU
+ * commands, used to hand decoded commands from the decoder task to the
+ * output task running on the other core.
+ */
+
+#ifndef VGM_RING_H
+#define VGM_RING_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+#include "vgm.h"
+
+typedef struct vgm_ring_t vgm_ring_t;
+
+/*
+ * Ring entries carry the song time, in samples, at which they occur.
+ * The value is the register data for VGM_CMD_NES_APU entries, and the
+ * sample count for VGM_CMD_WAIT entries.
+ */
+typedef struct {
+    uint32_t sample_time;
+    uint8_t type;
+    uint8_t reg;
+    uint16_t value;
+} vgm_ring_entry_t;
+
+/*
+ * Entry type marking where playback jumps back to the loop point, which
+ * is not a VGM command. It follows the last wait of the pass, and song
+ * time carries on increasing from there.
+ */
+#define VGM_RING_LOOP VGM_CMD_MAX
+
+/**
+ * Create an empty ring.
+ *
+ * @param capacity Number of entries, which must be a power of two
+ */
+esp_err_t vgm_ring_create(vgm_ring_t **ring, size_t capacity);
+
+/**
+ * Add an entry to the ring. Must only be called from the producer.
+ *
+ * @return true on success, false if the ring is full
+ */
+bool vgm_ring_push(vgm_ring_t *ring, const vgm_ring_entry_t *entry);
+
+/**
+ * Remove the oldest entry from the ring. Must only be called from the
+ * consumer.
+ *
+ * @return true on success, false if the ring is empty
+ */
+bool vgm_ring_pop(vgm_ring_t *ring, vgm_ring_entry_t *entry);
+
+size_t vgm_ring_count(const vgm_ring_t *ring);
+size_t vgm_ring_capacity(const vgm_ring_t *ring);
+
+void vgm_ring_free(vgm_ring_t *ring);
+
+#endif /* VGM_RING_H */
@@ -0,0 +1,412 @@
+#include "vgm_stream.h"
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_types.h>
+#include <esp_heap_caps.h>
+#include <sys/param.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "zlib.h"
+
+static const char *TAG = "vgm_stream";
+
+/* Size of the compressed input buffer */
+#define VGM_STREAM_CHUNK 4096
+
+/* Size of the scratch buffer for inflating over skipped data */
+#define VGM_STREAM_DISCARD 1024
+
+/* Size of the deflate history window saved with each checkpoint */
+#define VGM_STREAM_WINDOW 32768
+
+/* Minimum uncompressed distance between periodic checkpoints */
+#define VGM_INDEX_SPAN (128 * 1024)
+
+/* Upper limit on the memory for checkpoint windows, including the loop point */
+#define VGM_INDEX_MAX_SIZE (3 * VGM_STREAM_WINDOW)
+
+/* Fraction of the largest free heap block the checkpoint windows may use.
+ * Without PSRAM this usually leaves room for the loop point only. */
+#define VGM_INDEX_HEAP_FRACTION 2
+
+/*
+ * A point in the compressed stream where inflation can be restarted.
+ * Points are always at deflate block boundaries, which may start
+ * partway through a byte of the compressed input.
+ */
+typedef struct {
+    uint32_t out;       /* Uncompressed offset */
+    long in;            /* Offset of the first whole compressed byte */
+    int bits;           /* Number of bits from the byte before, if any */
+    uint16_t window_len;
+    uint8_t *window;
+} vgm_index_point_t;
+
+#define VGM_INDEX_MAX_POINTS (VGM_INDEX_MAX_SIZE / VGM_STREAM_WINDOW)
+
+struct vgm_stream_t {
+    FILE *file;
+    bool compressed;
+    z_stream strm;
+    bool strm_init;
+    bool strm_end;
+    uint8_t *in_buf;
+    uint8_t *discard_buf;
+    long in_base;       /* Compressed offset where the current inflate began */
+    uint32_t out_pos;   /* Current uncompressed offset */
+    uint32_t loop_offset;
+    vgm_index_point_t loop_point;
+    vgm_index_point_t points[VGM_INDEX_MAX_POINTS];
+    size_t point_count;
+    size_t index_limit; /* Memory available for checkpoint windows */
+    uint32_t index_high;
+};
+
+static esp_err_t vgm_stream_rewind(vgm_stream_t *stream);
+static esp_err_t vgm_stream_restore(vgm_stream_t *stream, const vgm_index_point_t *point);
+static void vgm_stream_index_boundary(vgm_stream_t *stream);
+static bool vgm_stream_capture_point(vgm_stream_t *stream, vgm_index_point_t *point);
+static size_t vgm_stream_index_size(const vgm_stream_t *stream);
+
+esp_err_t vgm_stream_open(vgm_stream_t **stream, const char *filename)
+{
+    esp_err_t ret = ESP_OK;
+    vgm_stream_t *result = NULL;
+
+    do {
+        result = malloc(sizeof(struct vgm_stream_t));
+        if (!result) {
+            ret = ESP_ERR_NO_MEM;
+            break;
+        }
+
+        bzero(result, sizeof(struct vgm_stream_t));
+
+        result->file = fopen(filename, "rb");
+        if (!result->file) {
+            ESP_LOGE(TAG, "Failed to open file for reading: %s", strerror(errno));
+            ret = ESP_FAIL;
+            break;
+        }
+
+        // Check for the gzip magic number
+        uint8_t magic[2];
+        if (fread(magic, 1, sizeof(magic), result->file) == sizeof(magic)
+                && magic[0] == 0x1F && magic[1] == 0x8B) {
+            result->compressed = true;
+        }
+
+        if (result->compressed) {
+            result->in_buf = malloc(VGM_STREAM_CHUNK);
+            result->discard_buf = malloc(VGM_STREAM_DISCARD);
+            if (!result->in_buf || !result->discard_buf) {
+                ret = ESP_ERR_NO_MEM;
+                break;
+            }
+
+            // Accept only a gzip wrapper at the start of the file
+            if (inflateInit2(&result->strm, 15 + 16) != Z_OK) {
+                ESP_LOGE(TAG, "inflateInit2: %s", result->strm.msg ? result->strm.msg : "");
+                ret = ESP_ERR_NO_MEM;
+                break;
+            }
+            result->strm_init = true;
+
+            // The windows come out of the same heap as everything else
+            // the prepare scan builds, so only take a share of it.
+            result->index_limit = MIN(heap_caps_get_largest_free_block(MALLOC_CAP_8BIT) / VGM_INDEX_HEAP_FRACTION,
+                    VGM_INDEX_MAX_SIZE);
+        }
+
+        ret = vgm_stream_rewind(result);
+    } while (0);
+
+    if (ret == ESP_OK) {
+        *stream = result;
+    } else {
+        vgm_stream_close(result);
+    }
+
+    return ret;
+}
+
+esp_err_t vgm_stream_rewind(vgm_stream_t *stream)
+{
+    if (fseek(stream->file, 0, SEEK_SET) != 0) {
+        ESP_LOGE(TAG, "fseek: %s", strerror(errno));
+        return ESP_FAIL;
+    }
+    stream->out_pos = 0;
+
+    if (stream->compressed) {
+        if (inflateReset2(&stream->strm, 15 + 16) != Z_OK) {
+            return ESP_FAIL;
+        }
+        stream->strm.next_in = stream->in_buf;
+        stream->strm.avail_in = 0;
+        stream->strm_end = false;
+        stream->in_base = 0;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t vgm_stream_restore(vgm_stream_t *stream, const vgm_index_point_t *point)
+{
+    // Resume in raw deflate mode, since the gzip header is behind us
+    if (inflateReset2(&stream->strm, -15) != Z_OK) {
+        return ESP_FAIL;
+    }
+
+    if (fseek(stream->file, point->in - (point->bits ? 1 : 0), SEEK_SET) != 0) {
+        ESP_LOGE(TAG, "fseek: %s", strerror(errno));
+        return ESP_FAIL;
+    }
+
+    if (point->bits) {
+        int ch = fgetc(stream->file);
+        if (ch == EOF) {
+            ESP_LOGE(TAG, "Unexpected end of file");
+            return ESP_FAIL;
+        }
+        inflatePrime(&stream->strm, point->bits, ch >> (8 - point->bits));
+    }
+
+    if (point->window_len > 0) {
+        inflateSetDictionary(&stream->strm, point->window, point->window_len);
+    }
+
+    stream->strm.next_in = stream->in_buf;
+    stream->strm.avail_in = 0;
+    stream->strm_end = false;
+    stream->in_base = point->in;
+    stream->out_pos = point->out;
+
+    return ESP_OK;
+}
+
+int vgm_stream_read(vgm_stream_t *stream, void *buf, size_t len)
+{
+    if (!stream->compressed) {
+        size_t n = fread(buf, 1, len, stream->file);
+        if (n < len && ferror(stream->file)) {
+            ESP_LOGE(TAG, "fread: %s", strerror(errno));
+            return -1;
+        }
+        stream->out_pos += n;
+        return n;
+    }
+
+    z_stream *strm = &stream->strm;
+    strm->next_out = buf;
+    strm->avail_out = len;
+
+    while (strm->avail_out > 0 && !stream->strm_end) {
+        if (strm->avail_in == 0) {
+            size_t n = fread(stream->in_buf, 1, VGM_STREAM_CHUNK, stream->file);
+            if (n == 0) {
+                if (ferror(stream->file)) {
+                    ESP_LOGE(TAG, "fread: %s", strerror(errno));
+                    return -1;
+                }
+                ESP_LOGW(TAG, "Compressed data ended early");
+                stream->strm_end = true;
+                break;
+            }
+            strm->next_in = stream->in_buf;
+            strm->avail_in = n;
+        }
+
+        // Stop at each deflate block boundary, so checkpoints can be taken
+        uInt avail_out = strm->avail_out;
+        int ret = inflate(strm, Z_BLOCK);
+        stream->out_pos += avail_out - strm->avail_out;
+
+        if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
+            ESP_LOGE(TAG, "inflate: %s [%d]", strm->msg ? strm->msg : "", ret);
+            return -1;
+        }
+
+        if (ret == Z_STREAM_END) {
+            stream->strm_end = true;
+        }
+        else if ((strm->data_type & 128) && !(strm->data_type & 64)) {
+            vgm_stream_index_boundary(stream);
+        }
+    }
+
+    return len - strm->avail_out;
+}
+
+esp_err_t vgm_stream_seek(vgm_stream_t *stream, uint32_t offset)
+{
+    if (!stream->compressed) {
+        if (fseek(stream->file, offset, SEEK_SET) != 0) {
+            ESP_LOGE(TAG, "fseek: %s", strerror(errno));
+            return ESP_FAIL;
+        }
+        stream->out_pos = offset;
+        return ESP_OK;
+    }
+
+    // Find the closest checkpoint at or before the offset
+    const vgm_index_point_t *point = NULL;
+    for (size_t i = 0; i < stream->point_count; i++) {
+        if (stream->points[i].out <= offset
+                && (!point || stream->points[i].out > point->out)) {
+            point = &stream->points[i];
+        }
+    }
+    if (stream->loop_point.window && stream->loop_point.out <= offset
+            && (!point || stream->loop_point.out > point->out)) {
+        point = &stream->loop_point;
+    }
+
+    // Only jump if that gets us closer than the current position,
+    // otherwise start over or keep inflating forward.
+    if (point && (offset < stream->out_pos || point->out > stream->out_pos)) {
+        if (vgm_stream_restore(stream, point) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+    else if (offset < stream->out_pos) {
+        if (vgm_stream_rewind(stream) != ESP_OK) {
+            return ESP_FAIL;
+        }
+    }
+
+    // Inflate over anything between the current position and the offset
+    while (stream->out_pos < offset) {
+        size_t len = MIN(offset - stream->out_pos, VGM_STREAM_DISCARD);
+        int n = vgm_stream_read(stream, stream->discard_buf, len);
+        if (n < 0) {
+            return ESP_FAIL;
+        }
+        if (n < len) {
+            ESP_LOGE(TAG, "Seek past end of stream");
+            return ESP_FAIL;
+        }
+    }
+
+    return ESP_OK;
+}
+
+uint32_t vgm_stream_tell(const vgm_stream_t *stream)
+{
+    return stream->out_pos;
+}
+
+void vgm_stream_set_loop_offset(vgm_stream_t *stream, uint32_t offset)
+{
+    stream->loop_offset = offset;
+}
+
+void vgm_stream_index_boundary(vgm_stream_t *stream)
+{
+    // Checkpoints are only collected the first time through the stream
+    if (stream->out_pos <= stream->index_high) {
+        return;
+    }
+    stream->index_high = stream->out_pos;
+
+    // Keep the last boundary at or before the loop offset, replacing
+    // it as later boundaries are found.
+    if (stream->loop_offset > 0 && stream->out_pos <= stream->loop_offset) {
+        if (stream->loop_point.window || stream->index_limit >= VGM_STREAM_WINDOW) {
+            vgm_stream_capture_point(stream, &stream->loop_point);
+        }
+        return;
+    }
+
+    // Add periodic checkpoints while there is space for them, leaving
+    // room for the loop point.
+    uint32_t last_out = stream->point_count > 0 ? stream->points[stream->point_count - 1].out : 0;
+    if (stream->loop_point.window) {
+        last_out = MAX(last_out, stream->loop_point.out);
+    }
+    if (stream->out_pos - last_out < VGM_INDEX_SPAN) {
+        return;
+    }
+    size_t reserved = stream->loop_point.window ? 0 : (stream->loop_offset > 0 ? VGM_STREAM_WINDOW : 0);
+    if (stream->point_count >= VGM_INDEX_MAX_POINTS
+            || vgm_stream_index_size(stream) + reserved + VGM_STREAM_WINDOW > stream->index_limit) {
+        return;
+    }
+
+    if (vgm_stream_capture_point(stream, &stream->points[stream->point_count])) {
+        stream->point_count++;
+    }
+}
+
+bool vgm_stream_capture_point(vgm_stream_t *stream, vgm_index_point_t *point)
+{
+    if (!point->window) {
+        point->window = malloc(VGM_STREAM_WINDOW);
+        if (!point->window) {
+            ESP_LOGW(TAG, "Unable to allocate checkpoint window");
+            return false;
+        }
+    }
+
+    uInt window_len = VGM_STREAM_WINDOW;
+    if (inflateGetDictionary(&stream->strm, point->window, &window_len) != Z_OK) {
+        return false;
+    }
+
+    point->out = stream->out_pos;
+    point->in = stream->in_base + stream->strm.total_in;
+    point->bits = stream->strm.data_type & 7;
+    point->window_len = window_len;
+
+    return true;
+}
+
+size_t vgm_stream_index_size(const vgm_stream_t *stream)
+{
+    size_t size = stream->loop_point.window ? VGM_STREAM_WINDOW : 0;
+    size += stream->point_count * VGM_STREAM_WINDOW;
+    return size;
+}
+
+void vgm_stream_log_index(const vgm_stream_t *stream)
+{
+    if (!stream->compressed) {
+        return;
+    }
+
+    ESP_LOGI(TAG, "Seek index: %d points, %d of %d bytes",
+            (int)(stream->point_count + (stream->loop_point.window ? 1 : 0)),
+            (int)vgm_stream_index_size(stream), (int)stream->index_limit);
+
+    if (stream->loop_point.window) {
+        ESP_LOGI(TAG, "Loop point: out=%d, in=%ld, bits=%d",
+                stream->loop_point.out, stream->loop_point.in, stream->loop_point.bits);
+    }
+    for (size_t i = 0; i < stream->point_count; i++) {
+        ESP_LOGI(TAG, "Point: out=%d, in=%ld, bits=%d",
+                stream->points[i].out, stream->points[i].in, stream->points[i].bits);
+    }
+}
+
+void vgm_stream_close(vgm_stream_t *stream)
+{
+    if (stream) {
+        if (stream->strm_init) {
+            inflateEnd(&stream->strm);
+        }
+        if (stream->file) {
+            fclose(stream->file);
+        }
+        for (size_t i = 0; i < VGM_INDEX_MAX_POINTS; i++) {
+            free(stream->points[i].window);
+        }
+        free(stream->loop_point.window);
+        free(stream->discard_buf);
+        free(stream->in_buf);
+        free(stream);
+    }
+}
@@ -0,0 +1,53 @@
+/*
+ * VGM File Stream
+ *
+ * Byte stream access to a plain or gzip-compressed VGM file, with a
+ * checkpoint index for bounded-cost seeks within compressed files.
+ */
+
+#ifndef VGM_STREAM_H
+#define VGM_STREAM_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+
+typedef struct vgm_stream_t vgm_stream_t;
+
+esp_err_t vgm_stream_open(vgm_stream_t **stream, const char *filename);
+
+/**
+ * Read uncompressed bytes from the current position.
+ *
+ * @return Number of bytes read, which is less than requested at the
+ *         end of the stream, or -1 on error
+ */
+int vgm_stream_read(vgm_stream_t *stream, void *buf, size_t len);
+
+/**
+ * Seek to an absolute uncompressed offset.
+ *
+ * Within a compressed file, this resumes from the nearest checkpoint
+ * at or before the offset, and inflates forward from there.
+ */
+esp_err_t vgm_stream_seek(vgm_stream_t *stream, uint32_t offset);
+
+uint32_t vgm_stream_tell(const vgm_stream_t *stream);
+
+/**
+ * Set the offset that the stream is expected to seek back to repeatedly,
+ * so that a checkpoint is reserved for it while the index is built.
+ */
+void vgm_stream_set_loop_offset(vgm_stream_t *stream, uint32_t offset);
+
+/**
+ * Log the checkpoints collected so far.
+ *
+ * Checkpoints are collected as the compressed stream is read forward
+ * for the first time, so the index is complete once the whole file
+ * has been read through.
+ */
+void vgm_stream_log_index(const vgm_stream_t *stream);
+
+void vgm_stream_close(vgm_stream_t *stream);
+
+#endif /* VGM_STREAM_H */
@@ -0,0 +1,348 @@
+#include "vgm_tape.h"
+
+#include <esp_err.h>
+#include <esp_log.h>
+#include <esp_types.h>
+#include <sys/param.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "vpool.h"
+
+static const char *TAG = "vgm_tape";
+
+/* Register value used for events that only carry a wait */
+#define VGM_TAPE_REG_WAIT 0xFF
+
+/* Growth increment for the tape buffer during recording */
+#define VGM_TAPE_BLOCK_SIZE 16384
+
+/*
+ * Each event waits for its delta, in samples, and then writes its value
+ * to APU register $4000 + reg. The register byte is VGM_TAPE_REG_WAIT
+ * for events that only wait.
+ */
+typedef struct {
+    uint16_t delta;
+    uint8_t reg;
+    uint8_t dat;
+} vgm_tape_event_t;
+
+/*
+ * A tape written to a file is this header followed by the events.
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t count;
+    uint32_t loop_index;
+    uint32_t has_loop;
+} vgm_tape_file_header_t;
+
+struct vgm_tape_t {
+    struct vpool pool;
+    vgm_tape_event_t *events;
+    size_t count;
+    size_t loop_index;
+    bool has_loop;
+    bool finished;
+    uint32_t pending_wait;
+    size_t index;
+    bool wait_done;
+    uint32_t sample_index;
+};
+
+static esp_err_t vgm_tape_push(vgm_tape_t *tape, uint16_t delta, uint8_t reg, uint8_t dat);
+static esp_err_t vgm_tape_flush_wait(vgm_tape_t *tape);
+
+vgm_tape_t *vgm_tape_create(size_t limit)
+{
+    vgm_tape_t *tape = malloc(sizeof(struct vgm_tape_t));
+    if (!tape) {
+        return NULL;
+    }
+
+    bzero(tape, sizeof(struct vgm_tape_t));
+    vpool_init(&tape->pool, VGM_TAPE_BLOCK_SIZE, limit);
+
+    return tape;
+}
+
+esp_err_t vgm_tape_push(vgm_tape_t *tape, uint16_t delta, uint8_t reg, uint8_t dat)
+{
+    vgm_tape_event_t event = {
+        .delta = delta,
+        .reg = reg,
+        .dat = dat
+    };
+
+    if (!vpool_insert(&tape->pool, vpool_get_length(&tape->pool), &event, sizeof(vgm_tape_event_t))) {
+        return ESP_ERR_NO_MEM;
+    }
+    tape->count++;
+
+    return ESP_OK;
+}
+
+esp_err_t vgm_tape_flush_wait(vgm_tape_t *tape)
+{
+    // Waits too long for a single event are split across wait-only events
+    while (tape->pending_wait > 0) {
+        uint16_t delta = MIN(tape->pending_wait, UINT16_MAX);
+        if (vgm_tape_push(tape, delta, VGM_TAPE_REG_WAIT, 0) != ESP_OK) {
+            return ESP_ERR_NO_MEM;
+        }
+        tape->pending_wait -= delta;
+    }
+    return ESP_OK;
+}
+
+esp_err_t vgm_tape_append(vgm_tape_t *tape, const vgm_command_t *command)
+{
+    if (!tape || !command || tape->finished) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (command->type == VGM_CMD_WAIT) {
+        tape->pending_wait += command->info.wait.samples;
+    }
+    else if (command->type == VGM_CMD_NES_APU) {
+        uint16_t delta = 0;
+        if (tape->pending_wait > UINT16_MAX) {
+            if (vgm_tape_flush_wait(tape) != ESP_OK) {
+                return ESP_ERR_NO_MEM;
+            }
+        } else {
+            delta = tape->pending_wait;
+            tape->pending_wait = 0;
+        }
+
+        if (vgm_tape_push(tape, delta,
+                command->info.nes_apu.reg & 0x00FF,
+                command->info.nes_apu.dat) != ESP_OK) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t vgm_tape_mark_loop(vgm_tape_t *tape)
+{
+    if (!tape || tape->finished) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    // Any wait so far belongs before the loop point
+    if (vgm_tape_flush_wait(tape) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    tape->loop_index = tape->count;
+    tape->has_loop = true;
+
+    return ESP_OK;
+}
+
+esp_err_t vgm_tape_finish(vgm_tape_t *tape)
+{
+    if (!tape || tape->finished) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (vgm_tape_flush_wait(tape) != ESP_OK) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    // Take ownership of the recorded events, trimming the buffer
+    // down to its used size.
+    size_t len = vpool_get_length(&tape->pool);
+    if (len > 0) {
+        void *buf = vpool_get_buf(&tape->pool);
+        void *events = malloc(len);
+        if (events) {
+            memcpy(events, buf, len);
+            vpool_final(&tape->pool);
+        } else {
+            events = buf;
+        }
+        tape->events = events;
+    } else {
+        vpool_final(&tape->pool);
+    }
+    vpool_init(&tape->pool, VGM_TAPE_BLOCK_SIZE, 0);
+
+    tape->finished = true;
+    vgm_tape_seek_start(tape);
+
+    return ESP_OK;
+}
+
+size_t vgm_tape_event_count(const vgm_tape_t *tape)
+{
+    return tape->count;
+}
+
+size_t vgm_tape_byte_size(const vgm_tape_t *tape)
+{
+    return tape->count * sizeof(vgm_tape_event_t);
+}
+
+bool vgm_tape_has_loop(const vgm_tape_t *tape)
+{
+    return tape->has_loop;
+}
+
+void vgm_tape_rewrite(vgm_tape_t *tape, nes_apu_register_t reg, vgm_tape_rewrite_cb_t cb, void *ctx)
+{
+    if (!tape->finished) {
+        return;
+    }
+
+    uint32_t sample_time = 0;
+    for (size_t i = 0; i < tape->count; i++) {
+        vgm_tape_event_t *event = &tape->events[i];
+        sample_time += event->delta;
+        if (event->reg == (reg & 0xFF)) {
+            event->dat = cb(sample_time, event->dat, ctx);
+        }
+    }
+}
+
+size_t vgm_tape_file_size(const vgm_tape_t *tape)
+{
+    return sizeof(vgm_tape_file_header_t) + vgm_tape_byte_size(tape);
+}
+
+esp_err_t vgm_tape_write(const vgm_tape_t *tape, FILE *file)
+{
+    if (!tape || !tape->finished || !file) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    vgm_tape_file_header_t header = {
+        .count = tape->count,
+        .loop_index = tape->loop_index,
+        .has_loop = tape->has_loop ? 1 : 0
+    };
+
+    if (fwrite(&header, sizeof(vgm_tape_file_header_t), 1, file) != 1) {
+        return ESP_FAIL;
+    }
+    if (tape->count > 0 && fwrite(tape->events, sizeof(vgm_tape_event_t), tape->count, file) != tape->count) {
+        return ESP_FAIL;
+    }
+
+    return ESP_OK;
+}
+
+esp_err_t vgm_tape_read(vgm_tape_t **tape, FILE *file, size_t len, size_t limit)
+{
+    vgm_tape_file_header_t header;
+
+    if (!tape || !file) {
+        return ESP_ERR_INVALID_ARG;
+    }
+
+    if (len < sizeof(vgm_tape_file_header_t)
+            || fread(&header, sizeof(vgm_tape_file_header_t), 1, file) != 1) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if ((uint64_t)header.count * sizeof(vgm_tape_event_t) != len - sizeof(vgm_tape_file_header_t)
+            || header.loop_index > header.count) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    if (header.count * sizeof(vgm_tape_event_t) > limit) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    vgm_tape_t *result = vgm_tape_create(0);
+    if (!result) {
+        return ESP_ERR_NO_MEM;
+    }
+
+    if (header.count > 0) {
+        result->events = malloc(header.count * sizeof(vgm_tape_event_t));
+        if (!result->events) {
+            vgm_tape_free(result);
+            return ESP_ERR_NO_MEM;
+        }
+        if (fread(result->events, sizeof(vgm_tape_event_t), header.count, file) != header.count) {
+            free(result->events);
+            vgm_tape_free(result);
+            return ESP_ERR_INVALID_SIZE;
+        }
+    }
+
+    result->count = header.count;
+    result->loop_index = header.loop_index;
+    result->has_loop = header.has_loop != 0;
+    result->finished = true;
+    vgm_tape_seek_start(result);
+
+    *tape = result;
+    return ESP_OK;
+}
+
+void vgm_tape_seek_start(vgm_tape_t *tape)
+{
+    tape->index = 0;
+    tape->wait_done = false;
+    tape->sample_index = 0;
+}
+
+void vgm_tape_seek_loop(vgm_tape_t *tape)
+{
+    if (!tape->has_loop) {
+        ESP_LOGE(TAG, "tape does not have a loop point");
+        return;
+    }
+    tape->index = tape->loop_index;
+    tape->wait_done = false;
+}
+
+esp_err_t vgm_tape_next_command(vgm_tape_t *tape, vgm_command_t *command)
+{
+    if (!tape->finished) {
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    memset(command, 0, sizeof(vgm_command_t));
+    command->sample_index = tape->sample_index;
+
+    if (tape->index >= tape->count) {
+        command->type = VGM_CMD_DONE;
+        return ESP_OK;
+    }
+
+    const vgm_tape_event_t *event = &tape->events[tape->index];
+
+    if (event->delta > 0 && !tape->wait_done) {
+        command->type = VGM_CMD_WAIT;
+        command->info.wait.samples = event->delta;
+        tape->sample_index += event->delta;
+
+        if (event->reg == VGM_TAPE_REG_WAIT) {
+            tape->index++;
+        } else {
+            tape->wait_done = true;
+        }
+    } else {
+        command->type = VGM_CMD_NES_APU;
+        command->info.nes_apu.reg = 0x4000 + event->reg;
+        command->info.nes_apu.dat = event->dat;
+        tape->index++;
+        tape->wait_done = false;
+    }
+
+    return ESP_OK;
+}
+
+void vgm_tape_free(vgm_tape_t *tape)
+{
+    if (tape) {
+        if (tape->finished) {
+            free(tape->events);
+        }
+        vpool_final(&tape->pool);
+        free(tape);
+    }
+}
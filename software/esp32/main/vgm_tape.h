@@ -0,0 +1,103 @@
+/*
+ * VGM Playback Event Tape
+ *
+ * Compact in-memory copy of the APU register writes and waits from a
+ * VGM file, built during the prepare scan so that playback does not
+ * need to decode the compressed file in real time.
+ */
+
+#ifndef VGM_TAPE_H
+#define VGM_TAPE_H
+
+#include <esp_err.h>
+#include <esp_types.h>
+#include <stdio.h>
+
+#include "vgm.h"
+
+typedef struct vgm_tape_t vgm_tape_t;
+
+/**
+ * Create an empty tape.
+ *
+ * @param limit Maximum size of the tape data, in bytes
+ * @return A new tape, or NULL if it could not be allocated
+ */
+vgm_tape_t *vgm_tape_create(size_t limit);
+
+/**
+ * Append a command to the tape.
+ *
+ * Only wait and NES APU commands are recorded, anything else is ignored.
+ * Adjacent waits are merged.
+ *
+ * @return ESP_OK on success, ESP_ERR_NO_MEM if the tape has exceeded
+ *         its size limit
+ */
+esp_err_t vgm_tape_append(vgm_tape_t *tape, const vgm_command_t *command);
+
+/**
+ * Mark the current end of the tape as the loop point.
+ */
+esp_err_t vgm_tape_mark_loop(vgm_tape_t *tape);
+
+/**
+ * Finish recording, flushing any pending wait and releasing any
+ * unused space.
+ */
+esp_err_t vgm_tape_finish(vgm_tape_t *tape);
+
+size_t vgm_tape_event_count(const vgm_tape_t *tape);
+size_t vgm_tape_byte_size(const vgm_tape_t *tape);
+bool vgm_tape_has_loop(const vgm_tape_t *tape);
+
+/**
+ * Callback for vgm_tape_rewrite(), returning the new value for a write.
+ *
+ * @param sample_time Time of the write, from the start of the tape
+ * @param dat Value currently on the tape
+ */
+typedef uint8_t (*vgm_tape_rewrite_cb_t)(uint32_t sample_time, uint8_t dat, void *ctx);
+
+/**
+ * Rewrite the value of every write to one register on a finished tape,
+ * in tape order. This is how DMC addresses are resolved to the blocks
+ * the samples will be loaded into.
+ *
+ * @param reg APU register to rewrite the writes to
+ */
+void vgm_tape_rewrite(vgm_tape_t *tape, nes_apu_register_t reg, vgm_tape_rewrite_cb_t cb, void *ctx);
+
+/**
+ * Get the number of bytes vgm_tape_write() will write for a finished tape.
+ */
+size_t vgm_tape_file_size(const vgm_tape_t *tape);
+
+/**
+ * Write a finished tape to a file, in the form vgm_tape_read() loads.
+ */
+esp_err_t vgm_tape_write(const vgm_tape_t *tape, FILE *file);
+
+/**
+ * Read a tape written by vgm_tape_write(), as a finished tape.
+ *
+ * @param len Number of bytes the tape takes up in the file
+ * @param limit Maximum size of the tape data, in bytes
+ * @return ESP_ERR_NO_MEM if the tape is over the limit or could not be
+ *         allocated, ESP_ERR_INVALID_SIZE if the tape is not valid
+ */
+esp_err_t vgm_tape_read(vgm_tape_t **tape, FILE *file, size_t len, size_t limit);
+
+void vgm_tape_seek_start(vgm_tape_t *tape);
+void vgm_tape_seek_loop(vgm_tape_t *tape);
+
+/**
+ * Read the next command from the tape, in the same form as
+ * vgm_next_command() would return it from the original file.
+ * The end of the tape is returned as a VGM_CMD_DONE command.
+ */
+esp_err_t vgm_tape_next_command(vgm_tape_t *tape, vgm_command_t *command);
+
+void vgm_tape_free(vgm_tape_t *tape);
+
+#endif /* VGM_TAPE_H */
@@ -0,0 +1,173 @@
+/*
+ * Host benchmark for the 6502 core.
+ *
+ * Runs a fixed number of clock ticks through fake6502.c, several times
+ * over, and reports the emulated clock rate along with how many times
+ * faster than a real 2A03 that is.
+ *
+ * With no image, a small built-in loop is run, mixing the indirect
+ * loads, arithmetic, indexed stores and calls that NSF play routines
+ * spend most of their time in. Otherwise, a 64K memory image is loaded
+ * and run from its reset vector.
+ *
+ * "make cpubench_baseline" builds the same benchmark against the core as
+ * it was before the switch-dispatched rework, for a before and after
+ * comparison.
+ *
+ * Usage: cpubench [-n passes] [-t ticks] [image.bin]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include <esp_timer.h>
+
+#include "fake6502.h"
+
+/* NTSC 2A03 clock rate, in Hz */
+#define CPU_CLOCK_NTSC 1789773
+
+#define BENCH_START 0x0200
+#define BENCH_SUB   0x0220
+
+/*
+ * The built-in loop, at BENCH_START:
+ *   ldy #0
+ *   ldx #0
+ * loop:
+ *   lda ($10),y
+ *   clc
+ *   adc $20
+ *   sta $20
+ *   lsr a
+ *   sta $0300,x
+ *   jsr sub
+ *   inx
+ *   iny
+ *   bne loop
+ *   jmp loop
+ */
+static const uint8_t bench_code[] = {
+    0xA0, 0x00, 0xA2, 0x00, 0xB1, 0x10, 0x18, 0x65,
+    0x20, 0x85, 0x20, 0x4A, 0x9D, 0x00, 0x03, 0x20,
+    0x20, 0x02, 0xE8, 0xC8, 0xD0, 0xEE, 0x4C, 0x04,
+    0x02
+};
+
+/*
+ * At BENCH_SUB:
+ *   inc $21
+ *   rts
+ */
+static const uint8_t bench_sub[] = {
+    0xE6, 0x21, 0x60
+};
+
+static uint8_t memory[0x10000];
+static uint8_t image[0x10000];
+
+uint8_t read6502(uint16_t address)
+{
+    return memory[address];
+}
+
+void write6502(uint16_t address, uint8_t value)
+{
+    memory[address] = value;
+}
+
+static void bench_image_builtin()
+{
+    memset(image, 0, sizeof(image));
+    memcpy(image + BENCH_START, bench_code, sizeof(bench_code));
+    memcpy(image + BENCH_SUB, bench_sub, sizeof(bench_sub));
+
+    // Point ($10) at some data to sum
+    image[0x10] = 0x00;
+    image[0x11] = 0x10;
+    for (int i = 0; i < 0x100; i++) {
+        image[0x1000 + i] = (uint8_t)(i * 7);
+    }
+
+    image[0xFFFC] = BENCH_START & 0xFF;
+    image[0xFFFD] = BENCH_START >> 8;
+}
+
+static bool bench_image_load(const char *filename)
+{
+    FILE *file = fopen(filename, "rb");
+    if (!file) {
+        return false;
+    }
+    size_t len = fread(image, 1, sizeof(image), file);
+    fclose(file);
+    return len == sizeof(image);
+}
+
+static int64_t bench_pass(uint32_t ticks)
+{
+    memcpy(memory, image, sizeof(memory));
+    reset6502();
+
+    int64_t time0 = esp_timer_get_time();
+    uint32_t start = get6502_ticks();
+    while (get6502_ticks() - start < ticks) {
+        exec6502(ticks - (get6502_ticks() - start));
+    }
+    int64_t time1 = esp_timer_get_time();
+
+    return time1 - time0;
+}
+
+int main(int argc, char **argv)
+{
+    int passes = 5;
+    uint32_t ticks = 100000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:t:")) != -1) {
+        if (opt == 'n') {
+            passes = atoi(optarg);
+        } else if (opt == 't') {
+            ticks = strtoul(optarg, NULL, 0);
+        } else {
+            fprintf(stderr, "Usage: %s [-n passes] [-t ticks] [image.bin]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 < argc || passes < 1 || ticks == 0) {
+        fprintf(stderr, "Usage: %s [-n passes] [-t ticks] [image.bin]\n", argv[0]);
+        return 1;
+    }
+
+    if (optind < argc) {
+        if (!bench_image_load(argv[optind])) {
+            fprintf(stderr, "%s: unable to load a 64K image\n", argv[optind]);
+            return 1;
+        }
+    } else {
+        bench_image_builtin();
+    }
+
+    // Keep the fastest pass, which is the one least disturbed by the
+    // rest of the system
+    int64_t best = 0;
+    for (int pass = 0; pass < passes; pass++) {
+        int64_t elapsed = bench_pass(ticks);
+        best = (pass == 0) ? elapsed : MIN(best, elapsed);
+    }
+    if (best <= 0) {
+        best = 1;
+    }
+
+    double mhz = (double)ticks / best;
+    printf("%u ticks in %lld us: %.2f MHz emulated, %.1fx a 2A03\n",
+            ticks, (long long)best, mhz, (mhz * 1000000.0) / CPU_CLOCK_NTSC);
+
+    return 0;
+}
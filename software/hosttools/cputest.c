@@ -0,0 +1,137 @@
+/*
+ * Runner for 6502 functional test ROMs, such as Klaus Dormann's
+ * 6502_functional_test, on the host build of the 6502 core.
+ *
+ * The test image is a 64K memory dump. It is run from its reset vector,
+ * or from the given start address, until it traps by jumping or
+ * branching to itself. Reaching the success address passes; trapping
+ * anywhere else fails, and the address is reported so it can be looked
+ * up in the test's listing.
+ *
+ * The core leaves out decimal mode, as the 2A03 does, so the functional
+ * test must be assembled with disable_decimal = 1. The default success
+ * address is that of the stock build, and will differ for others.
+ *
+ * Usage: cputest [-s start] [-p success] [-t maxticks] <image.bin>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "fake6502.h"
+
+#define DEFAULT_SUCCESS 0x3469
+
+/* Ticks to run between checks for a trap */
+#define CHECK_TICKS 100000
+
+static uint8_t memory[0x10000];
+
+uint8_t read6502(uint16_t address)
+{
+    return memory[address];
+}
+
+void write6502(uint16_t address, uint8_t value)
+{
+    memory[address] = value;
+}
+
+/*
+ * Check whether the instruction at an address only ever goes back to
+ * itself, which is how the test stops on success and on failure.
+ */
+static bool is_trap(uint16_t pc)
+{
+    uint8_t opcode = memory[pc];
+    uint8_t lo = memory[(uint16_t)(pc + 1)];
+    uint8_t hi = memory[(uint16_t)(pc + 2)];
+
+    if (opcode == 0x4C) {
+        // jmp *
+        return (lo | (hi << 8)) == pc;
+    }
+    if ((opcode & 0x1F) == 0x10) {
+        // Branch with an offset of -2
+        return lo == 0xFE;
+    }
+    return false;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-s start] [-p success] [-t maxticks] <image.bin>\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    long start = -1;
+    uint16_t success = DEFAULT_SUCCESS;
+    uint32_t maxticks = 200000000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:p:t:")) != -1) {
+        if (opt == 's') {
+            start = strtol(optarg, NULL, 16) & 0xFFFF;
+        } else if (opt == 'p') {
+            success = strtoul(optarg, NULL, 16) & 0xFFFF;
+        } else if (opt == 't') {
+            maxticks = strtoul(optarg, NULL, 0);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind + 1 != argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *file = fopen(argv[optind], "rb");
+    if (!file) {
+        fprintf(stderr, "%s: unable to open\n", argv[optind]);
+        return 1;
+    }
+    size_t len = fread(memory, 1, sizeof(memory), file);
+    fclose(file);
+    if (len != sizeof(memory)) {
+        fprintf(stderr, "%s: not a 64K image\n", argv[optind]);
+        return 1;
+    }
+
+    // The core only starts through the reset vector
+    if (start >= 0) {
+        memory[0xFFFC] = start & 0xFF;
+        memory[0xFFFD] = start >> 8;
+    }
+    reset6502();
+
+    bool passed = false;
+    uint32_t ticks = 0;
+    while (ticks < maxticks) {
+        uint32_t ticks0 = get6502_ticks();
+        if (run6502(success, CHECK_TICKS)) {
+            passed = true;
+            break;
+        }
+        ticks += get6502_ticks() - ticks0;
+
+        if (is_trap(get6502_pc())) {
+            break;
+        }
+    }
+
+    uint16_t pc = get6502_pc();
+    if (passed) {
+        printf("PASS: reached $%04X after %u ticks\n", pc, get6502_ticks());
+        return 0;
+    } else if (ticks >= maxticks) {
+        printf("FAIL: no trap after %u ticks, PC at $%04X\n", get6502_ticks(), pc);
+    } else {
+        printf("FAIL: trapped at $%04X after %u ticks\n", pc, get6502_ticks());
+    }
+    return 1;
+}
@@ -0,0 +1,304 @@
+/*
+ * Host benchmark for the DMC sample bookkeeping.
+ *
+ * Each file is decoded once, keeping only the commands the prepare scan
+ * acts on. Those are then replayed several times over through the
+ * firmware's sample modules, timing each stage:
+ * - add: staging data blocks and adding a reference for each DMC
+ *   trigger, as the prepare scan does
+ * - finish: merging duplicates, run length coding and building the
+ *   placement plan
+ * - walk: looking up every reference and reading its sample data, as
+ *   playback does
+ * - free: releasing the staged data, the state and the plan
+ *
+ * Files with many DMC triggers make the most of this.
+ *
+ * Usage: databench [-n passes] <file.vgm|file.vgz>...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+#include <esp_timer.h>
+
+#include "vgm.h"
+#include "vgm_data.h"
+#include "vgm_plan.h"
+#include "nes.h"
+
+/* Upload time for one block, as assumed before a real one is measured */
+#define BLOCK_LOAD_US 3500
+
+/* Somewhere for the sample reads to go, so they are not optimized away */
+static volatile uint32_t bench_sink;
+
+/*
+ * A command the prepare scan acts on. Waits are folded into the sample
+ * time of the command that ends them.
+ */
+typedef enum {
+    EVENT_DATA_BLOCK,
+    EVENT_MODADDR,
+    EVENT_MODLEN,
+    EVENT_GROUP_END
+} event_type_t;
+
+typedef struct {
+    event_type_t type;
+    uint32_t sample_time;
+    uint16_t addr;
+    uint8_t dat;
+    uint8_t *data;
+    size_t len;
+} event_t;
+
+typedef struct {
+    event_t *events;
+    size_t count;
+    size_t capacity;
+} event_list_t;
+
+typedef struct {
+    int64_t add;
+    int64_t finish;
+    int64_t walk;
+    int64_t free;
+    size_t refs;
+    size_t groups;
+} bench_result_t;
+
+static bool event_push(event_list_t *list, const event_t *event)
+{
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 1024;
+        event_t *events = realloc(list->events, capacity * sizeof(event_t));
+        if (!events) {
+            return false;
+        }
+        list->events = events;
+        list->capacity = capacity;
+    }
+    list->events[list->count++] = *event;
+    return true;
+}
+
+static void event_list_free(event_list_t *list)
+{
+    for (size_t i = 0; i < list->count; i++) {
+        free(list->events[i].data);
+    }
+    free(list->events);
+}
+
+static bool record_events(const char *filename, event_list_t *list)
+{
+    vgm_file_t *vgm_file;
+    if (vgm_open(&vgm_file, filename) != ESP_OK) {
+        return false;
+    }
+
+    bool ok = true;
+    uint32_t sample_time = 0;
+    vgm_command_t command;
+    while (ok) {
+        if (vgm_next_command(vgm_file, &command, /*load_data*/true) != ESP_OK) {
+            ok = false;
+            break;
+        }
+
+        event_t event = { .sample_time = sample_time };
+        if (command.type == VGM_CMD_DATA_BLOCK) {
+            event.type = EVENT_DATA_BLOCK;
+            event.addr = command.info.data_block.addr;
+            event.data = command.info.data_block.data;
+            event.len = command.info.data_block.len;
+            ok = event_push(list, &event);
+        } else if (command.type == VGM_CMD_NES_APU
+                && (command.info.nes_apu.reg == NES_APU_MODADDR
+                    || command.info.nes_apu.reg == NES_APU_MODLEN)) {
+            event.type = (command.info.nes_apu.reg == NES_APU_MODADDR) ? EVENT_MODADDR : EVENT_MODLEN;
+            event.dat = command.info.nes_apu.dat;
+            ok = event_push(list, &event);
+        } else if (command.type == VGM_CMD_WAIT || command.type == VGM_CMD_DONE) {
+            event.type = EVENT_GROUP_END;
+            ok = event_push(list, &event);
+            sample_time += (command.type == VGM_CMD_WAIT) ? command.info.wait.samples : 0;
+            if (command.type == VGM_CMD_DONE) {
+                break;
+            }
+        }
+    }
+    vgm_free(vgm_file);
+    return ok;
+}
+
+static bool bench_pass(const event_list_t *list, bench_result_t *result)
+{
+    bool ok = true;
+    int64_t time0 = esp_timer_get_time();
+
+    // Add references the way the prepare scan does
+    vgm_data_t *vgm_data = vgm_data_create();
+    vgm_data_state_t *data_state = vgm_data_state_create();
+    if (!vgm_data || !data_state) {
+        vgm_data_state_free(data_state);
+        vgm_data_free(vgm_data);
+        return false;
+    }
+
+    uint16_t current_block = 0;
+    uint16_t current_len = 0;
+    bool mod_dirty = false;
+    for (size_t i = 0; i < list->count && ok; i++) {
+        const event_t *event = &list->events[i];
+        if (event->type == EVENT_DATA_BLOCK) {
+            if (event->data && event->len > 0 && (event->addr & 0xFFC0) == event->addr) {
+                ok = vgm_data_load(vgm_data, event->sample_time,
+                        event->addr, event->data, event->len) == ESP_OK;
+            }
+        } else if (event->type == EVENT_MODADDR) {
+            current_block = event->dat;
+            mod_dirty = true;
+        } else if (event->type == EVENT_MODLEN) {
+            current_len = event->dat * 16;
+            mod_dirty = true;
+        } else if (mod_dirty && current_len > 0) {
+            mod_dirty = false;
+            ok = vgm_data_state_add_ref(data_state, vgm_data,
+                    event->sample_time, current_block, current_len) == ESP_OK;
+        }
+    }
+
+    int64_t time1 = esp_timer_get_time();
+
+    // Finish the state, as vgm_player_prepare_data_state() does
+    vgm_plan_t *plan = NULL;
+    size_t merged, bytes_saved, raw_bytes, stored_bytes;
+    ok = ok && vgm_data_state_merge_duplicates(data_state, &merged, &bytes_saved) == ESP_OK;
+    ok = ok && vgm_data_state_compress(data_state, &raw_bytes, &stored_bytes) == ESP_OK;
+    if (ok && vgm_data_state_has_refs(data_state)) {
+        ok = vgm_plan_create(&plan, data_state, NES_DATA_BLOCK_MIN, NES_DATA_BLOCK_MAX,
+                BLOCK_LOAD_US) == ESP_OK;
+    }
+
+    int64_t time2 = esp_timer_get_time();
+
+    // Walk the references and read each sample, as playback does
+    size_t ref_count = vgm_data_state_ref_count(data_state);
+    uint32_t checksum = 0;
+    uint8_t buf[256];
+    for (size_t i = 0; i < ref_count && ok; i++) {
+        uint32_t sample_time = vgm_data_state_ref_sample_time(data_state, i);
+        size_t index = vgm_data_state_find_ref(data_state, sample_time);
+        vgm_data_block_group_t *block_group = vgm_data_state_ref_block_group(data_state, index);
+
+        vgm_data_block_group_reader_t reader;
+        vgm_data_block_group_reader_init(&reader, block_group);
+        size_t len;
+        while ((len = vgm_data_block_group_read(&reader, buf, sizeof(buf))) > 0) {
+            checksum += buf[len - 1];
+        }
+    }
+
+    int64_t time3 = esp_timer_get_time();
+
+    result->refs = ref_count;
+    result->groups = vgm_data_state_group_count(data_state);
+
+    vgm_plan_free(plan);
+    vgm_data_state_free(data_state);
+    vgm_data_free(vgm_data);
+
+    int64_t time4 = esp_timer_get_time();
+
+    result->add = time1 - time0;
+    result->finish = time2 - time1;
+    result->walk = time3 - time2;
+    result->free = time4 - time3;
+
+    bench_sink += checksum;
+    return ok;
+}
+
+/*
+ * Keep the fastest time of each stage over several passes, which is the
+ * one least disturbed by the rest of the system.
+ */
+static void keep_best(bench_result_t *best, const bench_result_t *result, bool first)
+{
+    if (first) {
+        *best = *result;
+        return;
+    }
+    best->add = MIN(best->add, result->add);
+    best->finish = MIN(best->finish, result->finish);
+    best->walk = MIN(best->walk, result->walk);
+    best->free = MIN(best->free, result->free);
+}
+
+int main(int argc, char **argv)
+{
+    int passes = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            passes = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-n passes] <file.vgm|file.vgz>...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || passes < 1) {
+        fprintf(stderr, "Usage: %s [-n passes] <file.vgm|file.vgz>...\n", argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+
+    printf("%-32s %7s %6s %9s %9s %9s %9s %10s\n",
+            "file", "refs", "groups", "add us", "finish us", "walk us", "free us", "refs/s");
+
+    for (int i = optind; i < argc; i++) {
+        const char *filename = argv[i];
+
+        event_list_t list = {0};
+        if (!record_events(filename, &list)) {
+            fprintf(stderr, "%s: unable to decode\n", filename);
+            event_list_free(&list);
+            failed++;
+            continue;
+        }
+
+        bench_result_t best = {0};
+        bool ok = true;
+        for (int pass = 0; pass < passes && ok; pass++) {
+            bench_result_t result = {0};
+            ok = bench_pass(&list, &result);
+            keep_best(&best, &result, pass == 0);
+        }
+        event_list_free(&list);
+
+        if (!ok) {
+            fprintf(stderr, "%s: sample bookkeeping failed\n", filename);
+            failed++;
+            continue;
+        }
+
+        const char *name = strrchr(filename, '/');
+        name = name ? name + 1 : filename;
+        printf("%-32.32s %7zu %6zu %9lld %9lld %9lld %9lld %10.0f\n", name,
+                best.refs, best.groups,
+                (long long)best.add, (long long)best.finish,
+                (long long)best.walk, (long long)best.free,
+                best.add > 0 ? (best.refs * 1000000.0) / best.add : 0);
+    }
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,33 @@
+/*
+ * Host implementations of the few ESP-IDF functions that the playback
+ * code calls, so it can be built and measured on a desktop.
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#include <esp_timer.h>
+#include <esp_heap_caps.h>
+
+/* Free heap reported to the firmware code, about what is left on a board
+ * without PSRAM once everything else is running */
+#ifndef HOST_HEAP_SIZE
+#define HOST_HEAP_SIZE (160 * 1024)
+#endif
+
+int64_t esp_timer_get_time()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+size_t heap_caps_get_free_size(uint32_t caps)
+{
+    return HOST_HEAP_SIZE;
+}
+
+size_t heap_caps_get_largest_free_block(uint32_t caps)
+{
+    return HOST_HEAP_SIZE / 2;
+}
@@ -0,0 +1,11 @@
+/*
+ * Host stand-in for the ESP-IDF I2C driver, which is only needed for
+ * the types in nes.h
+ */
+
+#ifndef DRIVER_I2C_H
+#define DRIVER_I2C_H
+
+typedef int i2c_port_t;
+
+#endif /* DRIVER_I2C_H */
@@ -0,0 +1,21 @@
+/*
+ * Host stand-in for the ESP-IDF heap capabilities
+ */
+
+#ifndef ESP_HEAP_CAPS_H
+#define ESP_HEAP_CAPS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT    (1 << 2)
+#define MALLOC_CAP_DEFAULT (1 << 12)
+
+/*
+ * These report a fixed heap of HOST_HEAP_SIZE bytes, so the budgets
+ * sized from the heap come out as they would on the device.
+ */
+size_t heap_caps_get_free_size(uint32_t caps);
+size_t heap_caps_get_largest_free_block(uint32_t caps);
+
+#endif /* ESP_HEAP_CAPS_H */
@@ -0,0 +1,20 @@
+/*
+ * Host stand-in for the ESP-IDF logging macros
+ *
+ * Errors and warnings go to stderr, everything else is dropped so it
+ * does not get in the way of the measurements. Dropped messages still
+ * use their arguments and have their formats checked.
+ */
+
+#ifndef ESP_LOG_H
+#define ESP_LOG_H
+
+#include <stdio.h>
+
+#define ESP_LOGE(tag, format, ...) fprintf(stderr, "E (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) fprintf(stderr, "W (%s) " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) do { if (0) fprintf(stderr, format, ##__VA_ARGS__); (void)tag; } while (0)
+#define ESP_LOGD(tag, format, ...) do { if (0) fprintf(stderr, format, ##__VA_ARGS__); (void)tag; } while (0)
+#define ESP_LOGV(tag, format, ...) do { if (0) fprintf(stderr, format, ##__VA_ARGS__); (void)tag; } while (0)
+
+#endif /* ESP_LOG_H */
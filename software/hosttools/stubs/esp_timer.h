@@ -0,0 +1,15 @@
+/*
+ * Host stand-in for the ESP-IDF high resolution timer
+ */
+
+#ifndef ESP_TIMER_H
+#define ESP_TIMER_H
+
+#include <stdint.h>
+
+/**
+ * Get the time since startup, in microseconds
+ */
+int64_t esp_timer_get_time();
+
+#endif /* ESP_TIMER_H */
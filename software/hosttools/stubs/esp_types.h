@@ -0,0 +1,12 @@
+/*
+ * Host stand-in for the ESP-IDF basic types
+ */
+
+#ifndef ESP_TYPES_H
+#define ESP_TYPES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#endif /* ESP_TYPES_H */
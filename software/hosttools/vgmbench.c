@@ -0,0 +1,230 @@
+/*
+ * Host benchmark for the VGM command decoder.
+ *
+ * Each file is decoded from start to end, several times over, by two
+ * decoders:
+ * - gzread: one gzread() per opcode and per operand, the way
+ *   vgm_next_command() used to read commands
+ * - window: vgm_next_command() from the firmware, which decodes out of
+ *   its read-ahead window
+ *
+ * Data block contents are skipped rather than loaded, as the prepare
+ * scan does. Commands decoded per second are reported for each file
+ * and for the corpus as a whole.
+ *
+ * Usage: vgmbench [-n passes] <file.vgm|file.vgz>...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <zlib.h>
+
+#include <esp_timer.h>
+
+#include "vgm.h"
+
+#define UINT32_FROM_BYTES(buf, n) \
+    (uint32_t)(buf[n+3] << 24 | buf[n+2] << 16 | buf[n+1] << 8 | buf[n])
+
+typedef struct {
+    uint32_t commands;
+    int64_t elapsed;
+} bench_result_t;
+
+/*
+ * Decode one command with a gzread() per field, returning the command
+ * type or VGM_CMD_UNKNOWN on an error.
+ */
+static vgm_command_type_t gzread_next_command(gzFile file)
+{
+    uint8_t cmd;
+    uint8_t buf[6];
+
+    if (gzread(file, &cmd, 1) != 1) {
+        return VGM_CMD_UNKNOWN;
+    }
+
+    if (cmd == 0x61) {
+        if (gzread(file, buf, 2) != 2) {
+            return VGM_CMD_UNKNOWN;
+        }
+        return VGM_CMD_WAIT;
+    } else if (cmd == 0x62 || cmd == 0x63 || (cmd >= 0x70 && cmd <= 0x7F)) {
+        return VGM_CMD_WAIT;
+    } else if (cmd == 0x66) {
+        return VGM_CMD_DONE;
+    } else if (cmd == 0x67) {
+        if (gzread(file, buf, 6) != 6 || buf[0] != 0x66) {
+            return VGM_CMD_UNKNOWN;
+        }
+        uint32_t data_size = UINT32_FROM_BYTES(buf, 2);
+        if (gzseek(file, data_size, SEEK_CUR) < 0) {
+            return VGM_CMD_UNKNOWN;
+        }
+        return VGM_CMD_DATA_BLOCK;
+    } else if (cmd == 0xB4) {
+        if (gzread(file, buf, 2) != 2) {
+            return VGM_CMD_UNKNOWN;
+        }
+        return VGM_CMD_NES_APU;
+    }
+    return VGM_CMD_UNKNOWN;
+}
+
+static bool bench_gzread(const char *filename, uint32_t data_offset, bench_result_t *result)
+{
+    int64_t time0 = esp_timer_get_time();
+
+    gzFile file = gzopen(filename, "rb");
+    if (!file) {
+        return false;
+    }
+    gzbuffer(file, 4096);
+
+    bool ok = gzseek(file, data_offset, SEEK_SET) >= 0;
+    uint32_t commands = 0;
+    while (ok) {
+        vgm_command_type_t type = gzread_next_command(file);
+        if (type == VGM_CMD_UNKNOWN) {
+            ok = false;
+            break;
+        }
+        commands++;
+        if (type == VGM_CMD_DONE) {
+            break;
+        }
+    }
+    gzclose(file);
+
+    result->commands = commands;
+    result->elapsed = esp_timer_get_time() - time0;
+    return ok;
+}
+
+static bool bench_window(const char *filename, bench_result_t *result)
+{
+    int64_t time0 = esp_timer_get_time();
+
+    vgm_file_t *vgm_file;
+    if (vgm_open(&vgm_file, filename) != ESP_OK) {
+        return false;
+    }
+
+    bool ok = true;
+    uint32_t commands = 0;
+    vgm_command_t command;
+    while (ok) {
+        if (vgm_next_command(vgm_file, &command, false) != ESP_OK) {
+            ok = false;
+            break;
+        }
+        commands++;
+        if (command.type == VGM_CMD_DONE) {
+            break;
+        }
+    }
+    vgm_free(vgm_file);
+
+    result->commands = commands;
+    result->elapsed = esp_timer_get_time() - time0;
+    return ok;
+}
+
+static double commands_per_sec(const bench_result_t *result)
+{
+    if (result->elapsed <= 0) {
+        return 0;
+    }
+    return (result->commands * 1000000.0) / result->elapsed;
+}
+
+/*
+ * Keep the fastest of several passes, which is the one least disturbed
+ * by the rest of the system.
+ */
+static void keep_best(bench_result_t *best, const bench_result_t *result)
+{
+    if (best->elapsed == 0 || result->elapsed < best->elapsed) {
+        *best = *result;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int passes = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt == 'n') {
+            passes = atoi(optarg);
+        } else {
+            fprintf(stderr, "Usage: %s [-n passes] <file.vgm|file.vgz>...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc || passes < 1) {
+        fprintf(stderr, "Usage: %s [-n passes] <file.vgm|file.vgz>...\n", argv[0]);
+        return 1;
+    }
+
+    bench_result_t total_gzread = {0};
+    bench_result_t total_window = {0};
+    int failed = 0;
+
+    printf("%-40s %9s %12s %12s %7s\n", "file", "commands", "gzread/s", "window/s", "speedup");
+
+    for (int i = optind; i < argc; i++) {
+        const char *filename = argv[i];
+
+        vgm_file_t *vgm_file;
+        if (vgm_open(&vgm_file, filename) != ESP_OK) {
+            fprintf(stderr, "%s: unable to open\n", filename);
+            failed++;
+            continue;
+        }
+        uint32_t data_offset = vgm_get_header(vgm_file)->data_offset;
+        vgm_free(vgm_file);
+
+        bench_result_t best_gzread = {0};
+        bench_result_t best_window = {0};
+        bool ok = true;
+        for (int pass = 0; pass < passes && ok; pass++) {
+            bench_result_t result;
+            ok = bench_gzread(filename, data_offset, &result);
+            keep_best(&best_gzread, &result);
+            ok = ok && bench_window(filename, &result);
+            keep_best(&best_window, &result);
+        }
+
+        if (!ok || best_gzread.commands != best_window.commands) {
+            fprintf(stderr, "%s: decode failed (%u/%u commands)\n",
+                    filename, best_gzread.commands, best_window.commands);
+            failed++;
+            continue;
+        }
+
+        const char *name = strrchr(filename, '/');
+        name = name ? name + 1 : filename;
+        printf("%-40.40s %9u %12.0f %12.0f %6.2fx\n", name, best_window.commands,
+                commands_per_sec(&best_gzread), commands_per_sec(&best_window),
+                commands_per_sec(&best_window) / commands_per_sec(&best_gzread));
+
+        total_gzread.commands += best_gzread.commands;
+        total_gzread.elapsed += best_gzread.elapsed;
+        total_window.commands += best_window.commands;
+        total_window.elapsed += best_window.elapsed;
+    }
+
+    if (total_window.commands > 0) {
+        printf("%-40s %9u %12.0f %12.0f %6.2fx\n", "total", total_window.commands,
+                commands_per_sec(&total_gzread), commands_per_sec(&total_window),
+                commands_per_sec(&total_window) / commands_per_sec(&total_gzread));
+    }
+
+    return failed ? 1 : 0;
+}
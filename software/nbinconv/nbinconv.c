@@ -0,0 +1,628 @@
+/*
+ * Converter from VGM/VGZ files to the Nestronic binary playback format.
+ *
+ * This does the same work as the firmware's VGM prepare scan, ahead of
+ * time, so that the player can start immediately with no scan at all:
+ * - DMC sample data is collected into block groups and a reference
+ *   schedule, the same way vgm_data_state_add_ref() builds them
+ * - Waits are merged and delta-coded into short opcodes
+ * - Register writes that would not change the APU state are dropped
+ *
+ * Usage: nbinconv <input.vgm|input.vgz> <output.nbin>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "nbin_format.h"
+#include "nes_apu_regs.h"
+
+#define UINT32_FROM_BYTES(buf, n) \
+    (uint32_t)(buf[n+3] << 24 | buf[n+2] << 16 | buf[n+1] << 8 | buf[n])
+#define UINT16_FROM_BYTES(buf, n) \
+    (uint16_t)(buf[n+1] << 8 | buf[n])
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define APU_MODADDR 0x12
+#define APU_MODLEN  0x13
+
+typedef struct {
+    uint8_t *data;
+    size_t len;
+    size_t size;
+} buffer_t;
+
+typedef struct {
+    uint32_t key_sample_time;
+    uint16_t key_block;
+    uint16_t byte_size;
+    uint8_t *raw_data;
+} group_t;
+
+typedef struct {
+    /* VGM data block memory, equivalent to vgm_data_t */
+    uint8_t raw_data[32768];
+    uint32_t block_sample_time[512];
+
+    group_t *groups;
+    size_t group_count;
+    nbin_ref_t *refs;
+    size_t ref_count;
+
+    buffer_t events;
+    uint32_t pending_wait;
+    uint32_t total_samples;
+
+    /* Last value written to each APU register, for redundancy checks */
+    uint8_t shadow[0x20];
+    bool shadow_valid[0x20];
+
+    uint32_t writes_in;
+    uint32_t writes_out;
+} converter_t;
+
+static void buffer_append(buffer_t *buf, const void *data, size_t len)
+{
+    if (buf->len + len > buf->size) {
+        size_t size = MAX(buf->size * 2, buf->len + len + 4096);
+        uint8_t *p = realloc(buf->data, size);
+        if (!p) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        buf->data = p;
+        buf->size = size;
+    }
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+}
+
+static void buffer_append_byte(buffer_t *buf, uint8_t val)
+{
+    buffer_append(buf, &val, 1);
+}
+
+static void buffer_append_u16(buffer_t *buf, uint16_t val)
+{
+    uint8_t b[2] = { val & 0xFF, val >> 8 };
+    buffer_append(buf, b, sizeof(b));
+}
+
+static uint8_t *read_input(const char *filename, size_t *len)
+{
+    gzFile file = gzopen(filename, "rb");
+    if (!file) {
+        perror(filename);
+        return NULL;
+    }
+
+    buffer_t buf = { 0 };
+    uint8_t chunk[16384];
+    int n;
+    while ((n = gzread(file, chunk, sizeof(chunk))) > 0) {
+        buffer_append(&buf, chunk, n);
+    }
+    if (n < 0) {
+        int errnum;
+        fprintf(stderr, "%s: %s\n", filename, gzerror(file, &errnum));
+        gzclose(file);
+        free(buf.data);
+        return NULL;
+    }
+    gzclose(file);
+
+    *len = buf.len;
+    return buf.data;
+}
+
+/*
+ * Same block numbering as nes_addr_to_apu_block() and
+ * nes_len_to_apu_blocks() in the firmware.
+ */
+static uint16_t addr_to_apu_block(uint16_t addr)
+{
+    if (addr >= 0xC000) {
+        return (addr >> 6) & 0xFF;
+    } else {
+        return (((addr - 0xC000) >> 6) & 0xFF) + 256;
+    }
+}
+
+static uint16_t len_to_apu_blocks(uint32_t len)
+{
+    if ((len & 0x3F) == 0) {
+        return len >> 6;
+    } else {
+        return ((len | 0x3F) + 1) >> 6;
+    }
+}
+
+static void data_load_impl(converter_t *conv, uint32_t sample_time,
+        uint16_t addr, const uint8_t *data, size_t len)
+{
+    memcpy(conv->raw_data + (addr - 0x8000), data, len);
+
+    uint16_t start_block = addr_to_apu_block(addr);
+    uint16_t end_block = start_block + (len_to_apu_blocks(len) - 1);
+    for (uint16_t i = start_block; i <= end_block; i++) {
+        conv->block_sample_time[i % 512] = sample_time;
+    }
+}
+
+/*
+ * Same address clipping as vgm_data_load() in the firmware.
+ */
+static void data_load(converter_t *conv, uint32_t sample_time,
+        uint32_t addr, const uint8_t *data, size_t len)
+{
+    size_t remaining;
+
+    if (addr < 0x8000) {
+        if (addr + len <= 0x8000) {
+            return;
+        }
+        remaining = 0x8000 - addr;
+        addr = 0x8000;
+        data += remaining;
+        len -= remaining;
+    }
+
+    remaining = 0;
+    if (addr + len > 0x10000) {
+        remaining = len;
+        len = 0x10000 - addr;
+        remaining -= len;
+    }
+
+    data_load_impl(conv, sample_time, addr, data, len);
+
+    if (remaining > 0) {
+        data_load_impl(conv, sample_time, 0x8000, data + len, MIN(remaining, 0x8000));
+    }
+}
+
+/*
+ * Same grouping as vgm_data_state_add_ref() in the firmware.
+ */
+static bool add_ref(converter_t *conv, uint32_t sample_time, uint16_t block, size_t len)
+{
+    uint16_t block_count = len_to_apu_blocks(len);
+    if (block >= 256 || block + block_count >= 512) {
+        return false;
+    }
+
+    uint32_t data_sample_time = 0;
+    for (uint16_t i = block; i < block + block_count; i++) {
+        data_sample_time = MAX(data_sample_time, conv->block_sample_time[i]);
+    }
+
+    size_t index;
+    for (index = 0; index < conv->group_count; index++) {
+        if (conv->groups[index].key_sample_time == data_sample_time
+                && conv->groups[index].key_block == block) {
+            break;
+        }
+    }
+
+    if (index == conv->group_count) {
+        conv->groups = realloc(conv->groups, sizeof(group_t) * (conv->group_count + 1));
+        if (!conv->groups) {
+            return false;
+        }
+        memset(&conv->groups[index], 0, sizeof(group_t));
+        conv->groups[index].key_sample_time = data_sample_time;
+        conv->groups[index].key_block = block;
+        conv->group_count++;
+    }
+
+    group_t *group = &conv->groups[index];
+    if (group->byte_size < len) {
+        group->raw_data = realloc(group->raw_data, len);
+        if (!group->raw_data) {
+            return false;
+        }
+
+        uint16_t addr = 0xC000 + (block * 64);
+        size_t copy_len = MIN(len, (0xFFFF - addr) + 1);
+        memcpy(group->raw_data, conv->raw_data + (addr - 0x8000), copy_len);
+        if (copy_len < len) {
+            memcpy(group->raw_data + copy_len, conv->raw_data, len - copy_len);
+        }
+        group->byte_size = len;
+    }
+
+    conv->refs = realloc(conv->refs, sizeof(nbin_ref_t) * (conv->ref_count + 1));
+    if (!conv->refs) {
+        return false;
+    }
+    conv->refs[conv->ref_count].sample_time = sample_time;
+    conv->refs[conv->ref_count].group = index;
+    conv->refs[conv->ref_count].byte_size = len;
+    conv->ref_count++;
+
+    return true;
+}
+
+static void flush_wait(converter_t *conv)
+{
+    uint32_t wait = conv->pending_wait;
+
+    while (wait > 0) {
+        if (wait >= NBIN_FRAME_SAMPLES && (wait % NBIN_FRAME_SAMPLES) == 0) {
+            uint32_t frames = MIN(wait / NBIN_FRAME_SAMPLES, 64);
+            buffer_append_byte(&conv->events, NBIN_OP_WAIT_FRAMES | (frames - 1));
+            wait -= frames * NBIN_FRAME_SAMPLES;
+        } else if (wait <= 64) {
+            buffer_append_byte(&conv->events, NBIN_OP_WAIT | (wait - 1));
+            wait = 0;
+        } else {
+            uint16_t samples = MIN(wait, UINT16_MAX);
+            buffer_append_byte(&conv->events, NBIN_OP_WAIT_LONG);
+            buffer_append_u16(&conv->events, samples);
+            wait -= samples;
+        }
+    }
+
+    conv->total_samples += conv->pending_wait;
+    conv->pending_wait = 0;
+}
+
+/*
+ * Writes to these registers have side effects beyond latching a value,
+ * or are relocated at playback time, so they are never dropped. The
+ * list is shared with the APU shadow in the firmware.
+ */
+static bool is_side_effect_register(uint8_t reg)
+{
+    return reg < 32 && (NES_APU_SIDE_EFFECT_MASK & (1UL << reg)) != 0;
+}
+
+static void emit_write(converter_t *conv, uint8_t reg, uint8_t dat)
+{
+    conv->writes_in++;
+
+    if (reg < 0x20) {
+        if (!is_side_effect_register(reg)
+                && conv->shadow_valid[reg] && conv->shadow[reg] == dat) {
+            return;
+        }
+        conv->shadow[reg] = dat;
+        conv->shadow_valid[reg] = true;
+    }
+
+    flush_wait(conv);
+
+    if (reg < 0x20) {
+        buffer_append_byte(&conv->events, NBIN_OP_WRITE | reg);
+        buffer_append_byte(&conv->events, dat);
+    } else {
+        buffer_append_byte(&conv->events, NBIN_OP_WRITE_EXT);
+        buffer_append_byte(&conv->events, reg);
+        buffer_append_byte(&conv->events, dat);
+    }
+    conv->writes_out++;
+}
+
+static void append_gd3_string(buffer_t *tags, const uint8_t *p, size_t len)
+{
+    /* Keep only the low byte of each UTF-16 character, like the firmware */
+    for (size_t i = 0; i + 1 < len; i += 2) {
+        if (p[i] == 0 && p[i + 1] == 0) {
+            break;
+        }
+        buffer_append_byte(tags, p[i]);
+    }
+    buffer_append_byte(tags, 0);
+}
+
+static void convert_gd3_tags(const uint8_t *vgm, size_t vgm_len, uint32_t gd3_offset, buffer_t *tags)
+{
+    if (gd3_offset == 0 || gd3_offset + 12 > vgm_len
+            || memcmp(vgm + gd3_offset, "Gd3 ", 4) != 0) {
+        return;
+    }
+
+    uint32_t gd3_size = UINT32_FROM_BYTES(vgm, gd3_offset + 8);
+    const uint8_t *buf = vgm + gd3_offset + 12;
+    if (gd3_offset + 12 + gd3_size > vgm_len) {
+        return;
+    }
+
+    /* GD3 string indices for each field of vgm_gd3_tags_t */
+    const int field_index[] = { 0, 2, 4, 6, 8, 9, 10 };
+    const uint8_t *strings[11] = { 0 };
+    size_t lengths[11] = { 0 };
+
+    int index = 0;
+    uint32_t offset = 0;
+    for (uint32_t i = 0; i + 1 < gd3_size && index < 11; i += 2) {
+        if (buf[i] == 0 && buf[i + 1] == 0) {
+            strings[index] = buf + offset;
+            lengths[index] = (i - offset) + 2;
+            index++;
+            offset = i + 2;
+        }
+    }
+
+    for (int i = 0; i < sizeof(field_index) / sizeof(field_index[0]); i++) {
+        if (strings[field_index[i]]) {
+            append_gd3_string(tags, strings[field_index[i]], lengths[field_index[i]]);
+        } else {
+            buffer_append_byte(tags, 0);
+        }
+    }
+}
+
+static bool convert(converter_t *conv, const uint8_t *vgm, size_t vgm_len,
+        nbin_header_t *header)
+{
+    if (vgm_len < 0x40 || memcmp(vgm, "Vgm ", 4) != 0) {
+        fprintf(stderr, "File is not VGM\n");
+        return false;
+    }
+
+    uint32_t loop_offset = UINT32_FROM_BYTES(vgm, 0x1C);
+    if (loop_offset > 0) { loop_offset += 0x1C; }
+
+    uint32_t data_offset = vgm_len >= 0x38 ? UINT32_FROM_BYTES(vgm, 0x34) : 0;
+    if (data_offset > 0) { data_offset += 0x34; }
+    else { data_offset = 0x40; }
+
+    uint32_t nes_apu_clock = vgm_len >= 0x88 ? UINT32_FROM_BYTES(vgm, 0x84) : 0;
+    if (nes_apu_clock & 0x80000000) {
+        fprintf(stderr, "FDS Add-on is not supported\n");
+        return false;
+    }
+    if (nes_apu_clock < 1000000 || nes_apu_clock > 2000000 || data_offset < 0x38) {
+        fprintf(stderr, "File does not contain valid NES APU data\n");
+        return false;
+    }
+
+    header->loop_samples = UINT32_FROM_BYTES(vgm, 0x20);
+
+    uint32_t sample_time = 0;
+    uint16_t current_block = 0;
+    uint16_t current_len = 0;
+    bool mod_dirty = false;
+    bool at_end = false;
+    bool has_loop = false;
+
+    size_t pos = data_offset;
+    while (!at_end) {
+        if (loop_offset > 0 && pos == loop_offset) {
+            // Any wait so far belongs before the loop point, and writes
+            // after it can not assume the register state from before it.
+            flush_wait(conv);
+            header->loop_event_offset = conv->events.len;
+            memset(conv->shadow_valid, 0, sizeof(conv->shadow_valid));
+            has_loop = true;
+        }
+
+        if (pos >= vgm_len) {
+            fprintf(stderr, "Unexpected end of file\n");
+            return false;
+        }
+
+        uint8_t cmd = vgm[pos];
+        uint32_t wait = 0;
+        bool group_end = false;
+
+        if (cmd == 0x61 && pos + 3 <= vgm_len) {
+            wait = UINT16_FROM_BYTES(vgm, pos + 1);
+            pos += 3;
+        }
+        else if (cmd == 0x62) {
+            wait = 735;
+            pos += 1;
+        }
+        else if (cmd == 0x63) {
+            wait = 882;
+            pos += 1;
+        }
+        else if (cmd == 0x66) {
+            at_end = true;
+            pos += 1;
+        }
+        else if (cmd == 0x67 && pos + 7 <= vgm_len) {
+            uint8_t type = vgm[pos + 2];
+            uint32_t size = UINT32_FROM_BYTES(vgm, pos + 3);
+            pos += 7;
+            if (pos + size > vgm_len) {
+                fprintf(stderr, "Truncated data block\n");
+                return false;
+            }
+            if (type >= 0xC0 && type <= 0xDF && size > 2) {
+                uint16_t addr = UINT16_FROM_BYTES(vgm, pos);
+                data_load(conv, sample_time, addr, vgm + pos + 2, size - 2);
+            } else {
+                fprintf(stderr, "Unsupported data block type: %02X\n", type);
+            }
+            pos += size;
+        }
+        else if (cmd >= 0x70 && cmd <= 0x7F) {
+            wait = (cmd & 0x0F) + 1;
+            pos += 1;
+        }
+        else if (cmd == 0xB4 && pos + 3 <= vgm_len) {
+            uint8_t aa = vgm[pos + 1];
+            uint8_t dd = vgm[pos + 2];
+            pos += 3;
+
+            uint8_t reg_l;
+            if (aa <= 0x1F) {
+                reg_l = aa;
+            } else if (aa <= 0x3E) {
+                reg_l = 0x80 + (aa - 0x20);
+            } else if (aa == 0x3F) {
+                reg_l = 0x23;
+            } else if (aa <= 0x7F) {
+                reg_l = 0x40 + (aa - 0x40);
+            } else {
+                fprintf(stderr, "Unknown NES APU register: %02X\n", aa);
+                continue;
+            }
+
+            if (reg_l == APU_MODADDR) {
+                current_block = dd;
+                mod_dirty = true;
+            } else if (reg_l == APU_MODLEN) {
+                current_len = dd * 16;
+                mod_dirty = true;
+            }
+
+            emit_write(conv, reg_l, dd);
+        }
+        else {
+            fprintf(stderr, "Unsupported command: %02X\n", cmd);
+            return false;
+        }
+
+        group_end = (wait > 0 || at_end);
+
+        // At the end of a command group, collect DMC state changes
+        if (group_end && mod_dirty && current_len > 0) {
+            mod_dirty = false;
+            if (!add_ref(conv, sample_time, current_block, current_len)) {
+                fprintf(stderr, "Unable to add sample reference\n");
+                return false;
+            }
+        }
+
+        sample_time += wait;
+        conv->pending_wait += wait;
+    }
+
+    flush_wait(conv);
+    buffer_append_byte(&conv->events, NBIN_OP_END);
+
+    if (loop_offset > 0 && !has_loop) {
+        fprintf(stderr, "Loop offset is not on a command boundary, ignoring loop\n");
+    }
+
+    header->flags = has_loop ? NBIN_FLAG_LOOP : 0;
+    header->total_samples = conv->total_samples;
+
+    return true;
+}
+
+static bool write_output(const char *filename, converter_t *conv,
+        nbin_header_t *header, const buffer_t *tags)
+{
+    buffer_t out = { 0 };
+
+    // Lay out the sections after the header
+    uint32_t offset = sizeof(nbin_header_t);
+
+    header->tags_offset = offset;
+    header->tags_size = tags->len;
+    offset += tags->len;
+
+    header->groups_offset = offset;
+    header->group_count = conv->group_count;
+    offset += sizeof(nbin_group_t) * conv->group_count;
+
+    uint32_t data_offset = offset;
+    for (size_t i = 0; i < conv->group_count; i++) {
+        offset += conv->groups[i].byte_size;
+    }
+
+    header->refs_offset = offset;
+    header->ref_count = conv->ref_count;
+    offset += sizeof(nbin_ref_t) * conv->ref_count;
+
+    header->events_offset = offset;
+    header->events_size = conv->events.len;
+
+    buffer_append(&out, header, sizeof(nbin_header_t));
+    buffer_append(&out, tags->data, tags->len);
+    for (size_t i = 0; i < conv->group_count; i++) {
+        nbin_group_t group = {
+            .key_sample_time = conv->groups[i].key_sample_time,
+            .key_block = conv->groups[i].key_block,
+            .byte_size = conv->groups[i].byte_size,
+            .data_offset = data_offset
+        };
+        buffer_append(&out, &group, sizeof(nbin_group_t));
+        data_offset += conv->groups[i].byte_size;
+    }
+    for (size_t i = 0; i < conv->group_count; i++) {
+        buffer_append(&out, conv->groups[i].raw_data, conv->groups[i].byte_size);
+    }
+    buffer_append(&out, conv->refs, sizeof(nbin_ref_t) * conv->ref_count);
+    buffer_append(&out, conv->events.data, conv->events.len);
+
+    FILE *file = fopen(filename, "wb");
+    if (!file) {
+        perror(filename);
+        free(out.data);
+        return false;
+    }
+    bool result = fwrite(out.data, 1, out.len, file) == out.len;
+    if (fclose(file) != 0) {
+        result = false;
+    }
+    if (!result) {
+        perror(filename);
+    }
+
+    free(out.data);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <input.vgm|input.vgz> <output.nbin>\n", argv[0]);
+        return 1;
+    }
+
+    size_t vgm_len = 0;
+    uint8_t *vgm = read_input(argv[1], &vgm_len);
+    if (!vgm) {
+        return 1;
+    }
+
+    converter_t *conv = calloc(1, sizeof(converter_t));
+    nbin_header_t header;
+    buffer_t tags = { 0 };
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, NBIN_MAGIC, sizeof(header.magic));
+    header.version = NBIN_VERSION;
+
+    int ret = 1;
+    if (conv && convert(conv, vgm, vgm_len, &header)) {
+        uint32_t gd3_offset = UINT32_FROM_BYTES(vgm, 0x14);
+        if (gd3_offset > 0) {
+            convert_gd3_tags(vgm, vgm_len, gd3_offset + 0x14, &tags);
+        }
+
+        if (write_output(argv[2], conv, &header, &tags)) {
+            printf("Samples: %u (loop %u)\n", header.total_samples, header.loop_samples);
+            printf("Sample groups: %u, references: %u\n", header.group_count, header.ref_count);
+            printf("Register writes: %u in, %u out\n", conv->writes_in, conv->writes_out);
+            printf("Event stream: %u bytes (VGM: %zu bytes)\n", header.events_size, vgm_len);
+            ret = 0;
+        }
+    }
+
+    if (conv) {
+        for (size_t i = 0; i < conv->group_count; i++) {
+            free(conv->groups[i].raw_data);
+        }
+        free(conv->groups);
+        free(conv->refs);
+        free(conv->events.data);
+        free(conv);
+    }
+    free(tags.data);
+    free(vgm);
+
+    return ret;
+}